@@ -27,15 +27,31 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include <ripncode/ripncode.h>
 
 #define DEFAULT_CHUNK_SIZE (64 * 1024)
+#define FILE_WRITEBACK     (4 * 1024 * 1024)
+#define FILE_STAGE         (1 * 1024 * 1024)
+#define CACHELINE_SIZE     64
+#define MAP_WINDOW         (8 * 1024 * 1024)
+#define SPILL_DIR          "/var/tmp"
+#define WRITEV_IOV         256
+#define WRITEV_COPY        (64 * 1024)
 
 
 /*
@@ -52,6 +68,11 @@ typedef struct {
     off_t (*rseek)(rnc_buf_t *b, off_t offset, int whence);
     int (*close)(rnc_buf_t *b);
     int (*unlink)(rnc_buf_t *b);
+    int (*wait)(rnc_buf_t *b, int events, size_t size);
+    int (*shutdown)(rnc_buf_t *b);
+    int (*peek)(rnc_buf_t *b, struct iovec *iov, int niov);
+    int (*consume)(rnc_buf_t *b, size_t size);
+    ssize_t (*copy)(rnc_buf_t *b, int fd);
 } buf_api_t;
 
 
@@ -66,21 +87,33 @@ struct rnc_buf_s {
 
 /*
  * an in-memory buffer
+ *
+ * The buffer is kept as a table of fixed-size chunks. Growing the buffer
+ * only allocates new chunks (and occasionally grows the chunk table), so
+ * data that has already been written never gets moved around in memory.
  */
 typedef struct {
     char      *name;                     /* buffer name */
     buf_api_t *api;                      /* buffer API functions */
     size_t     chunk;                    /* buffer allocation chunk */
-    char      *buf;                      /* actual buffer */
+    char     **chunks;                   /* table of buffer chunks */
+    size_t     nchunk;                   /* number of allocated chunks */
+    size_t     ntable;                   /* chunk table size */
     size_t     size;                     /* current buffer size */
     size_t     data;                     /* amount of data in buffer */
-    char      *w;                        /* write pointer */
-    char      *r;                        /* read pointer */
+    size_t     w;                        /* write offset */
+    size_t     r;                        /* read offset */
 } mem_buf_t;
 
 
 /*
  * a file buffer
+ *
+ * Small writes are collected in a staging buffer and written to the file
+ * FILE_STAGE bytes at a time, so writers producing many small pieces of
+ * data (like encoders writing a frame at a time) don't pay for a system
+ * call each. The staged data is written out before anything else looks
+ * at the file: seeks, reads, copies and closing the buffer.
  */
 typedef struct {
     char      *name;                     /* buffer name */
@@ -88,9 +121,91 @@ typedef struct {
     char      *path;                     /* buffer file path */
     int        wfd;                      /* file descriptor for write */
     int        rfd;                      /* file descriptor for read */
+    size_t     dirty;                    /* written since last writeback */
+    char      *stage;                    /* staging buffer for writes */
+    size_t     nstage;                   /* amount of data staged */
 } file_buf_t;
 
 
+/*
+ * a memory-mapped file buffer
+ *
+ * The file is accessed through a fixed-size window mapped at a window-
+ * aligned offset, which is slid along as reads and writes move around
+ * in the file. The file is grown a window at a time with fallocate, so
+ * running out of disk space is reported at growth time instead of by a
+ * SIGBUS when a page in the window is first touched. Preallocated space
+ * beyond the data is trimmed off when the buffer is closed.
+ */
+typedef struct {
+    char      *name;                     /* buffer name */
+    buf_api_t *api;                      /* buffer API functions */
+    char      *path;                     /* buffer file path */
+    int        fd;                       /* file descriptor */
+    char      *map;                      /* mapped window, if any */
+    size_t     moffs;                    /* file offset of window */
+    size_t     alloc;                    /* allocated file size */
+    size_t     data;                     /* amount of data in file */
+    size_t     w;                        /* write offset */
+    size_t     r;                        /* read offset */
+    size_t     synced;                   /* writeback started up to here */
+} map_buf_t;
+
+
+/*
+ * an in-memory buffer which spills over to disk
+ *
+ * Data is collected in an in-memory buffer until the buffer would grow
+ * past the given limit. At that point an anonymous file is created in
+ * the spill directory, the data collected so far is copied over to it,
+ * and the memory is released. From then on the file is accessed with
+ * positional I/O, so the read and write offsets stay independent just
+ * like they are in memory.
+ */
+typedef struct {
+    char      *name;                     /* buffer name */
+    buf_api_t *api;                      /* buffer API functions */
+    rnc_buf_t *mem;                      /* in-memory buffer, until spilled */
+    size_t     limit;                    /* spill beyond this, 0 never */
+    char      *dir;                      /* directory to spill to */
+    int        fd;                       /* spill file, once spilled */
+    size_t     data;                     /* amount of data in file */
+    size_t     w;                        /* write offset */
+    size_t     r;                        /* read offset */
+    size_t     dirty;                    /* written since last writeback */
+} spill_buf_t;
+
+
+/*
+ * a single-producer, single-consumer ring buffer
+ *
+ * The producer only ever updates w and the consumer only ever updates r,
+ * both of which are free-running byte counters. Each side keeps a cached
+ * copy of the other side's counter and only reloads it when the cached
+ * value says the ring is full (or empty), so in the common case neither
+ * side touches the other's cache line. Producer and consumer state are
+ * padded apart to avoid false sharing. Waiting is optional and only costs
+ * anything when somebody actually waits.
+ */
+typedef struct {
+    char            *name;               /* buffer name */
+    buf_api_t       *api;                /* buffer API functions */
+    char            *data;               /* ring data */
+    size_t           size;               /* ring size, a power of 2 */
+    pthread_mutex_t  lock;               /* lock for waiting */
+    pthread_cond_t   cond;               /* signalled on progress */
+    int              waiting;            /* number of waiters */
+    int              down;               /* no more data coming */
+    char             pad0[CACHELINE_SIZE];
+    size_t           w;                  /* producer: bytes written */
+    size_t           rcache;             /* producer: cached copy of r */
+    char             pad1[CACHELINE_SIZE];
+    size_t           r;                  /* consumer: bytes read */
+    size_t           wcache;             /* consumer: cached copy of w */
+    char             pad2[CACHELINE_SIZE];
+} ring_buf_t;
+
+
 static int mem_open(rnc_buf_t *b, size_t pre_alloc);
 static int mem_write(rnc_buf_t *b, const void *buf, size_t size);
 static int mem_read(rnc_buf_t *b, void *buf, size_t size);
@@ -98,6 +213,7 @@ static off_t mem_wseek(rnc_buf_t *b, off_t offset, int whence);
 static off_t mem_rseek(rnc_buf_t *b, off_t offset, int whence);
 static int mem_close(rnc_buf_t *b);
 static int mem_unlink(rnc_buf_t *b);
+static int mem_peek(rnc_buf_t *b, struct iovec *iov, int niov);
 static int file_open(rnc_buf_t *b, int flags, mode_t mode);
 static int file_write(rnc_buf_t *b, const void *buf, size_t size);
 static int file_read(rnc_buf_t *b, void *buf, size_t size);
@@ -105,6 +221,33 @@ static off_t file_wseek(rnc_buf_t *b, off_t offset, int whence);
 static off_t file_rseek(rnc_buf_t *b, off_t offset, int whence);
 static int file_close(rnc_buf_t *b);
 static int file_unlink(rnc_buf_t *b);
+static ssize_t file_copy(rnc_buf_t *b, int fd);
+static int map_open(rnc_buf_t *b, int flags, mode_t mode);
+static int map_write(rnc_buf_t *b, const void *buf, size_t size);
+static int map_read(rnc_buf_t *b, void *buf, size_t size);
+static off_t map_wseek(rnc_buf_t *b, off_t offset, int whence);
+static off_t map_rseek(rnc_buf_t *b, off_t offset, int whence);
+static int map_close(rnc_buf_t *b);
+static int map_unlink(rnc_buf_t *b);
+static int map_peek(rnc_buf_t *b, struct iovec *iov, int niov);
+static ssize_t map_copy(rnc_buf_t *b, int fd);
+static int map_grow(map_buf_t *m, size_t size);
+static int spill_write(rnc_buf_t *b, const void *buf, size_t size);
+static int spill_read(rnc_buf_t *b, void *buf, size_t size);
+static off_t spill_wseek(rnc_buf_t *b, off_t offset, int whence);
+static off_t spill_rseek(rnc_buf_t *b, off_t offset, int whence);
+static int spill_close(rnc_buf_t *b);
+static int spill_peek(rnc_buf_t *b, struct iovec *iov, int niov);
+static ssize_t spill_copy(rnc_buf_t *b, int fd);
+static int ring_write(rnc_buf_t *b, const void *buf, size_t size);
+static int ring_read(rnc_buf_t *b, void *buf, size_t size);
+static off_t ring_wseek(rnc_buf_t *b, off_t offset, int whence);
+static off_t ring_rseek(rnc_buf_t *b, off_t offset, int whence);
+static int ring_close(rnc_buf_t *b);
+static int ring_wait(rnc_buf_t *b, int events, size_t size);
+static int ring_shutdown(rnc_buf_t *b);
+static int ring_peek(rnc_buf_t *b, struct iovec *iov, int niov);
+static int ring_consume(rnc_buf_t *b, size_t size);
 
 
 static rnc_buf_t *buf_alloc(const char *name, buf_api_t *api, size_t size)
@@ -134,6 +277,31 @@ static void buf_free(rnc_buf_t *b)
 }
 
 
+static off_t buf_seek(size_t data, size_t *ptr, off_t offset, int whence)
+{
+    off_t pos;
+
+    switch (whence) {
+    case SEEK_SET: pos = offset;               break;
+    case SEEK_CUR: pos = (off_t)*ptr + offset; break;
+    case SEEK_END: pos = (off_t)data + offset; break;
+    default:
+        goto invalid;
+    }
+
+    if (pos < 0 || pos > (off_t)data)
+        goto invalid;
+
+    *ptr = (size_t)pos;
+
+    return pos;
+
+ invalid:
+    errno = EINVAL;
+    return -1;
+}
+
+
 rnc_buf_t *rnc_buf_create(const char *name, size_t pre_alloc, size_t chunk_size)
 {
     static buf_api_t api = {
@@ -144,6 +312,7 @@ rnc_buf_t *rnc_buf_create(const char *name, size_t pre_alloc, size_t chunk_size)
           .rseek  = mem_rseek,
           .close  = mem_close,
           .unlink = mem_unlink,
+          .peek   = mem_peek,
     };
 
     mem_buf_t *b;
@@ -177,6 +346,7 @@ rnc_buf_t *rnc_buf_open(const char *path, int flags, mode_t mode)
           .rseek  = file_rseek,
           .close  = file_close,
           .unlink = file_unlink,
+          .copy   = file_copy,
     };
 
     file_buf_t *b;
@@ -200,6 +370,149 @@ rnc_buf_t *rnc_buf_open(const char *path, int flags, mode_t mode)
 }
 
 
+rnc_buf_t *rnc_buf_map(const char *path, int flags, mode_t mode)
+{
+    static buf_api_t api = {
+        { .fopen  = map_open, },
+          .write  = map_write,
+          .read   = map_read,
+          .wseek  = map_wseek,
+          .rseek  = map_rseek,
+          .close  = map_close,
+          .unlink = map_unlink,
+          .peek   = map_peek,
+          .copy   = map_copy,
+    };
+
+    map_buf_t *b;
+    int        error;
+
+    b = (map_buf_t *)buf_alloc(path, &api, sizeof(*b));
+
+    if (b == NULL)
+        return NULL;
+
+    b->path = b->name;
+    b->fd   = -1;
+
+    if (b->api->fopen((rnc_buf_t *)b, flags, mode) < 0)
+        goto fail;
+
+    return (rnc_buf_t *)b;
+
+ fail:
+    error = errno;
+    buf_free((rnc_buf_t *)b);
+
+    /* can't preallocate, use a plain file buffer (the file exists by now) */
+    if (error == EOPNOTSUPP)
+        return rnc_buf_open(path, flags & ~(O_EXCL | O_TRUNC), mode);
+
+    errno = error;
+
+    return NULL;
+}
+
+
+rnc_buf_t *rnc_buf_spill(const char *name, size_t chunk_size, size_t limit,
+                         const char *dir)
+{
+    static buf_api_t api = {
+        { .mopen  = NULL, },
+          .write  = spill_write,
+          .read   = spill_read,
+          .wseek  = spill_wseek,
+          .rseek  = spill_rseek,
+          .close  = spill_close,
+          .unlink = spill_close,
+          .peek   = spill_peek,
+          .copy   = spill_copy,
+    };
+
+    spill_buf_t *b;
+
+    b = (spill_buf_t *)buf_alloc(name, &api, sizeof(*b));
+
+    if (b == NULL)
+        return NULL;
+
+    if (dir == NULL && (dir = getenv("TMPDIR")) == NULL)
+        dir = SPILL_DIR;
+
+    b->limit = limit;
+    b->fd    = -1;
+    b->dir   = mrp_strdup(dir);
+    b->mem   = rnc_buf_create(name, 0, chunk_size);
+
+    if (b->dir == NULL || b->mem == NULL)
+        goto fail;
+
+    return (rnc_buf_t *)b;
+
+ fail:
+    if (b->mem != NULL)
+        rnc_buf_close(b->mem);
+    mrp_free(b->dir);
+    buf_free((rnc_buf_t *)b);
+
+    return NULL;
+}
+
+
+rnc_buf_t *rnc_buf_ring(const char *name, size_t size)
+{
+    static buf_api_t api = {
+        { .mopen    = NULL, },
+          .write    = ring_write,
+          .read     = ring_read,
+          .wseek    = ring_wseek,
+          .rseek    = ring_rseek,
+          .close    = ring_close,
+          .unlink   = ring_close,
+          .wait     = ring_wait,
+          .shutdown = ring_shutdown,
+          .peek     = ring_peek,
+          .consume  = ring_consume,
+    };
+
+    ring_buf_t *b;
+    size_t      n;
+
+    if (size == 0 || size > ((size_t)1 << (sizeof(size_t) * 8 - 2)))
+        goto invalid;
+
+    for (n = CACHELINE_SIZE; n < size; n <<= 1)
+        ;
+
+    b = (ring_buf_t *)buf_alloc(name, &api, sizeof(*b));
+
+    if (b == NULL)
+        return NULL;
+
+    b->size = n;
+    b->data = mrp_alloc(n);
+
+    if (b->data == NULL)
+        goto fail;
+
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->cond, NULL);
+
+    mrp_debug("created %zu byte ring buffer '%s'", n, b->name);
+
+    return (rnc_buf_t *)b;
+
+ invalid:
+    errno = EINVAL;
+    return NULL;
+
+ fail:
+    buf_free((rnc_buf_t *)b);
+
+    return NULL;
+}
+
+
 int rnc_buf_close(rnc_buf_t *b)
 {
     return b->api->close(b);
@@ -244,260 +557,1421 @@ off_t rnc_buf_tell(rnc_buf_t *b)
 }
 
 
-static int mem_open(rnc_buf_t *b, size_t pre_alloc)
+int rnc_buf_wait(rnc_buf_t *b, int events, size_t size)
 {
-    mem_buf_t *m = (mem_buf_t *)b;
+    if (b->api->wait == NULL)
+        goto notsup;
 
-    if (!pre_alloc)
-        return 0;
+    return b->api->wait(b, events, size);
 
-    mrp_debug("preallocating %zu bytes for buffer '%s'", pre_alloc, b->name);
+ notsup:
+    errno = ENOTSUP;
+    return -1;
+}
 
-    m->buf = mrp_allocz(pre_alloc);
 
-    if (m->buf == NULL)
-        return -1;
+int rnc_buf_shutdown(rnc_buf_t *b)
+{
+    if (b->api->shutdown == NULL)
+        goto notsup;
 
-    m->w = m->r = m->buf;
-    m->size = pre_alloc;
+    return b->api->shutdown(b);
 
-    return 0;
+ notsup:
+    errno = ENOTSUP;
+    return -1;
 }
 
 
-static int mem_write(rnc_buf_t *b, const void *buf, size_t size)
+static int kernel_refused(int error)
 {
-    mem_buf_t *m = (mem_buf_t *)b;
-    size_t     diff, woffs;
-
-    if (m->w + size > m->buf + m->size) {
-        diff = m->w + size - (m->buf + m->size);
-
-        if (diff < m->chunk)
-            diff = m->chunk;
-
-        woffs = m->w - m->buf;
+    switch (error) {
+    case ENOSYS:
+    case EXDEV:
+    case EINVAL:
+    case EBADF:
+    case EOPNOTSUPP:
+        return 1;
+    default:
+        return 0;
+    }
+}
 
-        if (!mrp_reallocz(m->buf, m->size, m->size + diff))
-            goto nomem;
 
-        m->size += diff;
-        m->w     = m->buf + woffs;
+static ssize_t kernel_copy(int src, loff_t *offs, size_t size, int dst)
+{
+    struct stat st;
+    ssize_t     total, n;
+    int         pipe;
+
+    /*
+     * Move data from one file to another without pulling it through
+     * user space: splice into pipes, copy_file_range to anything else.
+     * Either one can refuse certain kinds of files or filesystems, in
+     * which case the caller is expected to fall back to copying it
+     * itself from where we left off.
+     */
+
+    pipe  = fstat(dst, &st) == 0 && S_ISFIFO(st.st_mode);
+    total = 0;
+
+    while (size > 0) {
+        if (pipe)
+            n = splice(src, offs, dst, NULL, size, SPLICE_F_MOVE);
+        else {
+#ifdef HAVE_COPY_FILE_RANGE
+            n = copy_file_range(src, offs, dst, NULL, size, 0);
+#else
+            errno = ENOSYS;
+            n = -1;
+#endif
+        }
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+
+            /* report partial success, let the fallback do the rest */
+            if (total > 0 && kernel_refused(errno))
+                break;
+
+            return -1;
+        }
+
+        if (n == 0)
+            break;
+
+        size  -= n;
+        total += n;
     }
 
-    memcpy(m->w, buf, size);
-    m->w += size;
-    m->r  = m->buf;
+    return total;
+}
 
-    if (m->w - m->buf > (ptrdiff_t)m->data)
-        m->data = m->w - m->buf;
 
-    return size;
+int rnc_buf_peek(rnc_buf_t *b, struct iovec *iov, int niov)
+{
+    if (b->api->peek == NULL)
+        goto notsup;
 
- nomem:
+    return b->api->peek(b, iov, niov);
+
+ notsup:
+    errno = ENOTSUP;
     return -1;
 }
 
 
-static int mem_read(rnc_buf_t *b, void *buf, size_t size)
+int rnc_buf_consume(rnc_buf_t *b, size_t size)
 {
-    mem_buf_t *m = (mem_buf_t *)b;
+    if (b->api->consume != NULL)
+        return b->api->consume(b, size);
 
-    mrp_debug("reading %zu bytes of data from buffer '%s'", size, b->name);
+    if (b->api->rseek(b, (off_t)size, SEEK_CUR) < 0)
+        return -1;
 
-    if (m->r + size >= m->buf + m->data)
-        size = m->data - (m->r - m->buf);
+    return 0;
+}
 
-    if (size == 0)
-        return 0;
 
-    memcpy(buf, m->r, size);
-    m->r    += size;
+static ssize_t bounce_to_fd(rnc_buf_t *b, int fd)
+{
+    char    buf[WRITEV_COPY];
+    ssize_t total, n;
+    int     r, w;
+
+    total = 0;
+    while ((r = rnc_buf_read(b, buf, sizeof(buf))) > 0) {
+        w = 0;
+        while (w < r) {
+            n = write(fd, buf + w, r - w);
+
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                else
+                    return -1;
+            }
+
+            w += n;
+        }
+
+        total += r;
+    }
 
-    return (int)size;
+    return r < 0 ? -1 : total;
 }
 
 
-static off_t mem_wseek(rnc_buf_t *b, off_t offset, int whence)
+ssize_t rnc_buf_writev_to_fd(rnc_buf_t *b, int fd)
 {
-    mem_buf_t *m = (mem_buf_t *)b;
+    struct iovec iov[WRITEV_IOV];
+    ssize_t      total, n;
+    int          niov;
 
-    mrp_debug("seeking to %ld offset (whence: %d)", offset, whence);
+    total = 0;
+    while ((niov = rnc_buf_peek(b, iov, WRITEV_IOV)) > 0) {
+        n = writev(fd, iov, niov);
 
-    switch (whence) {
-    case SEEK_SET:
-        if (offset >= (off_t)m->size)
-            goto invalid;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
 
-        m->w = m->buf + offset;
-        break;
+        if (rnc_buf_consume(b, (size_t)n) < 0)
+            return -1;
 
-    case SEEK_CUR:
-        if (m->w + offset - m->buf > (ptrdiff_t)m->data)
-            goto invalid;
+        total += n;
+    }
 
-        m->w += offset;
-        break;
+    /* buffers without direct access to their data get copied */
+    if (niov < 0) {
+        if (errno != ENOTSUP || total != 0)
+            return -1;
 
-    case SEEK_END:
-    default:
-        goto invalid;
+        return bounce_to_fd(b, fd);
     }
 
-    return (off_t)(m->w - m->buf);
-
- invalid:
-    errno = EINVAL;
-    return -1;
+    return total;
 }
 
 
-static off_t mem_rseek(rnc_buf_t *b, off_t offset, int whence)
+ssize_t rnc_buf_copy_to_fd(rnc_buf_t *b, int fd)
 {
-    mem_buf_t *m = (mem_buf_t *)b;
-
-    mrp_debug("seeking to read offset %ld (whence: %d)", offset, whence);
-
-    switch (whence) {
-    case SEEK_SET:
-        if (offset >= (off_t)m->size)
-            goto invalid;
-
-        m->r = m->buf + offset;
-        break;
-
-    case SEEK_CUR:
-        if (m->r + offset - m->buf > (ptrdiff_t)m->data)
-            goto invalid;
+    ssize_t total, n;
 
-        m->r += offset;
-        break;
+    if (b->api->copy == NULL || (total = b->api->copy(b, fd)) < 0) {
+        if (b->api->copy != NULL && !kernel_refused(errno))
+            return -1;
 
-    case SEEK_END:
-        if (offset > 0 || -offset > (off_t)m->data)
-            goto invalid;
-
-        m->r = m->buf + m->data + offset;
-        break;
-
-    default:
-        goto invalid;
+        total = 0;
     }
 
-    return (off_t)(m->r - m->buf);
+    /* whatever the kernel did not move for us we write ourselves */
+    if ((n = rnc_buf_writev_to_fd(b, fd)) < 0)
+        return -1;
 
- invalid:
-    errno = EINVAL;
-    return -1;
+    return total + n;
 }
 
 
-static int mem_close(rnc_buf_t *b)
-{
-    mem_buf_t *m = (mem_buf_t *)b;
+/*
+ * a reference-counted, immutable slice of data
+ *
+ * A slice wraps data owned by someone else, typically a reader recycling
+ * a fixed set of buffers. Everybody who needs the data beyond the call
+ * it was passed in takes a reference to the slice. Once the last one is
+ * dropped the owner gets its data back through the release callback. A
+ * slice cut from another one has no data of its own, it just holds a
+ * reference to its parent.
+ */
+struct rnc_slice_s {
+    const char   *data;                  /* slice data */
+    size_t        size;                  /* amount of data */
+    int           refcnt;                /* number of references */
+    rnc_slice_t  *parent;                /* slice we were cut from */
+    rnc_slice_release_t release;         /* data release callback */
+    void         *user_data;             /* opaque release data */
+};
 
-    mrp_free(m->buf);
-    m->buf  = NULL;
-    m->w    = NULL;
-    m->r    = NULL;
-    m->size = 0;
-    m->data = 0;
 
-    return 0;
-}
+rnc_slice_t *rnc_slice_create(const void *data, size_t size,
+                              rnc_slice_release_t release, void *user_data)
+{
+    rnc_slice_t *s;
 
+    if ((s = mrp_allocz(sizeof(*s))) == NULL)
+        return NULL;
 
-static int mem_unlink(rnc_buf_t *b)
-{
-    return mem_close(b);
+    s->data      = data;
+    s->size      = size;
+    s->refcnt    = 1;
+    s->release   = release;
+    s->user_data = user_data;
+
+    return s;
 }
 
 
-static int file_open(rnc_buf_t *b, int flags, mode_t mode)
+rnc_slice_t *rnc_slice_cut(rnc_slice_t *s, size_t offs, size_t size)
 {
-    file_buf_t *f = (file_buf_t *)b;
+    rnc_slice_t *c;
 
-    mrp_debug("opening file '%s' for buffer '%s'", f->path, f->name);
+    if (offs > s->size || size > s->size - offs)
+        goto invalid;
 
-    f->wfd = open(f->path, flags, mode);
-    f->rfd = open(f->path, flags, mode);
+    if ((c = rnc_slice_create(s->data + offs, size, NULL, NULL)) == NULL)
+        return NULL;
 
-    if (f->wfd < 0 || f->rfd < 0)
-        goto ioerror;
+    c->parent = rnc_slice_ref(s);
 
-    return 0;
+    return c;
 
- ioerror:
-    errno = EIO;
-    close(f->wfd);
-    close(f->rfd);
-    f->wfd = f->rfd = -1;
-    return -1;
+ invalid:
+    errno = EINVAL;
+    return NULL;
 }
 
 
-static int file_write(rnc_buf_t *b, const void *buf, size_t size)
+rnc_slice_t *rnc_slice_ref(rnc_slice_t *s)
 {
-    file_buf_t *f = (file_buf_t *)b;
+    if (s != NULL)
+        __atomic_add_fetch(&s->refcnt, 1, __ATOMIC_RELAXED);
 
-    if (write(f->wfd, buf, size) != (ssize_t)size)
-        return -1;
-    else
-        return 0;
+    return s;
 }
 
 
-static int file_read(rnc_buf_t *b, void *buf, size_t size)
+void rnc_slice_unref(rnc_slice_t *s)
 {
-    file_buf_t *f = (file_buf_t *)b;
+    rnc_slice_t *parent;
 
-    mrp_debug("reading %zu bytes of data from buffer '%s'", size, b->name);
+    while (s != NULL) {
+        /* make all our accesses to the data visible to the releaser */
+        if (__atomic_sub_fetch(&s->refcnt, 1, __ATOMIC_ACQ_REL) > 0)
+            return;
 
-    /* XXX TODO: hmm... should we have a separate read and write fds ? */
+        if (s->release != NULL)
+            s->release((void *)s->data, s->size, s->user_data);
 
-    return read(f->rfd, buf, size);
+        parent = s->parent;
+        mrp_free(s);
+        s = parent;
+    }
 }
 
 
-static off_t file_wseek(rnc_buf_t *b, off_t offset, int whence)
+const void *rnc_slice_data(rnc_slice_t *s)
 {
-    file_buf_t *f = (file_buf_t *)b;
-
-    return lseek(f->wfd, offset, whence);
+    return s->data;
 }
 
 
-static off_t file_rseek(rnc_buf_t *b, off_t offset, int whence)
+size_t rnc_slice_size(rnc_slice_t *s)
 {
-    file_buf_t *f = (file_buf_t *)b;
-
-    return lseek(f->rfd, offset, whence);
+    return s->size;
 }
 
 
-static int file_close(rnc_buf_t *b)
+static int mem_grow(mem_buf_t *m, size_t size)
 {
-    file_buf_t *f = (file_buf_t *)b;
+    size_t n;
 
-    close(f->wfd);
-    close(f->rfd);
-    f->wfd = -1;
-    f->rfd = -1;
+    while (m->size < size) {
+        if (m->nchunk >= m->ntable) {
+            n = m->ntable ? 2 * m->ntable : 16;
 
-    mrp_free(f->path);
-    f->path = f->name = NULL;
+            if (!mrp_reallocz(m->chunks, m->ntable, n))
+                return -1;
 
-    mrp_free(f);
+            m->ntable = n;
+        }
+
+        m->chunks[m->nchunk] = mrp_alloc(m->chunk);
+
+        if (m->chunks[m->nchunk] == NULL)
+            return -1;
+
+        m->nchunk++;
+        m->size += m->chunk;
+    }
 
     return 0;
 }
 
 
-static int file_unlink(rnc_buf_t *b)
+static int mem_open(rnc_buf_t *b, size_t pre_alloc)
 {
-    file_buf_t *f = (file_buf_t *)b;
+    mem_buf_t *m = (mem_buf_t *)b;
 
-    unlink(f->path);
+    if (!pre_alloc)
+        return 0;
+
+    mrp_debug("preallocating %zu bytes for buffer '%s'", pre_alloc, b->name);
+
+    return mem_grow(m, pre_alloc);
+}
+
+
+static int mem_write(rnc_buf_t *b, const void *buf, size_t size)
+{
+    mem_buf_t  *m = (mem_buf_t *)b;
+    const char *p = buf;
+    size_t      offs, n, left;
+
+    if (mem_grow(m, m->w + size) < 0)
+        goto nomem;
+
+    left = size;
+    while (left > 0) {
+        offs = m->w % m->chunk;
+        n    = m->chunk - offs;
+
+        if (n > left)
+            n = left;
+
+        memcpy(m->chunks[m->w / m->chunk] + offs, p, n);
+        p    += n;
+        m->w += n;
+        left -= n;
+    }
+
+    m->r = 0;
+
+    if (m->w > m->data)
+        m->data = m->w;
+
+    return size;
+
+ nomem:
+    return -1;
+}
+
+
+static int mem_read(rnc_buf_t *b, void *buf, size_t size)
+{
+    mem_buf_t *m = (mem_buf_t *)b;
+    char      *p = buf;
+    size_t     offs, n, left;
+
+    mrp_debug("reading %zu bytes of data from buffer '%s'", size, b->name);
+
+    if (m->r + size >= m->data)
+        size = m->data - m->r;
+
+    left = size;
+    while (left > 0) {
+        offs = m->r % m->chunk;
+        n    = m->chunk - offs;
+
+        if (n > left)
+            n = left;
+
+        memcpy(p, m->chunks[m->r / m->chunk] + offs, n);
+        p    += n;
+        m->r += n;
+        left -= n;
+    }
+
+    return (int)size;
+}
+
+
+static int mem_peek(rnc_buf_t *b, struct iovec *iov, int niov)
+{
+    mem_buf_t *m = (mem_buf_t *)b;
+    size_t     r, offs, n;
+    int        i;
+
+    r = m->r;
+    for (i = 0; i < niov && r < m->data; i++) {
+        offs = r % m->chunk;
+        n    = m->chunk - offs;
+
+        if (n > m->data - r)
+            n = m->data - r;
+
+        iov[i].iov_base = m->chunks[r / m->chunk] + offs;
+        iov[i].iov_len  = n;
+        r += n;
+    }
+
+    return i;
+}
+
+
+static off_t mem_wseek(rnc_buf_t *b, off_t offset, int whence)
+{
+    mem_buf_t *m = (mem_buf_t *)b;
+
+    mrp_debug("seeking to %ld offset (whence: %d)", offset, whence);
+
+    return buf_seek(m->data, &m->w, offset, whence);
+}
+
+
+static off_t mem_rseek(rnc_buf_t *b, off_t offset, int whence)
+{
+    mem_buf_t *m = (mem_buf_t *)b;
+
+    mrp_debug("seeking to read offset %ld (whence: %d)", offset, whence);
+
+    return buf_seek(m->data, &m->r, offset, whence);
+}
+
+
+static int mem_close(rnc_buf_t *b)
+{
+    mem_buf_t *m = (mem_buf_t *)b;
+    size_t     i;
+
+    for (i = 0; i < m->nchunk; i++)
+        mrp_free(m->chunks[i]);
+    mrp_free(m->chunks);
+
+    buf_free(b);
+
+    return 0;
+}
+
+
+static int mem_unlink(rnc_buf_t *b)
+{
+    return mem_close(b);
+}
+
+
+static int file_open(rnc_buf_t *b, int flags, mode_t mode)
+{
+    file_buf_t *f = (file_buf_t *)b;
+
+    mrp_debug("opening file '%s' for buffer '%s'", f->path, f->name);
+
+    f->wfd = open(f->path, flags, mode);
+    f->rfd = open(f->path, flags, mode);
+
+    if (f->wfd < 0 || f->rfd < 0)
+        goto ioerror;
+
+    return 0;
+
+ ioerror:
+    errno = EIO;
+    close(f->wfd);
+    close(f->rfd);
+    f->wfd = f->rfd = -1;
+    return -1;
+}
+
+
+static void file_writeback(file_buf_t *f)
+{
+    /*
+     * Kick off (but don't wait for) writeback of what we have written so
+     * far. This keeps the amount of dirty page cache for long streams in
+     * check instead of leaving it all for the kernel to flush at once.
+     */
+
+#ifdef SYNC_FILE_RANGE_WRITE
+    sync_file_range(f->wfd, 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif
+
+    f->dirty = 0;
+}
+
+
+static int file_put(file_buf_t *f, const void *buf, size_t size)
+{
+    const char *p = buf;
+    ssize_t     n;
+
+    while (size > 0) {
+        n = write(f->wfd, p, size);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            else
+                return -1;
+        }
+
+        p        += n;
+        size     -= n;
+        f->dirty += n;
+    }
+
+    if (f->dirty >= FILE_WRITEBACK)
+        file_writeback(f);
+
+    return 0;
+}
+
+
+static int file_flush(file_buf_t *f)
+{
+    size_t n = f->nstage;
+
+    if (n == 0)
+        return 0;
+
+    f->nstage = 0;
+
+    return file_put(f, f->stage, n);
+}
+
+
+static int file_write(rnc_buf_t *b, const void *buf, size_t size)
+{
+    file_buf_t *f = (file_buf_t *)b;
+
+    if (f->stage == NULL && size < FILE_STAGE)
+        f->stage = mrp_alloc(FILE_STAGE);
+
+    /* don't bother staging what would fill the buffer anyway */
+    if (f->stage == NULL || size >= FILE_STAGE) {
+        if (file_flush(f) < 0)
+            return -1;
+
+        return file_put(f, buf, size);
+    }
+
+    if (f->nstage + size > FILE_STAGE && file_flush(f) < 0)
+        return -1;
+
+    memcpy(f->stage + f->nstage, buf, size);
+    f->nstage += size;
+
+    return 0;
+}
+
+
+static int file_read(rnc_buf_t *b, void *buf, size_t size)
+{
+    file_buf_t *f = (file_buf_t *)b;
+
+    mrp_debug("reading %zu bytes of data from buffer '%s'", size, b->name);
+
+    if (file_flush(f) < 0)
+        return -1;
+
+    return read(f->rfd, buf, size);
+}
+
+
+static off_t file_wseek(rnc_buf_t *b, off_t offset, int whence)
+{
+    file_buf_t *f = (file_buf_t *)b;
+
+    if (file_flush(f) < 0)
+        return -1;
+
+    return lseek(f->wfd, offset, whence);
+}
+
+
+static off_t file_rseek(rnc_buf_t *b, off_t offset, int whence)
+{
+    file_buf_t *f = (file_buf_t *)b;
+
+    if (file_flush(f) < 0)
+        return -1;
+
+    return lseek(f->rfd, offset, whence);
+}
+
+
+static ssize_t file_copy(rnc_buf_t *b, int fd)
+{
+    file_buf_t  *f = (file_buf_t *)b;
+    struct stat  st;
+    off_t        offs;
+
+    if (file_flush(f) < 0)
+        return -1;
+
+    if (fstat(f->rfd, &st) < 0 || (offs = lseek(f->rfd, 0, SEEK_CUR)) < 0)
+        return -1;
+
+    if (st.st_size <= offs)
+        return 0;
+
+    /* with no offset given the kernel moves our read position for us */
+    return kernel_copy(f->rfd, NULL, (size_t)(st.st_size - offs), fd);
+}
+
+
+static int file_close(rnc_buf_t *b)
+{
+    file_buf_t *f = (file_buf_t *)b;
+    int         status, error;
+
+    status = file_flush(f);
+    error  = errno;
+
+    close(f->wfd);
+    close(f->rfd);
+    f->wfd = -1;
+    f->rfd = -1;
+
+    mrp_free(f->stage);
+    mrp_free(f->path);
+    f->path = f->name = NULL;
+
+    mrp_free(f);
+
+    errno = error;
+    return status;
+}
+
+
+static int file_unlink(rnc_buf_t *b)
+{
+    file_buf_t *f = (file_buf_t *)b;
+
+    /* no point in writing out what we're about to remove */
+    f->nstage = 0;
+    unlink(f->path);
 
     return file_close(b);
 }
+
+
+
+static int map_open(rnc_buf_t *b, int flags, mode_t mode)
+{
+    map_buf_t   *m = (map_buf_t *)b;
+    struct stat  st;
+    int          error;
+
+    mrp_debug("opening file '%s' for mapped buffer", m->path);
+
+    /* we need to be able to read for mapping, even if we only write */
+    if ((m->fd = open(m->path, (flags & ~O_ACCMODE) | O_RDWR, mode)) < 0)
+        return -1;
+
+    if (fstat(m->fd, &st) < 0) {
+        close(m->fd);
+        m->fd = -1;
+        return -1;
+    }
+
+    m->data  = (size_t)st.st_size;
+    m->alloc = m->data;
+
+    /* find out right away if we can preallocate, we won't map otherwise */
+    if ((flags & O_ACCMODE) != O_RDONLY && map_grow(m, m->data + 1) < 0) {
+        error = errno;
+        close(m->fd);
+        m->fd = -1;
+        errno = error;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static int map_grow(map_buf_t *m, size_t size)
+{
+    size_t n;
+
+    if (size <= m->alloc)
+        return 0;
+
+    n = (size + MAP_WINDOW - 1) & ~((size_t)MAP_WINDOW - 1);
+
+    mrp_debug("growing mapped buffer '%s' to %zu bytes", m->name, n);
+
+    /*
+     * Don't fall back to a sparse file if the filesystem can't preallocate
+     * (NFS, CIFS, ...). Running out of space there would only show up as
+     * a SIGBUS once we touch the page.
+     */
+
+    if (fallocate(m->fd, 0, (off_t)m->alloc, (off_t)(n - m->alloc)) < 0) {
+        if (errno == ENOSYS)
+            errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    m->alloc = n;
+
+    return 0;
+}
+
+
+static void map_writeback(map_buf_t *m)
+{
+    size_t end = m->w & ~((size_t)FILE_WRITEBACK - 1);
+
+    /*
+     * Only kick off writeback for what lies fully behind the write
+     * pointer. Cleaning pages we are still writing to would make us
+     * take another write fault on them right away.
+     */
+
+    if (end <= m->synced)
+        return;
+
+#ifdef SYNC_FILE_RANGE_WRITE
+    sync_file_range(m->fd, (off_t)m->synced, (off_t)(end - m->synced),
+                    SYNC_FILE_RANGE_WRITE);
+#endif
+
+    m->synced = end;
+}
+
+
+static int map_window(map_buf_t *m, size_t offs)
+{
+    size_t start = offs & ~((size_t)MAP_WINDOW - 1);
+    void  *map;
+
+    if (m->map != NULL) {
+        if (m->moffs == start)
+            return 0;
+
+        munmap(m->map, MAP_WINDOW);
+        m->map = NULL;
+    }
+
+    map = mmap(NULL, MAP_WINDOW, PROT_READ | PROT_WRITE, MAP_SHARED,
+               m->fd, (off_t)start);
+
+    if (map == MAP_FAILED)
+        return -1;
+
+    m->map   = map;
+    m->moffs = start;
+
+    return 0;
+}
+
+
+static int map_write(rnc_buf_t *b, const void *buf, size_t size)
+{
+    map_buf_t  *m = (map_buf_t *)b;
+    const char *p = buf;
+    size_t      offs, n, left;
+
+    if (map_grow(m, m->w + size) < 0)
+        return -1;
+
+    left = size;
+    while (left > 0) {
+        if (map_window(m, m->w) < 0)
+            return -1;
+
+        offs = m->w - m->moffs;
+        n    = MAP_WINDOW - offs;
+
+        if (n > left)
+            n = left;
+
+        memcpy(m->map + offs, p, n);
+        p    += n;
+        m->w += n;
+        left -= n;
+    }
+
+    if (m->w > m->data)
+        m->data = m->w;
+
+    if (m->w - m->synced >= 2 * FILE_WRITEBACK)
+        map_writeback(m);
+
+    return size;
+}
+
+
+static int map_read(rnc_buf_t *b, void *buf, size_t size)
+{
+    map_buf_t *m = (map_buf_t *)b;
+    char      *p = buf;
+    size_t     offs, n, left;
+
+    mrp_debug("reading %zu bytes of data from buffer '%s'", size, b->name);
+
+    if (m->r + size >= m->data)
+        size = m->data - m->r;
+
+    left = size;
+    while (left > 0) {
+        if (map_window(m, m->r) < 0)
+            return -1;
+
+        offs = m->r - m->moffs;
+        n    = MAP_WINDOW - offs;
+
+        if (n > left)
+            n = left;
+
+        memcpy(p, m->map + offs, n);
+        p    += n;
+        m->r += n;
+        left -= n;
+    }
+
+    return (int)size;
+}
+
+
+static int map_peek(rnc_buf_t *b, struct iovec *iov, int niov)
+{
+    map_buf_t *m = (map_buf_t *)b;
+    size_t     offs, n;
+
+    /* we only have a single window mapped at a time */
+    if (niov < 1 || m->r >= m->data)
+        return 0;
+
+    if (map_window(m, m->r) < 0)
+        return -1;
+
+    offs = m->r - m->moffs;
+    n    = MAP_WINDOW - offs;
+
+    if (n > m->data - m->r)
+        n = m->data - m->r;
+
+    iov[0].iov_base = m->map + offs;
+    iov[0].iov_len  = n;
+
+    return 1;
+}
+
+
+static off_t map_wseek(rnc_buf_t *b, off_t offset, int whence)
+{
+    map_buf_t *m = (map_buf_t *)b;
+
+    return buf_seek(m->data, &m->w, offset, whence);
+}
+
+
+static off_t map_rseek(rnc_buf_t *b, off_t offset, int whence)
+{
+    map_buf_t *m = (map_buf_t *)b;
+
+    return buf_seek(m->data, &m->r, offset, whence);
+}
+
+
+static ssize_t map_copy(rnc_buf_t *b, int fd)
+{
+    map_buf_t *m = (map_buf_t *)b;
+    loff_t     offs;
+    ssize_t    n;
+
+    if (m->r >= m->data)
+        return 0;
+
+    /* the mapping is shared, so the page cache is up to date */
+    offs = (loff_t)m->r;
+    n    = kernel_copy(m->fd, &offs, m->data - m->r, fd);
+    m->r = (size_t)offs;
+
+    return n;
+}
+
+
+static int map_close(rnc_buf_t *b)
+{
+    map_buf_t *m = (map_buf_t *)b;
+    int        status = 0;
+
+    if (m->map != NULL)
+        munmap(m->map, MAP_WINDOW);
+
+    /* trim any preallocated space past the data */
+    if (m->fd >= 0) {
+        if (m->alloc != m->data && ftruncate(m->fd, (off_t)m->data) < 0)
+            status = -1;
+
+        close(m->fd);
+    }
+
+    mrp_free(m->path);
+    m->path = m->name = NULL;
+
+    mrp_free(m);
+
+    return status;
+}
+
+
+static int map_unlink(rnc_buf_t *b)
+{
+    map_buf_t *m = (map_buf_t *)b;
+
+    unlink(m->path);
+
+    return map_close(b);
+}
+
+
+static int spill_pwrite(int fd, const void *buf, size_t size, size_t offs)
+{
+    const char *p = buf;
+    ssize_t     n;
+
+    while (size > 0) {
+        n = pwrite(fd, p, size, (off_t)offs);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            else
+                return -1;
+        }
+
+        p    += n;
+        offs += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+
+static int spill_file(spill_buf_t *s)
+{
+    mem_buf_t *m = (mem_buf_t *)s->mem;
+    char       path[PATH_MAX];
+    size_t     offs, n;
+    int        fd;
+
+    mrp_debug("spilling %zu bytes of buffer '%s' to '%s'", m->data, s->name,
+              s->dir);
+
+#ifdef O_TMPFILE
+    fd = open(s->dir, O_TMPFILE | O_RDWR | O_EXCL, 0600);
+#else
+    fd = -1;
+    errno = EOPNOTSUPP;
+#endif
+
+    /* no O_TMPFILE support in libc or the filesystem, unlink by hand */
+    if (fd < 0 && (errno == EOPNOTSUPP || errno == EISDIR || errno == EINVAL)) {
+        if (snprintf(path, sizeof(path), "%s/rnc-spill.XXXXXX",
+                     s->dir) >= (int)sizeof(path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+
+        if ((fd = mkstemp(path)) >= 0)
+            unlink(path);
+    }
+
+    if (fd < 0)
+        return -1;
+
+    for (offs = 0; offs < m->data; offs += n) {
+        n = m->data - offs;
+
+        if (n > m->chunk)
+            n = m->chunk;
+
+        if (spill_pwrite(fd, m->chunks[offs / m->chunk], n, offs) < 0) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    s->fd   = fd;
+    s->data = m->data;
+    s->w    = m->w;
+    s->r    = m->r;
+
+    mem_close(s->mem);
+    s->mem = NULL;
+
+    return 0;
+}
+
+
+static int spill_write(rnc_buf_t *b, const void *buf, size_t size)
+{
+    spill_buf_t *s = (spill_buf_t *)b;
+    mem_buf_t   *m = (mem_buf_t *)s->mem;
+
+    if (m != NULL) {
+        if (!s->limit || m->w + size <= s->limit)
+            return mem_write(s->mem, buf, size);
+
+        if (spill_file(s) < 0)
+            return -1;
+    }
+
+    if (spill_pwrite(s->fd, buf, size, s->w) < 0)
+        return -1;
+
+    s->w     += size;
+    s->dirty += size;
+
+    /* rewind the reader, just like the in-memory buffer does */
+    s->r = 0;
+
+    if (s->w > s->data)
+        s->data = s->w;
+
+    if (s->dirty >= FILE_WRITEBACK) {
+#ifdef SYNC_FILE_RANGE_WRITE
+        sync_file_range(s->fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif
+        s->dirty = 0;
+    }
+
+    return size;
+}
+
+
+static int spill_read(rnc_buf_t *b, void *buf, size_t size)
+{
+    spill_buf_t *s = (spill_buf_t *)b;
+    char        *p = buf;
+    ssize_t      n;
+    size_t       left;
+
+    if (s->mem != NULL)
+        return mem_read(s->mem, buf, size);
+
+    mrp_debug("reading %zu bytes of data from buffer '%s'", size, b->name);
+
+    if (s->r + size >= s->data)
+        size = s->data - s->r;
+
+    left = size;
+    while (left > 0) {
+        n = pread(s->fd, p, left, (off_t)s->r);
+
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n == 0)
+                errno = EIO;
+            return -1;
+        }
+
+        p    += n;
+        s->r += n;
+        left -= n;
+    }
+
+    return (int)size;
+}
+
+
+static int spill_peek(rnc_buf_t *b, struct iovec *iov, int niov)
+{
+    spill_buf_t *s = (spill_buf_t *)b;
+
+    if (s->mem == NULL)
+        goto notsup;
+
+    return mem_peek(s->mem, iov, niov);
+
+ notsup:
+    errno = ENOTSUP;
+    return -1;
+}
+
+
+static off_t spill_wseek(rnc_buf_t *b, off_t offset, int whence)
+{
+    spill_buf_t *s = (spill_buf_t *)b;
+
+    if (s->mem != NULL)
+        return mem_wseek(s->mem, offset, whence);
+
+    return buf_seek(s->data, &s->w, offset, whence);
+}
+
+
+static off_t spill_rseek(rnc_buf_t *b, off_t offset, int whence)
+{
+    spill_buf_t *s = (spill_buf_t *)b;
+
+    if (s->mem != NULL)
+        return mem_rseek(s->mem, offset, whence);
+
+    return buf_seek(s->data, &s->r, offset, whence);
+}
+
+
+static ssize_t spill_copy(rnc_buf_t *b, int fd)
+{
+    spill_buf_t *s = (spill_buf_t *)b;
+    loff_t       offs;
+    ssize_t      n;
+
+    /* in-memory data is best written straight from memory */
+    if (s->mem != NULL)
+        return 0;
+
+    if (s->r >= s->data)
+        return 0;
+
+    offs = (loff_t)s->r;
+    n    = kernel_copy(s->fd, &offs, s->data - s->r, fd);
+    s->r = (size_t)offs;
+
+    return n;
+}
+
+
+static int spill_close(rnc_buf_t *b)
+{
+    spill_buf_t *s = (spill_buf_t *)b;
+
+    /* the spill file is anonymous, closing it is all the cleanup needed */
+    if (s->mem != NULL)
+        mem_close(s->mem);
+
+    if (s->fd >= 0)
+        close(s->fd);
+
+    mrp_free(s->dir);
+    buf_free(b);
+
+    return 0;
+}
+
+
+static void ring_wakeup(ring_buf_t *rb)
+{
+    /*
+     * Pairs with the fence in ring_wait: either we see the waiter, or
+     * the waiter sees our counter update before it goes to sleep.
+     */
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&rb->waiting, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&rb->lock);
+        pthread_cond_broadcast(&rb->cond);
+        pthread_mutex_unlock(&rb->lock);
+    }
+}
+
+
+static int ring_write(rnc_buf_t *b, const void *buf, size_t size)
+{
+    ring_buf_t *rb = (ring_buf_t *)b;
+    size_t      w, offs, n;
+
+    w = rb->w;
+
+    if (rb->size - (w - rb->rcache) < size)
+        rb->rcache = __atomic_load_n(&rb->r, __ATOMIC_ACQUIRE);
+
+    n = rb->size - (w - rb->rcache);
+
+    if (size > n)
+        size = n;
+
+    if (size > INT_MAX)
+        size = INT_MAX;
+
+    if (size == 0)
+        return 0;
+
+    offs = w & (rb->size - 1);
+    n    = rb->size - offs;
+
+    if (n > size)
+        n = size;
+
+    memcpy(rb->data + offs, buf, n);
+    memcpy(rb->data, (const char *)buf + n, size - n);
+
+    __atomic_store_n(&rb->w, w + size, __ATOMIC_RELEASE);
+
+    ring_wakeup(rb);
+
+    return (int)size;
+}
+
+
+static int ring_read(rnc_buf_t *b, void *buf, size_t size)
+{
+    ring_buf_t *rb = (ring_buf_t *)b;
+    size_t      r, offs, n;
+
+    r = rb->r;
+
+    if (rb->wcache - r < size)
+        rb->wcache = __atomic_load_n(&rb->w, __ATOMIC_ACQUIRE);
+
+    n = rb->wcache - r;
+
+    if (size > n)
+        size = n;
+
+    if (size > INT_MAX)
+        size = INT_MAX;
+
+    if (size == 0)
+        return 0;
+
+    offs = r & (rb->size - 1);
+    n    = rb->size - offs;
+
+    if (n > size)
+        n = size;
+
+    memcpy(buf, rb->data + offs, n);
+    memcpy((char *)buf + n, rb->data, size - n);
+
+    __atomic_store_n(&rb->r, r + size, __ATOMIC_RELEASE);
+
+    ring_wakeup(rb);
+
+    return (int)size;
+}
+
+
+static int ring_peek(rnc_buf_t *b, struct iovec *iov, int niov)
+{
+    ring_buf_t *rb = (ring_buf_t *)b;
+    size_t      r, offs, n, size;
+
+    r = rb->r;
+    rb->wcache = __atomic_load_n(&rb->w, __ATOMIC_ACQUIRE);
+
+    size = rb->wcache - r;
+
+    if (size == 0 || niov < 1)
+        return 0;
+
+    offs = r & (rb->size - 1);
+    n    = rb->size - offs;
+
+    iov[0].iov_base = rb->data + offs;
+    iov[0].iov_len  = n < size ? n : size;
+
+    if (n >= size || niov < 2)
+        return 1;
+
+    iov[1].iov_base = rb->data;
+    iov[1].iov_len  = size - n;
+
+    return 2;
+}
+
+
+static int ring_consume(rnc_buf_t *b, size_t size)
+{
+    ring_buf_t *rb = (ring_buf_t *)b;
+    size_t      r;
+
+    r = rb->r;
+
+    if (rb->wcache - r < size)
+        rb->wcache = __atomic_load_n(&rb->w, __ATOMIC_ACQUIRE);
+
+    if (rb->wcache - r < size)
+        goto invalid;
+
+    __atomic_store_n(&rb->r, r + size, __ATOMIC_RELEASE);
+
+    ring_wakeup(rb);
+
+    return 0;
+
+ invalid:
+    errno = EINVAL;
+    return -1;
+}
+
+
+static off_t ring_wseek(rnc_buf_t *b, off_t offset, int whence)
+{
+    ring_buf_t *rb = (ring_buf_t *)b;
+
+    /* only telling the current position is possible */
+    if (offset != 0 || whence != SEEK_CUR)
+        goto invalid;
+
+    return (off_t)rb->w;
+
+ invalid:
+    errno = ESPIPE;
+    return -1;
+}
+
+
+static off_t ring_rseek(rnc_buf_t *b, off_t offset, int whence)
+{
+    ring_buf_t *rb = (ring_buf_t *)b;
+
+    if (offset != 0 || whence != SEEK_CUR)
+        goto invalid;
+
+    return (off_t)rb->r;
+
+ invalid:
+    errno = ESPIPE;
+    return -1;
+}
+
+
+static int ring_ready(ring_buf_t *rb, int events, size_t size)
+{
+    size_t w = __atomic_load_n(&rb->w, __ATOMIC_ACQUIRE);
+    size_t r = __atomic_load_n(&rb->r, __ATOMIC_ACQUIRE);
+
+    if (events == RNC_BUF_READABLE && w - r >= size)
+        return 1;
+
+    if (events == RNC_BUF_WRITABLE && rb->size - (w - r) >= size)
+        return 1;
+
+    return __atomic_load_n(&rb->down, __ATOMIC_ACQUIRE);
+}
+
+
+static int ring_wait(rnc_buf_t *b, int events, size_t size)
+{
+    ring_buf_t *rb = (ring_buf_t *)b;
+
+    if (size > rb->size ||
+        (events != RNC_BUF_READABLE && events != RNC_BUF_WRITABLE))
+        goto invalid;
+
+    if (ring_ready(rb, events, size))
+        goto out;
+
+    pthread_mutex_lock(&rb->lock);
+
+    __atomic_add_fetch(&rb->waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    while (!ring_ready(rb, events, size))
+        pthread_cond_wait(&rb->cond, &rb->lock);
+
+    __atomic_sub_fetch(&rb->waiting, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&rb->lock);
+
+ out:
+    /* after a shutdown, we might have stopped short of size */
+    if (events == RNC_BUF_READABLE)
+        return (int)(__atomic_load_n(&rb->w, __ATOMIC_ACQUIRE) - rb->r);
+    else
+        return (int)(rb->size - (rb->w - __atomic_load_n(&rb->r,
+                                                         __ATOMIC_ACQUIRE)));
+
+ invalid:
+    errno = EINVAL;
+    return -1;
+}
+
+
+static int ring_shutdown(rnc_buf_t *b)
+{
+    ring_buf_t *rb = (ring_buf_t *)b;
+
+    __atomic_store_n(&rb->down, 1, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&rb->lock);
+    pthread_cond_broadcast(&rb->cond);
+    pthread_mutex_unlock(&rb->lock);
+
+    return 0;
+}
+
+
+static int ring_close(rnc_buf_t *b)
+{
+    ring_buf_t *rb = (ring_buf_t *)b;
+
+    pthread_mutex_destroy(&rb->lock);
+    pthread_cond_destroy(&rb->cond);
+    mrp_free(rb->data);
+
+    buf_free(b);
+
+    return 0;
+}
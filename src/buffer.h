@@ -34,6 +34,7 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #include <ripncode/ripncode.h>
 
@@ -44,12 +45,51 @@
 rnc_buf_t *rnc_buf_create(const char *name, size_t pre_alloc, size_t chunk_size);
 
 
+/**
+ * @brief Create a new in-memory buffer which spills over to disk.
+ *
+ * The buffer behaves like one created with rnc_buf_create until it would
+ * grow past limit bytes. Then its contents are moved to an anonymous file
+ * in dir (or $TMPDIR, or /var/tmp if NULL) and it continues from there.
+ * A limit of 0 keeps the buffer in memory.
+ */
+rnc_buf_t *rnc_buf_spill(const char *name, size_t chunk_size, size_t limit,
+                         const char *dir);
+
+
 /**
  * @brief Create a new buffer frontend to a file.
  */
 rnc_buf_t *rnc_buf_open(const char *path, int flags, mode_t mode);
 
 
+/**
+ * @brief Create a new memory-mapped buffer frontend to a file.
+ *
+ * Like rnc_buf_open, but reads and writes are memory copies through a
+ * sliding mapped window, and seeking is pointer arithmetic. The file is
+ * preallocated as it grows. On filesystems which can't do that, a plain
+ * file buffer (rnc_buf_open) is returned instead. Each new page costs a
+ * write fault, so for streaming writes this is not faster than the plain
+ * file buffer.
+ */
+rnc_buf_t *rnc_buf_map(const char *path, int flags, mode_t mode);
+
+
+/**
+ * @brief Create a new fixed-size single-producer/single-consumer ring.
+ *
+ * The ring lets one thread write data and another read it without locks.
+ * Its size is rounded up to a power of two. Writes and reads never block;
+ * they transfer as much as fits (or is available) and return the number
+ * of bytes transferred, 0 if the ring is full (or empty). Use rnc_buf_wait
+ * to block until there is room or data, and rnc_buf_shutdown to tell the
+ * other side that no more data is coming. Rings can't be seeked, seeking
+ * by 0 from SEEK_CUR tells the total number of bytes written (or read).
+ */
+rnc_buf_t *rnc_buf_ring(const char *name, size_t size);
+
+
 /**
  * @brief Destroy a buffer.
  */
@@ -92,4 +132,123 @@ off_t rnc_buf_rseek(rnc_buf_t *b, off_t offset, int whence);
 off_t rnc_buf_tell(rnc_buf_t *b);
 
 
+/**
+ * @brief Conditions to wait for with rnc_buf_wait.
+ */
+typedef enum {
+    RNC_BUF_READABLE = 0x1,              /* data to read (consumer) */
+    RNC_BUF_WRITABLE = 0x2,              /* room to write (producer) */
+} rnc_buf_event_t;
+
+
+/**
+ * @brief Wait until at least size bytes can be read from or written to b.
+ *
+ * Returns the number of bytes that can be read (or written), which is
+ * less than size only if the buffer has been shut down. Only supported
+ * for rings.
+ */
+int rnc_buf_wait(rnc_buf_t *b, int events, size_t size);
+
+
+/**
+ * @brief Shut down a buffer, waking up anyone waiting for it.
+ */
+int rnc_buf_shutdown(rnc_buf_t *b);
+
+
+/**
+ * @brief Get the data readable from a buffer without copying it.
+ *
+ * Fill iov with up to niov regions describing the data from the read
+ * offset on, in order, and return the number of regions filled, 0 if
+ * there is no data to read. The regions point into the buffer itself,
+ * and stay valid until the buffer is next written to, read from or
+ * closed. Use rnc_buf_consume to tell how much of the data was used.
+ * Buffers without direct access to their data fail with ENOTSUP.
+ */
+int rnc_buf_peek(rnc_buf_t *b, struct iovec *iov, int niov);
+
+
+/**
+ * @brief Advance the read pointer past size bytes of peeked data.
+ */
+int rnc_buf_consume(rnc_buf_t *b, size_t size);
+
+
+/**
+ * @brief Write all readable data from a buffer to the given file.
+ *
+ * The data is passed to writev straight from the buffer if possible,
+ * and copied through a bounce buffer otherwise. Returns the number of
+ * bytes written, or -1 on error.
+ */
+ssize_t rnc_buf_writev_to_fd(rnc_buf_t *b, int fd);
+
+
+/**
+ * @brief Move all readable data from a buffer to the given file.
+ *
+ * Like rnc_buf_writev_to_fd, but data in file-backed buffers is moved
+ * by the kernel, with splice if fd is a pipe and with copy_file_range
+ * otherwise, without passing through user space. Falls back to writing
+ * the data if the kernel refuses. Returns the number of bytes written,
+ * or -1 on error.
+ */
+ssize_t rnc_buf_copy_to_fd(rnc_buf_t *b, int fd);
+
+
+/**
+ * @brief Callback to give the data of a released slice back to its owner.
+ */
+typedef void (*rnc_slice_release_t)(void *data, size_t size, void *user_data);
+
+
+/**
+ * @brief Create a new reference-counted slice of data.
+ *
+ * Slices let several consumers share the same block of data, for instance
+ * PCM audio fed both to an encoder and to loudness analysis, without any
+ * of them copying it. The data is not copied, it must stay valid and must
+ * not be changed until release is called with user_data, once the last
+ * reference to the slice is gone. The new slice has a single reference,
+ * owned by the caller.
+ */
+rnc_slice_t *rnc_slice_create(const void *data, size_t size,
+                              rnc_slice_release_t release, void *user_data);
+
+
+/**
+ * @brief Create a new slice of size bytes at offs within s.
+ *
+ * The new slice shares the data of s, and keeps s alive for as long as
+ * it is around itself.
+ */
+rnc_slice_t *rnc_slice_cut(rnc_slice_t *s, size_t offs, size_t size);
+
+
+/**
+ * @brief Take a new reference to a slice.
+ */
+rnc_slice_t *rnc_slice_ref(rnc_slice_t *s);
+
+
+/**
+ * @brief Drop a reference to a slice, releasing it if it was the last one.
+ */
+void rnc_slice_unref(rnc_slice_t *s);
+
+
+/**
+ * @brief Get the data of a slice.
+ */
+const void *rnc_slice_data(rnc_slice_t *s);
+
+
+/**
+ * @brief Get the size of a slice.
+ */
+size_t rnc_slice_size(rnc_slice_t *s);
+
+
 #endif /* __RIPNCODE_BUFFER_H__ */
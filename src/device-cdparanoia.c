@@ -85,7 +85,7 @@ static bool cdpa_probe(rnc_dev_api_t *api, const char *device)
     fd = open(device, O_RDONLY);
 
     if (fd < 0)
-        return -1;
+        return false;
 
     is_cd = (ioctl(fd, CDROM_DRIVE_STATUS) != -1);
 
@@ -392,6 +392,48 @@ static int cdpa_read(rnc_dev_t *dev, void *buf, size_t size)
 }
 
 
+static int cdpa_read_view(rnc_dev_t *dev, const void **bufp, size_t size)
+{
+    cdpa_t *cdpa = dev->data;
+    char   *s;
+
+    mrp_debug("reading a view of %zu bytes", size);
+
+    if (size < CDIO_CD_FRAMESIZE_RAW)
+        goto invalid;
+
+    /*
+     * cd-paranoia only guarantees the frame it returned to stay intact
+     * until the next read, so we can only hand out a single frame.
+     */
+
+    s = (char *)cdio_paranoia_read(cdpa->cdpa, read_status);
+
+    if (s == NULL)
+        goto ioerror;
+
+    *bufp = s;
+
+    return CDIO_CD_FRAMESIZE_RAW;
+
+ invalid:
+    errno = EINVAL;
+    return -1;
+
+ ioerror:
+    errno = EIO;
+    return -1;
+}
+
+
+static void cdpa_release_view(rnc_dev_t *dev, const void *buf, size_t size)
+{
+    MRP_UNUSED(dev);
+    MRP_UNUSED(buf);
+    MRP_UNUSED(size);
+}
+
+
 static int cdpa_error(rnc_dev_t *dev, const char **error)
 {
     cdpa_t *cdpa = dev->data;
@@ -416,6 +458,8 @@ RNC_DEVICE_REGISTER(cdio, {
         .get_blocksize = cdpa_get_blocksize,
         .seek          = cdpa_seek,
         .read          = cdpa_read,
+        .read_view     = cdpa_read_view,
+        .release_view  = cdpa_release_view,
         .error         = cdpa_error,
 });
 
@@ -0,0 +1,799 @@
+/*
+ * Copyright (c) 2015, Krisztian Litkey, <kli@iki.fi>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <libgen.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <murphy/common/debug.h>
+#include <ripncode/ripncode.h>
+
+/*
+ * Disc image device backend.
+ *
+ * This backend serves audio from disc images instead of a drive: BIN/CUE
+ * images, raw CDDA dumps and WAV files. Image files are mmap'd and reads
+ * are served straight from the mappings. A device is taken to be an image
+ * if it has one of the known image suffixes, or if it is explicitly given
+ * with an 'image:' prefix. All audio tracks of an image must have the
+ * same byte order, cue sheets mixing BINARY and MOTOROLA files for them
+ * are rejected.
+ */
+
+#define IMAGE_PREFIX    "image:"
+#define IMAGE_BLOCKSIZE 2352             /* CDDA frame size */
+#define IMAGE_FRAMES    75               /* CDDA frames per second */
+
+
+typedef struct {
+    char   *path;                        /* image file path */
+    int     fd;                          /* opened image file */
+    char   *map;                         /* mapped image file */
+    size_t  size;                        /* size of mapping */
+    char   *data;                        /* start of audio data */
+    size_t  len;                         /* amount of audio data */
+    int     endn;                        /* audio data byte order */
+} img_file_t;
+
+
+typedef struct {
+    int         id;                      /* track number */
+    int         file;                    /* file with track data */
+    uint32_t    fblk;                    /* first block within disc */
+    uint32_t    nblk;                    /* number of blocks */
+    char       *data;                    /* start of track data */
+    size_t      size;                    /* amount of track data */
+    int         audio;                   /* whether an audio track */
+} img_track_t;
+
+
+typedef struct {
+    img_file_t  *files;                  /* image files */
+    int          nfile;                  /* number of image files */
+    img_track_t *tracks;                 /* audio tracks */
+    int          ntrack;                 /* number of audio tracks */
+    int          ctrack;                 /* current track */
+    size_t       pos;                    /* offset within current track */
+    char         pad[IMAGE_BLOCKSIZE];   /* padded incomplete last block */
+    char        *errmsg;                 /* last error message */
+    int          error;                  /* last error code */
+} img_t;
+
+
+static const char *image_suffix(const char *path)
+{
+    static const char *suffixes[] = {
+        ".cue", ".bin", ".raw", ".cdda", ".pcm", ".wav", NULL
+    };
+    const char **s;
+    const char  *dot;
+
+    if ((dot = strrchr(path, '.')) == NULL)
+        return NULL;
+
+    for (s = suffixes; *s != NULL; s++)
+        if (!strcasecmp(dot, *s))
+            return *s;
+
+    return NULL;
+}
+
+
+static bool img_probe(rnc_dev_api_t *api, const char *device)
+{
+    MRP_UNUSED(api);
+
+    mrp_debug("probing device '%s' as a disc image", device);
+
+    if (!strncmp(device, IMAGE_PREFIX, sizeof(IMAGE_PREFIX) - 1))
+        return true;
+
+    return image_suffix(device) != NULL;
+}
+
+
+static int set_error(img_t *img, int error, const char *fmt, ...)
+{
+    va_list ap;
+    char    msg[PATH_MAX + 256];
+
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+
+    mrp_free(img->errmsg);
+    img->errmsg = mrp_strdup(msg);
+    img->error  = error;
+
+    mrp_log_error("%s", msg);
+
+    errno = error;
+    return -1;
+}
+
+
+static uint32_t le32(const char *p)
+{
+    const uint8_t *b = (const uint8_t *)p;
+
+    return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+
+static uint16_t le16(const char *p)
+{
+    const uint8_t *b = (const uint8_t *)p;
+
+    return b[0] | (b[1] << 8);
+}
+
+
+static int parse_wave(img_t *img, img_file_t *f)
+{
+    char     *p, *end;
+    uint32_t  len;
+    int       fmt_ok;
+
+    p   = f->map;
+    end = f->map + f->size;
+
+    if (f->size < 12 || memcmp(p, "RIFF", 4) || memcmp(p + 8, "WAVE", 4))
+        return set_error(img, EINVAL, "'%s' is not a WAV file", f->path);
+
+    fmt_ok = 0;
+    p += 12;
+
+    while (p + 8 <= end) {
+        len = le32(p + 4);
+
+        if (!memcmp(p, "fmt ", 4)) {
+            if (len < 16 || p + 8 + 16 > end)
+                break;
+
+            if ((le16(p + 8) != 1 && le16(p + 8) != 0xfffe) ||
+                le16(p + 10) != 2 || le32(p + 12) != 44100 ||
+                le16(p + 22) != 16)
+                return set_error(img, EOPNOTSUPP, "'%s' is not 16-bit "
+                                 "44.1 kHz stereo PCM", f->path);
+            fmt_ok = 1;
+        }
+        else if (!memcmp(p, "data", 4)) {
+            if (!fmt_ok)
+                break;
+
+            f->data = p + 8;
+            f->len  = len;
+
+            if (f->data + f->len > end)
+                f->len = end - f->data;
+
+            f->endn = RNC_ENDIAN_LITTLE;
+
+            return 0;
+        }
+
+        p += 8 + len + (len & 0x1);
+    }
+
+    return set_error(img, EINVAL, "malformed WAV file '%s'", f->path);
+}
+
+
+static img_file_t *map_file(img_t *img, const char *path, int wave, int endn)
+{
+    img_file_t  *f;
+    struct stat  st;
+
+    if (!mrp_reallocz(img->files, img->nfile, img->nfile + 1)) {
+        set_error(img, ENOMEM, "failed to allocate image file");
+        return NULL;
+    }
+
+    f = img->files + img->nfile++;
+    f->fd   = open(path, O_RDONLY);
+    f->path = mrp_strdup(path);
+
+    if (f->fd < 0 || f->path == NULL || fstat(f->fd, &st) < 0) {
+        set_error(img, errno, "failed to open image file '%s' (%d: %s)",
+                  path, errno, strerror(errno));
+        return NULL;
+    }
+
+    if (st.st_size == 0) {
+        set_error(img, EINVAL, "empty image file '%s'", path);
+        return NULL;
+    }
+
+    f->size = st.st_size;
+    f->map  = mmap(NULL, f->size, PROT_READ, MAP_SHARED, f->fd, 0);
+
+    if (f->map == MAP_FAILED) {
+        f->map = NULL;
+        set_error(img, errno, "failed to mmap image file '%s' (%d: %s)",
+                  path, errno, strerror(errno));
+        return NULL;
+    }
+
+    madvise(f->map, f->size, MADV_SEQUENTIAL);
+
+    if (wave) {
+        if (parse_wave(img, f) < 0)
+            return NULL;
+    }
+    else {
+        f->data = f->map;
+        f->len  = f->size;
+        f->endn = endn;
+    }
+
+    return f;
+}
+
+
+static img_track_t *add_track(img_t *img, int id, img_file_t *f, size_t offs,
+                              int audio)
+{
+    img_track_t *t;
+
+    if (!mrp_reallocz(img->tracks, img->ntrack, img->ntrack + 1)) {
+        set_error(img, ENOMEM, "failed to allocate image track");
+        return NULL;
+    }
+
+    t = img->tracks + img->ntrack++;
+    t->id   = id;
+    t->file = f - img->files;
+    t->data  = f->data + offs;
+    t->audio = audio;
+
+    return t;
+}
+
+
+/*
+ * Size tracks by where the next one starts, then drop all but the audio
+ * tracks. Data tracks are only kept until here, so that they end the
+ * audio track before them in the same file.
+ */
+static void close_tracks(img_t *img)
+{
+    img_track_t *t, *next;
+    img_file_t  *f;
+    uint32_t     fblk;
+    int          i, n;
+
+    fblk = 0;
+
+    for (i = n = 0; i < img->ntrack; i++) {
+        t    = img->tracks + i;
+        next = i < img->ntrack - 1 ? t + 1 : NULL;
+        f    = img->files + t->file;
+
+        if (next != NULL && next->file == t->file)
+            t->size = next->data - t->data;
+        else
+            t->size = f->data + f->len - t->data;
+
+        if (!t->audio)
+            continue;
+
+        t->fblk = fblk;
+        t->nblk = (t->size + IMAGE_BLOCKSIZE - 1) / IMAGE_BLOCKSIZE;
+        fblk   += t->nblk;
+
+        img->tracks[n++] = *t;
+    }
+
+    img->ntrack = n;
+}
+
+
+static char *cue_token(char **line, char *buf, size_t size)
+{
+    char   *p = *line, *q;
+    size_t  n;
+
+    while (isspace(*p))
+        p++;
+
+    if (!*p)
+        return NULL;
+
+    if (*p == '"') {
+        q = strchr(++p, '"');
+        if (q == NULL)
+            return NULL;
+        n = q - p;
+        q++;
+    }
+    else {
+        for (q = p; *q && !isspace(*q); q++)
+            ;
+        n = q - p;
+    }
+
+    if (n >= size)
+        return NULL;
+
+    memcpy(buf, p, n);
+    buf[n] = '\0';
+    *line  = q;
+
+    return buf;
+}
+
+
+static int parse_cue(img_t *img, const char *path)
+{
+    FILE        *fp;
+    char         line[PATH_MAX + 64], cmd[32], arg[PATH_MAX], typ[32];
+    char         dir[PATH_MAX], file[PATH_MAX], *l;
+    img_file_t  *f;
+    img_track_t *t;
+    int          id, audio, idx, mm, ss, ff, lineno, n, i;
+
+    if ((fp = fopen(path, "r")) == NULL)
+        return set_error(img, errno, "failed to open cue sheet '%s'", path);
+
+    snprintf(line, sizeof(line), "%s", path);
+    snprintf(dir, sizeof(dir), "%s", dirname(line));
+
+    f      = NULL;
+    id     = 0;
+    audio  = 0;
+    lineno = 0;
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        lineno++;
+        l = line;
+
+        if (cue_token(&l, cmd, sizeof(cmd)) == NULL)
+            continue;
+
+        if (!strcasecmp(cmd, "FILE")) {
+            if (cue_token(&l, arg, sizeof(arg)) == NULL ||
+                cue_token(&l, typ, sizeof(typ)) == NULL)
+                goto invalid;
+
+            if (arg[0] == '/')
+                n = snprintf(file, sizeof(file), "%s", arg);
+            else
+                n = snprintf(file, sizeof(file), "%s/%s", dir, arg);
+
+            if (n < 0 || n >= (int)sizeof(file))
+                goto invalid;
+
+            if (!strcasecmp(typ, "WAVE"))
+                f = map_file(img, file, true, RNC_ENDIAN_LITTLE);
+            else if (!strcasecmp(typ, "BINARY"))
+                f = map_file(img, file, false, RNC_ENDIAN_LITTLE);
+            else if (!strcasecmp(typ, "MOTOROLA"))
+                f = map_file(img, file, false, RNC_ENDIAN_BIG);
+            else {
+                set_error(img, EOPNOTSUPP, "%s:%d: unsupported file type '%s'",
+                          path, lineno, typ);
+                goto fail;
+            }
+
+            if (f == NULL)
+                goto fail;
+        }
+        else if (!strcasecmp(cmd, "TRACK")) {
+            if (cue_token(&l, arg, sizeof(arg)) == NULL ||
+                cue_token(&l, typ, sizeof(typ)) == NULL)
+                goto invalid;
+
+            id    = (int)strtoul(arg, NULL, 10);
+            audio = !strcasecmp(typ, "AUDIO");
+        }
+        else if (!strcasecmp(cmd, "INDEX")) {
+            if (cue_token(&l, arg, sizeof(arg)) == NULL ||
+                cue_token(&l, typ, sizeof(typ)) == NULL ||
+                sscanf(typ, "%d:%d:%d", &mm, &ss, &ff) != 3)
+                goto invalid;
+
+            idx = (int)strtoul(arg, NULL, 10);
+
+            /* data tracks are needed to tell where audio tracks end */
+            if (idx != 1)
+                continue;
+
+            if (f == NULL)
+                goto invalid;
+
+            ff += (mm * 60 + ss) * IMAGE_FRAMES;
+
+            if ((size_t)ff * IMAGE_BLOCKSIZE > f->len)
+                goto invalid;
+
+            t = add_track(img, id, f, (size_t)ff * IMAGE_BLOCKSIZE, audio);
+
+            if (t == NULL)
+                goto fail;
+        }
+    }
+
+    fclose(fp);
+
+    close_tracks(img);
+
+    if (img->ntrack == 0)
+        return set_error(img, EINVAL, "no audio tracks in '%s'", path);
+
+    /* a single format is negotiated for all tracks, they must agree on it */
+    for (i = 1; i < img->ntrack; i++)
+        if (img->files[img->tracks[i].file].endn !=
+            img->files[img->tracks[0].file].endn)
+            return set_error(img, EOPNOTSUPP, "'%s' mixes little- and "
+                             "big-endian audio files", path);
+
+    return 0;
+
+ invalid:
+    set_error(img, EINVAL, "%s:%d: invalid cue sheet entry", path, lineno);
+ fail:
+    fclose(fp);
+    return -1;
+}
+
+
+static int img_open(rnc_dev_t *dev, const char *device)
+{
+    img_t       *img;
+    img_file_t  *f;
+    const char  *path, *suffix;
+
+    mrp_debug("opening disc image '%s'", device);
+
+    img = dev->data = mrp_allocz(sizeof(*img));
+
+    if (img == NULL)
+        return -1;
+
+    path = device;
+    if (!strncmp(path, IMAGE_PREFIX, sizeof(IMAGE_PREFIX) - 1))
+        path += sizeof(IMAGE_PREFIX) - 1;
+
+    suffix = image_suffix(path);
+
+    if (suffix != NULL && !strcasecmp(suffix, ".cue"))
+        return parse_cue(img, path);
+
+    f = map_file(img, path, suffix && !strcasecmp(suffix, ".wav"),
+                 RNC_ENDIAN_LITTLE);
+
+    if (f == NULL || add_track(img, 1, f, 0, true) == NULL)
+        return -1;
+
+    close_tracks(img);
+
+    return 0;
+}
+
+
+static void img_close(rnc_dev_t *dev)
+{
+    img_t      *img = dev->data;
+    img_file_t *f;
+    int         i;
+
+    mrp_debug("closing disc image");
+
+    if (img == NULL)
+        return;
+
+    for (i = 0, f = img->files; i < img->nfile; i++, f++) {
+        if (f->map != NULL)
+            munmap(f->map, f->size);
+        if (f->fd >= 0)
+            close(f->fd);
+        mrp_free(f->path);
+    }
+
+    mrp_free(img->files);
+    mrp_free(img->tracks);
+    mrp_free(img->errmsg);
+    mrp_free(img);
+
+    dev->data = NULL;
+}
+
+
+static int img_set_speed(rnc_dev_t *dev, int speed)
+{
+    MRP_UNUSED(dev);
+    MRP_UNUSED(speed);
+
+    return 0;
+}
+
+
+static int img_get_tracks(rnc_dev_t *dev, rnc_track_t *buf, size_t size)
+{
+    img_t       *img = dev->data;
+    img_track_t *trk;
+    rnc_track_t *t;
+    int          i;
+
+    mrp_debug("getting tracks");
+
+    if ((int)size > img->ntrack)
+        size = img->ntrack;
+
+    for (i = 0, t = buf, trk = img->tracks; i < (int)size; i++, t++, trk++) {
+        t->idx    = i;
+        t->id     = trk->id;
+        t->fblk   = trk->fblk;
+        t->nblk   = trk->nblk;
+        t->length = 1.0 * t->nblk / IMAGE_FRAMES;
+    }
+
+    return img->ntrack;
+}
+
+
+static uint32_t img_format(img_t *img)
+{
+    int cmap = RNC_CHANNELMAP_LEFTRIGHT;
+    int cmpr = RNC_ENCODING_PCM;
+    int chnl = 2;
+    int rate = RNC_SAMPLERATE_44100;
+    int bits = 16;
+    int frmt = RNC_SAMPLE_SIGNED;
+    int endn = RNC_ENDIAN_LITTLE;
+    int ctrk = img->ctrack;
+
+    if (0 <= ctrk && ctrk < img->ntrack)
+        endn = img->files[img->tracks[ctrk].file].endn;
+
+    return RNC_FORMAT_ID(cmap, cmpr, chnl, rate, bits, frmt, endn);
+}
+
+
+static int img_get_formats(rnc_dev_t *dev, uint32_t *buf, size_t size)
+{
+    img_t *img = dev->data;
+
+    mrp_debug("getting supported device format(s)");
+
+    if (size > 0)
+        *buf = img_format(img);
+
+    return 1;
+}
+
+
+static int img_set_format(rnc_dev_t *dev, uint32_t f)
+{
+    img_t *img = dev->data;
+
+    mrp_debug("setting active device format");
+
+    if (f != img_format(img))
+        return -1;
+    else
+        return 0;
+}
+
+
+static uint32_t img_get_format(rnc_dev_t *dev)
+{
+    img_t *img = dev->data;
+
+    mrp_debug("getting active device format");
+
+    return img_format(img);
+}
+
+
+static int img_get_blocksize(rnc_dev_t *dev)
+{
+    MRP_UNUSED(dev);
+
+    return IMAGE_BLOCKSIZE;
+}
+
+
+static int32_t img_seek(rnc_dev_t *dev, rnc_track_t *trk, uint32_t blk)
+{
+    img_t *img = dev->data;
+
+    mrp_debug("seeking to track #%d, block %u", trk->idx, blk);
+
+    if (trk->idx < 0 || trk->idx >= img->ntrack)
+        goto invalid;
+
+    if (blk >= img->tracks[trk->idx].nblk)
+        goto invalid;
+
+    img->ctrack = trk->idx;
+    img->pos    = (size_t)blk * IMAGE_BLOCKSIZE;
+
+    return (int32_t)((img->tracks[trk->idx].fblk + blk) * IMAGE_BLOCKSIZE);
+
+ invalid:
+    errno = EINVAL;
+    return -1;
+}
+
+
+static int img_read(rnc_dev_t *dev, void *buf, size_t size)
+{
+    img_t       *img = dev->data;
+    img_track_t *t;
+    char        *p;
+    size_t       n, avail, left;
+
+    mrp_debug("reading %zu bytes", size);
+
+    if ((size % IMAGE_BLOCKSIZE) != 0)
+        goto invalid;
+
+    p    = buf;
+    left = size;
+
+    /*
+     * Just like a drive would, we happily read past the end of a track
+     * into the next one. The last block of a track is padded with silence
+     * if the image has an incomplete one.
+     */
+
+    while (left > 0 && img->ctrack < img->ntrack) {
+        t = img->tracks + img->ctrack;
+        n = t->nblk * IMAGE_BLOCKSIZE - img->pos;
+
+        if (n > left)
+            n = left;
+
+        avail = img->pos < t->size ? t->size - img->pos : 0;
+
+        if (avail > n)
+            avail = n;
+
+        memcpy(p, t->data + img->pos, avail);
+
+        if (avail < n)
+            memset(p + avail, 0, n - avail);
+
+        p        += n;
+        left     -= n;
+        img->pos += n;
+
+        if (img->pos >= t->nblk * IMAGE_BLOCKSIZE) {
+            img->ctrack++;
+            img->pos = 0;
+        }
+    }
+
+    return size - left;
+
+ invalid:
+    errno = EINVAL;
+    return -1;
+}
+
+
+static int img_read_view(rnc_dev_t *dev, const void **bufp, size_t size)
+{
+    img_t       *img = dev->data;
+    img_track_t *t;
+    size_t       n;
+
+    mrp_debug("reading a view of %zu bytes", size);
+
+    if (size < IMAGE_BLOCKSIZE)
+        goto invalid;
+
+    if (img->ctrack >= img->ntrack)
+        return 0;
+
+    /*
+     * Views never cross track boundaries, since tracks can live in
+     * different files. An incomplete last block of a track is padded
+     * with silence, which needs a copy.
+     */
+
+    t = img->tracks + img->ctrack;
+    n = t->size > img->pos ? t->size - img->pos : 0;
+
+    if (n > size)
+        n = size;
+
+    n -= n % IMAGE_BLOCKSIZE;
+
+    if (n > 0)
+        *bufp = t->data + img->pos;
+    else {
+        n = t->size > img->pos ? t->size - img->pos : 0;
+        memcpy(img->pad, t->data + img->pos, n);
+        memset(img->pad + n, 0, IMAGE_BLOCKSIZE - n);
+
+        *bufp = img->pad;
+        n     = IMAGE_BLOCKSIZE;
+    }
+
+    img->pos += n;
+
+    if (img->pos >= t->nblk * IMAGE_BLOCKSIZE) {
+        img->ctrack++;
+        img->pos = 0;
+    }
+
+    return n;
+
+ invalid:
+    errno = EINVAL;
+    return -1;
+}
+
+
+static void img_release_view(rnc_dev_t *dev, const void *buf, size_t size)
+{
+    MRP_UNUSED(dev);
+    MRP_UNUSED(buf);
+    MRP_UNUSED(size);
+}
+
+
+static int img_error(rnc_dev_t *dev, const char **error)
+{
+    img_t *img = dev->data;
+
+    if (error != NULL && img->errmsg != NULL)
+        *error = img->errmsg;
+
+    return img->error;
+}
+
+
+RNC_DEVICE_REGISTER(image, {
+        .name          = "image",
+        .probe         = img_probe,
+        .open          = img_open,
+        .close         = img_close,
+        .set_speed     = img_set_speed,
+        .get_tracks    = img_get_tracks,
+        .get_formats   = img_get_formats,
+        .set_format    = img_set_format,
+        .get_format    = img_get_format,
+        .get_blocksize = img_get_blocksize,
+        .seek          = img_seek,
+        .read          = img_read,
+        .read_view     = img_read_view,
+        .release_view  = img_release_view,
+        .error         = img_error,
+});
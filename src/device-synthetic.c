@@ -0,0 +1,773 @@
+/*
+ * Copyright (c) 2015, Krisztian Litkey, <kli@iki.fi>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <murphy/common/debug.h>
+#include <ripncode/ripncode.h>
+
+/*
+ * Synthetic audio device backend.
+ *
+ * This backend produces reproducible audio for a configurable track
+ * layout, so the full rip/encode path can be exercised and benchmarked
+ * without a drive. The device is given as
+ *
+ *     synthetic:[key=value[:key=value...]]
+ *
+ * with the following keys:
+ *
+ *     tracks=KIND/SECONDS[,...]  track layout, where KIND is one of
+ *                                silence, tone, white, pink, music or
+ *                                loud (brickwalled music)
+ *     seed=N                     seed for all generated noise
+ *     latency=USEC               time to read a single sector
+ *     seek=USEC                  time for a full-stroke seek
+ *     errors=N                   fail about one in every N sectors
+ *
+ * All audio is a pure function of the seed, the track layout and the
+ * sample position, so reads are reproducible regardless of read sizes
+ * and seeks. Failing sectors are likewise picked by the seed, and a read
+ * touching one always fails with EIO.
+ */
+
+#define SYNTHETIC_PREFIX    "synthetic:"
+#define SYNTHETIC_TRACKS    "silence/2,tone/30,pink/60,music/200,loud/120"
+#define SYNTHETIC_BLOCKSIZE 2352         /* CDDA frame size */
+#define SYNTHETIC_SAMPLES   588          /* samples per frame */
+#define SYNTHETIC_FRAMES    75           /* CDDA frames per second */
+#define SYNTHETIC_RATE      44100        /* sample rate */
+
+#define SINE_BITS  12                    /* sine table size, log2 */
+#define PINK_ROWS  16                    /* Voss-McCartney rows */
+#define BEAT       22050                 /* beat length, 120 bpm */
+#define BAR        (4 * BEAT)            /* bar length, 4/4 */
+#define NOTES      3                     /* notes in a chord */
+
+typedef enum {
+    SYNTH_SILENCE,
+    SYNTH_TONE,
+    SYNTH_WHITE,
+    SYNTH_PINK,
+    SYNTH_MUSIC,
+    SYNTH_LOUD,
+} synth_kind_t;
+
+
+typedef struct {
+    int         id;                      /* track number */
+    int         kind;                    /* type of audio, SYNTH_* */
+    uint32_t    fblk;                    /* first block within disc */
+    uint32_t    nblk;                    /* number of blocks */
+} synth_track_t;
+
+
+typedef struct {
+    uint64_t    key;                     /* sample index >> row */
+    float       val;                     /* generated value */
+} synth_row_t;
+
+
+typedef struct {
+    synth_track_t *tracks;               /* audio tracks */
+    int            ntrack;               /* number of tracks */
+    uint32_t       nblk;                 /* total number of blocks */
+    uint64_t       seed;                 /* noise seed */
+    uint32_t       latency;              /* sector read time, usecs */
+    uint32_t       seek;                 /* full-stroke seek time, usecs */
+    uint32_t       errors;               /* one bad sector in this many */
+    uint32_t       pos;                  /* current block */
+    synth_row_t    pink[2][PINK_ROWS];   /* pink noise generator rows */
+    int            ctrack;               /* track of cached chord */
+    int64_t        cbar;                 /* bar of cached chord */
+    uint32_t       chord[NOTES];         /* cached chord phase increments */
+    uint32_t       bass;                 /* cached bass phase increment */
+    char          *errmsg;               /* last error message */
+    int            error;                /* last error code */
+} synth_t;
+
+
+static const char *kinds[] = {
+    [SYNTH_SILENCE] = "silence",
+    [SYNTH_TONE]    = "tone",
+    [SYNTH_WHITE]   = "white",
+    [SYNTH_PINK]    = "pink",
+    [SYNTH_MUSIC]   = "music",
+    [SYNTH_LOUD]    = "loud",
+};
+
+static float sine[1 << SINE_BITS];
+static pthread_once_t sine_once = PTHREAD_ONCE_INIT;
+
+
+static bool synth_probe(rnc_dev_api_t *api, const char *device)
+{
+    MRP_UNUSED(api);
+
+    mrp_debug("probing device '%s' as a synthetic device", device);
+
+    return !strncmp(device, SYNTHETIC_PREFIX, sizeof(SYNTHETIC_PREFIX) - 1);
+}
+
+
+static int set_error(synth_t *syn, int error, const char *fmt, ...)
+{
+    va_list ap;
+    char    msg[256];
+
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+
+    mrp_free(syn->errmsg);
+    syn->errmsg = mrp_strdup(msg);
+    syn->error  = error;
+
+    errno = error;
+    return -1;
+}
+
+
+static inline uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+
+    return x;
+}
+
+
+static inline uint64_t hash(synth_t *syn, uint64_t salt, uint64_t n)
+{
+    return mix64(syn->seed ^ mix64(salt ^ (n * 0x9e3779b97f4a7c15ULL)));
+}
+
+
+static inline float white(synth_t *syn, uint64_t salt, uint64_t n)
+{
+    return (int32_t)(hash(syn, salt, n) >> 32) / 2147483648.0f;
+}
+
+
+static inline float sinph(uint32_t phase)
+{
+    return sine[phase >> (32 - SINE_BITS)];
+}
+
+
+static inline uint32_t phase_inc(double freq)
+{
+    return (uint32_t)(freq * 4294967296.0 / SYNTHETIC_RATE);
+}
+
+
+static inline uint32_t phase_at(uint32_t inc, uint64_t n)
+{
+    return (uint32_t)(inc * n);
+}
+
+
+static float pink(synth_t *syn, int ch, uint64_t n)
+{
+    synth_row_t *row = syn->pink[ch];
+    float        sum;
+    uint64_t     key;
+    int          i;
+
+    /*
+     * Voss-McCartney pink noise: row i is white noise updated every 2^i
+     * samples. Each row only depends on n >> i, so the rows are a cache
+     * and the result is still a pure function of n.
+     */
+
+    sum = 0;
+    for (i = 0; i < PINK_ROWS; i++) {
+        key = n >> i;
+
+        if (row[i].key != key) {
+            row[i].key = key;
+            row[i].val = white(syn, 0x100 + (ch << 5) + i, key);
+        }
+
+        sum += row[i].val;
+    }
+
+    return sum / PINK_ROWS;
+}
+
+
+static double note_freq(int note)
+{
+    return 440.0 * pow(2.0, (note - 69) / 12.0);
+}
+
+
+static void pick_chord(synth_t *syn, int idx, int64_t bar)
+{
+    static const int scale[] = { 0, 2, 4, 5, 7, 9, 11 };
+    uint64_t h;
+    int      root, third;
+
+    if (syn->ctrack == idx && syn->cbar == bar)
+        return;
+
+    h     = hash(syn, 0x200 + idx, bar);
+    root  = 48 + scale[h % 7];
+    third = (h >> 8) & 0x1 ? 3 : 4;
+
+    syn->chord[0] = phase_inc(note_freq(root + 12));
+    syn->chord[1] = phase_inc(note_freq(root + 12 + third));
+    syn->chord[2] = phase_inc(note_freq(root + 12 + 7));
+    syn->bass     = phase_inc(note_freq(root - 12));
+    syn->ctrack   = idx;
+    syn->cbar     = bar;
+}
+
+
+static void music(synth_t *syn, int idx, uint64_t n, uint64_t abs,
+                  float *l, float *r)
+{
+    static const float pan[NOTES] = { 0.8f, 0.5f, 0.2f };
+    float    env, tone, v, drums, bed;
+    uint32_t ph, beat, hat;
+    int      i, h;
+
+    /*
+     * A crude band: a chord of harmonically rich notes changing every
+     * bar with a per-beat envelope, a bass line, a kick on every beat,
+     * hi-hats on eighths and a bed of pink noise.
+     */
+
+    pick_chord(syn, idx, n / BAR);
+
+    beat = n % BEAT;
+    env  = 1.0f - (float)beat / BEAT;
+    env *= env;
+
+    *l = *r = 0;
+    for (i = 0; i < NOTES; i++) {
+        ph   = phase_at(syn->chord[i], n);
+        tone = 0;
+        for (h = 1; h <= 4; h++)
+            tone += sinph(ph * h) / h;
+
+        v   = 0.08f * env * tone;
+        *l += v * pan[i];
+        *r += v * (1.0f - pan[i]);
+    }
+
+    v = 0.25f * (0.5f + 0.5f * env) * sinph(phase_at(syn->bass, n));
+
+    drums = 0;
+    if (beat < 4410) {
+        env    = 1.0f - beat / 4410.0f;
+        drums += 0.4f * env * env * sinph(phase_at(phase_inc(55.0), beat));
+    }
+
+    hat = n % (BEAT / 2);
+    if (hat < 1000)
+        drums += 0.06f * (1.0f - hat / 1000.0f) * white(syn, 0x300, abs);
+
+    bed = 0.05f;
+    *l += v + drums + bed * pink(syn, 0, abs);
+    *r += v + drums + bed * pink(syn, 1, abs);
+}
+
+
+static void synth_frame(synth_t *syn, synth_track_t *t, uint64_t n,
+                        uint64_t abs, float *l, float *r)
+{
+    switch (t->kind) {
+    case SYNTH_TONE:
+        *l = *r = 0.5f * sinph(phase_at(phase_inc(997.0), n));
+        break;
+
+    case SYNTH_WHITE:
+        *l = 0.5f * white(syn, 0, abs);
+        *r = 0.5f * white(syn, 1, abs);
+        break;
+
+    case SYNTH_PINK:
+        *l = pink(syn, 0, abs);
+        *r = pink(syn, 1, abs);
+        break;
+
+    case SYNTH_MUSIC:
+        music(syn, t - syn->tracks, n, abs, l, r);
+        break;
+
+    case SYNTH_LOUD:
+        music(syn, t - syn->tracks, n, abs, l, r);
+        *l *= 4.0f;
+        *r *= 4.0f;
+        *l /= 1.0f + fabsf(*l);
+        *r /= 1.0f + fabsf(*r);
+        break;
+
+    case SYNTH_SILENCE:
+    default:
+        *l = *r = 0;
+    }
+}
+
+
+static inline int16_t s16(float v)
+{
+    v *= 32767.0f;
+
+    if (v > 32767.0f)
+        return 32767;
+    if (v < -32768.0f)
+        return -32768;
+
+    return (int16_t)lrintf(v);
+}
+
+
+static void synth_block(synth_t *syn, synth_track_t *t, uint32_t blk,
+                        char *buf)
+{
+    uint8_t  *p = (uint8_t *)buf;
+    uint64_t  n, abs;
+    float     l, r;
+    int16_t   sl, sr;
+    int       i;
+
+    n   = (uint64_t)(blk - t->fblk) * SYNTHETIC_SAMPLES;
+    abs = (uint64_t)blk * SYNTHETIC_SAMPLES;
+
+    for (i = 0; i < SYNTHETIC_SAMPLES; i++, n++, abs++) {
+        synth_frame(syn, t, n, abs, &l, &r);
+
+        sl = s16(l);
+        sr = s16(r);
+
+        *p++ = sl & 0xff;
+        *p++ = (sl >> 8) & 0xff;
+        *p++ = sr & 0xff;
+        *p++ = (sr >> 8) & 0xff;
+    }
+}
+
+
+static bool bad_sector(synth_t *syn, uint32_t blk)
+{
+    return syn->errors && hash(syn, 0x400, blk) % syn->errors == 0;
+}
+
+
+static void delay(uint64_t usecs)
+{
+    struct timespec ts;
+
+    if (usecs == 0)
+        return;
+
+    ts.tv_sec  = usecs / 1000000;
+    ts.tv_nsec = (usecs % 1000000) * 1000;
+
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+
+static int parse_tracks(synth_t *syn, const char *layout)
+{
+    synth_track_t *t;
+    const char    *p, *e;
+    char          *end;
+    double         secs;
+    size_t         len;
+    int            kind;
+
+    p = layout;
+
+    while (*p) {
+        if ((e = strchr(p, '/')) == NULL)
+            goto invalid;
+
+        len = e - p;
+
+        for (kind = 0; kind < (int)MRP_ARRAY_SIZE(kinds); kind++)
+            if (strlen(kinds[kind]) == len && !strncmp(p, kinds[kind], len))
+                break;
+
+        if (kind == (int)MRP_ARRAY_SIZE(kinds))
+            return set_error(syn, EINVAL, "unknown synthetic track '%.*s'",
+                             (int)len, p);
+
+        secs = strtod(e + 1, &end);
+
+        if (end == e + 1 || (*end && *end != ',') || secs <= 0)
+            goto invalid;
+
+        if (!mrp_reallocz(syn->tracks, syn->ntrack, syn->ntrack + 1))
+            return set_error(syn, ENOMEM, "failed to allocate track");
+
+        t = syn->tracks + syn->ntrack++;
+
+        t->id   = syn->ntrack;
+        t->kind = kind;
+        t->fblk = syn->nblk;
+        t->nblk = (uint32_t)(secs * SYNTHETIC_FRAMES + 0.5);
+
+        if (t->nblk == 0)
+            t->nblk = 1;
+
+        syn->nblk += t->nblk;
+
+        p = *end ? end + 1 : end;
+    }
+
+    if (syn->ntrack == 0)
+        goto invalid;
+
+    return 0;
+
+ invalid:
+    return set_error(syn, EINVAL, "invalid synthetic track layout '%s'",
+                     layout);
+}
+
+
+static int parse_config(synth_t *syn, const char *config)
+{
+    char        buf[1024], *p, *next, *val, *end;
+    const char *tracks;
+    uint64_t    v;
+
+    if (snprintf(buf, sizeof(buf), "%s", config) >= (int)sizeof(buf))
+        return set_error(syn, EINVAL, "synthetic device config too long");
+
+    tracks = SYNTHETIC_TRACKS;
+
+    for (p = buf; p != NULL && *p; p = next) {
+        if ((next = strchr(p, ':')) != NULL)
+            *next++ = '\0';
+
+        if ((val = strchr(p, '=')) == NULL)
+            goto invalid;
+
+        *val++ = '\0';
+
+        if (!strcmp(p, "tracks")) {
+            tracks = val;
+            continue;
+        }
+
+        v = strtoull(val, &end, 10);
+
+        if (end == val || *end)
+            goto invalid;
+
+        if (!strcmp(p, "seed"))
+            syn->seed = v;
+        else if (!strcmp(p, "latency"))
+            syn->latency = (uint32_t)v;
+        else if (!strcmp(p, "seek"))
+            syn->seek = (uint32_t)v;
+        else if (!strcmp(p, "errors"))
+            syn->errors = (uint32_t)v;
+        else
+            goto invalid;
+    }
+
+    return parse_tracks(syn, tracks);
+
+ invalid:
+    return set_error(syn, EINVAL, "invalid synthetic device config '%s'",
+                     config);
+}
+
+
+static void sine_init(void)
+{
+    int i;
+
+    for (i = 0; i < (int)MRP_ARRAY_SIZE(sine); i++)
+        sine[i] = (float)sin(2 * M_PI * i / MRP_ARRAY_SIZE(sine));
+}
+
+
+static int synth_open(rnc_dev_t *dev, const char *device)
+{
+    synth_t *syn;
+    int      i;
+
+    mrp_debug("opening synthetic device '%s'", device);
+
+    syn = dev->data = mrp_allocz(sizeof(*syn));
+
+    if (syn == NULL)
+        return -1;
+
+    pthread_once(&sine_once, sine_init);
+
+    syn->seed   = 1;
+    syn->ctrack = -1;
+
+    for (i = 0; i < PINK_ROWS; i++)
+        syn->pink[0][i].key = syn->pink[1][i].key = (uint64_t)-1;
+
+    if (parse_config(syn, device + sizeof(SYNTHETIC_PREFIX) - 1) < 0) {
+        mrp_log_error("%s", syn->errmsg);
+        return -1;
+    }
+
+    mrp_debug("synthetic device with %d tracks, %u blocks", syn->ntrack,
+              syn->nblk);
+
+    return 0;
+}
+
+
+static void synth_close(rnc_dev_t *dev)
+{
+    synth_t *syn = dev->data;
+
+    mrp_debug("closing synthetic device");
+
+    if (syn == NULL)
+        return;
+
+    mrp_free(syn->tracks);
+    mrp_free(syn->errmsg);
+    mrp_free(syn);
+
+    dev->data = NULL;
+}
+
+
+static int synth_set_speed(rnc_dev_t *dev, int speed)
+{
+    MRP_UNUSED(dev);
+    MRP_UNUSED(speed);
+
+    return 0;
+}
+
+
+static int synth_get_tracks(rnc_dev_t *dev, rnc_track_t *buf, size_t size)
+{
+    synth_t       *syn = dev->data;
+    synth_track_t *trk;
+    rnc_track_t   *t;
+    int            i;
+
+    mrp_debug("getting tracks");
+
+    if ((int)size > syn->ntrack)
+        size = syn->ntrack;
+
+    for (i = 0, t = buf, trk = syn->tracks; i < (int)size; i++, t++, trk++) {
+        t->idx    = i;
+        t->id     = trk->id;
+        t->fblk   = trk->fblk;
+        t->nblk   = trk->nblk;
+        t->length = 1.0 * t->nblk / SYNTHETIC_FRAMES;
+    }
+
+    return syn->ntrack;
+}
+
+
+static uint32_t synth_format(void)
+{
+    int cmap = RNC_CHANNELMAP_LEFTRIGHT;
+    int cmpr = RNC_ENCODING_PCM;
+    int chnl = 2;
+    int rate = RNC_SAMPLERATE_44100;
+    int bits = 16;
+    int frmt = RNC_SAMPLE_SIGNED;
+    int endn = RNC_ENDIAN_LITTLE;
+
+    return RNC_FORMAT_ID(cmap, cmpr, chnl, rate, bits, frmt, endn);
+}
+
+
+static int synth_get_formats(rnc_dev_t *dev, uint32_t *buf, size_t size)
+{
+    MRP_UNUSED(dev);
+
+    mrp_debug("getting supported device format(s)");
+
+    if (size > 0)
+        *buf = synth_format();
+
+    return 1;
+}
+
+
+static int synth_set_format(rnc_dev_t *dev, uint32_t f)
+{
+    MRP_UNUSED(dev);
+
+    mrp_debug("setting active device format");
+
+    if (f != synth_format())
+        return -1;
+    else
+        return 0;
+}
+
+
+static uint32_t synth_get_format(rnc_dev_t *dev)
+{
+    MRP_UNUSED(dev);
+
+    mrp_debug("getting active device format");
+
+    return synth_format();
+}
+
+
+static int synth_get_blocksize(rnc_dev_t *dev)
+{
+    MRP_UNUSED(dev);
+
+    return SYNTHETIC_BLOCKSIZE;
+}
+
+
+static int32_t synth_seek(rnc_dev_t *dev, rnc_track_t *trk, uint32_t blk)
+{
+    synth_t  *syn = dev->data;
+    uint32_t  pos, dist;
+
+    mrp_debug("seeking to track #%d, block %u", trk->idx, blk);
+
+    if (trk->idx < 0 || trk->idx >= syn->ntrack)
+        goto invalid;
+
+    if (blk >= syn->tracks[trk->idx].nblk)
+        goto invalid;
+
+    pos  = syn->tracks[trk->idx].fblk + blk;
+    dist = pos > syn->pos ? pos - syn->pos : syn->pos - pos;
+
+    /* settle time plus travel time proportional to the seek distance */
+    if (dist > 0)
+        delay(syn->seek / 10 + (uint64_t)syn->seek * dist / syn->nblk);
+
+    syn->pos = pos;
+
+    return (int32_t)(pos * SYNTHETIC_BLOCKSIZE);
+
+ invalid:
+    errno = EINVAL;
+    return -1;
+}
+
+
+static int synth_read(rnc_dev_t *dev, void *buf, size_t size)
+{
+    synth_t       *syn = dev->data;
+    synth_track_t *t;
+    char          *p;
+    uint32_t       nblk, blk, i;
+
+    mrp_debug("reading %zu bytes", size);
+
+    if ((size % SYNTHETIC_BLOCKSIZE) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    nblk = size / SYNTHETIC_BLOCKSIZE;
+
+    if (nblk > syn->nblk - syn->pos)
+        nblk = syn->nblk - syn->pos;
+
+    for (i = 0; i < nblk; i++) {
+        if (bad_sector(syn, syn->pos + i)) {
+            delay((uint64_t)syn->latency * (i + 1));
+            return set_error(syn, EIO, "read error at sector %u",
+                             syn->pos + i);
+        }
+    }
+
+    /*
+     * Like a drive, we happily read past the end of a track into the
+     * next one.
+     */
+
+    t = syn->tracks;
+    p = buf;
+
+    for (i = 0, blk = syn->pos; i < nblk; i++, blk++) {
+        while (blk >= t->fblk + t->nblk)
+            t++;
+
+        synth_block(syn, t, blk, p);
+        p += SYNTHETIC_BLOCKSIZE;
+    }
+
+    delay((uint64_t)syn->latency * nblk);
+
+    syn->pos += nblk;
+
+    return nblk * SYNTHETIC_BLOCKSIZE;
+}
+
+
+static int synth_error(rnc_dev_t *dev, const char **error)
+{
+    synth_t *syn = dev->data;
+
+    if (error != NULL && syn->errmsg != NULL)
+        *error = syn->errmsg;
+
+    return syn->error;
+}
+
+
+RNC_DEVICE_REGISTER(synthetic, {
+        .name          = "synthetic",
+        .probe         = synth_probe,
+        .open          = synth_open,
+        .close         = synth_close,
+        .set_speed     = synth_set_speed,
+        .get_tracks    = synth_get_tracks,
+        .get_formats   = synth_get_formats,
+        .set_format    = synth_set_format,
+        .get_format    = synth_get_format,
+        .get_blocksize = synth_get_blocksize,
+        .seek          = synth_seek,
+        .read          = synth_read,
+        .error         = synth_error,
+});
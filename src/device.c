@@ -27,12 +27,53 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include <errno.h>
+#include <string.h>
+#include <pthread.h>
 
 #include <ripncode/ripncode.h>
 
 static MRP_LIST_HOOK(devices);
 
 
+/*
+ * device read-ahead
+ */
+
+typedef struct {
+    char *data;                          /* slot buffer */
+    int   size;                          /* amount of data, -1 for error */
+    int   error;                         /* errno of failed read */
+} ra_slot_t;
+
+struct rnc_readahead_s {
+    rnc_dev_t       *dev;                /* device we read ahead for */
+    pthread_t        thread;             /* read-ahead thread */
+    pthread_mutex_t  lock;               /* lock protecting the ring */
+    pthread_cond_t   cond;               /* signalled on ring changes */
+    ra_slot_t       *slots;              /* ring of slots */
+    int              depth;              /* number of slots */
+    size_t           slotsize;           /* slot size */
+    int              blksize;            /* device block size */
+    int              rd;                 /* next slot to consume */
+    int              wr;                 /* next slot to fill */
+    int              nfull;              /* number of filled slots */
+    size_t           offs;               /* consumed offset within slot */
+    unsigned int     running : 1;        /* whether thread is running */
+    unsigned int     stop : 1;           /* whether thread should stop */
+    unsigned int     valid : 1;          /* whether pos is valid */
+    uint32_t         pos;                /* consumer position, in blocks */
+    uint64_t         reads;              /* number of reads served */
+    uint64_t         underruns;          /* number of reads that waited */
+    uint64_t         fillsum;            /* sum of fill levels seen */
+};
+
+static void readahead_free(rnc_readahead_t *ra);
+static void readahead_stop(rnc_readahead_t *ra);
+static int readahead_read(rnc_readahead_t *ra, void *buf, size_t size);
+static int readahead_view(rnc_readahead_t *ra, const void **bufp, size_t size);
+static void readahead_release(rnc_readahead_t *ra, size_t size);
+
+
 int rnc_device_init(rnc_t *rnc)
 {
     mrp_list_init(&rnc->devices);
@@ -109,9 +150,12 @@ void rnc_device_close(rnc_dev_t *dev)
     if (dev == NULL)
         return;
 
+    readahead_free(dev->ra);
+
     if (dev->api)
         dev->api->close(dev);
 
+    mrp_free(dev->bounce);
     mrp_free(dev->dev);
     mrp_free(dev);
 }
@@ -155,17 +199,418 @@ int rnc_device_get_blocksize(rnc_dev_t *dev)
 
 int32_t rnc_device_seek(rnc_dev_t *dev, rnc_track_t *trk, uint32_t blk)
 {
-    return dev->api->seek(dev, trk, blk);
+    rnc_readahead_t *ra  = dev->ra;
+    uint32_t         pos = trk->fblk + blk;
+    int32_t          r;
+
+    if (ra != NULL) {
+        if (ra->running && ra->valid && ra->pos == pos) {
+            mrp_debug("contiguous seek, keeping read-ahead data");
+            return (int32_t)(pos * ra->blksize);
+        }
+
+        readahead_stop(ra);
+    }
+
+    r = dev->api->seek(dev, trk, blk);
+
+    if (ra != NULL && r >= 0) {
+        ra->pos   = pos;
+        ra->valid = 1;
+    }
+
+    return r;
 }
 
 
 int rnc_device_read(rnc_dev_t *dev, void *buf, size_t size)
 {
+    if (dev->ra != NULL)
+        return readahead_read(dev->ra, buf, size);
+
     return dev->api->read(dev, buf, size);
 }
 
 
+int rnc_device_read_view(rnc_dev_t *dev, const void **bufp, size_t size)
+{
+    int n;
+
+    if (dev->ra != NULL)
+        return readahead_view(dev->ra, bufp, size);
+
+    if (dev->api->read_view != NULL)
+        return dev->api->read_view(dev, bufp, size);
+
+    if (dev->nbounce < size) {
+        mrp_free(dev->bounce);
+        dev->nbounce = 0;
+
+        if ((dev->bounce = mrp_alloc(size)) == NULL)
+            return -1;
+
+        dev->nbounce = size;
+    }
+
+    n = dev->api->read(dev, dev->bounce, size);
+
+    if (n >= 0)
+        *bufp = dev->bounce;
+
+    return n;
+}
+
+
+void rnc_device_release_view(rnc_dev_t *dev, const void *buf, size_t size)
+{
+    if (dev->ra != NULL) {
+        readahead_release(dev->ra, size);
+        return;
+    }
+
+    if (dev->api->release_view != NULL)
+        dev->api->release_view(dev, buf, size);
+}
+
+
 int rnc_device_error(rnc_dev_t *dev, const char **errstr)
 {
     return dev->api->error(dev, errstr);
 }
+
+
+int rnc_device_set_readahead(rnc_dev_t *dev, int depth, size_t slotsize)
+{
+    rnc_readahead_t *ra;
+    int              blksize, i;
+
+    readahead_free(dev->ra);
+    dev->ra = NULL;
+
+    if (depth <= 0)
+        return 0;
+
+    blksize = rnc_device_get_blocksize(dev);
+
+    if (blksize <= 0)
+        goto invalid;
+
+    if (slotsize == 0)
+        slotsize = RNC_READAHEAD_SLOT * blksize;
+    else
+        slotsize = ((slotsize + blksize - 1) / blksize) * blksize;
+
+    ra = mrp_allocz(sizeof(*ra));
+
+    if (ra == NULL)
+        return -1;
+
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->cond, NULL);
+
+    ra->dev      = dev;
+    ra->depth    = depth;
+    ra->slotsize = slotsize;
+    ra->blksize  = blksize;
+    ra->slots    = mrp_allocz_array(ra_slot_t, depth);
+
+    if (ra->slots == NULL)
+        goto fail;
+
+    for (i = 0; i < depth; i++)
+        if ((ra->slots[i].data = mrp_alloc(slotsize)) == NULL)
+            goto fail;
+
+    mrp_debug("read-ahead of %d x %zu bytes enabled", depth, slotsize);
+
+    dev->ra = ra;
+
+    return 0;
+
+ invalid:
+    errno = EINVAL;
+    return -1;
+
+ fail:
+    readahead_free(ra);
+    return -1;
+}
+
+
+int rnc_device_readahead_stats(rnc_dev_t *dev, rnc_readahead_stats_t *stats)
+{
+    rnc_readahead_t *ra = dev->ra;
+
+    if (ra == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    pthread_mutex_lock(&ra->lock);
+
+    stats->depth     = ra->depth;
+    stats->slotsize  = ra->slotsize;
+    stats->fill      = ra->nfull;
+    stats->avgfill   = ra->reads ? (double)ra->fillsum / ra->reads : 0.0;
+    stats->reads     = ra->reads;
+    stats->underruns = ra->underruns;
+
+    pthread_mutex_unlock(&ra->lock);
+
+    return 0;
+}
+
+
+static void *readahead_thread(void *arg)
+{
+    rnc_readahead_t *ra  = arg;
+    rnc_dev_t       *dev = ra->dev;
+    ra_slot_t       *s;
+    int              n;
+
+    pthread_mutex_lock(&ra->lock);
+
+    while (!ra->stop) {
+        if (ra->nfull == ra->depth) {
+            pthread_cond_wait(&ra->cond, &ra->lock);
+            continue;
+        }
+
+        /*
+         * The slot at wr is not visible to the consumer until we bump
+         * nfull, so we can fill it without holding the lock.
+         */
+
+        s = ra->slots + ra->wr;
+
+        pthread_mutex_unlock(&ra->lock);
+        n = dev->api->read(dev, s->data, ra->slotsize);
+        pthread_mutex_lock(&ra->lock);
+
+        s->size  = n;
+        s->error = n < 0 ? errno : 0;
+
+        ra->wr = (ra->wr + 1) % ra->depth;
+        ra->nfull++;
+
+        pthread_cond_broadcast(&ra->cond);
+
+        /* stop at end of data or error, leaving a marker slot for reads */
+        if (n <= 0)
+            break;
+    }
+
+    pthread_mutex_unlock(&ra->lock);
+
+    return NULL;
+}
+
+
+static int readahead_start(rnc_readahead_t *ra)
+{
+    int r;
+
+    ra->stop = 0;
+    r = pthread_create(&ra->thread, NULL, readahead_thread, ra);
+
+    if (r != 0) {
+        errno = r;
+        return -1;
+    }
+
+    ra->running = 1;
+
+    return 0;
+}
+
+
+static void readahead_stop(rnc_readahead_t *ra)
+{
+    pthread_mutex_lock(&ra->lock);
+
+    if (!ra->running) {
+        pthread_mutex_unlock(&ra->lock);
+        return;
+    }
+
+    ra->stop = 1;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+
+    pthread_join(ra->thread, NULL);
+
+    ra->running = 0;
+    ra->valid   = 0;
+    ra->rd      = 0;
+    ra->wr      = 0;
+    ra->nfull   = 0;
+    ra->offs    = 0;
+}
+
+
+static void readahead_free(rnc_readahead_t *ra)
+{
+    int i;
+
+    if (ra == NULL)
+        return;
+
+    readahead_stop(ra);
+
+    if (ra->slots != NULL)
+        for (i = 0; i < ra->depth; i++)
+            mrp_free(ra->slots[i].data);
+
+    mrp_free(ra->slots);
+
+    pthread_cond_destroy(&ra->cond);
+    pthread_mutex_destroy(&ra->lock);
+
+    mrp_free(ra);
+}
+
+
+static ra_slot_t *readahead_slot(rnc_readahead_t *ra, int *waited)
+{
+    if (!ra->running && readahead_start(ra) < 0)
+        return NULL;
+
+    while (ra->nfull == 0) {
+        *waited = 1;
+        pthread_cond_wait(&ra->cond, &ra->lock);
+    }
+
+    return ra->slots + ra->rd;
+}
+
+
+static void readahead_consume(rnc_readahead_t *ra, size_t size)
+{
+    ra_slot_t *s = ra->slots + ra->rd;
+
+    ra->offs += size;
+    ra->pos  += size / ra->blksize;
+
+    if (ra->offs >= (size_t)s->size) {
+        ra->offs  = 0;
+        ra->rd    = (ra->rd + 1) % ra->depth;
+        ra->nfull--;
+
+        pthread_cond_broadcast(&ra->cond);
+    }
+}
+
+
+static int readahead_read(rnc_readahead_t *ra, void *buf, size_t size)
+{
+    ra_slot_t *s;
+    char      *p;
+    size_t     n, left;
+    int        r, waited;
+
+    pthread_mutex_lock(&ra->lock);
+
+    ra->reads++;
+    ra->fillsum += ra->nfull;
+
+    p      = buf;
+    left   = size;
+    r      = 0;
+    waited = 0;
+
+    while (left > 0) {
+        if ((s = readahead_slot(ra, &waited)) == NULL) {
+            r = -1;
+            break;
+        }
+
+        if (s->size <= 0) {
+            if (s->size < 0) {
+                errno = s->error;
+                r = -1;
+            }
+            break;
+        }
+
+        n = s->size - ra->offs;
+
+        if (n > left)
+            n = left;
+
+        memcpy(p, s->data + ra->offs, n);
+        readahead_consume(ra, n);
+
+        p    += n;
+        left -= n;
+    }
+
+    if (waited)
+        ra->underruns++;
+
+    pthread_mutex_unlock(&ra->lock);
+
+    /* report an error only if we could not return any data */
+    if (r < 0 && left < size)
+        r = 0;
+
+    return r < 0 ? -1 : (int)(size - left);
+}
+
+
+static int readahead_view(rnc_readahead_t *ra, const void **bufp, size_t size)
+{
+    ra_slot_t *s;
+    size_t     n;
+    int        r, waited;
+
+    pthread_mutex_lock(&ra->lock);
+
+    ra->reads++;
+    ra->fillsum += ra->nfull;
+    waited = 0;
+
+    s = readahead_slot(ra, &waited);
+
+    if (waited)
+        ra->underruns++;
+
+    if (s == NULL) {
+        pthread_mutex_unlock(&ra->lock);
+        return -1;
+    }
+
+    if (s->size <= 0) {
+        r = s->size;
+
+        if (r < 0)
+            errno = s->error;
+
+        pthread_mutex_unlock(&ra->lock);
+
+        return r;
+    }
+
+    /*
+     * The slot stays filled (hence untouched by the read-ahead thread)
+     * until the view is released, so it is safe to hand out.
+     */
+
+    n = s->size - ra->offs;
+
+    if (n > size)
+        n = size;
+
+    *bufp = s->data + ra->offs;
+
+    pthread_mutex_unlock(&ra->lock);
+
+    return (int)n;
+}
+
+
+static void readahead_release(rnc_readahead_t *ra, size_t size)
+{
+    pthread_mutex_lock(&ra->lock);
+    readahead_consume(ra, size);
+    pthread_mutex_unlock(&ra->lock);
+}
@@ -66,6 +66,10 @@ struct rnc_dev_api_s {
     int32_t (*seek)(rnc_dev_t *d, rnc_track_t *trk, uint32_t blk);
     /* read data */
     int (*read)(rnc_dev_t *d, void *buf, size_t size);
+    /* get a read-only view of the next data, optional */
+    int (*read_view)(rnc_dev_t *d, const void **bufp, size_t size);
+    /* release a view obtained with read_view, optional */
+    void (*release_view)(rnc_dev_t *d, const void *buf, size_t size);
     /* get last error code and string */
     int (*error)(rnc_dev_t *d, const char **errstr);
 };
@@ -82,9 +86,31 @@ struct rnc_dev_s {
     char          *dev;                  /* device id (eg. /dev entry) */
     rnc_dev_api_t *api;                  /* device API */
     void          *data;                 /* opaque device data */
+    void          *bounce;               /* buffer for emulated views */
+    size_t         nbounce;              /* size of bounce buffer */
+    rnc_readahead_t *ra;                 /* read-ahead state, if enabled */
 };
 
 
+/**
+ * @brief Default size of a read-ahead slot, in device blocks.
+ */
+#define RNC_READAHEAD_SLOT 64
+
+
+/**
+ * @brief Device read-ahead statistics.
+ */
+typedef struct {
+    int      depth;                      /* ring depth, in slots */
+    size_t   slotsize;                   /* slot size, in bytes */
+    int      fill;                       /* current fill level, in slots */
+    double   avgfill;                    /* average fill level seen by reads */
+    uint64_t reads;                      /* number of reads served */
+    uint64_t underruns;                  /* number of reads that had to wait */
+} rnc_readahead_stats_t;
+
+
 /**
  * @brief Initialize devices known to RNC.
  */
@@ -215,6 +241,71 @@ int32_t rnc_device_seek(rnc_dev_t *dev, rnc_track_t *trk, uint32_t blk);
  */
 int rnc_device_read(rnc_dev_t *dev, void *buf, size_t size);
 
+/**
+ * @brief Configure device read-ahead.
+ *
+ * Enable, reconfigure or disable reading ahead for the given device.
+ * With read-ahead enabled, a dedicated thread keeps reading the device
+ * ahead of the consumer into a preallocated ring of @depth slots, each
+ * @slotsize bytes large. Reads and views are then served from the ring,
+ * so the drive keeps streaming while the consumer is busy encoding.
+ * Seeking to the position the consumer is already at (for instance, to
+ * the beginning of the next track after reading the previous one) keeps
+ * the data read ahead, any other seek flushes the ring. Any data already
+ * read ahead is discarded when read-ahead is reconfigured, so the device
+ * should be seeked afterwards.
+ *
+ * @param [in] dev       device to configure read-ahead for
+ * @param [in] depth     number of slots to read ahead, 0 to disable
+ * @param [in] slotsize  slot size, 0 for RNC_READAHEAD_SLOT blocks
+ *
+ * @return Returns 0 upon success, -1 otherwise.
+ */
+int rnc_device_set_readahead(rnc_dev_t *dev, int depth, size_t slotsize);
+
+/**
+ * @brief Get device read-ahead statistics.
+ *
+ * @param [in]  dev    device to get read-ahead statistics for
+ * @param [out] stats  buffer to return statistics in
+ *
+ * @return Returns 0 upon success, -1 if read-ahead is not enabled.
+ */
+int rnc_device_readahead_stats(rnc_dev_t *dev, rnc_readahead_stats_t *stats);
+
+/**
+ * @brief Get a read-only view of the next audio data.
+ *
+ * Read audio data from the given device without copying it, if the
+ * device backend supports this. Instead of copying the data to a buffer
+ * provided by the caller, a pointer to data already held by the backend
+ * is returned. The view might be shorter than requested (for instance,
+ * cd-paranoia can only hand out a single frame at a time), but it is
+ * always a multiple of the device blocksize. The view stays valid until
+ * it is released with rnc_device_release_view. Only a single view can be
+ * outstanding at any time and it must be released before the device is
+ * read from or seeked again. For backends without native support for
+ * views, they are emulated using a copying read to an internal buffer.
+ *
+ * @param [in]  dev   device to read audio from
+ * @param [out] bufp  pointer to set to the audio data
+ * @param [in]  size  maximum amount of audio to read
+ *
+ * @return Returns the amount of audio in the view, or -1 upon error.
+ */
+int rnc_device_read_view(rnc_dev_t *dev, const void **bufp, size_t size);
+
+/**
+ * @brief Release a view of audio data.
+ *
+ * Release a view obtained with rnc_device_read_view.
+ *
+ * @param [in] dev   device the view was obtained from
+ * @param [in] buf   view to release
+ * @param [in] size  size of the view
+ */
+void rnc_device_release_view(rnc_dev_t *dev, const void *buf, size_t size);
+
 /**
  * @brief Return the last error for a device.
  *
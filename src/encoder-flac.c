@@ -27,8 +27,14 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <errno.h>
-#include <byteswap.h>
+#include <string.h>
+#include <pthread.h>
 #include <FLAC/stream_encoder.h>
 #include <FLAC/metadata.h>
 
@@ -37,20 +43,96 @@
 
 
 #define BUFFER_CHUNK (64 * 1024)
+#define FEED_BLOCKS     4                /* blocks of samples fed at once */
+#define SEGMENT_FRAMES  32               /* frames per parallel segment */
+#define STREAMINFO_OFFS 8                /* STREAMINFO offset in stream */
+
+/*
+ * ReplayGain tags are written with fixed-width placeholders, then
+ * overwritten in place once the gains are known. Each placeholder must
+ * be exactly as wide as the corresponding formatted value.
+ */
+#define TRACK_GAIN_TAG  "REPLAYGAIN_TRACK_GAIN"
+#define TRACK_PEAK_TAG  "REPLAYGAIN_TRACK_PEAK"
+#define ALBUM_GAIN_TAG  "REPLAYGAIN_ALBUM_GAIN"
+#define GAIN_FORMAT     "%+6.2f dB"      /* -51.00 dB ... +51.00 dB */
+#define PEAK_FORMAT     "%8.6f"          /* 0.000000 ... 9.999999 */
+#define TRACK_GAIN_HOLD " #TRK# dB"
+#define ALBUM_GAIN_HOLD " #ALB# dB"
+#define PEAK_HOLD       "##PEAK##"
+#define COMMENT_MAX     (64 * 1024)      /* max. comment block to patch */
+
+/*
+ * Parallel encoding.
+ *
+ * If libFLAC has multithreading support, we simply let it use several
+ * threads. Otherwise we split the stream into segments of a fixed number
+ * of frames, encode the segments in parallel each with its own encoder,
+ * and stitch the stream together by renumbering the frames of each
+ * segment. Since FLAC frames are encoded independently of each other,
+ * the result is identical to a single-threaded encoding. The encoder of
+ * the stream itself only produces the stream header, which we patch with
+ * the frame sizes, sample count and MD5 sum of the stitched stream.
+ */
+
+typedef struct flen_s     flen_t;
+typedef struct flen_seg_s flen_seg_t;
 
-typedef struct {
+struct flen_s {
     FLAC__StreamEncoder *enc;
     rnc_enc_data_cb_t    data_cb;
     int                  chnl;
     int                  bits;
+    int                  rate;
+    int                  endn;
     rnc_buf_t           *buf;
-    uint32_t             gain_offs;
+    FLAC__StreamMetadata *meta[2];       /* comment and padding blocks */
+    off_t                gain_offs;      /* track gain tag value offset */
+    off_t                peak_offs;      /* track peak tag value offset */
     double               track_gain;
     double               track_peak;
     double               album_gain;
-    int                  swap : 1;
+    rnc_convert_t        cvt;            /* conversion to FLAC__int32 */
+    rnc_convert_t        le;             /* conversion to LE for MD5 */
     int                  busy : 1;
-} flen_t;
+    int                  native : 1;     /* libFLAC does multithreading */
+    int                  output : 1;     /* writing directly to a file */
+    int                  done : 1;       /* finished successfully */
+    FLAC__int32         *pcm;            /* samples to feed to libFLAC */
+    unsigned             npcm;           /* pcm size, samples per channel */
+    int                  nthread;        /* number of threads to use */
+    pthread_t           *workers;        /* segment encoder threads */
+    int                  nworker;        /* number of segment encoders */
+    rnc_queue_t         *jobs;           /* segments to encode */
+    pthread_mutex_t      lock;           /* lock for segment status */
+    pthread_cond_t       cond;           /* signalled when a segment is done */
+    mrp_list_hook_t      segs;           /* segments in stream order */
+    int                  nseg;           /* number of segments in segs */
+    flen_seg_t          *cur;            /* segment being filled */
+    unsigned             blocksize;      /* (fixed) FLAC blocksize */
+    uint64_t             nframe;         /* frames handed out to segments */
+    uint64_t             nsample;        /* samples handed out to segments */
+    uint32_t             min_frame;      /* smallest frame size */
+    uint32_t             max_frame;      /* largest frame size */
+    rnc_md5_t            md5;            /* MD5 sum of all samples */
+    int                  failed;         /* whether a segment failed */
+};
+
+struct flen_seg_s {
+    mrp_list_hook_t  hook;               /* to list of segments */
+    flen_t          *fe;                 /* encoder we belong to */
+    uint64_t         frame;              /* number of first frame */
+    FLAC__int32     *pcm;                /* interleaved samples */
+    unsigned         nsample;            /* number of samples */
+    unsigned         size;               /* room for samples */
+    uint8_t         *data;               /* encoded frames */
+    size_t           len;                /* amount of encoded data */
+    size_t           alloc;              /* size of data buffer */
+    uint32_t         min_frame;          /* smallest frame size */
+    uint32_t         max_frame;          /* largest frame size */
+    int              status;             /* encoding status */
+    int              done;               /* whether encoding is done */
+};
 
 
 static FLAC__StreamEncoderWriteStatus \
@@ -69,25 +151,60 @@ static FLAC__StreamEncoderTellStatus \
 static void __flen_meta(const FLAC__StreamEncoder *se,
                         const FLAC__StreamMetadata *meta, void *client_data);
 
+static int setup_encoder(flen_t *fe, FLAC__StreamEncoder *se,
+                         unsigned blocksize);
+static int seg_start(flen_t *fe);
+static void seg_stop(flen_t *fe);
+static int seg_write(flen_t *fe, const void *buf, size_t size);
+static int seg_finish(flen_t *fe);
+static void free_metadata(flen_t *fe);
+static void find_gain_tags(flen_t *fe, const void *buf, size_t size);
+static int patch_track_gain(flen_t *fe);
+
+
+int flen_get_formats(uint32_t *buf, size_t size)
+{
+    int endn[] = { RNC_ENDIAN_HOST, !RNC_ENDIAN_HOST };
+    int rate[] = { RNC_SAMPLERATE_44100, RNC_SAMPLERATE_48000,
+                   RNC_SAMPLERATE_96000, RNC_SAMPLERATE_192000 };
+    int e, r, n;
+
+    /*
+     * Samples are widened to FLAC__int32 in a single pass either way,
+     * but host-endian ones need no byte-swapping while at it.
+     */
+
+    n = 0;
+    for (e = 0; e < (int)MRP_ARRAY_SIZE(endn); e++) {
+        for (r = 0; r < (int)MRP_ARRAY_SIZE(rate); r++, n++) {
+            if (n < (int)size)
+                buf[n] = RNC_FORMAT_ID(RNC_CHANNELMAP_LEFTRIGHT,
+                                       RNC_ENCODING_PCM, 2, rate[r], 16,
+                                       RNC_SAMPLE_SIGNED, endn[e]);
+        }
+    }
+
+    return n;
+}
 
 
 int flen_create(rnc_encoder_t *enc, uint32_t format)
 {
     flen_t *fe;
     FLAC__StreamEncoder *se;
-    int chnl, rate, bits, smpl, endn, one;
+    int chnl, rate, bits, smpl, endn, error;
 
     mrp_debug("creating FLAC encoder for format 0x%x", format);
 
     fe = mrp_allocz(sizeof(*fe));
 
     if (fe == NULL)
-        goto nomem;
+        return -1;
 
     se = fe->enc = FLAC__stream_encoder_new();
 
-    if (enc == NULL)
-        goto nomem;
+    if (se == NULL)
+        goto fail;
 
     chnl = RNC_FORMAT_CHNL(format);
     rate = rnc_id_freq(RNC_FORMAT_RATE(format));
@@ -98,49 +215,62 @@ int flen_create(rnc_encoder_t *enc, uint32_t format)
     if (smpl != RNC_SAMPLE_SIGNED) /* XXX should convert instead */
         goto invalid;
 
-    fe->buf = rnc_buf_create("FLAC-encoder", 0, BUFFER_CHUNK);
-
-    if (fe->buf == NULL)
-        goto nomem;
+    /* writing steps through the input as int16_t, like we advertise */
+    if (bits != 16)
+        goto invalid;
 
-    one = 1;
-    if ((endn == RNC_ENDIAN_BIG    &&  *((char *)&one)) ||
-        (endn == RNC_ENDIAN_LITTLE && !*((char *)&one)))
-        fe->swap = true;
+    if (rnc_convert_init(&fe->cvt, format,
+                         RNC_FORMAT_ID(0, 0, chnl, 0, 32, RNC_SAMPLE_SIGNED,
+                                       RNC_ENDIAN_HOST), 0) < 0 ||
+        rnc_convert_init(&fe->le, format,
+                         RNC_FORMAT_ID(0, 0, chnl, 0, bits, RNC_SAMPLE_SIGNED,
+                                       RNC_ENDIAN_LITTLE), 0) < 0)
+        goto invalid;
 
-    enc->data = fe;
-    fe->chnl  = chnl;
-    fe->bits  = bits;
+    /*
+     * Unless we get an output file, the encoded track is collected in
+     * memory. Don't let a long track eat up all memory on small boxes,
+     * spill it to disk beyond the configured limit.
+     */
 
-    mrp_debug("setting stream to %d Hz, %d channels, %d bits", rate,
-              chnl, bits);
+    fe->buf = rnc_buf_spill("FLAC-encoder", BUFFER_CHUNK, enc->rnc->spill,
+                            enc->rnc->spill_dir);
 
-    if (!FLAC__stream_encoder_set_sample_rate(se, (unsigned)rate))
-        goto invalid;
+    if (fe->buf == NULL)
+        goto fail;
 
-    if (!FLAC__stream_encoder_set_channels(se, (unsigned)chnl))
-        goto invalid;
+    enc->data   = fe;
+    fe->chnl    = chnl;
+    fe->bits    = bits;
+    fe->rate    = rate;
+    fe->endn    = endn;
+    fe->nthread = 1;
 
-    if (!FLAC__stream_encoder_set_bits_per_sample(se, (unsigned)bits))
-        goto invalid;
+    mrp_list_init(&fe->segs);
 
-    if (!FLAC__stream_encoder_set_compression_level(se, 8))
-        goto invalid;
+    mrp_debug("setting stream to %d Hz, %d channels, %d bits", rate,
+              chnl, bits);
 
-    if (!FLAC__stream_encoder_set_blocksize(se, 0))
+    if (setup_encoder(fe, se, 0) < 0)
         goto invalid;
 
     return 0;
 
  invalid:
-    if (se)
-        FLAC__stream_encoder_delete(se);
-    mrp_free(fe);
     errno = EINVAL;
-    return -1;
+ fail:
+    error = errno;
 
- nomem:
+    /* don't leak the spill buffer (and its file) of a failed encoder */
+    if (fe->buf != NULL)
+        rnc_buf_close(fe->buf);
+    if (se != NULL)
+        FLAC__stream_encoder_delete(se);
+
+    enc->data = NULL;
     mrp_free(fe);
+
+    errno = error;
     return -1;
 }
 
@@ -156,12 +286,33 @@ int flen_open(rnc_encoder_t *enc)
     if ((fe = enc->data) == NULL || (se = fe->enc) == NULL)
         goto invalid;
 
+#ifdef HAVE_FLAC__STREAM_ENCODER_SET_NUM_THREADS
+    if (fe->nthread > 1 &&
+        FLAC__stream_encoder_set_num_threads(se, fe->nthread) ==
+        FLAC__STREAM_ENCODER_SET_NUM_THREADS_OK)
+        fe->native = true;
+#endif
+
     status = FLAC__stream_encoder_init_stream(se, __flen_write, __flen_seek,
                                               __flen_tell, __flen_meta, enc);
 
     if (status != FLAC__STREAM_ENCODER_INIT_STATUS_OK)
         goto invalid;
 
+    if (fe->nthread > 1 && !fe->native) {
+        fe->blocksize = FLAC__stream_encoder_get_blocksize(se);
+
+        if (seg_start(fe) < 0)
+            return -1;
+    }
+    else {
+        fe->npcm = FEED_BLOCKS * FLAC__stream_encoder_get_blocksize(se);
+        fe->pcm  = mrp_alloc(fe->npcm * fe->chnl * sizeof(fe->pcm[0]));
+
+        if (fe->pcm == NULL)
+            return -1;
+    }
+
     return 0;
 
  invalid:
@@ -180,11 +331,77 @@ void flen_close(rnc_encoder_t *enc)
     if (enc == NULL || (fe = enc->data) == NULL || (se = fe->enc) == NULL)
         return;
 
+    seg_stop(fe);
+
     FLAC__stream_encoder_delete(se);
+    free_metadata(fe);
+    mrp_free(fe->pcm);
+
+    /* don't leave truncated files behind */
+    if (fe->output && !fe->done)
+        rnc_buf_unlink(fe->buf);
+    else
+        rnc_buf_close(fe->buf);
+
+    mrp_free(fe);
+
     enc->data = NULL;
 }
 
 
+int flen_set_output(rnc_encoder_t *enc, const char *path)
+{
+    flen_t    *fe;
+    rnc_buf_t *buf;
+
+    mrp_debug("setting FLAC encoder output to '%s'", path);
+
+    if (enc == NULL || (fe = enc->data) == NULL || path == NULL)
+        goto invalid;
+
+    /*
+     * Switch from the in-memory buffer to a file buffer. libFLAC only
+     * ever seeks back to rewrite the STREAMINFO (and seek table) at the
+     * end, which the file buffer handles just as well, so the encoded
+     * data can go straight to its final destination.
+     */
+
+    buf = rnc_buf_open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if (buf == NULL)
+        return -1;
+
+    rnc_buf_close(fe->buf);
+    fe->buf    = buf;
+    fe->output = true;
+
+    return 0;
+
+ invalid:
+    errno = EINVAL;
+    return -1;
+}
+
+
+int flen_set_threads(rnc_encoder_t *enc, int nthread)
+{
+    flen_t *fe;
+
+    mrp_debug("setting FLAC encoder threads to %d", nthread);
+
+    if (enc == NULL || (fe = enc->data) == NULL || nthread < 1)
+        goto invalid;
+
+    fe->nthread = nthread;
+
+    return 0;
+
+ invalid:
+    errno = EINVAL;
+    return -1;
+}
+
+
 int flen_set_quality(rnc_encoder_t *enc, uint16_t qlty, uint16_t cmpr)
 {
     flen_t *fe;
@@ -211,7 +428,21 @@ int flen_set_quality(rnc_encoder_t *enc, uint16_t qlty, uint16_t cmpr)
 }
 
 
-int flen_set_metadata(rnc_encoder_t *enc, rnc_meta_t *meta)
+static void free_metadata(flen_t *fe)
+{
+    int i;
+
+    /* libFLAC does not take ownership of the metadata we hand to it */
+    for (i = 0; i < (int)MRP_ARRAY_SIZE(fe->meta); i++) {
+        if (fe->meta[i] != NULL) {
+            FLAC__metadata_object_delete(fe->meta[i]);
+            fe->meta[i] = NULL;
+        }
+    }
+}
+
+
+int flen_set_metadata(rnc_encoder_t *enc, rnc_meta_t *meta, int flags)
 {
 #define TAG(_tag, ...) do {                                                    \
         const char *_v;                                                        \
@@ -234,7 +465,7 @@ int flen_set_metadata(rnc_encoder_t *enc, rnc_meta_t *meta)
     flen_t *fe;
     FLAC__StreamEncoder *se;
     FLAC__StreamMetadata_VorbisComment_Entry entry;
-    FLAC__StreamMetadata *data[3];
+    FLAC__StreamMetadata **data;
     char tags[16 * 1024], *p;
     int  l, n;
 
@@ -246,6 +477,9 @@ int flen_set_metadata(rnc_encoder_t *enc, rnc_meta_t *meta)
     if (fe->busy)
         goto busy;
 
+    data = fe->meta;
+    free_metadata(fe);
+
     data[0] = FLAC__metadata_object_new(FLAC__METADATA_TYPE_VORBIS_COMMENT);
     data[1] = FLAC__metadata_object_new(FLAC__METADATA_TYPE_PADDING);
     data[1]->length = 16;
@@ -301,12 +535,12 @@ int flen_set_metadata(rnc_encoder_t *enc, rnc_meta_t *meta)
         TAG("ORGANIZATION", "%s", meta->organization);
     }
 
-    TAG("REPLAYGAIN_TRACK_GAIN", "#TRK# dB");    /* dummy placeholder */
-    TAG("REPLAYGAIN_TRACK_PEAK", "#PK#");        /* dummy placeholder */
-    TAG("REPLAYGAIN_ALBUM_GAIN", "#ALB# dB");    /* dummy placeholder */
+    TAG(TRACK_GAIN_TAG, "%s", TRACK_GAIN_HOLD);
+    TAG(TRACK_PEAK_TAG, "%s", PEAK_HOLD);
 
-    if (!fe->gain_offs)
-        fe->gain_offs = rnc_buf_wseek(fe->buf, 0, SEEK_CUR);
+    if (flags & RNC_META_ALBUM_GAIN) {
+        TAG(ALBUM_GAIN_TAG, "%s", ALBUM_GAIN_HOLD);
+    }
 
     if (FLAC__stream_encoder_set_metadata(se, data, 2))
         return 0;
@@ -340,7 +574,8 @@ int flen_set_gain(rnc_encoder_t *enc, double gain, double peak, double album)
     fe->track_peak = peak;
     fe->album_gain = album;
 
-    mrp_debug("replaygain offset: %u", fe->gain_offs);
+    mrp_debug("replaygain offsets: %lld, %lld", (long long)fe->gain_offs,
+              (long long)fe->peak_offs);
 
     return 0;
 
@@ -349,44 +584,45 @@ int flen_set_gain(rnc_encoder_t *enc, double gain, double peak, double album)
     return -1;
 }
 
-int flen_write(rnc_encoder_t *enc, void *buf, size_t size)
+
+int flen_write(rnc_encoder_t *enc, const void *buf, size_t size)
 {
     flen_t *fe;
     FLAC__StreamEncoder *se;
-    unsigned nsample, i;
-    int32_t l[size], r[size];
-    const FLAC__int32 const *samples[2];
-    int16_t *p;
+    unsigned nsample, n;
+    const int16_t *p;
+    void *pcm[1];
 
     if (enc == NULL || (fe = enc->data) == NULL || (se = fe->enc) == NULL)
         goto invalid;
 
+    if (fe->workers != NULL)
+        return seg_write(fe, buf, size);
+
     nsample = size / (fe->chnl * (fe->bits / 8));
 
     mrp_debug("writing %zu bytes (%u samples) of FLAC data", size, nsample);
 
-    p = (int16_t *)buf;
-    i = 0;
-    if (fe->swap) {
-        while (i < nsample) {
-            l[i] = bswap_16(*p++);
-            r[i] = bswap_16(*p++);
-            i++;
-        }
-    }
-    else {
-        while (i < nsample) {
-            l[i] = *p++;
-            r[i] = *p++;
-            i++;
-        }
-    }
+    /*
+     * Feed libFLAC interleaved samples, widened in a single pass into
+     * our preallocated buffer, at most a few blocks at a time.
+     */
 
-    samples[0] = l;
-    samples[1] = r;
+    pcm[0] = fe->pcm;
 
-    if (!FLAC__stream_encoder_process(se, samples, nsample))
-        goto ioerror;
+    p = (const int16_t *)buf;
+
+    while (nsample > 0) {
+        n = nsample < fe->npcm ? nsample : fe->npcm;
+
+        rnc_convert(&fe->cvt, pcm, p, n);
+
+        if (!FLAC__stream_encoder_process_interleaved(se, fe->pcm, n))
+            goto ioerror;
+
+        p       += n * fe->chnl;
+        nsample -= n;
+    }
 
     return 0;
 
@@ -409,9 +645,24 @@ int flen_finish(rnc_encoder_t *enc)
     if (enc == NULL || (fe = enc->data) == NULL || (se = fe->enc) == NULL)
         goto invalid;
 
-    if (!FLAC__stream_encoder_finish(se))
+    if (fe->workers != NULL) {
+        if (seg_finish(fe) < 0)
+            return -1;
+    }
+    else {
+        if (!FLAC__stream_encoder_finish(se))
+            goto ioerror;
+    }
+
+    if (patch_track_gain(fe) < 0)
+        goto ioerror;
+
+    /* write out anything the file buffer still has staged */
+    if (fe->output && rnc_buf_wseek(fe->buf, 0, SEEK_END) < 0)
         goto ioerror;
 
+    fe->done = true;
+
     return 0;
 
  ioerror:
@@ -458,6 +709,21 @@ int flen_read(rnc_encoder_t *enc, void *buf, size_t size)
 }
 
 
+ssize_t flen_write_to_fd(rnc_encoder_t *enc, int fd)
+{
+    flen_t *fe;
+
+    if (enc == NULL || (fe = enc->data) == NULL)
+        goto invalid;
+
+    return rnc_buf_copy_to_fd(fe->buf, fd);
+
+ invalid:
+    errno = EINVAL;
+    return -1;
+}
+
+
 static FLAC__StreamEncoderWriteStatus
 __flen_write(const FLAC__StreamEncoder *se, const FLAC__byte buffer[],
              size_t bytes, unsigned samples, unsigned current_frame,
@@ -476,6 +742,9 @@ __flen_write(const FLAC__StreamEncoder *se, const FLAC__byte buffer[],
     if ((enc = client_data) == NULL || (fe = enc->data) == NULL)
         goto invalid;
 
+    if (samples == 0 && fe->gain_offs == 0)
+        find_gain_tags(fe, buffer, bytes);
+
     if (rnc_buf_write(fe->buf, buffer, bytes) < 0)
         goto nomem;
 
@@ -549,18 +818,705 @@ static void __flen_meta(const FLAC__StreamEncoder *se,
 }
 
 
+static off_t tag_offset(const void *buf, size_t size, const char *tag)
+{
+    char        name[64];
+    const char *p;
+    int         n;
+
+    n = snprintf(name, sizeof(name), "%s=", tag);
+    p = memmem(buf, size, name, n);
+
+    return p != NULL ? (p - (const char *)buf) + n : -1;
+}
+
+
+static void find_gain_tags(flen_t *fe, const void *buf, size_t size)
+{
+    off_t offs, gain, peak;
+
+    /*
+     * libFLAC writes each metadata block with a single call, so we get
+     * the whole VORBIS_COMMENT block with all our placeholders at once.
+     */
+
+    gain = tag_offset(buf, size, TRACK_GAIN_TAG);
+    peak = tag_offset(buf, size, TRACK_PEAK_TAG);
+
+    if (gain < 0 || peak < 0)
+        return;
+
+    if ((offs = rnc_buf_tell(fe->buf)) < 0)
+        return;
+
+    fe->gain_offs = offs + gain;
+    fe->peak_offs = offs + peak;
+
+    mrp_debug("replaygain tags at offsets %lld, %lld",
+              (long long)fe->gain_offs, (long long)fe->peak_offs);
+}
+
+
+static void format_gain(char *buf, size_t size, double gain)
+{
+    if (gain < -51.0)
+        gain = -51.0;
+    else if (gain > 51.0)
+        gain = 51.0;
+
+    snprintf(buf, size, GAIN_FORMAT, gain);
+}
+
+
+static void format_peak(char *buf, size_t size, double peak)
+{
+    if (peak < 0.0)
+        peak = 0.0;
+    else if (peak > 9.999999)
+        peak = 9.999999;
+
+    snprintf(buf, size, PEAK_FORMAT, peak);
+}
+
+
+static int patch_track_gain(flen_t *fe)
+{
+    char gain[16], peak[16];
+
+    if (fe->gain_offs == 0)              /* no metadata, nothing to patch */
+        return 0;
+
+    format_gain(gain, sizeof(gain), fe->track_gain);
+    format_peak(peak, sizeof(peak), fe->track_peak);
+
+    if (rnc_buf_wseek(fe->buf, fe->gain_offs, SEEK_SET) < 0 ||
+        rnc_buf_write(fe->buf, gain, sizeof(TRACK_GAIN_HOLD) - 1) < 0 ||
+        rnc_buf_wseek(fe->buf, fe->peak_offs, SEEK_SET) < 0 ||
+        rnc_buf_write(fe->buf, peak, sizeof(PEAK_HOLD) - 1) < 0 ||
+        rnc_buf_wseek(fe->buf, 0, SEEK_END) < 0)
+        return -1;
+
+    return 0;
+}
+
+
+#define LE32(_p) ((uint32_t)(_p)[0]         | (uint32_t)(_p)[1] << 8 |  \
+                  (uint32_t)(_p)[2] << 16   | (uint32_t)(_p)[3] << 24)
+
+int flen_patch_gain(const char *path, double album)
+{
+    uint8_t  hdr[4], *blk;
+    char     gain[16];
+    off_t    offs;
+    uint32_t len, n, cnt, elen, tlen, i;
+    int      fd, type;
+
+    mrp_debug("patching album gain %.2f into '%s'", album, path);
+
+    blk = NULL;
+
+    if ((fd = open(path, O_RDWR)) < 0)
+        return -1;
+
+    if (pread(fd, hdr, 4, 0) != 4 || memcmp(hdr, "fLaC", 4))
+        goto invalid;
+
+    /*
+     * Find the VORBIS_COMMENT block by hopping over the metadata block
+     * headers, then locate the reserved album gain value in it and
+     * overwrite it in place. Only the metadata block headers and the
+     * comment block are ever read, the audio is not touched.
+     */
+
+    offs = 4;
+
+    while (1) {
+        if (pread(fd, hdr, 4, offs) != 4)
+            goto invalid;
+
+        type = hdr[0] & 0x7f;
+        len  = (hdr[1] << 16) | (hdr[2] << 8) | hdr[3];
+
+        if (type == FLAC__METADATA_TYPE_VORBIS_COMMENT)
+            break;
+
+        if (hdr[0] & 0x80)
+            goto notfound;
+
+        offs += 4 + len;
+    }
+
+    if (len < 8 || len > COMMENT_MAX || (blk = mrp_alloc(len)) == NULL)
+        goto invalid;
+
+    if (pread(fd, blk, len, offs + 4) != (ssize_t)len)
+        goto invalid;
+
+    tlen = sizeof(ALBUM_GAIN_TAG "=") - 1;
+    n    = 4 + LE32(blk);                /* skip vendor string */
+
+    if (n < 4 || n > len - 4)
+        goto invalid;
+
+    cnt = LE32(blk + n);
+    n  += 4;
+
+    for (i = 0; i < cnt; i++) {
+        if (n > len - 4)
+            goto invalid;
+
+        elen = LE32(blk + n);
+        n   += 4;
+
+        if (elen > len - n)
+            goto invalid;
+
+        if (elen == tlen + sizeof(ALBUM_GAIN_HOLD) - 1 &&
+            !strncasecmp((char *)blk + n, ALBUM_GAIN_TAG "=", tlen)) {
+            format_gain(gain, sizeof(gain), album);
+
+            if (pwrite(fd, gain, elen - tlen, offs + 4 + n + tlen) !=
+                (ssize_t)(elen - tlen))
+                goto ioerror;
+
+            mrp_free(blk);
+            close(fd);
+
+            return 0;
+        }
+
+        n += elen;
+    }
+
+ notfound:
+    errno = ENOENT;
+    goto fail;
+ invalid:
+    errno = EINVAL;
+    goto fail;
+ ioerror:
+    errno = EIO;
+ fail:
+    mrp_free(blk);
+    close(fd);
+    return -1;
+}
+
+#undef LE32
+
+
+static int setup_encoder(flen_t *fe, FLAC__StreamEncoder *se,
+                         unsigned blocksize)
+{
+    if (!FLAC__stream_encoder_set_sample_rate(se, (unsigned)fe->rate))
+        return -1;
+
+    if (!FLAC__stream_encoder_set_channels(se, (unsigned)fe->chnl))
+        return -1;
+
+    if (!FLAC__stream_encoder_set_bits_per_sample(se, (unsigned)fe->bits))
+        return -1;
+
+    if (!FLAC__stream_encoder_set_compression_level(se, 8))
+        return -1;
+
+    if (!FLAC__stream_encoder_set_blocksize(se, blocksize))
+        return -1;
+
+    return 0;
+}
+
+
+static uint8_t  crc8_table[256];
+static uint16_t crc16_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+
+static void crc_init(void)
+{
+    uint8_t  c8;
+    uint16_t c16;
+    int      i, j;
+
+    for (i = 0; i < 256; i++) {
+        c8  = i;
+        c16 = i << 8;
+        for (j = 0; j < 8; j++) {
+            c8  = (c8  & 0x80)   ? (c8  << 1) ^ 0x07   : (c8  << 1);
+            c16 = (c16 & 0x8000) ? (c16 << 1) ^ 0x8005 : (c16 << 1);
+        }
+        crc8_table[i]  = c8;
+        crc16_table[i] = c16;
+    }
+}
+
+
+static uint8_t crc8(const uint8_t *p, size_t n)
+{
+    uint8_t crc;
+
+    pthread_once(&crc_once, crc_init);
+
+    crc = 0;
+    while (n--)
+        crc = crc8_table[crc ^ *p++];
+
+    return crc;
+}
+
+
+static uint16_t crc16(const uint8_t *p, size_t n)
+{
+    uint16_t crc;
+
+    pthread_once(&crc_once, crc_init);
+
+    crc = 0;
+    while (n--)
+        crc = (crc << 8) ^ crc16_table[(crc >> 8) ^ *p++];
+
+    return crc;
+}
+
+
+static size_t frame_renumber(const uint8_t *in, size_t len, uint64_t num,
+                             uint8_t *out)
+{
+    size_t   hlen, nlen, xlen, olen, i;
+    int      bs, sr, m;
+    uint16_t crc;
+
+    /*
+     * Rewrite the header of a fixed-blocksize frame with the given frame
+     * number. The frame number is UTF-8 coded, so the header can change
+     * in size, and both the header CRC-8 and the frame CRC-16 need to be
+     * recalculated.
+     */
+
+    if (len < 8 || in[0] != 0xff || in[1] != 0xf8)
+        return 0;
+
+    for (nlen = 0; nlen < 8 && (in[4] & (0x80 >> nlen)); nlen++)
+        ;
+
+    if (nlen == 1 || nlen == 8)          /* not a valid lead byte */
+        return 0;
+
+    if (nlen == 0)
+        nlen = 1;
+
+    bs   = in[2] >> 4;
+    sr   = in[2] & 0xf;
+    xlen = (bs == 6 ? 1 : bs == 7 ? 2 : 0) + (sr == 12 ? 1 : 0) +
+        (sr == 13 || sr == 14 ? 2 : 0);
+    hlen = 4 + nlen + xlen + 1;
+
+    if (len < hlen + 2)
+        return 0;
+
+    memcpy(out, in, 4);
+    olen = 4;
+
+    if (num < 0x80)
+        out[olen++] = num;
+    else {
+        for (m = 2; m < 7 && num >= (1ULL << (5 * m + 1)); m++)
+            ;
+        out[olen++] = (0xff00 >> m) | (num >> (6 * (m - 1)));
+        for (i = m - 1; i > 0; i--)
+            out[olen++] = 0x80 | ((num >> (6 * (i - 1))) & 0x3f);
+    }
+
+    memcpy(out + olen, in + 4 + nlen, xlen);
+    olen += xlen;
+    out[olen] = crc8(out, olen);
+    olen++;
+
+    memcpy(out + olen, in + hlen, len - hlen - 2);
+    olen += len - hlen - 2;
+
+    crc = crc16(out, olen);
+    out[olen++] = crc >> 8;
+    out[olen++] = crc & 0xff;
+
+    return olen;
+}
+
+
+static FLAC__StreamEncoderWriteStatus
+__seg_write(const FLAC__StreamEncoder *se, const FLAC__byte buffer[],
+            size_t bytes, unsigned samples, unsigned current_frame,
+            void *client_data)
+{
+    flen_seg_t *seg = client_data;
+    size_t      n;
+
+    MRP_UNUSED(se);
+
+    /* drop the stream header, we only need the frames */
+    if (samples == 0)
+        return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+
+    if (seg->alloc < seg->len + bytes + 8) {
+        n = seg->alloc ? 2 * seg->alloc : 64 * 1024;
+
+        while (n < seg->len + bytes + 8)
+            n *= 2;
+
+        if (!mrp_realloc(seg->data, n))
+            return FLAC__STREAM_ENCODER_WRITE_STATUS_FATAL_ERROR;
+
+        seg->alloc = n;
+    }
+
+    n = frame_renumber(buffer, bytes, seg->frame + current_frame,
+                       seg->data + seg->len);
+
+    if (n == 0)
+        return FLAC__STREAM_ENCODER_WRITE_STATUS_FATAL_ERROR;
+
+    if (seg->min_frame == 0 || n < seg->min_frame)
+        seg->min_frame = n;
+    if (n > seg->max_frame)
+        seg->max_frame = n;
+
+    seg->len += n;
+
+    return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+}
+
+
+static int seg_encode(flen_seg_t *seg)
+{
+    flen_t              *fe = seg->fe;
+    FLAC__StreamEncoder *se;
+    int                  status;
+
+    se = FLAC__stream_encoder_new();
+
+    if (se == NULL)
+        return -1;
+
+    status = -1;
+
+    if (setup_encoder(fe, se, fe->blocksize) < 0 ||
+        !FLAC__stream_encoder_set_do_md5(se, false))
+        goto out;
+
+    if (FLAC__stream_encoder_init_stream(se, __seg_write, NULL, NULL, NULL,
+                                         seg) !=
+        FLAC__STREAM_ENCODER_INIT_STATUS_OK)
+        goto out;
+
+    if (FLAC__stream_encoder_process_interleaved(se, seg->pcm, seg->nsample) &&
+        FLAC__stream_encoder_finish(se))
+        status = 0;
+
+ out:
+    FLAC__stream_encoder_delete(se);
+
+    return status;
+}
+
+
+static void *seg_worker(void *arg)
+{
+    flen_t     *fe = arg;
+    flen_seg_t *seg;
+    int         status;
+
+    while ((seg = rnc_queue_pop(fe->jobs)) != NULL) {
+        status = seg_encode(seg);
+
+        mrp_free(seg->pcm);
+        seg->pcm = NULL;
+
+        pthread_mutex_lock(&fe->lock);
+        seg->status = status;
+        seg->done   = 1;
+        pthread_cond_broadcast(&fe->cond);
+        pthread_mutex_unlock(&fe->lock);
+    }
+
+    return NULL;
+}
+
+
+static void seg_free(flen_seg_t *seg)
+{
+    if (seg == NULL)
+        return;
+
+    mrp_list_delete(&seg->hook);
+    mrp_free(seg->pcm);
+    mrp_free(seg->data);
+    mrp_free(seg);
+}
+
+
+static int seg_start(flen_t *fe)
+{
+    int i;
+
+    mrp_debug("starting %d FLAC segment encoders, blocksize %u", fe->nthread,
+              fe->blocksize);
+
+    rnc_md5_init(&fe->md5);
+    pthread_mutex_init(&fe->lock, NULL);
+    pthread_cond_init(&fe->cond, NULL);
+
+    fe->jobs    = rnc_queue_create(2 * fe->nthread);
+    fe->workers = mrp_allocz_array(pthread_t, fe->nthread);
+
+    if (fe->jobs == NULL || fe->workers == NULL)
+        goto fail;
+
+    for (i = 0; i < fe->nthread; i++) {
+        if (pthread_create(fe->workers + i, NULL, seg_worker, fe) != 0)
+            goto fail;
+        fe->nworker++;
+    }
+
+    return 0;
+
+ fail:
+    seg_stop(fe);
+    errno = ENOMEM;
+    return -1;
+}
+
+
+static void seg_stop(flen_t *fe)
+{
+    mrp_list_hook_t *p, *n;
+    int              i;
+
+    if (fe->jobs == NULL && fe->workers == NULL)
+        return;
+
+    if (fe->jobs != NULL)
+        rnc_queue_close(fe->jobs);
+
+    for (i = 0; i < fe->nworker; i++)
+        pthread_join(fe->workers[i], NULL);
+
+    mrp_list_foreach(&fe->segs, p, n) {
+        seg_free(mrp_list_entry(p, flen_seg_t, hook));
+    }
+
+    seg_free(fe->cur);
+
+    rnc_queue_destroy(fe->jobs);
+    mrp_free(fe->workers);
+    pthread_cond_destroy(&fe->cond);
+    pthread_mutex_destroy(&fe->lock);
+
+    fe->jobs    = NULL;
+    fe->workers = NULL;
+    fe->nworker = 0;
+    fe->cur     = NULL;
+    fe->nseg    = 0;
+}
+
+
+static int seg_collect(flen_t *fe, bool all)
+{
+    flen_seg_t *seg;
+    int         status;
+
+    /*
+     * Append finished segments to the stream in order. Unless asked to
+     * wait for all of them, only wait if too many segments are pending.
+     */
+
+    while (!mrp_list_empty(&fe->segs)) {
+        seg = mrp_list_entry(fe->segs.next, flen_seg_t, hook);
+
+        pthread_mutex_lock(&fe->lock);
+        while (!seg->done && (all || fe->nseg >= 2 * fe->nworker))
+            pthread_cond_wait(&fe->cond, &fe->lock);
+        status = seg->done ? seg->status : 1;
+        pthread_mutex_unlock(&fe->lock);
+
+        if (status > 0)
+            break;
+
+        if (status < 0)
+            fe->failed = true;
+        else if (!fe->failed) {
+            if (rnc_buf_write(fe->buf, seg->data, seg->len) < 0)
+                fe->failed = true;
+
+            if (fe->min_frame == 0 || seg->min_frame < fe->min_frame)
+                fe->min_frame = seg->min_frame;
+            if (seg->max_frame > fe->max_frame)
+                fe->max_frame = seg->max_frame;
+        }
+
+        seg_free(seg);
+        fe->nseg--;
+    }
+
+    return fe->failed ? -1 : 0;
+}
+
+
+static int seg_dispatch(flen_t *fe)
+{
+    flen_seg_t *seg = fe->cur;
+
+    fe->cur = NULL;
+
+    seg->frame   = fe->nframe;
+    fe->nframe  += (seg->nsample + fe->blocksize - 1) / fe->blocksize;
+    fe->nsample += seg->nsample;
+
+    mrp_list_append(&fe->segs, &seg->hook);
+    fe->nseg++;
+
+    if (rnc_queue_push(fe->jobs, seg) < 0) {
+        mrp_list_delete(&seg->hook);
+        fe->nseg--;
+        seg_free(seg);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static int seg_write(flen_t *fe, const void *buf, size_t size)
+{
+    const int16_t *p = buf;
+    flen_seg_t    *seg;
+    unsigned       nsample, n;
+    int16_t        le[1024];
+    size_t         cnt;
+    void          *d[1];
+
+    nsample = size / (fe->chnl * (fe->bits / 8));
+
+    /* FLAC checksums little-endian samples */
+    if (fe->endn != RNC_ENDIAN_LITTLE)
+        for (cnt = 0; cnt < nsample; cnt += n) {
+            n = MRP_ARRAY_SIZE(le) / fe->chnl;
+            if (n > nsample - cnt)
+                n = nsample - cnt;
+            d[0] = le;
+            rnc_convert(&fe->le, d, p + cnt * fe->chnl, n);
+            rnc_md5_update(&fe->md5, le, n * fe->chnl * sizeof(le[0]));
+        }
+    else
+        rnc_md5_update(&fe->md5, buf, nsample * fe->chnl * sizeof(*p));
+
+    while (nsample > 0) {
+        if ((seg = fe->cur) == NULL) {
+            seg = fe->cur = mrp_allocz(sizeof(*seg));
+
+            if (seg == NULL)
+                return -1;
+
+            mrp_list_init(&seg->hook);
+            seg->fe   = fe;
+            seg->size = SEGMENT_FRAMES * fe->blocksize;
+            seg->pcm  = mrp_alloc(seg->size * fe->chnl * sizeof(seg->pcm[0]));
+
+            if (seg->pcm == NULL)
+                return -1;
+        }
+
+        n = seg->size - seg->nsample;
+
+        if (n > nsample)
+            n = nsample;
+
+        d[0] = seg->pcm + seg->nsample * fe->chnl;
+        rnc_convert(&fe->cvt, d, p, n);
+
+        seg->nsample += n;
+        nsample      -= n;
+        p            += n * fe->chnl;
+
+        if (seg->nsample == seg->size && seg_dispatch(fe) < 0)
+            goto ioerror;
+    }
+
+    if (seg_collect(fe, false) < 0)
+        goto ioerror;
+
+    return 0;
+
+ ioerror:
+    errno = EIO;
+    return -1;
+}
+
+
+static int seg_finish(flen_t *fe)
+{
+    uint8_t  si[30];
+    uint64_t v;
+    int      i;
+
+    if (fe->cur != NULL && fe->cur->nsample > 0 && seg_dispatch(fe) < 0)
+        goto ioerror;
+
+    if (seg_collect(fe, true) < 0)
+        goto ioerror;
+
+    /* let the (sample-less) stream encoder write its STREAMINFO... */
+    if (!FLAC__stream_encoder_finish(fe->enc))
+        goto ioerror;
+
+    /* ...then patch in frame sizes, sample count and MD5 sum */
+    si[0] = fe->min_frame >> 16;
+    si[1] = fe->min_frame >> 8;
+    si[2] = fe->min_frame;
+    si[3] = fe->max_frame >> 16;
+    si[4] = fe->max_frame >> 8;
+    si[5] = fe->max_frame;
+
+    v = ((uint64_t)fe->rate << 44) | ((uint64_t)(fe->chnl - 1) << 41) |
+        ((uint64_t)(fe->bits - 1) << 36) | (fe->nsample & 0xfffffffffULL);
+
+    for (i = 0; i < 8; i++)
+        si[6 + i] = v >> (56 - 8 * i);
+
+    rnc_md5_final(&fe->md5, si + 14);
+
+    if (rnc_buf_wseek(fe->buf, STREAMINFO_OFFS + 4, SEEK_SET) < 0 ||
+        rnc_buf_write(fe->buf, si, sizeof(si)) < 0 ||
+        rnc_buf_wseek(fe->buf, 0, SEEK_END) < 0)
+        goto ioerror;
+
+    seg_stop(fe);
+
+    return 0;
+
+ ioerror:
+    seg_stop(fe);
+    errno = EIO;
+    return -1;
+}
+
+
 static const char *flac_types[] = { "flac", NULL };
 
 RNC_ENCODER_REGISTER(flac, {
         .types        = flac_types,
+        .get_formats  = flen_get_formats,
         .create       = flen_create,
         .open         = flen_open,
         .close        = flen_close,
         .set_quality  = flen_set_quality,
+        .set_threads  = flen_set_threads,
+        .set_output   = flen_set_output,
+        .patch_gain   = flen_patch_gain,
         .set_metadata = flen_set_metadata,
         .set_gain     = flen_set_gain,
         .write        = flen_write,
         .finish       = flen_finish,
         .set_data_cb  = flen_set_data_cb,
         .read         = flen_read,
+        .write_to_fd  = flen_write_to_fd,
     });
@@ -28,6 +28,7 @@
  */
 
 #include <errno.h>
+#include <unistd.h>
 
 #include <ripncode/ripncode.h>
 
@@ -169,12 +170,71 @@ int rnc_encoder_set_quality(rnc_encoder_t *enc, uint16_t qlty, uint16_t cmpr)
 }
 
 
-int rnc_encoder_set_metadata(rnc_encoder_t *enc, rnc_meta_t *meta)
+int rnc_encoder_set_threads(rnc_encoder_t *enc, int nthread)
 {
     if (enc->api == NULL)
         goto invalid;
 
-    return enc->api->set_metadata(enc, meta);
+    if (enc->open)
+        goto busy;
+
+    if (enc->api->set_threads == NULL)
+        goto notsup;
+
+    return enc->api->set_threads(enc, nthread);
+
+ invalid:
+    errno = EINVAL;
+    return -1;
+
+ busy:
+    errno = EBUSY;
+    return -1;
+
+ notsup:
+    errno = ENOTSUP;
+    return -1;
+}
+
+
+int rnc_encoder_set_output(rnc_encoder_t *enc, const char *path)
+{
+    if (enc->api == NULL)
+        goto invalid;
+
+    if (enc->open)
+        goto busy;
+
+    if (enc->api->set_output == NULL)
+        goto notsup;
+
+    if (enc->api->set_output(enc, path) < 0)
+        return -1;
+
+    enc->output = 1;
+
+    return 0;
+
+ invalid:
+    errno = EINVAL;
+    return -1;
+
+ busy:
+    errno = EBUSY;
+    return -1;
+
+ notsup:
+    errno = ENOTSUP;
+    return -1;
+}
+
+
+int rnc_encoder_set_metadata(rnc_encoder_t *enc, rnc_meta_t *meta, int flags)
+{
+    if (enc->api == NULL)
+        goto invalid;
+
+    return enc->api->set_metadata(enc, meta, flags);
 
  invalid:
     errno = EINVAL;
@@ -195,7 +255,7 @@ int rnc_encoder_set_gain(rnc_encoder_t *enc, double t, double p, double a)
 }
 
 
-int rnc_encoder_write(rnc_encoder_t *enc, void *buf, size_t size)
+int rnc_encoder_write(rnc_encoder_t *enc, const void *buf, size_t size)
 {
     if (enc->api == NULL)
         goto invalid;
@@ -228,6 +288,68 @@ int rnc_encoder_finish(rnc_encoder_t *enc)
 }
 
 
+int rnc_encoder_patch_gain(rnc_t *rnc, uint32_t format, const char *path,
+                           double gain)
+{
+    rnc_enc_api_t *api;
+    const char    *type;
+
+    type = rnc_compress_name(rnc, RNC_FORMAT_CMPR(format));
+
+    if (type == NULL || (api = api_lookup(rnc, type)) == NULL)
+        goto invalid;
+
+    if (api->patch_gain == NULL)
+        goto notsup;
+
+    return api->patch_gain(path, gain);
+
+ invalid:
+    errno = EINVAL;
+    return -1;
+
+ notsup:
+    errno = ENOTSUP;
+    return -1;
+}
+
+
+int rnc_encoder_get_formats(rnc_t *rnc, uint32_t format, uint32_t *buf,
+                            size_t size)
+{
+    rnc_enc_api_t *api;
+    const char    *type;
+    int            cmpr, n, i;
+
+    cmpr = RNC_FORMAT_CMPR(format);
+    type = rnc_compress_name(rnc, cmpr);
+
+    if (type == NULL || (api = api_lookup(rnc, type)) == NULL)
+        goto invalid;
+
+    /* backends without a list take what we have always fed them */
+    if (api->get_formats == NULL) {
+        if (size > 0)
+            buf[0] = RNC_FORMAT_ID(RNC_CHANNELMAP_LEFTRIGHT, cmpr, 2,
+                                   RNC_SAMPLERATE_44100, 16,
+                                   RNC_SAMPLE_SIGNED, RNC_ENDIAN_LITTLE);
+        return 1;
+    }
+
+    if ((n = api->get_formats(buf, size)) < 0)
+        return -1;
+
+    for (i = 0; i < n && i < (int)size; i++)
+        buf[i] = RNC_FORMAT_SET_CMPR(buf[i], cmpr);
+
+    return n;
+
+ invalid:
+    errno = EINVAL;
+    return -1;
+}
+
+
 int rnc_encoder_read(rnc_encoder_t *enc, void *buf, size_t size)
 {
     if (enc->api == NULL)
@@ -239,3 +361,42 @@ int rnc_encoder_read(rnc_encoder_t *enc, void *buf, size_t size)
     errno = EINVAL;
     return -1;
 }
+
+
+ssize_t rnc_encoder_write_to_fd(rnc_encoder_t *enc, int fd)
+{
+    char    buf[64 * 1024];
+    ssize_t total, n;
+    int     r, w;
+
+    if (enc->api == NULL)
+        goto invalid;
+
+    if (enc->api->write_to_fd != NULL)
+        return enc->api->write_to_fd(enc, fd);
+
+    total = 0;
+    while ((r = rnc_encoder_read(enc, buf, sizeof(buf))) > 0) {
+        w = 0;
+        while (w < r) {
+            n = write(fd, buf + w, r - w);
+
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                else
+                    return -1;
+            }
+
+            w += n;
+        }
+
+        total += r;
+    }
+
+    return r < 0 ? -1 : total;
+
+ invalid:
+    errno = EINVAL;
+    return -1;
+}
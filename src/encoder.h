@@ -34,6 +34,14 @@
 
 MRP_CDECL_BEGIN
 
+/**
+ * @brief Flags for rnc_encoder_set_metadata.
+ */
+typedef enum {
+    RNC_META_ALBUM_GAIN = 0x1,           /* reserve album gain for patching */
+} rnc_meta_flag_t;
+
+
 /**
  * @brief RNC encoder backend API abstraction.
  */
@@ -44,6 +52,8 @@ struct rnc_enc_api_s {
     mrp_list_hook_t   hook;              /* to list of known backends */
     const char       *name;              /* backend name */
     const char      **types;             /* supported output types */
+    /* get supported input formats, in order of preference, optional */
+    int (*get_formats)(uint32_t *buf, size_t size);
     /* create a new encoder instance for the given format */
     int (*create)(rnc_encoder_t *enc, uint32_t format);
     /* open and initialize the given instance */
@@ -52,18 +62,26 @@ struct rnc_enc_api_s {
     void (*close)(rnc_encoder_t *enc);
     /* set compression/quality, if supported */
     int (*set_quality)(rnc_encoder_t *enc, uint16_t qlty, uint16_t cmpr);
+    /* set number of encoding threads, optional */
+    int (*set_threads)(rnc_encoder_t *enc, int nthread);
+    /* write encoded data directly to the given file, optional */
+    int (*set_output)(rnc_encoder_t *enc, const char *path);
     /* add/set metadata */
-    int (*set_metadata)(rnc_encoder_t *enc, rnc_meta_t *meta);
+    int (*set_metadata)(rnc_encoder_t *enc, rnc_meta_t *meta, int flags);
     /* set replaygain */
     int (*set_gain)(rnc_encoder_t *enc, double gain, double peak, double album);
     /* add new audio data to encode */
-    int (*write)(rnc_encoder_t *enc, void *buf, size_t size);
+    int (*write)(rnc_encoder_t *enc, const void *buf, size_t size);
     /* finish the encoding process */
     int (*finish)(rnc_encoder_t *enc);
+    /* patch album gain into an already written file, optional */
+    int (*patch_gain)(const char *path, double album);
     /* set data available callback */
     int (*set_data_cb)(rnc_encoder_t *enc, rnc_enc_data_cb_t cb);
     /* retrieve encoded data */
     int (*read)(rnc_encoder_t *enc, void *buf, size_t size);
+    /* write all encoded data to the given file, optional */
+    ssize_t (*write_to_fd)(rnc_encoder_t *enc, int fd);
 };
 
 
@@ -75,6 +93,7 @@ struct rnc_encoder_s {
     rnc_enc_api_t *api;                  /* encoder API */
     void          *data;                 /* encoder-specific data */
     int            open : 1;             /* opened for writing samples */
+    int            output : 1;           /* writing directly to a file */
 };
 
 
@@ -167,17 +186,53 @@ void rnc_encoder_destroy(rnc_encoder_t *enc);
 int rnc_encoder_set_quality(rnc_encoder_t *enc, uint16_t qlty, uint16_t cmpr);
 
 
+/**
+ * @brief Set the number of encoding threads.
+ *
+ * Let the encoder use up to the given number of threads for encoding a
+ * single stream. Encoders are free to produce the same output they would
+ * with a single thread, and the FLAC encoder does so. The number of
+ * threads must be set before calling rnc_encoder_write.
+ *
+ * @param [in] enc      encoder to set number of threads for
+ * @param [in] nthread  number of threads to use
+ *
+ * @return Returns 0 on success, -1 on error, for instance if the encoder
+ *         does not support multithreaded encoding (errno is ENOTSUP).
+ */
+int rnc_encoder_set_threads(rnc_encoder_t *enc, int nthread);
+
+
+/**
+ * @brief Write encoded data directly to the given file.
+ * Let the encoder write encoded data to the given file as it is produced,
+ * instead of collecting it in memory for rnc_encoder_read. This keeps the
+ * memory used by the encoder constant regardless of the length of the
+ * track. Any existing file is truncated. The output must be set before
+ * calling rnc_encoder_write.
+ * @param [in] enc   encoder to set output for
+ * @param [in] path  path of the file to write
+ * @return Returns 0 on success, -1 on error, for instance if the encoder
+ *         does not support writing to a file (errno is ENOTSUP).
+ */
+int rnc_encoder_set_output(rnc_encoder_t *enc, const char *path);
+
+
 /**
  * @brief Set metadata for the encoded track.
  *
- * Set metadata for the track being encoded.
+ * Set metadata for the track being encoded. With RNC_META_ALBUM_GAIN
+ * set in flags, room is reserved for the album gain, which is filled
+ * in later by rnc_encoder_patch_gain. Only ask for this if the output
+ * can be patched, otherwise the placeholder would end up in the file.
  *
- * @param [in] enc   encoder to set metadata for
- * @param [in] meta  metadata for the track
+ * @param [in] enc    encoder to set metadata for
+ * @param [in] meta   metadata for the track
+ * @param [in] flags  RNC_META_* flags
  *
  * @return Return 0 upon success, -1 otherwise.
  */
-int rnc_encoder_set_metadata(rnc_encoder_t *enc, rnc_meta_t *meta);
+int rnc_encoder_set_metadata(rnc_encoder_t *enc, rnc_meta_t *meta, int flags);
 
 /**
  * @brief Set replaygain for the encoded track.
@@ -206,15 +261,69 @@ int rnc_encoder_set_gain(rnc_encoder_t *enc, double gain, double peak,
  *
  * @return Returns 0 upon success, -1 otherwise.
  */
-int rnc_encoder_write(rnc_encoder_t *enc, void *buf, size_t size);
+int rnc_encoder_write(rnc_encoder_t *enc, const void *buf, size_t size);
 
 
 int rnc_encoder_finish(rnc_encoder_t *enc);
 
 
+/**
+ * @brief Patch album gain into an already encoded file.
+ * Once the album gain is known, that is after all tracks have been
+ * encoded, update the album gain reserved in the given encoded file.
+ * The gain is overwritten in place, the rest of the file, including
+ * the audio, is left untouched. Track gain is filled in by the encoder
+ * itself during rnc_encoder_finish.
+ * @param [in] rnc     RNC instance
+ * @param [in] format  format the file was encoded to
+ * @param [in] path    path to the encoded file
+ * @param [in] gain    album gain to set
+ * @return Returns 0 on success, -1 on error.
+ */
+int rnc_encoder_patch_gain(rnc_t *rnc, uint32_t format, const char *path,
+                           double gain);
+
+
 int rnc_encoder_read(rnc_encoder_t *enc, void *buf, size_t size);
 
 
+/**
+ * @brief Write all encoded data to the given file.
+ *
+ * Write the encoded data collected by the encoder to the given file
+ * descriptor. Backends which can hand out their data without copying
+ * it do so, for the rest the data is copied out with rnc_encoder_read.
+ *
+ * @param [in] enc  encoder to write data from
+ * @param [in] fd   file descriptor to write data to
+ *
+ * @return Returns the number of bytes written, or -1 on error.
+ */
+ssize_t rnc_encoder_write_to_fd(rnc_encoder_t *enc, int fd);
+
+
+/**
+ * @brief Get the input formats supported by an encoder.
+ *
+ * Get the sample formats the encoder for the given format can take
+ * as input, in order of preference. The first format is the one the
+ * encoder can consume with the least amount of work, typically without
+ * converting samples at all. Only the compression of the given format
+ * is used to pick the encoder, and all returned formats have the same
+ * compression.
+ *
+ * @param [in]  rnc     RNC instance
+ * @param [in]  format  format to get encoder input formats for
+ * @param [out] buf     buffer to write supported formats into
+ * @param [in]  size    number of format entries buf has space for
+ *
+ * @return Returns the number of formats supported by the encoder, which
+ *         can be larger than size, or -1 on error.
+ */
+int rnc_encoder_get_formats(rnc_t *rnc, uint32_t format, uint32_t *buf,
+                            size_t size);
+
+
 
 
 MRP_CDECL_END
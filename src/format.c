@@ -27,6 +27,18 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <errno.h>
+#include <string.h>
+#include <byteswap.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#    include <immintrin.h>
+#    define CONVERT_X86
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#    include <arm_neon.h>
+#    define CONVERT_NEON
+#endif
+
 #include <ripncode/ripncode.h>
 
 static char *builtins[] = { "PCM" };
@@ -125,3 +137,721 @@ const char *rnc_compress_name(rnc_t *rnc, int id)
 
     return NULL;
 }
+
+
+/*
+ * sample conversion
+ *
+ * Kernels convert nframe frames of interleaved 16-bit signed samples
+ * to one of a few destination sample types, optionally byte-swapping
+ * the source and optionally splitting the channels into planar buffers.
+ * The portable C kernels handle any number of channels; the SIMD ones
+ * exist for the common cases, stereo for planar output, and fall back
+ * to the C kernels for the tail that does not fill a full vector.
+ */
+
+#define SCALE_F32 (1.0f / 32768.0f)
+
+#define LOAD_NATIVE(_p)  (*(_p))
+#define LOAD_SWAPPED(_p) ((int16_t)bswap_16(*(_p)))
+#define STORE_S16(_v)    (_v)
+#define STORE_S32(_v)    ((int32_t)(_v))
+#define STORE_F32(_v)    ((_v) * SCALE_F32)
+
+#define SCALAR_KERNELS(_name, _load, _type, _store)                     \
+    static void _name(void *const *dst, const void *src, size_t n,      \
+                      int chnl)                                         \
+    {                                                                   \
+        const int16_t *s = src;                                         \
+        _type         *d = dst[0];                                      \
+        size_t         i;                                               \
+                                                                        \
+        for (i = 0; i < n * chnl; i++)                                  \
+            d[i] = _store(_load(s + i));                                \
+    }                                                                   \
+                                                                        \
+    static void _name##_planar(void *const *dst, const void *src,       \
+                               size_t n, int chnl)                      \
+    {                                                                   \
+        const int16_t *s = src;                                         \
+        size_t         i;                                               \
+        int            c;                                               \
+                                                                        \
+        for (i = 0; i < n; i++, s += chnl)                              \
+            for (c = 0; c < chnl; c++)                                  \
+                ((_type *)dst[c])[i] = _store(_load(s + c));            \
+    }
+
+SCALAR_KERNELS(c_s16_s16 , LOAD_NATIVE , int16_t, STORE_S16)
+SCALAR_KERNELS(c_s16x_s16, LOAD_SWAPPED, int16_t, STORE_S16)
+SCALAR_KERNELS(c_s16_s32 , LOAD_NATIVE , int32_t, STORE_S32)
+SCALAR_KERNELS(c_s16x_s32, LOAD_SWAPPED, int32_t, STORE_S32)
+SCALAR_KERNELS(c_s16_f32 , LOAD_NATIVE , float  , STORE_F32)
+SCALAR_KERNELS(c_s16x_f32, LOAD_SWAPPED, float  , STORE_F32)
+
+
+static void c_s16_copy(void *const *dst, const void *src, size_t n, int chnl)
+{
+    memcpy(dst[0], src, n * chnl * sizeof(int16_t));
+}
+
+
+/*
+ * Tail handling for SIMD kernels: convert whatever is left after the
+ * last full vector with the corresponding C kernel.
+ */
+#define CONVERT_TAIL(_kernel, _dst, _src, _done, _n, _chnl, _type) do { \
+        void *_d[2];                                                    \
+                                                                        \
+        if ((_done) < (_n)) {                                           \
+            _d[0] = (_type *)(_dst)[0] + (_done) * (_chnl);             \
+            _kernel(_d, (const int16_t *)(_src) + (_done) * (_chnl),    \
+                    (_n) - (_done), (_chnl));                           \
+        }                                                               \
+    } while (0)
+
+#define CONVERT_TAIL_PLANAR(_kernel, _dst, _src, _done, _n, _type) do { \
+        void *_d[2];                                                    \
+                                                                        \
+        if ((_done) < (_n)) {                                           \
+            _d[0] = (_type *)(_dst)[0] + (_done);                       \
+            _d[1] = (_type *)(_dst)[1] + (_done);                       \
+            _kernel(_d, (const int16_t *)(_src) + (_done) * 2,          \
+                    (_n) - (_done), 2);                                 \
+        }                                                               \
+    } while (0)
+
+
+#ifdef CONVERT_X86
+
+/*
+ * SSE2 kernels, 8 samples at a time
+ */
+
+#define SSE2 __attribute__((target("sse2")))
+
+static inline SSE2 __m128i sse2_swap16(__m128i v)
+{
+    return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+
+static inline SSE2 void sse2_widen(__m128i v, __m128i *lo, __m128i *hi)
+{
+    *lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+    *hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+}
+
+
+/* L0 R0 L1 R1, L2 R2 L3 R3 -> L0 L1 L2 L3, R0 R1 R2 R3 */
+static inline SSE2 void sse2_split(__m128i *lo, __m128i *hi)
+{
+    __m128i a = _mm_shuffle_epi32(*lo, _MM_SHUFFLE(3, 1, 2, 0));
+    __m128i b = _mm_shuffle_epi32(*hi, _MM_SHUFFLE(3, 1, 2, 0));
+
+    *lo = _mm_unpacklo_epi64(a, b);
+    *hi = _mm_unpackhi_epi64(a, b);
+}
+
+
+#define SSE2_KERNELS(_name, _swap, _cname)                              \
+    static SSE2 void _name##_s16(void *const *dst, const void *src,     \
+                                 size_t n, int chnl)                    \
+    {                                                                   \
+        const __m128i *s = src;                                         \
+        __m128i       *d = dst[0];                                      \
+        size_t         i, cnt = n * chnl / 8;                           \
+        __m128i        v;                                               \
+                                                                        \
+        for (i = 0; i < cnt; i++) {                                     \
+            v = _mm_loadu_si128(s + i);                                 \
+            if (_swap)                                                  \
+                v = sse2_swap16(v);                                     \
+            _mm_storeu_si128(d + i, v);                                 \
+        }                                                               \
+                                                                        \
+        CONVERT_TAIL(_cname##_s16, dst, src, cnt * 8 / chnl, n, chnl,   \
+                     int16_t);                                          \
+    }                                                                   \
+                                                                        \
+    static SSE2 void _name##_s32(void *const *dst, const void *src,     \
+                                 size_t n, int chnl)                    \
+    {                                                                   \
+        const __m128i *s = src;                                         \
+        __m128i       *d = dst[0];                                      \
+        size_t         i, cnt = n * chnl / 8;                           \
+        __m128i        v, lo, hi;                                       \
+                                                                        \
+        for (i = 0; i < cnt; i++) {                                     \
+            v = _mm_loadu_si128(s + i);                                 \
+            if (_swap)                                                  \
+                v = sse2_swap16(v);                                     \
+            sse2_widen(v, &lo, &hi);                                    \
+            _mm_storeu_si128(d + 2 * i    , lo);                        \
+            _mm_storeu_si128(d + 2 * i + 1, hi);                        \
+        }                                                               \
+                                                                        \
+        CONVERT_TAIL(_cname##_s32, dst, src, cnt * 8 / chnl, n, chnl,   \
+                     int32_t);                                          \
+    }                                                                   \
+                                                                        \
+    static SSE2 void _name##_f32(void *const *dst, const void *src,     \
+                                 size_t n, int chnl)                    \
+    {                                                                   \
+        const __m128i *s = src;                                         \
+        float         *d = dst[0];                                      \
+        size_t         i, cnt = n * chnl / 8;                           \
+        __m128i        v, lo, hi;                                       \
+        __m128         scale = _mm_set1_ps(SCALE_F32);                  \
+                                                                        \
+        for (i = 0; i < cnt; i++) {                                     \
+            v = _mm_loadu_si128(s + i);                                 \
+            if (_swap)                                                  \
+                v = sse2_swap16(v);                                     \
+            sse2_widen(v, &lo, &hi);                                    \
+            _mm_storeu_ps(d + 8 * i,                                    \
+                          _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));      \
+            _mm_storeu_ps(d + 8 * i + 4,                                \
+                          _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));      \
+        }                                                               \
+                                                                        \
+        CONVERT_TAIL(_cname##_f32, dst, src, cnt * 8 / chnl, n, chnl,   \
+                     float);                                            \
+    }                                                                   \
+                                                                        \
+    static SSE2 void _name##_s32_planar(void *const *dst,               \
+                                        const void *src,                \
+                                        size_t n, int chnl)             \
+    {                                                                   \
+        const __m128i *s = src;                                         \
+        int32_t       *l = dst[0], *r = dst[1];                         \
+        size_t         i, cnt = n / 4;                                  \
+        __m128i        v, lo, hi;                                       \
+                                                                        \
+        MRP_UNUSED(chnl);                                               \
+                                                                        \
+        for (i = 0; i < cnt; i++) {                                     \
+            v = _mm_loadu_si128(s + i);                                 \
+            if (_swap)                                                  \
+                v = sse2_swap16(v);                                     \
+            sse2_widen(v, &lo, &hi);                                    \
+            sse2_split(&lo, &hi);                                       \
+            _mm_storeu_si128((__m128i *)(l + 4 * i), lo);               \
+            _mm_storeu_si128((__m128i *)(r + 4 * i), hi);               \
+        }                                                               \
+                                                                        \
+        CONVERT_TAIL_PLANAR(_cname##_s32_planar, dst, src, cnt * 4, n,  \
+                            int32_t);                                   \
+    }                                                                   \
+                                                                        \
+    static SSE2 void _name##_f32_planar(void *const *dst,               \
+                                        const void *src,                \
+                                        size_t n, int chnl)             \
+    {                                                                   \
+        const __m128i *s = src;                                         \
+        float         *l = dst[0], *r = dst[1];                         \
+        size_t         i, cnt = n / 4;                                  \
+        __m128i        v, lo, hi;                                       \
+        __m128         scale = _mm_set1_ps(SCALE_F32);                  \
+                                                                        \
+        MRP_UNUSED(chnl);                                               \
+                                                                        \
+        for (i = 0; i < cnt; i++) {                                     \
+            v = _mm_loadu_si128(s + i);                                 \
+            if (_swap)                                                  \
+                v = sse2_swap16(v);                                     \
+            sse2_widen(v, &lo, &hi);                                    \
+            sse2_split(&lo, &hi);                                       \
+            _mm_storeu_ps(l + 4 * i,                                    \
+                          _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));      \
+            _mm_storeu_ps(r + 4 * i,                                    \
+                          _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));      \
+        }                                                               \
+                                                                        \
+        CONVERT_TAIL_PLANAR(_cname##_f32_planar, dst, src, cnt * 4, n,  \
+                            float);                                     \
+    }
+
+SSE2_KERNELS(sse2_s16 , 0, c_s16 )
+SSE2_KERNELS(sse2_s16x, 1, c_s16x)
+
+
+/*
+ * AVX2 kernels, 16 samples at a time
+ */
+
+#define AVX2 __attribute__((target("avx2")))
+
+static inline AVX2 __m256i avx2_swap16(__m256i v)
+{
+    return _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+}
+
+
+static inline AVX2 void avx2_widen(__m256i v, __m256i *lo, __m256i *hi)
+{
+    *lo = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(v));
+    *hi = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(v, 1));
+}
+
+
+/* L0 R0 .. L3 R3, L4 R4 .. L7 R7 -> L0 .. L7, R0 .. R7 */
+static inline AVX2 void avx2_split(__m256i *lo, __m256i *hi)
+{
+    __m256i idx = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    __m256i a   = _mm256_permutevar8x32_epi32(*lo, idx);
+    __m256i b   = _mm256_permutevar8x32_epi32(*hi, idx);
+
+    *lo = _mm256_permute2x128_si256(a, b, 0x20);
+    *hi = _mm256_permute2x128_si256(a, b, 0x31);
+}
+
+
+#define AVX2_KERNELS(_name, _swap, _cname)                              \
+    static AVX2 void _name##_s16(void *const *dst, const void *src,     \
+                                 size_t n, int chnl)                    \
+    {                                                                   \
+        const __m256i *s = src;                                         \
+        __m256i       *d = dst[0];                                      \
+        size_t         i, cnt = n * chnl / 16;                          \
+        __m256i        v;                                               \
+                                                                        \
+        for (i = 0; i < cnt; i++) {                                     \
+            v = _mm256_loadu_si256(s + i);                              \
+            if (_swap)                                                  \
+                v = avx2_swap16(v);                                     \
+            _mm256_storeu_si256(d + i, v);                              \
+        }                                                               \
+                                                                        \
+        CONVERT_TAIL(_cname##_s16, dst, src, cnt * 16 / chnl, n, chnl,  \
+                     int16_t);                                          \
+    }                                                                   \
+                                                                        \
+    static AVX2 void _name##_s32(void *const *dst, const void *src,     \
+                                 size_t n, int chnl)                    \
+    {                                                                   \
+        const __m256i *s = src;                                         \
+        __m256i       *d = dst[0];                                      \
+        size_t         i, cnt = n * chnl / 16;                          \
+        __m256i        v, lo, hi;                                       \
+                                                                        \
+        for (i = 0; i < cnt; i++) {                                     \
+            v = _mm256_loadu_si256(s + i);                              \
+            if (_swap)                                                  \
+                v = avx2_swap16(v);                                     \
+            avx2_widen(v, &lo, &hi);                                    \
+            _mm256_storeu_si256(d + 2 * i    , lo);                     \
+            _mm256_storeu_si256(d + 2 * i + 1, hi);                     \
+        }                                                               \
+                                                                        \
+        CONVERT_TAIL(_cname##_s32, dst, src, cnt * 16 / chnl, n, chnl,  \
+                     int32_t);                                          \
+    }                                                                   \
+                                                                        \
+    static AVX2 void _name##_f32(void *const *dst, const void *src,     \
+                                 size_t n, int chnl)                    \
+    {                                                                   \
+        const __m256i *s = src;                                         \
+        float         *d = dst[0];                                      \
+        size_t         i, cnt = n * chnl / 16;                          \
+        __m256i        v, lo, hi;                                       \
+        __m256         scale = _mm256_set1_ps(SCALE_F32);               \
+                                                                        \
+        for (i = 0; i < cnt; i++) {                                     \
+            v = _mm256_loadu_si256(s + i);                              \
+            if (_swap)                                                  \
+                v = avx2_swap16(v);                                     \
+            avx2_widen(v, &lo, &hi);                                    \
+            _mm256_storeu_ps(d + 16 * i,                                \
+                             _mm256_mul_ps(_mm256_cvtepi32_ps(lo),      \
+                                           scale));                     \
+            _mm256_storeu_ps(d + 16 * i + 8,                            \
+                             _mm256_mul_ps(_mm256_cvtepi32_ps(hi),      \
+                                           scale));                     \
+        }                                                               \
+                                                                        \
+        CONVERT_TAIL(_cname##_f32, dst, src, cnt * 16 / chnl, n, chnl,  \
+                     float);                                            \
+    }                                                                   \
+                                                                        \
+    static AVX2 void _name##_s32_planar(void *const *dst,               \
+                                        const void *src,                \
+                                        size_t n, int chnl)             \
+    {                                                                   \
+        const __m256i *s = src;                                         \
+        int32_t       *l = dst[0], *r = dst[1];                         \
+        size_t         i, cnt = n / 8;                                  \
+        __m256i        v, lo, hi;                                       \
+                                                                        \
+        MRP_UNUSED(chnl);                                               \
+                                                                        \
+        for (i = 0; i < cnt; i++) {                                     \
+            v = _mm256_loadu_si256(s + i);                              \
+            if (_swap)                                                  \
+                v = avx2_swap16(v);                                     \
+            avx2_widen(v, &lo, &hi);                                    \
+            avx2_split(&lo, &hi);                                       \
+            _mm256_storeu_si256((__m256i *)(l + 8 * i), lo);            \
+            _mm256_storeu_si256((__m256i *)(r + 8 * i), hi);            \
+        }                                                               \
+                                                                        \
+        CONVERT_TAIL_PLANAR(_cname##_s32_planar, dst, src, cnt * 8, n,  \
+                            int32_t);                                   \
+    }                                                                   \
+                                                                        \
+    static AVX2 void _name##_f32_planar(void *const *dst,               \
+                                        const void *src,                \
+                                        size_t n, int chnl)             \
+    {                                                                   \
+        const __m256i *s = src;                                         \
+        float         *l = dst[0], *r = dst[1];                         \
+        size_t         i, cnt = n / 8;                                  \
+        __m256i        v, lo, hi;                                       \
+        __m256         scale = _mm256_set1_ps(SCALE_F32);               \
+                                                                        \
+        MRP_UNUSED(chnl);                                               \
+                                                                        \
+        for (i = 0; i < cnt; i++) {                                     \
+            v = _mm256_loadu_si256(s + i);                              \
+            if (_swap)                                                  \
+                v = avx2_swap16(v);                                     \
+            avx2_widen(v, &lo, &hi);                                    \
+            avx2_split(&lo, &hi);                                       \
+            _mm256_storeu_ps(l + 8 * i,                                 \
+                             _mm256_mul_ps(_mm256_cvtepi32_ps(lo),      \
+                                           scale));                     \
+            _mm256_storeu_ps(r + 8 * i,                                 \
+                             _mm256_mul_ps(_mm256_cvtepi32_ps(hi),      \
+                                           scale));                     \
+        }                                                               \
+                                                                        \
+        CONVERT_TAIL_PLANAR(_cname##_f32_planar, dst, src, cnt * 8, n,  \
+                            float);                                     \
+    }
+
+AVX2_KERNELS(avx2_s16 , 0, c_s16 )
+AVX2_KERNELS(avx2_s16x, 1, c_s16x)
+
+#endif /* CONVERT_X86 */
+
+
+#ifdef CONVERT_NEON
+
+/*
+ * NEON kernels, 8 samples (or 8 stereo frames) at a time
+ */
+
+static inline int16x8_t neon_load(const int16_t *p, int swap)
+{
+    int16x8_t v = vld1q_s16(p);
+
+    return swap ? vreinterpretq_s16_u8(vrev16q_u8(vreinterpretq_u8_s16(v))) : v;
+}
+
+
+static inline int16x8x2_t neon_load2(const int16_t *p, int swap)
+{
+    int16x8x2_t v = vld2q_s16(p);
+
+    if (swap) {
+        v.val[0] = vreinterpretq_s16_u8(vrev16q_u8(vreinterpretq_u8_s16(v.val[0])));
+        v.val[1] = vreinterpretq_s16_u8(vrev16q_u8(vreinterpretq_u8_s16(v.val[1])));
+    }
+
+    return v;
+}
+
+
+#define NEON_KERNELS(_name, _swap, _cname)                              \
+    static void _name##_s16(void *const *dst, const void *src,          \
+                            size_t n, int chnl)                         \
+    {                                                                   \
+        const int16_t *s = src;                                         \
+        int16_t       *d = dst[0];                                      \
+        size_t         i, cnt = n * chnl / 8;                           \
+                                                                        \
+        for (i = 0; i < cnt; i++)                                       \
+            vst1q_s16(d + 8 * i, neon_load(s + 8 * i, _swap));          \
+                                                                        \
+        CONVERT_TAIL(_cname##_s16, dst, src, cnt * 8 / chnl, n, chnl,   \
+                     int16_t);                                          \
+    }                                                                   \
+                                                                        \
+    static void _name##_s32(void *const *dst, const void *src,          \
+                            size_t n, int chnl)                         \
+    {                                                                   \
+        const int16_t *s = src;                                         \
+        int32_t       *d = dst[0];                                      \
+        size_t         i, cnt = n * chnl / 8;                           \
+        int16x8_t      v;                                               \
+                                                                        \
+        for (i = 0; i < cnt; i++) {                                     \
+            v = neon_load(s + 8 * i, _swap);                            \
+            vst1q_s32(d + 8 * i    , vmovl_s16(vget_low_s16(v)));       \
+            vst1q_s32(d + 8 * i + 4, vmovl_high_s16(v));                \
+        }                                                               \
+                                                                        \
+        CONVERT_TAIL(_cname##_s32, dst, src, cnt * 8 / chnl, n, chnl,   \
+                     int32_t);                                          \
+    }                                                                   \
+                                                                        \
+    static void _name##_f32(void *const *dst, const void *src,          \
+                            size_t n, int chnl)                         \
+    {                                                                   \
+        const int16_t *s = src;                                         \
+        float         *d = dst[0];                                      \
+        size_t         i, cnt = n * chnl / 8;                           \
+        int16x8_t      v;                                               \
+                                                                        \
+        for (i = 0; i < cnt; i++) {                                     \
+            v = neon_load(s + 8 * i, _swap);                            \
+            vst1q_f32(d + 8 * i,                                        \
+                      vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(              \
+                                      vget_low_s16(v))), SCALE_F32));   \
+            vst1q_f32(d + 8 * i + 4,                                    \
+                      vmulq_n_f32(vcvtq_f32_s32(vmovl_high_s16(v)),     \
+                                  SCALE_F32));                          \
+        }                                                               \
+                                                                        \
+        CONVERT_TAIL(_cname##_f32, dst, src, cnt * 8 / chnl, n, chnl,   \
+                     float);                                            \
+    }                                                                   \
+                                                                        \
+    static void _name##_s32_planar(void *const *dst, const void *src,   \
+                                   size_t n, int chnl)                  \
+    {                                                                   \
+        const int16_t *s = src;                                         \
+        int32_t       *l = dst[0], *r = dst[1];                         \
+        size_t         i, cnt = n / 8;                                  \
+        int16x8x2_t    v;                                               \
+                                                                        \
+        MRP_UNUSED(chnl);                                               \
+                                                                        \
+        for (i = 0; i < cnt; i++) {                                     \
+            v = neon_load2(s + 16 * i, _swap);                          \
+            vst1q_s32(l + 8 * i    , vmovl_s16(vget_low_s16(v.val[0])));\
+            vst1q_s32(l + 8 * i + 4, vmovl_high_s16(v.val[0]));         \
+            vst1q_s32(r + 8 * i    , vmovl_s16(vget_low_s16(v.val[1])));\
+            vst1q_s32(r + 8 * i + 4, vmovl_high_s16(v.val[1]));         \
+        }                                                               \
+                                                                        \
+        CONVERT_TAIL_PLANAR(_cname##_s32_planar, dst, src, cnt * 8, n,  \
+                            int32_t);                                   \
+    }                                                                   \
+                                                                        \
+    static void _name##_f32_planar(void *const *dst, const void *src,   \
+                                   size_t n, int chnl)                  \
+    {                                                                   \
+        const int16_t *s = src;                                         \
+        float         *l = dst[0], *r = dst[1];                         \
+        size_t         i, cnt = n / 8;                                  \
+        int16x8x2_t    v;                                               \
+        int            c;                                               \
+        float         *d;                                               \
+                                                                        \
+        MRP_UNUSED(chnl);                                               \
+                                                                        \
+        for (i = 0; i < cnt; i++) {                                     \
+            v = neon_load2(s + 16 * i, _swap);                          \
+            for (c = 0; c < 2; c++) {                                   \
+                d = (c ? r : l) + 8 * i;                                \
+                vst1q_f32(d, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(       \
+                              vget_low_s16(v.val[c]))), SCALE_F32));    \
+                vst1q_f32(d + 4, vmulq_n_f32(vcvtq_f32_s32(             \
+                              vmovl_high_s16(v.val[c])), SCALE_F32));   \
+            }                                                           \
+        }                                                               \
+                                                                        \
+        CONVERT_TAIL_PLANAR(_cname##_f32_planar, dst, src, cnt * 8, n,  \
+                            float);                                     \
+    }
+
+NEON_KERNELS(neon_s16 , 0, c_s16 )
+NEON_KERNELS(neon_s16x, 1, c_s16x)
+
+#endif /* CONVERT_NEON */
+
+
+/*
+ * kernel table, best first for each conversion
+ */
+
+typedef enum {
+    ISA_C    = 0x1,
+    ISA_SSE2 = 0x2,
+    ISA_AVX2 = 0x4,
+    ISA_NEON = 0x8,
+} convert_isa_t;
+
+typedef enum {
+    TO_S16,                              /* 16-bit signed integer */
+    TO_S32,                              /* 32-bit signed integer */
+    TO_F32,                              /* 32-bit normalized float */
+} convert_to_t;
+
+typedef struct {
+    int               isa;               /* instruction set needed */
+    int               swap;              /* byte-swaps its input */
+    int               to;                /* destination sample type */
+    int               planar;            /* produces planar output */
+    int               chnl;              /* channels handled, 0 for any */
+    const char       *name;              /* kernel name */
+    rnc_convert_fn_t  fn;                /* kernel function */
+} convert_kernel_t;
+
+#define KERNEL(_isa, _swap, _to, _planar, _chnl, _fn) \
+    { ISA_##_isa, _swap, TO_##_to, _planar, _chnl, #_fn, _fn }
+
+static convert_kernel_t kernels[] = {
+#ifdef CONVERT_X86
+    KERNEL(AVX2, 0, S16, 0, 0, avx2_s16_s16        ),
+    KERNEL(AVX2, 1, S16, 0, 0, avx2_s16x_s16       ),
+    KERNEL(AVX2, 0, S32, 0, 0, avx2_s16_s32        ),
+    KERNEL(AVX2, 1, S32, 0, 0, avx2_s16x_s32       ),
+    KERNEL(AVX2, 0, F32, 0, 0, avx2_s16_f32        ),
+    KERNEL(AVX2, 1, F32, 0, 0, avx2_s16x_f32       ),
+    KERNEL(AVX2, 0, S32, 1, 2, avx2_s16_s32_planar ),
+    KERNEL(AVX2, 1, S32, 1, 2, avx2_s16x_s32_planar),
+    KERNEL(AVX2, 0, F32, 1, 2, avx2_s16_f32_planar ),
+    KERNEL(AVX2, 1, F32, 1, 2, avx2_s16x_f32_planar),
+    KERNEL(SSE2, 0, S16, 0, 0, sse2_s16_s16        ),
+    KERNEL(SSE2, 1, S16, 0, 0, sse2_s16x_s16       ),
+    KERNEL(SSE2, 0, S32, 0, 0, sse2_s16_s32        ),
+    KERNEL(SSE2, 1, S32, 0, 0, sse2_s16x_s32       ),
+    KERNEL(SSE2, 0, F32, 0, 0, sse2_s16_f32        ),
+    KERNEL(SSE2, 1, F32, 0, 0, sse2_s16x_f32       ),
+    KERNEL(SSE2, 0, S32, 1, 2, sse2_s16_s32_planar ),
+    KERNEL(SSE2, 1, S32, 1, 2, sse2_s16x_s32_planar),
+    KERNEL(SSE2, 0, F32, 1, 2, sse2_s16_f32_planar ),
+    KERNEL(SSE2, 1, F32, 1, 2, sse2_s16x_f32_planar),
+#endif
+#ifdef CONVERT_NEON
+    KERNEL(NEON, 0, S16, 0, 0, neon_s16_s16        ),
+    KERNEL(NEON, 1, S16, 0, 0, neon_s16x_s16       ),
+    KERNEL(NEON, 0, S32, 0, 0, neon_s16_s32        ),
+    KERNEL(NEON, 1, S32, 0, 0, neon_s16x_s32       ),
+    KERNEL(NEON, 0, F32, 0, 0, neon_s16_f32        ),
+    KERNEL(NEON, 1, F32, 0, 0, neon_s16x_f32       ),
+    KERNEL(NEON, 0, S32, 1, 2, neon_s16_s32_planar ),
+    KERNEL(NEON, 1, S32, 1, 2, neon_s16x_s32_planar),
+    KERNEL(NEON, 0, F32, 1, 2, neon_s16_f32_planar ),
+    KERNEL(NEON, 1, F32, 1, 2, neon_s16x_f32_planar),
+#endif
+    KERNEL(C   , 0, S16, 0, 0, c_s16_copy          ),
+    KERNEL(C   , 1, S16, 0, 0, c_s16x_s16          ),
+    KERNEL(C   , 0, S32, 0, 0, c_s16_s32           ),
+    KERNEL(C   , 1, S32, 0, 0, c_s16x_s32          ),
+    KERNEL(C   , 0, F32, 0, 0, c_s16_f32           ),
+    KERNEL(C   , 1, F32, 0, 0, c_s16x_f32          ),
+    KERNEL(C   , 0, S16, 1, 0, c_s16_s16_planar    ),
+    KERNEL(C   , 1, S16, 1, 0, c_s16x_s16_planar   ),
+    KERNEL(C   , 0, S32, 1, 0, c_s16_s32_planar    ),
+    KERNEL(C   , 1, S32, 1, 0, c_s16x_s32_planar   ),
+    KERNEL(C   , 0, F32, 1, 0, c_s16_f32_planar    ),
+    KERNEL(C   , 1, F32, 1, 0, c_s16x_f32_planar   ),
+};
+
+#undef KERNEL
+
+
+static int cpu_isa(void)
+{
+    static int cached = 0;
+    int        isa;
+
+    if ((isa = __atomic_load_n(&cached, __ATOMIC_RELAXED)) != 0)
+        return isa;
+
+    isa = ISA_C;
+
+#if defined(CONVERT_X86)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("sse2"))
+        isa |= ISA_SSE2;
+    if (__builtin_cpu_supports("avx2"))
+        isa |= ISA_AVX2;
+#elif defined(CONVERT_NEON)
+    isa |= ISA_NEON;
+#endif
+
+    __atomic_store_n(&cached, isa, __ATOMIC_RELAXED);
+
+    return isa;
+}
+
+
+int rnc_convert_init(rnc_convert_t *c, uint32_t src, uint32_t dst, int flags)
+{
+    convert_kernel_t *k;
+    int               chnl, swap, to, planar, isa;
+
+    mrp_clear(c);
+
+    chnl = RNC_FORMAT_CHNL(src);
+
+    if ((uint32_t)chnl != RNC_FORMAT_CHNL(dst))
+        goto invalid;
+
+    if (RNC_FORMAT_BITS(src) != 16 || RNC_FORMAT_SMPL(src) != RNC_SAMPLE_SIGNED)
+        goto unsupported;
+
+    switch (RNC_FORMAT_SMPL(dst)) {
+    case RNC_SAMPLE_SIGNED:
+        switch (RNC_FORMAT_BITS(dst)) {
+        case 16: to = TO_S16; break;
+        case 32: to = TO_S32; break;
+        default: goto unsupported;
+        }
+        break;
+    case RNC_SAMPLE_FLOATING:
+        if (RNC_FORMAT_BITS(dst) != 32)
+            goto unsupported;
+        to = TO_F32;
+        break;
+    default:
+        goto unsupported;
+    }
+
+    /* 16-bit output may have either byte order, wider output is native */
+    if (to == TO_S16)
+        swap = RNC_FORMAT_ENDN(src) != RNC_FORMAT_ENDN(dst);
+    else {
+        if (RNC_FORMAT_ENDN(dst) != RNC_ENDIAN_HOST)
+            goto unsupported;
+        swap = RNC_FORMAT_ENDN(src) != RNC_ENDIAN_HOST;
+    }
+
+    planar = (flags & RNC_CONVERT_PLANAR) ? 1 : 0;
+    isa    = cpu_isa();
+
+    if (flags & RNC_CONVERT_SCALAR)
+        isa = ISA_C;
+    if (flags & RNC_CONVERT_NOAVX2)
+        isa &= ~ISA_AVX2;
+
+    for (k = kernels; k < kernels + MRP_ARRAY_SIZE(kernels); k++) {
+        if (!(k->isa & isa) || k->swap != swap || k->to != to ||
+            k->planar != planar || (k->chnl && k->chnl != chnl))
+            continue;
+
+        c->src   = src;
+        c->dst   = dst;
+        c->chnl  = chnl;
+        c->flags = flags;
+        c->name  = k->name;
+        c->fn    = k->fn;
+
+        mrp_debug("conversion 0x%x -> 0x%x: %s", src, dst, c->name);
+
+        return 0;
+    }
+
+ unsupported:
+    errno = EOPNOTSUPP;
+    return -1;
+
+ invalid:
+    errno = EINVAL;
+    return -1;
+}
@@ -156,6 +156,11 @@ typedef enum {
 typedef enum {
     RNC_ENDIAN_LITTLE = 0,               /* Hiawatha */
     RNC_ENDIAN_BIG,                      /* Winnetou */
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    RNC_ENDIAN_HOST = RNC_ENDIAN_BIG,    /* native byte order */
+#else
+    RNC_ENDIAN_HOST = RNC_ENDIAN_LITTLE, /* native byte order */
+#endif
 } rnc_endian_t;
 
 
@@ -249,6 +254,23 @@ static inline int rnc_id_freq(int id) {
 #define RNC_FORMAT_SMPL(_id) ( __RNC_FORMAT_BITS(_id, SMPL)         )
 #define RNC_FORMAT_ENDN(_id) ( __RNC_FORMAT_BITS(_id, ENDN)         )
 
+/**
+ * @brief Replace the compression (encoding) of a format identifier.
+ */
+#define RNC_FORMAT_SET_CMPR(_id, _cmpr)                                  \
+    ((uint32_t)                                                          \
+     (((_id) & ~__RNC_MASK(__RNC_CMPR_BITS, __RNC_CMPR_OFFS)) |          \
+      ((_cmpr) << __RNC_CMPR_OFFS)))
+
+/**
+ * @brief Check whether two format identifiers have the same sample layout.
+ *
+ * Two formats have the same sample layout if they only differ in their
+ * compression, IOW if samples can be passed from one to the other as is.
+ */
+#define RNC_FORMAT_SAME_SAMPLES(_a, _b)                                  \
+    ((((_a) ^ (_b)) & ~__RNC_MASK(__RNC_CMPR_BITS, __RNC_CMPR_OFFS)) == 0)
+
 
 /**
  * @brief Initialize formats known to RNC.
@@ -297,4 +319,75 @@ int rnc_compress_id(rnc_t *rnc, const char *name);
 const char *rnc_compress_name(rnc_t *rnc, int id);
 
 
+/**
+ * @brief Sample format conversion.
+ *
+ * Convert audio samples from one (uncompressed) sample format to another.
+ * Only the sample layout of the format identifiers (channels, bits per
+ * sample, sample type and endianness) is taken into account, so the
+ * format of an encoder can be used as the destination format directly.
+ * The source must be 16-bit signed integer samples of either endianness.
+ * The destination can be 16-bit signed integers of either endianness,
+ * or 32-bit signed integers or floating point samples normalized to
+ * [-1.0, 1.0) in host byte order, either interleaved or planar.
+ *
+ * A conversion is resolved to a single kernel once, when it is set up,
+ * using the best instruction set supported by the CPU at runtime.
+ */
+
+typedef enum {
+    RNC_CONVERT_PLANAR = 0x1,            /* planar, one buffer per channel */
+    RNC_CONVERT_SCALAR = 0x2,            /* only use portable C kernels */
+    RNC_CONVERT_NOAVX2 = 0x4,            /* don't use AVX2 kernels */
+} rnc_convert_flag_t;
+
+typedef void (*rnc_convert_fn_t)(void *const *dst, const void *src,
+                                 size_t nframe, int nchnl);
+
+struct rnc_convert_s {
+    uint32_t          src;               /* source format */
+    uint32_t          dst;               /* destination format */
+    int               chnl;              /* number of channels */
+    int               flags;             /* conversion flags */
+    const char       *name;              /* kernel name */
+    rnc_convert_fn_t  fn;                /* conversion kernel */
+};
+
+
+/**
+ * @brief Set up a sample format conversion.
+ *
+ * Resolve a conversion from the given source to the given destination
+ * sample format to a conversion kernel.
+ *
+ * @param [in] c      conversion to set up
+ * @param [in] src    source format
+ * @param [in] dst    destination format
+ * @param [in] flags  conversion flags, a combination of rnc_convert_flag_t
+ *
+ * @return Returns 0 on success, -1 on error in which case errno is set,
+ *         to EOPNOTSUPP if the conversion is not supported.
+ */
+int rnc_convert_init(rnc_convert_t *c, uint32_t src, uint32_t dst, int flags);
+
+
+/**
+ * @brief Convert samples.
+ *
+ * Convert the given number of frames (samples per channel) of audio. For
+ * interleaved conversions dst[0] is the destination buffer, for planar
+ * ones dst[i] is the destination buffer for channel i.
+ *
+ * @param [in] c       conversion to use
+ * @param [in] dst     destination buffer(s)
+ * @param [in] src     samples to convert
+ * @param [in] nframe  number of frames to convert
+ */
+static inline void rnc_convert(rnc_convert_t *c, void *const *dst,
+                               const void *src, size_t nframe)
+{
+    c->fn(dst, src, nframe, c->chnl);
+}
+
+
 #endif /* __RIPNCODE_FORMAT_H__ */
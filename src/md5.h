@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2015, Krisztian Litkey, <kli@iki.fi>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __RIPNCODE_MD5_H__
+#define __RIPNCODE_MD5_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <ripncode/ripncode.h>
+
+MRP_CDECL_BEGIN
+
+/**
+ * @brief MD5 message digest context.
+ *
+ * A plain RFC 1321 MD5 implementation, used for calculating the audio
+ * checksums of streams which are not produced by a single encoder, for
+ * instance FLAC streams stitched together from separately encoded parts.
+ */
+typedef struct {
+    uint32_t state[4];                   /* digest state */
+    uint64_t size;                       /* amount of data digested */
+    uint8_t  block[64];                  /* partial input block */
+} rnc_md5_t;
+
+/**
+ * @brief Initialize an MD5 context.
+ *
+ * @param [in] md5  context to initialize
+ */
+void rnc_md5_init(rnc_md5_t *md5);
+
+/**
+ * @brief Add data to an MD5 digest.
+ *
+ * @param [in] md5   context to add data to
+ * @param [in] data  data to add
+ * @param [in] size  amount of data to add
+ */
+void rnc_md5_update(rnc_md5_t *md5, const void *data, size_t size);
+
+/**
+ * @brief Finalize an MD5 digest.
+ *
+ * Finalize the digest and return it. The context needs to be initialized
+ * again before it can be reused.
+ *
+ * @param [in]  md5     context to finalize
+ * @param [out] digest  buffer to return the digest in
+ */
+void rnc_md5_final(rnc_md5_t *md5, uint8_t digest[16]);
+
+MRP_CDECL_END
+
+#endif /* __RIPNCODE_MD5_H__ */
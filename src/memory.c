@@ -0,0 +1,422 @@
+/*
+ * Copyright (c) 2015, Krisztian Litkey, <kli@iki.fi>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include <ripncode/ripncode.h>
+
+#define CACHELINE_SIZE  64
+#define HUGE_PAGE_SIZE  (2 * 1024 * 1024)
+#define ARENA_BLOCK     (256 * 1024)
+
+#define ALIGN(_n, _a) (((_n) + (_a) - 1) & ~((size_t)(_a) - 1))
+
+
+/*
+ * an arena block, the memory handed out follows the header
+ */
+typedef struct arena_block_s arena_block_t;
+
+struct arena_block_s {
+    arena_block_t *next;                 /* next (older) block */
+    size_t         size;                 /* block size, header included */
+    size_t         used;                 /* amount in use, header included */
+};
+
+
+struct rnc_arena_s {
+    char            *name;               /* arena name */
+    size_t           block;              /* default block size */
+    int              flags;              /* RNC_MEM_* flags for blocks */
+    pthread_mutex_t  lock;               /* lock for allocation */
+    arena_block_t   *blocks;             /* allocated blocks, newest first */
+};
+
+
+/*
+ * a pool slab, the buffers follow the header
+ */
+typedef struct pool_slab_s pool_slab_t;
+
+struct pool_slab_s {
+    pool_slab_t *next;                   /* next slab */
+};
+
+
+struct rnc_pool_s {
+    char            *name;               /* pool name */
+    size_t           size;               /* buffer size */
+    int              count;              /* buffers per slab */
+    int              flags;              /* RNC_MEM_* flags for slabs */
+    pthread_mutex_t  lock;               /* lock for free list */
+    pool_slab_t     *slabs;              /* allocated slabs */
+    void            *free;               /* free buffers */
+    int              nused;              /* buffers in use */
+    int              peak;               /* high-water mark of nused */
+};
+
+
+/* statistics of page-backed allocations */
+static size_t mapped;
+static size_t peak;
+static size_t nmap;
+static size_t nhuge;
+
+
+static size_t map_size(size_t size, int flags)
+{
+    if (flags & (RNC_MEM_HUGETLB | RNC_MEM_THP))
+        return ALIGN(size, HUGE_PAGE_SIZE);
+    else
+        return ALIGN(size, sysconf(_SC_PAGESIZE));
+}
+
+
+static void account(ssize_t diff)
+{
+    size_t total, high;
+
+    total = __atomic_add_fetch(&mapped, diff, __ATOMIC_RELAXED);
+    high  = __atomic_load_n(&peak, __ATOMIC_RELAXED);
+
+    while (total > high)
+        if (__atomic_compare_exchange_n(&peak, &high, total, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+}
+
+
+void *rnc_mem_map(size_t size, int flags)
+{
+    void *ptr;
+    int   prot, mflags;
+
+    /*
+     * Huge page mappings are rounded up to a full huge page, whether we
+     * get any huge pages or not. This keeps the size we need to unmap
+     * the same regardless of what we ended up with.
+     */
+
+    size   = map_size(size, flags);
+    prot   = PROT_READ | PROT_WRITE;
+    mflags = MAP_PRIVATE | MAP_ANONYMOUS;
+    ptr    = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    if (flags & RNC_MEM_HUGETLB) {
+        ptr = mmap(NULL, size, prot, mflags | MAP_HUGETLB, -1, 0);
+
+        if (ptr != MAP_FAILED)
+            __atomic_add_fetch(&nhuge, 1, __ATOMIC_RELAXED);
+        else
+            mrp_debug("no huge pages for %zu bytes, using normal pages", size);
+    }
+#endif
+
+    if (ptr == MAP_FAILED) {
+        ptr = mmap(NULL, size, prot, mflags, -1, 0);
+
+        if (ptr == MAP_FAILED)
+            return NULL;
+
+#ifdef MADV_HUGEPAGE
+        if (flags & (RNC_MEM_HUGETLB | RNC_MEM_THP))
+            madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+    }
+
+    __atomic_add_fetch(&nmap, 1, __ATOMIC_RELAXED);
+    account((ssize_t)size);
+
+    return ptr;
+}
+
+
+void rnc_mem_unmap(void *ptr, size_t size, int flags)
+{
+    if (ptr == NULL)
+        return;
+
+    size = map_size(size, flags);
+
+    munmap(ptr, size);
+    account(-(ssize_t)size);
+}
+
+
+void rnc_mem_stats(rnc_mem_stats_t *st)
+{
+    struct rusage ru;
+
+    mrp_clear(st);
+
+    st->mapped = __atomic_load_n(&mapped, __ATOMIC_RELAXED);
+    st->peak   = __atomic_load_n(&peak, __ATOMIC_RELAXED);
+    st->nmap   = __atomic_load_n(&nmap, __ATOMIC_RELAXED);
+    st->nhuge  = __atomic_load_n(&nhuge, __ATOMIC_RELAXED);
+
+    if (getrusage(RUSAGE_SELF, &ru) == 0) {
+        st->minflt = ru.ru_minflt;
+        st->majflt = ru.ru_majflt;
+        st->maxrss = ru.ru_maxrss;
+    }
+}
+
+
+rnc_arena_t *rnc_arena_create(const char *name, size_t block, int flags)
+{
+    rnc_arena_t *a;
+
+    if ((a = mrp_allocz(sizeof(*a))) == NULL)
+        goto nomem;
+
+    if ((a->name = mrp_strdup(name)) == NULL)
+        goto nomem;
+
+    a->block = block ? block : ARENA_BLOCK;
+    a->flags = flags;
+
+    pthread_mutex_init(&a->lock, NULL);
+
+    return a;
+
+ nomem:
+    mrp_free(a);
+    return NULL;
+}
+
+
+void *rnc_arena_alloc(rnc_arena_t *a, size_t size)
+{
+    arena_block_t *b;
+    size_t         hdr, bsize;
+    void          *ptr;
+
+    hdr  = ALIGN(sizeof(*b), CACHELINE_SIZE);
+    size = ALIGN(size ? size : 1, CACHELINE_SIZE);
+
+    pthread_mutex_lock(&a->lock);
+
+    b = a->blocks;
+
+    if (b == NULL || b->size - b->used < size) {
+        bsize = hdr + size > a->block ? hdr + size : a->block;
+        b     = rnc_mem_map(bsize, a->flags);
+
+        if (b == NULL) {
+            pthread_mutex_unlock(&a->lock);
+            return NULL;
+        }
+
+        mrp_debug("arena '%s': new block of %zu bytes", a->name, bsize);
+
+        b->size = bsize;
+        b->used = hdr;
+
+        /* keep filling the current block if this one is for a big item */
+        if (a->blocks != NULL && bsize > a->block) {
+            b->next = a->blocks->next;
+            a->blocks->next = b;
+        }
+        else {
+            b->next   = a->blocks;
+            a->blocks = b;
+        }
+    }
+
+    ptr      = (char *)b + b->used;
+    b->used += size;
+
+    pthread_mutex_unlock(&a->lock);
+
+    return ptr;
+}
+
+
+void rnc_arena_reset(rnc_arena_t *a)
+{
+    arena_block_t *b, *next;
+
+    if (a == NULL)
+        return;
+
+    pthread_mutex_lock(&a->lock);
+
+    for (b = a->blocks; b != NULL; b = next) {
+        next = b->next;
+        rnc_mem_unmap(b, b->size, a->flags);
+    }
+
+    a->blocks = NULL;
+
+    pthread_mutex_unlock(&a->lock);
+}
+
+
+void rnc_arena_destroy(rnc_arena_t *a)
+{
+    if (a == NULL)
+        return;
+
+    rnc_arena_reset(a);
+    pthread_mutex_destroy(&a->lock);
+
+    mrp_free(a->name);
+    mrp_free(a);
+}
+
+
+rnc_pool_t *rnc_pool_create(const char *name, size_t size, int count,
+                            int flags)
+{
+    rnc_pool_t *p;
+
+    if (size == 0 || count <= 0)
+        goto invalid;
+
+    if ((p = mrp_allocz(sizeof(*p))) == NULL)
+        goto nomem;
+
+    if ((p->name = mrp_strdup(name)) == NULL)
+        goto nomem;
+
+    p->size  = ALIGN(size, CACHELINE_SIZE);
+    p->count = count;
+    p->flags = flags;
+
+    pthread_mutex_init(&p->lock, NULL);
+
+    return p;
+
+ invalid:
+    errno = EINVAL;
+    return NULL;
+
+ nomem:
+    mrp_free(p);
+    return NULL;
+}
+
+
+static int pool_grow(rnc_pool_t *p)
+{
+    pool_slab_t *s;
+    char        *buf;
+    size_t       hdr;
+    int          i;
+
+    hdr = ALIGN(sizeof(*s), CACHELINE_SIZE);
+    s   = rnc_mem_map(hdr + p->count * p->size, p->flags);
+
+    if (s == NULL)
+        return -1;
+
+    mrp_debug("pool '%s': new slab of %d x %zu bytes", p->name, p->count,
+              p->size);
+
+    s->next  = p->slabs;
+    p->slabs = s;
+
+    buf = (char *)s + hdr;
+
+    for (i = 0; i < p->count; i++, buf += p->size) {
+        *(void **)buf = p->free;
+        p->free = buf;
+    }
+
+    return 0;
+}
+
+
+void *rnc_pool_get(rnc_pool_t *p)
+{
+    void *ptr;
+
+    pthread_mutex_lock(&p->lock);
+
+    if (p->free == NULL && pool_grow(p) < 0) {
+        pthread_mutex_unlock(&p->lock);
+        return NULL;
+    }
+
+    ptr     = p->free;
+    p->free = *(void **)ptr;
+
+    if (++p->nused > p->peak)
+        p->peak = p->nused;
+
+    pthread_mutex_unlock(&p->lock);
+
+    return ptr;
+}
+
+
+void rnc_pool_put(rnc_pool_t *p, void *ptr)
+{
+    if (ptr == NULL)
+        return;
+
+    pthread_mutex_lock(&p->lock);
+
+    *(void **)ptr = p->free;
+    p->free = ptr;
+    p->nused--;
+
+    pthread_mutex_unlock(&p->lock);
+}
+
+
+void rnc_pool_destroy(rnc_pool_t *p)
+{
+    pool_slab_t *s, *next;
+    size_t       hdr;
+
+    if (p == NULL)
+        return;
+
+    mrp_debug("pool '%s': %d buffers at most in use", p->name, p->peak);
+
+    hdr = ALIGN(sizeof(*s), CACHELINE_SIZE);
+
+    for (s = p->slabs; s != NULL; s = next) {
+        next = s->next;
+        rnc_mem_unmap(s, hdr + p->count * p->size, p->flags);
+    }
+
+    pthread_mutex_destroy(&p->lock);
+
+    mrp_free(p->name);
+    mrp_free(p);
+}
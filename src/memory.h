@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2015, Krisztian Litkey, <kli@iki.fi>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __RIPNCODE_MEMORY_H__
+#define __RIPNCODE_MEMORY_H__
+
+#include <ripncode/ripncode.h>
+
+MRP_CDECL_BEGIN
+
+/**
+ * @brief Page-backed memory for large and bulk allocations.
+ *
+ * Big buffers (sectors, whole tracks) and allocations that live as long
+ * as a rip are taken directly from anonymous mappings instead of from
+ * malloc. Mappings can ask to be backed by huge pages, which cuts down
+ * on page faults and TLB misses for the big buffers. Arenas hand out
+ * memory which is only ever released in bulk. Pools recycle fixed-size
+ * buffers. All mappings are accounted for, so the memory high-water mark
+ * and page fault counts can be reported after a rip.
+ */
+
+/**
+ * @brief Flags for page-backed allocations.
+ */
+typedef enum {
+    RNC_MEM_HUGETLB = 0x1,               /* try explicit huge pages first */
+    RNC_MEM_THP     = 0x2,               /* ask for transparent huge pages */
+} rnc_mem_flag_t;
+
+/**
+ * @brief Memory allocation statistics.
+ */
+typedef struct {
+    size_t mapped;                       /* bytes currently mapped */
+    size_t peak;                         /* high-water mark of mapped */
+    size_t nmap;                         /* number of mappings made */
+    size_t nhuge;                        /* of which with explicit hugepages */
+    long   minflt;                       /* minor page faults */
+    long   majflt;                       /* major page faults */
+    long   maxrss;                       /* maximum resident set, in KB */
+} rnc_mem_stats_t;
+
+/**
+ * @brief Map zeroed memory.
+ *
+ * Map at least size bytes of zeroed anonymous memory. With RNC_MEM_HUGETLB
+ * explicit huge pages are tried first, falling back to normal pages if none
+ * are available. With RNC_MEM_THP the kernel is asked to back the memory
+ * with transparent huge pages.
+ *
+ * @param [in] size   amount of memory to map
+ * @param [in] flags  RNC_MEM_* flags
+ *
+ * @return Returns the mapped memory, or NULL upon failure.
+ */
+void *rnc_mem_map(size_t size, int flags);
+
+/**
+ * @brief Unmap memory.
+ *
+ * Unmap memory mapped by rnc_mem_map. The size and flags must be the same
+ * the memory was mapped with.
+ *
+ * @param [in] ptr    memory to unmap
+ * @param [in] size   size given to rnc_mem_map
+ * @param [in] flags  flags given to rnc_mem_map
+ */
+void rnc_mem_unmap(void *ptr, size_t size, int flags);
+
+/**
+ * @brief Get memory allocation statistics.
+ *
+ * Get statistics of page-backed allocations made so far, together with
+ * the page fault counts and maximum resident set size of the process.
+ *
+ * @param [out] st  statistics to fill in
+ */
+void rnc_mem_stats(rnc_mem_stats_t *st);
+
+/**
+ * @brief Create an arena.
+ *
+ * Create an arena which allocates memory in blocks of the given size.
+ * Memory from an arena is never freed individually, only all at once
+ * when the arena is reset or destroyed. Arenas are thread-safe.
+ *
+ * @param [in] name   arena name, for debugging
+ * @param [in] block  block size, or 0 for a default
+ * @param [in] flags  RNC_MEM_* flags to map blocks with
+ *
+ * @return Returns the new arena, or NULL upon failure.
+ */
+rnc_arena_t *rnc_arena_create(const char *name, size_t block, int flags);
+
+/**
+ * @brief Allocate zeroed memory from an arena.
+ *
+ * @param [in] a     arena to allocate from
+ * @param [in] size  amount of memory to allocate
+ *
+ * @return Returns cacheline-aligned zeroed memory, or NULL upon failure.
+ */
+void *rnc_arena_alloc(rnc_arena_t *a, size_t size);
+
+/**
+ * @brief Allocate a zeroed array of the given type from an arena.
+ */
+#define rnc_arena_alloc_array(_a, _type, _n) \
+    ((_type *)rnc_arena_alloc((_a), sizeof(_type) * (_n)))
+
+/**
+ * @brief Release all memory allocated from an arena.
+ *
+ * @param [in] a  arena to reset
+ */
+void rnc_arena_reset(rnc_arena_t *a);
+
+/**
+ * @brief Destroy an arena, releasing all memory allocated from it.
+ *
+ * @param [in] a  arena to destroy
+ */
+void rnc_arena_destroy(rnc_arena_t *a);
+
+/**
+ * @brief Create a pool of fixed-size buffers.
+ *
+ * Create a pool of buffers of the given size. Buffers are mapped count
+ * at a time, and returned buffers are recycled. Pools are thread-safe.
+ *
+ * @param [in] name   pool name, for debugging
+ * @param [in] size   buffer size
+ * @param [in] count  number of buffers to map at a time
+ * @param [in] flags  RNC_MEM_* flags to map buffers with
+ *
+ * @return Returns the new pool, or NULL upon failure.
+ */
+rnc_pool_t *rnc_pool_create(const char *name, size_t size, int count,
+                            int flags);
+
+/**
+ * @brief Get a buffer from a pool.
+ *
+ * Get a cacheline-aligned buffer from the pool. Recycled buffers are not
+ * cleared.
+ *
+ * @param [in] p  pool to get a buffer from
+ *
+ * @return Returns the buffer, or NULL upon failure.
+ */
+void *rnc_pool_get(rnc_pool_t *p);
+
+/**
+ * @brief Return a buffer to its pool.
+ *
+ * @param [in] p    pool the buffer was taken from
+ * @param [in] ptr  buffer to return
+ */
+void rnc_pool_put(rnc_pool_t *p, void *ptr);
+
+/**
+ * @brief Destroy a pool, releasing all of its buffers.
+ *
+ * @param [in] p  pool to destroy
+ */
+void rnc_pool_destroy(rnc_pool_t *p);
+
+MRP_CDECL_END
+
+#endif /* __RIPNCODE_MEMORY_H__ */
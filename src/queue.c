@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2015, Krisztian Litkey, <kli@iki.fi>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <ripncode/ripncode.h>
+
+
+struct rnc_queue_s {
+    pthread_mutex_t   lock;              /* queue lock */
+    pthread_cond_t    room;              /* signalled when room available */
+    pthread_cond_t    items;             /* signalled when items available */
+    void            **q;                 /* queued items */
+    int               size;              /* queue size */
+    int               head;              /* first queued item */
+    int               cnt;               /* number of queued items */
+    int               closed;            /* whether closed for pushing */
+    uint64_t          push_wait;         /* nsecs blocked in pushing */
+    uint64_t          pop_wait;          /* nsecs blocked in popping */
+};
+
+
+static inline uint64_t now_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+rnc_queue_t *rnc_queue_create(int size)
+{
+    rnc_queue_t *q;
+
+    if (size <= 0)
+        goto invalid;
+
+    if ((q = mrp_allocz(sizeof(*q))) == NULL)
+        goto nomem;
+
+    if ((q->q = mrp_allocz_array(void *, size)) == NULL)
+        goto nomem;
+
+    q->size = size;
+
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->room, NULL);
+    pthread_cond_init(&q->items, NULL);
+
+    return q;
+
+ invalid:
+    errno = EINVAL;
+    return NULL;
+
+ nomem:
+    mrp_free(q);
+    return NULL;
+}
+
+
+void rnc_queue_destroy(rnc_queue_t *q)
+{
+    if (q == NULL)
+        return;
+
+    pthread_cond_destroy(&q->items);
+    pthread_cond_destroy(&q->room);
+    pthread_mutex_destroy(&q->lock);
+
+    mrp_free(q->q);
+    mrp_free(q);
+}
+
+
+int rnc_queue_push(rnc_queue_t *q, void *item)
+{
+    uint64_t start;
+
+    pthread_mutex_lock(&q->lock);
+
+    if (q->cnt == q->size && !q->closed) {
+        start = now_nsec();
+
+        while (q->cnt == q->size && !q->closed)
+            pthread_cond_wait(&q->room, &q->lock);
+
+        q->push_wait += now_nsec() - start;
+    }
+
+    if (q->closed)
+        goto closed;
+
+    q->q[(q->head + q->cnt) % q->size] = item;
+    q->cnt++;
+
+    pthread_cond_signal(&q->items);
+    pthread_mutex_unlock(&q->lock);
+
+    return 0;
+
+ closed:
+    pthread_mutex_unlock(&q->lock);
+    errno = EPIPE;
+    return -1;
+}
+
+
+void *rnc_queue_pop(rnc_queue_t *q)
+{
+    uint64_t  start;
+    void     *item;
+
+    pthread_mutex_lock(&q->lock);
+
+    if (q->cnt == 0 && !q->closed) {
+        start = now_nsec();
+
+        while (q->cnt == 0 && !q->closed)
+            pthread_cond_wait(&q->items, &q->lock);
+
+        q->pop_wait += now_nsec() - start;
+    }
+
+    if (q->cnt == 0) {
+        pthread_mutex_unlock(&q->lock);
+        return NULL;
+    }
+
+    item    = q->q[q->head];
+    q->head = (q->head + 1) % q->size;
+    q->cnt--;
+
+    pthread_cond_signal(&q->room);
+    pthread_mutex_unlock(&q->lock);
+
+    return item;
+}
+
+
+void rnc_queue_close(rnc_queue_t *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->room);
+    pthread_cond_broadcast(&q->items);
+    pthread_mutex_unlock(&q->lock);
+}
+
+
+void rnc_queue_stalls(rnc_queue_t *q, double *push, double *pop)
+{
+    pthread_mutex_lock(&q->lock);
+
+    if (push != NULL)
+        *push = q->push_wait / 1000000000.0;
+    if (pop != NULL)
+        *pop = q->pop_wait / 1000000000.0;
+
+    pthread_mutex_unlock(&q->lock);
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2015, Krisztian Litkey, <kli@iki.fi>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __RIPNCODE_QUEUE_H__
+#define __RIPNCODE_QUEUE_H__
+
+#include <ripncode/ripncode.h>
+
+MRP_CDECL_BEGIN
+
+/**
+ * @brief A bounded, blocking multi-producer/multi-consumer queue.
+ *
+ * Queues are used to pass work items between the threads of a pipelined
+ * rip. Both pushing to a full and popping from an empty queue blocks the
+ * caller. The total time callers spent blocked is accounted separately for
+ * pushing and popping, so stalls of the stages around a queue can be told
+ * apart.
+ */
+
+/**
+ * @brief Create a queue.
+ *
+ * Create a new queue with room for at most size items.
+ *
+ * @param [in] size  maximum number of items in the queue
+ *
+ * @return Returns the newly created queue, or NULL upon failure.
+ */
+rnc_queue_t *rnc_queue_create(int size);
+
+/**
+ * @brief Destroy a queue.
+ *
+ * Destroy the given queue. Any items still in the queue are not freed.
+ *
+ * @param [in] q  queue to destroy
+ */
+void rnc_queue_destroy(rnc_queue_t *q);
+
+/**
+ * @brief Push an item to a queue.
+ *
+ * Append the given item to the queue, waiting for room if the queue
+ * is full.
+ *
+ * @param [in] q     queue to push to
+ * @param [in] item  item to push, must not be NULL
+ *
+ * @return Returns 0 upon success, -1 if the queue has been closed.
+ */
+int rnc_queue_push(rnc_queue_t *q, void *item);
+
+/**
+ * @brief Pop an item from a queue.
+ *
+ * Remove and return the first item from the queue, waiting for one to
+ * become available if the queue is empty.
+ *
+ * @param [in] q  queue to pop from
+ *
+ * @return Returns the popped item, or NULL if the queue has been closed
+ *         and there are no more items left in it.
+ */
+void *rnc_queue_pop(rnc_queue_t *q);
+
+/**
+ * @brief Close a queue.
+ *
+ * Close the given queue for pushing. Items already in the queue can still
+ * be popped. Once the queue is drained, rnc_queue_pop returns NULL.
+ *
+ * @param [in] q  queue to close
+ */
+void rnc_queue_close(rnc_queue_t *q);
+
+/**
+ * @brief Get the time spent blocked on a queue.
+ *
+ * Get the total time callers of rnc_queue_push and rnc_queue_pop have
+ * spent waiting for room and for items, respectively.
+ *
+ * @param [in]  q     queue to get stall times for
+ * @param [out] push  time spent blocked in pushing, in seconds, or NULL
+ * @param [out] pop   time spent blocked in popping, in seconds, or NULL
+ */
+void rnc_queue_stalls(rnc_queue_t *q, double *push, double *pop);
+
+MRP_CDECL_END
+
+#endif /* __RIPNCODE_QUEUE_H__ */
@@ -28,156 +28,1897 @@
  */
 
 #include <errno.h>
-#include <byteswap.h>
+#include <string.h>
+#include <stdio.h>
+#include <limits.h>
+#include <unistd.h>
+#include <math.h>
+#include <float.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <ebur128.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#    include <immintrin.h>
+#    define GAIN_X86
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#    include <arm_neon.h>
+#    define GAIN_NEON
+#endif
+
 #include <ripncode/ripncode.h>
 
-#define REPLAYGAIN_REFERENCE (-18.0)
+#define REPLAYGAIN_REFERENCE (-18.0)
+#define SWAP_FRAMES          1024
+#define ANALYZER_QUEUE       32          /* chunks queued for analysis */
+#define STATE_MAGIC          "RNC-GAIN"  /* saved state file magic */
+#define STATE_VERSION        2           /* saved state file version */
+#define STATE_LABEL_MAX      4096        /* max. saved track label length */
+
+#define R128_GATE_BLOCK      4           /* 100 ms blocks per gating block */
+#define R128_SHORT_BLOCK     30          /* 100 ms blocks per 3 s block */
+#define R128_SHORT_HOP       10          /* 100 ms blocks between those */
+#define R128_ABSOLUTE_GATE   (-70.0)     /* absolute gate, LUFS */
+#define R128_RELATIVE_GATE   (-10.0)     /* relative gate, LU */
+#define R128_RANGE_GATE      (-20.0)     /* relative gate for range, LU */
+#define R128_BIN_WIDTH       0.01        /* histogram resolution, LU */
+#define R128_BINS            8000        /* histogram bins, -70 - +10 LUFS */
+#define R128_SEGMENT         600         /* min. 100 ms blocks per segment */
+#define R128_TP_TAPS         49          /* true-peak interpolator taps */
+#define R128_TP_PHASE        24          /* max. taps per interpolated phase */
+#define R128_TP_CHUNK        256         /* frames interpolated at a time */
+
+
+/*
+ * a histogram of block loudness
+ *
+ * Blocks are counted in 0.01 LU wide bins starting at the absolute gate.
+ * Next to the count, the total energy of the blocks is kept for each bin,
+ * so gated averages are exact and only the handful of blocks falling into
+ * the same bin as a relative gate are ever misjudged.
+ */
+typedef struct {
+    uint32_t count[R128_BINS];           /* number of blocks */
+    double   energy[R128_BINS];          /* total energy of blocks */
+} r128_hist_t;
+
+
+/*
+ * K-weighting filter state
+ */
+typedef struct {
+    double z[4][2];                      /* filter state, [delay][channel] */
+    double peak[2];                      /* sample peaks */
+    double energy[2];                    /* energy of current 100 ms block */
+} r128_filter_t;
+
+
+/*
+ * true-peak interpolator state
+ */
+typedef struct {
+    float  x[R128_TP_PHASE - 1][2];      /* latest frames, oldest first */
+    double peak[2];                      /* interpolated peaks */
+} r128_tp_t;
+
+
+/*
+ * true-peak interpolator coefficients
+ *
+ * Phase 0 of the oversampled signal is the original samples, so only the
+ * other phases are ever interpolated. Each coefficient is stored for four
+ * lanes, ready to be loaded into a vector as is.
+ */
+typedef struct {
+    int    factor;                       /* oversampling factor */
+    int    ntap;                         /* taps per phase */
+    double gain;                         /* max. gain of any phase */
+    float  c[3][R128_TP_PHASE][4];       /* coefficients of phases 1 - 3 */
+} r128_interp_t;
+
+
+/*
+ * native loudness analysis state of a single track
+ */
+typedef struct {
+    r128_filter_t f;                     /* K-weighting filter */
+    r128_tp_t     tp;                    /* true-peak interpolator */
+    size_t        nframe;                /* frames in current 100 ms block */
+    size_t        nblock;                /* number of 100 ms blocks so far */
+    double        block[R128_SHORT_BLOCK]; /* latest 100 ms block energies */
+    r128_hist_t   gate;                  /* gating (400 ms) block loudness */
+    r128_hist_t   range;                 /* short-term (3 s) block loudness */
+} r128_t;
+
+
+/*
+ * K-weighting kernel, filters n frames, adding their energy to f
+ *
+ * Energy is summed per channel, sample after sample, so the energy of
+ * a block is the same however its frames are split between calls.
+ */
+typedef void (*r128_kernel_t)(r128_filter_t *f, const double *k,
+                              const int16_t *src, size_t n);
+
+
+/*
+ * true-peak kernel, interpolates n frames, updating the peaks in t
+ */
+typedef void (*r128_tp_kernel_t)(r128_tp_t *t, const r128_interp_t *ip,
+                                 const int16_t *src, size_t n);
+
+
+/*
+ * a loudness analysis engine
+ */
+typedef struct {
+    const char *name;
+    void   *(*create)(rnc_gain_t *g);
+    void    (*destroy)(void *state);
+    int     (*add)(rnc_gain_t *g, void *state, const int16_t *src, size_t n);
+    int     (*add_segments)(rnc_gain_t *g, void *state, const int16_t *src,
+                            size_t n, int nthread);
+    double  (*loudness)(void **states, int nstate);
+    double  (*range)(void *state);
+    double  (*peak)(void *state);
+    double  (*true_peak)(void *state);
+    int     (*save)(void *state, rnc_buf_t *b);
+    int     (*load)(void *state, rnc_buf_t *b, uint32_t version);
+} gain_engine_t;
+
+
+struct rnc_gain_s {
+    int             ntrack;              /* number of tracks on album */
+    gain_engine_t  *engine;              /* analysis engine */
+    void          **state;               /* per-track analysis state */
+    char          **label;               /* per-track labels, if any */
+    int             chnl;                /* number of channels */
+    int             rate;                /* rate */
+    int             mode;                /* libebur128 analysis mode */
+    int             bits;                /* bits per sample */
+    int             smpl;                /* sample type */
+    int             swap;                /* whether to swap endianness */
+    rnc_convert_t   cvt;                 /* conversion to host endianness */
+    double          k[10];               /* K-weighting filter coefficients */
+    size_t          block;               /* frames per 100 ms block */
+    r128_kernel_t   kernel;              /* K-weighting kernel */
+    r128_interp_t   interp;              /* true-peak interpolator */
+    r128_tp_kernel_t tp_kernel;         /* true-peak kernel, if enabled */
+    rnc_queue_t    *jobs;                /* chunks to analyze, if async */
+    pthread_t       analyzer;            /* analyzer thread, if async */
+    pthread_mutex_t lock;                /* lock for pending and failed */
+    pthread_cond_t  drained;             /* signalled when a track drains */
+    int            *pending;             /* chunks queued per track */
+    int            *failed;              /* errno of failed analysis */
+};
+
+
+/*
+ * a chunk queued for asynchronous analysis
+ */
+typedef struct {
+    int          track;                  /* track to analyze chunk for */
+    rnc_slice_t *samples;                /* samples to analyze */
+} gain_job_t;
+
+
+static int gain_wait(rnc_gain_t *g, int track);
+static void gain_stop(rnc_gain_t *g);
+
+
+/*
+ * libebur128 engine
+ */
+
+static void *ebur_create(rnc_gain_t *g)
+{
+    ebur128_state *ebur;
+
+    ebur = ebur128_init(g->chnl, rnc_id_freq(g->rate), g->mode);
+
+    if (ebur == NULL)
+        return NULL;
+
+    ebur128_set_channel(ebur, 0, EBUR128_LEFT);
+    ebur128_set_channel(ebur, 1, EBUR128_RIGHT);
+
+    return ebur;
+}
+
+
+static void ebur_destroy(void *state)
+{
+    ebur128_state *ebur = state;
+
+    ebur128_destroy(&ebur);
+}
+
+
+static int ebur_add(rnc_gain_t *g, void *state, const int16_t *src, size_t n)
+{
+    MRP_UNUSED(g);
+
+    if (ebur128_add_frames_short(state, src, n) != EBUR128_SUCCESS)
+        return -1;
+
+    return 0;
+}
+
+
+static double ebur_loudness(void **states, int nstate)
+{
+    double loudness;
+
+    ebur128_loudness_global_multiple((ebur128_state **)states, nstate,
+                                     &loudness);
+
+    return loudness;
+}
+
+
+static double ebur_range(void *state)
+{
+    double range;
+
+    ebur128_loudness_range(state, &range);
+
+    return range;
+}
+
+
+static double ebur_peak(void *state)
+{
+    double l, r;
+
+    ebur128_sample_peak(state, 0, &l);
+    ebur128_sample_peak(state, 1, &r);
+
+    return l > r ? l : r;
+}
+
+
+static double ebur_true_peak(void *state)
+{
+    double l, r;
+
+    if (ebur128_true_peak(state, 0, &l) != EBUR128_SUCCESS ||
+        ebur128_true_peak(state, 1, &r) != EBUR128_SUCCESS)
+        return ebur_peak(state);
+
+    return l > r ? l : r;
+}
+
+
+static gain_engine_t ebur_engine = {
+    .name      = "libebur128",
+    .create    = ebur_create,
+    .destroy   = ebur_destroy,
+    .add       = ebur_add,
+    .loudness  = ebur_loudness,
+    .range     = ebur_range,
+    .peak      = ebur_peak,
+    .true_peak = ebur_true_peak,
+};
+
+
+/*
+ * native engine
+ *
+ * Audio is run through the two stages of the BS.1770 K-weighting filter,
+ * a high shelf and a high-pass, both channels at a time with SIMD where
+ * available. The energy of the filtered audio is collected in 100 ms
+ * blocks. Every 100 ms, the loudness of the latest 400 ms gating block
+ * is added to one histogram, and every second, once there is enough of
+ * it, the loudness of the latest 3 s short-term block to another. The
+ * integrated loudness and the loudness range are calculated from those
+ * histograms as libebur128 calculates them from its full list of blocks,
+ * so memory use stays the same however long a track is.
+ */
+
+static void r128_coefficients(rnc_gain_t *g)
+{
+    double rate = rnc_id_freq(g->rate);
+    double f0, G, Q, K, Vh, Vb, a0;
+
+    /* high shelf, modelling the acoustic effect of the head */
+    f0 = 1681.974450955533;
+    G  = 3.999843853973347;
+    Q  = 0.7071752369554196;
+    K  = tan(M_PI * f0 / rate);
+    Vh = pow(10.0, G / 20.0);
+    Vb = pow(Vh, 0.4996667741545416);
+    a0 = 1.0 + K / Q + K * K;
+
+    g->k[0] = (Vh + Vb * K / Q + K * K) / a0;
+    g->k[1] = 2.0 * (K * K - Vh) / a0;
+    g->k[2] = (Vh - Vb * K / Q + K * K) / a0;
+    g->k[3] = 2.0 * (K * K - 1.0) / a0;
+    g->k[4] = (1.0 - K / Q + K * K) / a0;
+
+    /* revised low-frequency B-weighting high-pass */
+    f0 = 38.13547087602444;
+    Q  = 0.5003270373238773;
+    K  = tan(M_PI * f0 / rate);
+    a0 = 1.0 + K / Q + K * K;
+
+    g->k[5] = 1.0;
+    g->k[6] = -2.0;
+    g->k[7] = 1.0;
+    g->k[8] = 2.0 * (K * K - 1.0) / a0;
+    g->k[9] = (1.0 - K / Q + K * K) / a0;
+
+    g->block = ((size_t)rate + 5) / 10;
+}
+
+
+static void c_kernel(r128_filter_t *f, const double *k, const int16_t *src,
+                     size_t n)
+{
+    double x, y, e;
+    size_t i;
+    int    c, d;
+
+    for (c = 0; c < 2; c++) {
+        e = f->energy[c];
+
+        for (i = 0; i < n; i++) {
+            x = src[2 * i + c] / 32768.0;
+
+            if (fabs(x) > f->peak[c])
+                f->peak[c] = fabs(x);
+
+            /* transposed direct form II, one stage after the other */
+            y          = k[0] * x + f->z[0][c];
+            f->z[0][c] = k[1] * x - k[3] * y + f->z[1][c];
+            f->z[1][c] = k[2] * x - k[4] * y;
+
+            x          = y;
+            y          = k[5] * x + f->z[2][c];
+            f->z[2][c] = k[6] * x - k[8] * y + f->z[3][c];
+            f->z[3][c] = k[7] * x - k[9] * y;
+
+            e += y * y;
+        }
+
+        f->energy[c] = e;
+
+        /* don't let the filters decay into denormals */
+        for (d = 0; d < 4; d++)
+            if (fabs(f->z[d][c]) < DBL_MIN)
+                f->z[d][c] = 0.0;
+    }
+}
+
+
+#ifdef GAIN_X86
+
+#define SSE2 __attribute__((target("sse2")))
+
+/* both channels at once, left in the low and right in the high lane */
+static SSE2 void sse2_kernel(r128_filter_t *f, const double *k,
+                             const int16_t *src, size_t n)
+{
+    __m128d  b0 = _mm_set1_pd(k[0]), b1 = _mm_set1_pd(k[1]);
+    __m128d  b2 = _mm_set1_pd(k[2]), a1 = _mm_set1_pd(k[3]);
+    __m128d  a2 = _mm_set1_pd(k[4]), c0 = _mm_set1_pd(k[5]);
+    __m128d  c1 = _mm_set1_pd(k[6]), c2 = _mm_set1_pd(k[7]);
+    __m128d  d1 = _mm_set1_pd(k[8]), d2 = _mm_set1_pd(k[9]);
+    __m128d  scale = _mm_set1_pd(1.0 / 32768.0), sign = _mm_set1_pd(-0.0);
+    __m128d  z0, z1, z2, z3, pk, e, x, y;
+    __m128i  s;
+    int32_t  lr;
+    unsigned csr;
+    size_t   i;
+
+    /* flush denormals to zero instead of crawling through them */
+    csr = _mm_getcsr();
+    _mm_setcsr(csr | 0x8040);
+
+    z0 = _mm_loadu_pd(f->z[0]);
+    z1 = _mm_loadu_pd(f->z[1]);
+    z2 = _mm_loadu_pd(f->z[2]);
+    z3 = _mm_loadu_pd(f->z[3]);
+    pk = _mm_loadu_pd(f->peak);
+    e  = _mm_loadu_pd(f->energy);
+
+    for (i = 0; i < n; i++) {
+        memcpy(&lr, src + 2 * i, sizeof(lr));
+        s = _mm_cvtsi32_si128(lr);
+        s = _mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16);
+        x = _mm_mul_pd(_mm_cvtepi32_pd(s), scale);
+
+        pk = _mm_max_pd(pk, _mm_andnot_pd(sign, x));
+
+        y  = _mm_add_pd(_mm_mul_pd(b0, x), z0);
+        z0 = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(b1, x), _mm_mul_pd(a1, y)), z1);
+        z1 = _mm_sub_pd(_mm_mul_pd(b2, x), _mm_mul_pd(a2, y));
+
+        x  = y;
+        y  = _mm_add_pd(_mm_mul_pd(c0, x), z2);
+        z2 = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(c1, x), _mm_mul_pd(d1, y)), z3);
+        z3 = _mm_sub_pd(_mm_mul_pd(c2, x), _mm_mul_pd(d2, y));
+
+        e = _mm_add_pd(e, _mm_mul_pd(y, y));
+    }
+
+    _mm_storeu_pd(f->z[0], z0);
+    _mm_storeu_pd(f->z[1], z1);
+    _mm_storeu_pd(f->z[2], z2);
+    _mm_storeu_pd(f->z[3], z3);
+    _mm_storeu_pd(f->peak, pk);
+    _mm_storeu_pd(f->energy, e);
+
+    _mm_setcsr(csr);
+}
+
+#endif /* GAIN_X86 */
+
+
+#ifdef GAIN_NEON
+
+/* both channels at once, left in lane 0 and right in lane 1 */
+static void neon_kernel(r128_filter_t *f, const double *k,
+                        const int16_t *src, size_t n)
+{
+    float64x2_t b0 = vdupq_n_f64(k[0]), b1 = vdupq_n_f64(k[1]);
+    float64x2_t b2 = vdupq_n_f64(k[2]), a1 = vdupq_n_f64(k[3]);
+    float64x2_t a2 = vdupq_n_f64(k[4]), c0 = vdupq_n_f64(k[5]);
+    float64x2_t c1 = vdupq_n_f64(k[6]), c2 = vdupq_n_f64(k[7]);
+    float64x2_t d1 = vdupq_n_f64(k[8]), d2 = vdupq_n_f64(k[9]);
+    float64x2_t scale = vdupq_n_f64(1.0 / 32768.0);
+    float64x2_t z0, z1, z2, z3, pk, e, x, y;
+    int16x4_t   s;
+    size_t      i;
+    int         d, c;
+
+    z0 = vld1q_f64(f->z[0]);
+    z1 = vld1q_f64(f->z[1]);
+    z2 = vld1q_f64(f->z[2]);
+    z3 = vld1q_f64(f->z[3]);
+    pk = vld1q_f64(f->peak);
+    e  = vld1q_f64(f->energy);
+
+    for (i = 0; i < n; i++) {
+        s = vreinterpret_s16_s32(vld1_dup_s32((const int32_t *)(src + 2 * i)));
+        x = vcvtq_f64_s64(vmovl_s32(vget_low_s32(vmovl_s16(s))));
+        x = vmulq_f64(x, scale);
+
+        pk = vmaxq_f64(pk, vabsq_f64(x));
+
+        y  = vaddq_f64(vmulq_f64(b0, x), z0);
+        z0 = vaddq_f64(vsubq_f64(vmulq_f64(b1, x), vmulq_f64(a1, y)), z1);
+        z1 = vsubq_f64(vmulq_f64(b2, x), vmulq_f64(a2, y));
+
+        x  = y;
+        y  = vaddq_f64(vmulq_f64(c0, x), z2);
+        z2 = vaddq_f64(vsubq_f64(vmulq_f64(c1, x), vmulq_f64(d1, y)), z3);
+        z3 = vsubq_f64(vmulq_f64(c2, x), vmulq_f64(d2, y));
+
+        e = vaddq_f64(e, vmulq_f64(y, y));
+    }
+
+    vst1q_f64(f->z[0], z0);
+    vst1q_f64(f->z[1], z1);
+    vst1q_f64(f->z[2], z2);
+    vst1q_f64(f->z[3], z3);
+    vst1q_f64(f->peak, pk);
+    vst1q_f64(f->energy, e);
+
+    for (d = 0; d < 4; d++)
+        for (c = 0; c < 2; c++)
+            if (fabs(f->z[d][c]) < DBL_MIN)
+                f->z[d][c] = 0.0;
+}
+
+#endif /* GAIN_NEON */
+
+
+static r128_kernel_t r128_kernel(int flags)
+{
+    if (flags & RNC_GAIN_SCALAR)
+        return c_kernel;
+
+#if defined(GAIN_X86)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("sse2"))
+        return sse2_kernel;
+#elif defined(GAIN_NEON)
+    return neon_kernel;
+#endif
+
+    return c_kernel;
+}
+
+
+/*
+ * true peaks
+ *
+ * The true peak is measured as BS.1770 Annex 2 suggests and libebur128
+ * does it: audio is oversampled 4x below 96 kHz and 2x below 192 kHz
+ * with a 49-tap Hann-windowed sinc interpolator and the largest absolute
+ * value of the result taken. The interpolator is run as a polyphase
+ * filter, only for the phases falling between the original samples, in
+ * single precision like libebur128, and with SIMD where available, two
+ * frames at a time.
+ * Audio is interpolated in chunks, and chunks which are too quiet for
+ * any interpolated value to exceed the peak found so far are skipped.
+ */
+
+static void r128_interpolator(rnc_gain_t *g)
+{
+    r128_interp_t *ip   = &g->interp;
+    double         rate = rnc_id_freq(g->rate);
+    double         m, c, sum[3];
+    int            j, p, t, l;
+
+    ip->factor = rate < 96000 ? 4 : (rate < 192000 ? 2 : 1);
+    ip->ntap   = (R128_TP_TAPS - 1) / ip->factor;
+    sum[0] = sum[1] = sum[2] = 0.0;
+
+    for (j = 0; j < R128_TP_TAPS; j++) {
+        if ((p = j % ip->factor) == 0)
+            continue;
+
+        t = j / ip->factor;
+        m = j - (R128_TP_TAPS - 1) / 2.0;
+        c = sin(m * M_PI / ip->factor) / (m * M_PI / ip->factor);
+        c *= 0.5 * (1.0 - cos(2.0 * M_PI * j / (R128_TP_TAPS - 1)));
+
+        for (l = 0; l < 4; l++)
+            ip->c[p - 1][t][l] = c;
+
+        sum[p - 1] += fabs(c);
+    }
+
+    /* with plenty of room for rounding errors in single precision */
+    for (p = 0; p < 3; p++)
+        if (sum[p] > ip->gain)
+            ip->gain = sum[p];
+
+    ip->gain *= 1.0 + 1e-5;
+}
+
+
+static void c_tp_kernel(r128_tp_t *t, const r128_interp_t *ip,
+                        const int16_t *src, size_t n)
+{
+    float  x[R128_TP_PHASE - 1 + R128_TP_CHUNK][2], max[2], y;
+    size_t h, m, i;
+    int    c, p, j;
+
+    h = ip->ntap - 1;
+    memcpy(x, t->x, h * sizeof(x[0]));
+
+    for (; n > 0; src += 2 * m, n -= m) {
+        m = n < R128_TP_CHUNK ? n : R128_TP_CHUNK;
+
+        for (i = 0; i < m; i++) {
+            x[h + i][0] = src[2 * i]     / 32768.0f;
+            x[h + i][1] = src[2 * i + 1] / 32768.0f;
+        }
+
+        for (c = 0; c < 2; c++) {
+            for (i = 0, max[c] = 0.0f; i < h + m; i++)
+                if (fabsf(x[i][c]) > max[c])
+                    max[c] = fabsf(x[i][c]);
+
+            if (max[c] * ip->gain <= t->peak[c])
+                continue;
+
+            for (i = h; i < h + m; i++) {
+                for (p = 0; p < ip->factor - 1; p++) {
+                    for (j = 0, y = 0.0f; j < ip->ntap; j++)
+                        y += ip->c[p][j][0] * x[i - j][c];
+
+                    if (fabsf(y) > t->peak[c])
+                        t->peak[c] = fabsf(y);
+                }
+            }
+        }
+
+        memmove(x, x + m, h * sizeof(x[0]));
+    }
+
+    memcpy(t->x, x, h * sizeof(x[0]));
+}
+
+
+#if defined(GAIN_X86) || defined(GAIN_NEON)
+
+/*
+ * SIMD kernels interpolate two frames per vector, left-right-left-right,
+ * and two vectors at a time. All three phases are always interpolated,
+ * those not there at lower oversampling factors with zero coefficients.
+ * The last round of a chunk may run past its end, the lanes of the first
+ * r frames of a round to keep are at tp_keep + 8 - 2 * r for the first
+ * vector and at tp_keep + 12 - 2 * r for the second one.
+ */
+static const int32_t tp_keep[16] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+#endif
+
+
+#ifdef GAIN_X86
+
+static SSE2 void sse2_tp_kernel(r128_tp_t *t, const r128_interp_t *ip,
+                                const int16_t *src, size_t n)
+{
+    float   x[R128_TP_PHASE - 1 + R128_TP_CHUNK + 4][2], p[4];
+    __m128  scale = _mm_set1_ps(1.0f / 32768.0f), sign = _mm_set1_ps(-0.0f);
+    __m128  gain = _mm_set1_ps(ip->gain);
+    __m128  a0, a1, a2, b0, b1, b2, va, vb, c, ka, kb, mx, pk;
+    __m128i s;
+    size_t  h, m, e, i, r;
+    int     j;
+
+    h  = ip->ntap - 1;
+    pk = _mm_setr_ps(t->peak[0], t->peak[1], t->peak[0], t->peak[1]);
+    memcpy(x, t->x, h * sizeof(x[0]));
+
+    for (; n > 0; src += 2 * m, n -= m) {
+        m  = n < R128_TP_CHUNK ? n : R128_TP_CHUNK;
+        e  = h + m;
+        mx = _mm_setzero_ps();
+
+        for (i = 0; i + 4 <= m; i += 4) {
+            s  = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+            va = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16));
+            vb = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16));
+            va = _mm_mul_ps(va, scale);
+            vb = _mm_mul_ps(vb, scale);
+            mx = _mm_max_ps(mx, _mm_andnot_ps(sign, va));
+            mx = _mm_max_ps(mx, _mm_andnot_ps(sign, vb));
+            _mm_storeu_ps(x[h + i], va);
+            _mm_storeu_ps(x[h + i + 2], vb);
+        }
+        for (; i < m; i++) {
+            x[h + i][0] = src[2 * i]     / 32768.0f;
+            x[h + i][1] = src[2 * i + 1] / 32768.0f;
+        }
+        memset(x[e], 0, 4 * sizeof(x[0]));
+
+        /* the frames left over and the history */
+        for (i = h + (m & ~3); i < e; i++)
+            mx = _mm_max_ps(mx, _mm_andnot_ps(sign, _mm_setr_ps(
+                                x[i][0], x[i][1], 0.0f, 0.0f)));
+        for (i = 0; i < h; i++)
+            mx = _mm_max_ps(mx, _mm_andnot_ps(sign, _mm_setr_ps(
+                                x[i][0], x[i][1], 0.0f, 0.0f)));
+
+        /* skip chunks too quiet to have a new peak */
+        mx = _mm_max_ps(mx, _mm_movehl_ps(mx, mx));
+        if (!(_mm_movemask_ps(_mm_cmpgt_ps(_mm_mul_ps(mx, gain), pk)) & 3)) {
+            memmove(x, x + m, h * sizeof(x[0]));
+            continue;
+        }
+
+        for (i = h; i < e; i += 4) {
+            a0 = a1 = a2 = b0 = b1 = b2 = _mm_setzero_ps();
+
+            for (j = 0; j < ip->ntap; j++) {
+                va = _mm_loadu_ps(x[i - j]);
+                vb = _mm_loadu_ps(x[i - j + 2]);
+                c  = _mm_loadu_ps(ip->c[0][j]);
+                a0 = _mm_add_ps(a0, _mm_mul_ps(c, va));
+                b0 = _mm_add_ps(b0, _mm_mul_ps(c, vb));
+                c  = _mm_loadu_ps(ip->c[1][j]);
+                a1 = _mm_add_ps(a1, _mm_mul_ps(c, va));
+                b1 = _mm_add_ps(b1, _mm_mul_ps(c, vb));
+                c  = _mm_loadu_ps(ip->c[2][j]);
+                a2 = _mm_add_ps(a2, _mm_mul_ps(c, va));
+                b2 = _mm_add_ps(b2, _mm_mul_ps(c, vb));
+            }
+
+            a0 = _mm_max_ps(_mm_andnot_ps(sign, a0), _mm_andnot_ps(sign, a1));
+            a0 = _mm_max_ps(_mm_andnot_ps(sign, a2), a0);
+            b0 = _mm_max_ps(_mm_andnot_ps(sign, b0), _mm_andnot_ps(sign, b1));
+            b0 = _mm_max_ps(_mm_andnot_ps(sign, b2), b0);
+
+            r  = e - i < 4 ? e - i : 4;
+            ka = _mm_loadu_ps((const float *)tp_keep + 8 - 2 * r);
+            kb = _mm_loadu_ps((const float *)tp_keep + 12 - 2 * r);
+            pk = _mm_max_ps(pk, _mm_and_ps(a0, ka));
+            pk = _mm_max_ps(pk, _mm_and_ps(b0, kb));
+        }
+
+        /* keep the peaks of both frames of a vector in both of them */
+        pk = _mm_max_ps(pk, _mm_movehl_ps(pk, pk));
+        pk = _mm_movelh_ps(pk, pk);
+
+        memmove(x, x + m, h * sizeof(x[0]));
+    }
+
+    memcpy(t->x, x, h * sizeof(x[0]));
+
+    _mm_storeu_ps(p, pk);
+    t->peak[0] = p[0];
+    t->peak[1] = p[1];
+}
+
+#endif /* GAIN_X86 */
+
+
+#ifdef GAIN_NEON
+
+static void neon_tp_kernel(r128_tp_t *t, const r128_interp_t *ip,
+                           const int16_t *src, size_t n)
+{
+    float       x[R128_TP_PHASE - 1 + R128_TP_CHUNK + 4][2], p[4];
+    float32x4_t a0, a1, a2, b0, b1, b2, va, vb, c, mx, pk;
+    float32x2_t hi;
+    uint32x4_t  ka, kb;
+    uint32x2_t  gt;
+    int16x8_t   s;
+    size_t      h, m, e, i, r;
+    int         j;
+
+    h    = ip->ntap - 1;
+    p[0] = p[2] = t->peak[0];
+    p[1] = p[3] = t->peak[1];
+    pk   = vld1q_f32(p);
+    memcpy(x, t->x, h * sizeof(x[0]));
+
+    for (; n > 0; src += 2 * m, n -= m) {
+        m  = n < R128_TP_CHUNK ? n : R128_TP_CHUNK;
+        e  = h + m;
+        mx = vdupq_n_f32(0.0f);
+
+        for (i = 0; i + 4 <= m; i += 4) {
+            s  = vld1q_s16(src + 2 * i);
+            va = vcvtq_f32_s32(vmovl_s16(vget_low_s16(s)));
+            vb = vcvtq_f32_s32(vmovl_s16(vget_high_s16(s)));
+            va = vmulq_n_f32(va, 1.0f / 32768.0f);
+            vb = vmulq_n_f32(vb, 1.0f / 32768.0f);
+            mx = vmaxq_f32(mx, vmaxq_f32(vabsq_f32(va), vabsq_f32(vb)));
+            vst1q_f32(x[h + i], va);
+            vst1q_f32(x[h + i + 2], vb);
+        }
+        for (; i < m; i++) {
+            x[h + i][0] = src[2 * i]     / 32768.0f;
+            x[h + i][1] = src[2 * i + 1] / 32768.0f;
+        }
+        memset(x[e], 0, 4 * sizeof(x[0]));
+
+        /* the frames left over and the history */
+        hi = vget_high_f32(mx);
+        for (i = h + (m & ~3); i < e; i++)
+            hi = vmax_f32(hi, vabs_f32(vld1_f32(x[i])));
+        for (i = 0; i < h; i++)
+            hi = vmax_f32(hi, vabs_f32(vld1_f32(x[i])));
+
+        /* skip chunks too quiet to have a new peak */
+        hi = vmax_f32(hi, vget_low_f32(mx));
+        gt = vcgt_f32(vmul_n_f32(hi, ip->gain), vget_low_f32(pk));
+        if (!(vget_lane_u32(gt, 0) | vget_lane_u32(gt, 1))) {
+            memmove(x, x + m, h * sizeof(x[0]));
+            continue;
+        }
+
+        for (i = h; i < e; i += 4) {
+            a0 = a1 = a2 = b0 = b1 = b2 = vdupq_n_f32(0.0f);
+
+            for (j = 0; j < ip->ntap; j++) {
+                va = vld1q_f32(x[i - j]);
+                vb = vld1q_f32(x[i - j + 2]);
+                c  = vld1q_f32(ip->c[0][j]);
+                a0 = vmlaq_f32(a0, c, va);
+                b0 = vmlaq_f32(b0, c, vb);
+                c  = vld1q_f32(ip->c[1][j]);
+                a1 = vmlaq_f32(a1, c, va);
+                b1 = vmlaq_f32(b1, c, vb);
+                c  = vld1q_f32(ip->c[2][j]);
+                a2 = vmlaq_f32(a2, c, va);
+                b2 = vmlaq_f32(b2, c, vb);
+            }
+
+            a0 = vmaxq_f32(vmaxq_f32(vabsq_f32(a0), vabsq_f32(a1)),
+                           vabsq_f32(a2));
+            b0 = vmaxq_f32(vmaxq_f32(vabsq_f32(b0), vabsq_f32(b1)),
+                           vabsq_f32(b2));
+
+            r  = e - i < 4 ? e - i : 4;
+            ka = vld1q_u32((const uint32_t *)tp_keep + 8 - 2 * r);
+            kb = vld1q_u32((const uint32_t *)tp_keep + 12 - 2 * r);
+            /* non-negative floats order as their bits do */
+            ka = vandq_u32(ka, vreinterpretq_u32_f32(a0));
+            kb = vandq_u32(kb, vreinterpretq_u32_f32(b0));
+            pk = vmaxq_f32(pk, vreinterpretq_f32_u32(vmaxq_u32(ka, kb)));
+        }
+
+        /* keep the peaks of both frames of a vector in both of them */
+        hi = vmax_f32(vget_low_f32(pk), vget_high_f32(pk));
+        pk = vcombine_f32(hi, hi);
+
+        memmove(x, x + m, h * sizeof(x[0]));
+    }
+
+    memcpy(t->x, x, h * sizeof(x[0]));
+
+    vst1q_f32(p, pk);
+    t->peak[0] = p[0];
+    t->peak[1] = p[1];
+}
+
+#endif /* GAIN_NEON */
+
+
+static r128_tp_kernel_t r128_tp_kernel(int flags)
+{
+    if (flags & RNC_GAIN_SCALAR)
+        return c_tp_kernel;
+
+#if defined(GAIN_X86)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("sse2"))
+        return sse2_tp_kernel;
+#elif defined(GAIN_NEON)
+    return neon_tp_kernel;
+#endif
+
+    return c_tp_kernel;
+}
+
+
+static inline double energy_to_loudness(double e)
+{
+    return 10.0 * log10(e) - 0.691;
+}
+
+
+static inline int loudness_bin(double loudness)
+{
+    double bin = (loudness - R128_ABSOLUTE_GATE) / R128_BIN_WIDTH;
+
+    if (bin < 0)
+        return 0;
+    if (bin >= R128_BINS)
+        return R128_BINS - 1;
+
+    return (int)bin;
+}
+
+
+static void hist_add(r128_hist_t *h, double e)
+{
+    double loudness = energy_to_loudness(e);
+    int    bin;
+
+    if (loudness < R128_ABSOLUTE_GATE)
+        return;
+
+    bin = loudness_bin(loudness);
+
+    h->count[bin]++;
+    h->energy[bin] += e;
+}
+
+
+#define HIST(_r, _range) ((_range) ? &(_r)->range : &(_r)->gate)
+
+/*
+ * Find the first bin passing a relative gate of gate LU below the mean
+ * energy of the gating (or short-term) histograms of the given states.
+ * Return the number of blocks and their total energy from that bin on.
+ */
+static int hist_gate(r128_t **r, int nstate, int range, double gate,
+                     size_t *countp, double *energyp)
+{
+    r128_hist_t *h;
+    double       energy, threshold;
+    size_t       count;
+    int          first, bin, i;
+
+    count  = 0;
+    energy = 0.0;
+
+    for (i = 0; i < nstate; i++) {
+        h = HIST(r[i], range);
+
+        for (bin = 0; bin < R128_BINS; bin++) {
+            count  += h->count[bin];
+            energy += h->energy[bin];
+        }
+    }
+
+    if (count == 0) {
+        *countp  = 0;
+        *energyp = 0.0;
+        return R128_BINS;
+    }
+
+    threshold = energy / count * pow(10.0, gate / 10.0);
+    first     = loudness_bin(energy_to_loudness(threshold));
+
+    /* the bin the threshold falls into goes by the mean of its blocks */
+    count  = 0;
+    energy = 0.0;
+
+    for (i = 0; i < nstate; i++) {
+        h = HIST(r[i], range);
+        count  += h->count[first];
+        energy += h->energy[first];
+    }
+
+    if (count > 0 && energy / count < threshold)
+        first++;
+
+    count  = 0;
+    energy = 0.0;
+
+    for (i = 0; i < nstate; i++) {
+        h = HIST(r[i], range);
+
+        for (bin = first; bin < R128_BINS; bin++) {
+            count  += h->count[bin];
+            energy += h->energy[bin];
+        }
+    }
+
+    *countp  = count;
+    *energyp = energy;
+
+    return first;
+}
+
+
+static void *r128_create(rnc_gain_t *g)
+{
+    MRP_UNUSED(g);
+
+    return mrp_allocz(sizeof(r128_t));
+}
+
+
+static void r128_destroy(void *state)
+{
+    mrp_free(state);
+}
+
+
+static void r128_block(rnc_gain_t *g, r128_t *r)
+{
+    double e;
+    int    i;
+
+    e = r->f.energy[0] + r->f.energy[1];
+
+    r->block[r->nblock++ % R128_SHORT_BLOCK] = e;
+    r->f.energy[0] = r->f.energy[1] = 0.0;
+    r->nframe = 0;
+
+    if (r->nblock >= R128_GATE_BLOCK) {
+        for (i = 1, e = 0.0; i <= R128_GATE_BLOCK; i++)
+            e += r->block[(r->nblock - i) % R128_SHORT_BLOCK];
+
+        hist_add(&r->gate, e / (R128_GATE_BLOCK * g->block));
+    }
+
+    if (r->nblock >= R128_SHORT_BLOCK &&
+        (r->nblock - R128_SHORT_BLOCK) % R128_SHORT_HOP == 0) {
+        for (i = 0, e = 0.0; i < R128_SHORT_BLOCK; i++)
+            e += r->block[i];
+
+        hist_add(&r->range, e / (R128_SHORT_BLOCK * g->block));
+    }
+}
+
+
+static int r128_add(rnc_gain_t *g, void *state, const int16_t *src, size_t n)
+{
+    r128_t *r = state;
+    size_t  m;
+
+    while (n > 0) {
+        m = g->block - r->nframe;
+
+        if (m > n)
+            m = n;
+
+        g->kernel(&r->f, g->k, src, m);
+        r->nframe += m;
+
+        if (g->tp_kernel != NULL)
+            g->tp_kernel(&r->tp, &g->interp, src, m);
+
+        if (r->nframe == g->block)
+            r128_block(g, r);
+
+        src += 2 * m;
+        n   -= m;
+    }
+
+    return 0;
+}
+
+
+/*
+ * segment-parallel analysis
+ *
+ * A long stretch of audio can be split into segments at 100 ms block
+ * boundaries and the segments filtered on separate threads. The first
+ * segment continues with the filter state of the track. The rest start
+ * with a cold filter, warmed up by running it through one gating window
+ * of audio preceding the segment, which is more than enough for it to
+ * settle to the state it would have had. Each segment only collects the
+ * energies of its 100 ms blocks. Once all segments are done, those are
+ * fed to the track in order, exactly as if they had been collected by
+ * analyzing the track serially.
+ */
+
+typedef struct {
+    rnc_gain_t    *g;                    /* analyzer context */
+    r128_filter_t  f;                    /* filter state of segment */
+    r128_tp_t      tp;                   /* true-peak state of segment */
+    const int16_t *src;                  /* segment audio */
+    size_t         n;                    /* frames in segment */
+    double       (*energy)[2];           /* energies of 100 ms blocks */
+    pthread_t      thread;               /* thread analyzing segment */
+    int            started;              /* whether thread was started */
+} r128_segment_t;
+
+
+static void *r128_segment(void *ptr)
+{
+    r128_segment_t *s = ptr;
+    rnc_gain_t     *g = s->g;
+    size_t          warmup, offs, m;
+    int             i;
+
+    warmup = R128_GATE_BLOCK * g->block;
+
+    g->kernel(&s->f, g->k, s->src - 2 * warmup, warmup);
+    s->f.peak[0] = s->f.peak[1] = 0.0;
+
+    if (g->tp_kernel != NULL) {
+        g->tp_kernel(&s->tp, &g->interp, s->src - 2 * warmup, warmup);
+        s->tp.peak[0] = s->tp.peak[1] = 0.0;
+    }
+
+    for (i = 0, offs = 0; offs < s->n; i++, offs += m) {
+        m = s->n - offs < g->block ? s->n - offs : g->block;
+
+        s->f.energy[0] = s->f.energy[1] = 0.0;
+        g->kernel(&s->f, g->k, s->src + 2 * offs, m);
+
+        s->energy[i][0] = s->f.energy[0];
+        s->energy[i][1] = s->f.energy[1];
+
+        if (g->tp_kernel != NULL)
+            g->tp_kernel(&s->tp, &g->interp, s->src + 2 * offs, m);
+    }
+
+    return NULL;
+}
+
+
+static int r128_add_segments(rnc_gain_t *g, void *state, const int16_t *src,
+                             size_t n, int nthread)
+{
+    r128_t         *r = state;
+    r128_segment_t *seg, *s;
+    size_t          head, nblk, per, offs, m;
+    int             nseg, i, j, status;
+
+    /* the first segment completes any partial block of the track */
+    head = (g->block - r->nframe) % g->block;
+    nblk = n > head ? (n - head) / g->block : 0;
+    nseg = nblk / R128_SEGMENT;
+
+    if (nseg > nthread)
+        nseg = nthread;
+
+    if (nseg < 2)
+        return r128_add(g, state, src, n);
+
+    if ((seg = mrp_allocz(nseg * sizeof(seg[0]))) == NULL)
+        return -1;
+
+    per    = nblk / nseg;
+    status = -1;
+
+    for (i = 1; i < nseg; i++) {
+        s = seg + i;
+
+        offs      = head + i * per * g->block;
+        s->g      = g;
+        s->src    = src + 2 * offs;
+        s->n      = i < nseg - 1 ? per * g->block : n - offs;
+        s->energy = mrp_alloc((s->n / g->block + 1) * sizeof(s->energy[0]));
+
+        if (s->energy == NULL)
+            goto out;
+    }
+
+    for (i = 1; i < nseg; i++) {
+        s = seg + i;
+
+        if (pthread_create(&s->thread, NULL, r128_segment, s) == 0)
+            s->started = 1;
+    }
+
+    r128_add(g, r, src, head + per * g->block);
+
+    /* analyze ourselves what we failed to start a thread for */
+    for (i = 1; i < nseg; i++) {
+        s = seg + i;
+
+        if (s->started)
+            pthread_join(s->thread, NULL);
+        else
+            r128_segment(s);
+    }
+
+    for (i = 1; i < nseg; i++) {
+        s = seg + i;
+
+        for (j = 0, offs = 0; offs < s->n; j++, offs += m) {
+            m = s->n - offs < g->block ? s->n - offs : g->block;
+
+            r->f.energy[0] = s->energy[j][0];
+            r->f.energy[1] = s->energy[j][1];
+            r->nframe      = m;
+
+            if (m == g->block)
+                r128_block(g, r);
+        }
+
+        if (s->f.peak[0] > r->f.peak[0])
+            r->f.peak[0] = s->f.peak[0];
+        if (s->f.peak[1] > r->f.peak[1])
+            r->f.peak[1] = s->f.peak[1];
+        if (s->tp.peak[0] > r->tp.peak[0])
+            r->tp.peak[0] = s->tp.peak[0];
+        if (s->tp.peak[1] > r->tp.peak[1])
+            r->tp.peak[1] = s->tp.peak[1];
+    }
+
+    memcpy(r->f.z, seg[nseg - 1].f.z, sizeof(r->f.z));
+    memcpy(r->tp.x, seg[nseg - 1].tp.x, sizeof(r->tp.x));
+    status = 0;
+
+ out:
+    for (i = 1; i < nseg; i++)
+        mrp_free(seg[i].energy);
+    mrp_free(seg);
+
+    return status;
+}
+
+
+static double r128_loudness(void **states, int nstate)
+{
+    size_t count;
+    double energy;
+
+    hist_gate((r128_t **)states, nstate, false, R128_RELATIVE_GATE,
+              &count, &energy);
+
+    if (count == 0)
+        return -HUGE_VAL;
+
+    return energy_to_loudness(energy / count);
+}
+
+
+/*
+ * Get the loudness of the block of the given rank in h, from bin on.
+ */
+static double hist_rank(r128_hist_t *h, int bin, size_t rank)
+{
+    size_t n = 0;
+
+    for (; bin < R128_BINS; bin++) {
+        if ((n += h->count[bin]) > rank)
+            break;
+    }
+
+    return energy_to_loudness(h->energy[bin] / h->count[bin]);
+}
+
+
+static double r128_range(void *state)
+{
+    r128_t *r = state;
+    size_t  count;
+    double  energy, hi, lo;
+    int     first;
+
+    first = hist_gate(&r, 1, true, R128_RANGE_GATE, &count, &energy);
+
+    if (count == 0)
+        return 0.0;
+
+    lo = hist_rank(&r->range, first, (size_t)((count - 1) * 0.10 + 0.5));
+    hi = hist_rank(&r->range, first, (size_t)((count - 1) * 0.95 + 0.5));
+
+    return hi - lo;
+}
+
+
+static double r128_peak(void *state)
+{
+    r128_t *r = state;
+
+    return r->f.peak[0] > r->f.peak[1] ? r->f.peak[0] : r->f.peak[1];
+}
+
+
+/*
+ * Without true-peak measurement, or at rates too high to oversample,
+ * the interpolated peaks stay zero and this is the sample peak.
+ */
+static double r128_true_peak(void *state)
+{
+    r128_t *r    = state;
+    double  peak = r128_peak(state);
+
+    if (r->tp.peak[0] > peak)
+        peak = r->tp.peak[0];
+    if (r->tp.peak[1] > peak)
+        peak = r->tp.peak[1];
+
+    return peak;
+}
+
+
+/*
+ * Saved states are finished tracks: their peaks and histograms, with
+ * only the occupied bins stored, in little-endian byte order. Filter
+ * state and partial blocks are not saved, so a loaded track cannot be
+ * analyzed any further.
+ */
+
+static int put_u32(rnc_buf_t *b, uint32_t v)
+{
+    v = htole32(v);
+
+    return rnc_buf_write(b, &v, sizeof(v)) < 0 ? -1 : 0;
+}
+
+
+static int put_u64(rnc_buf_t *b, uint64_t v)
+{
+    v = htole64(v);
+
+    return rnc_buf_write(b, &v, sizeof(v)) < 0 ? -1 : 0;
+}
+
+
+static int put_f64(rnc_buf_t *b, double d)
+{
+    uint64_t v;
+
+    memcpy(&v, &d, sizeof(v));
+
+    return put_u64(b, v);
+}
+
+
+static int get_u32(rnc_buf_t *b, uint32_t *v)
+{
+    if (rnc_buf_read(b, v, sizeof(*v)) != sizeof(*v))
+        goto invalid;
+
+    *v = le32toh(*v);
+
+    return 0;
+
+ invalid:
+    errno = EINVAL;
+    return -1;
+}
+
+
+static int get_u64(rnc_buf_t *b, uint64_t *v)
+{
+    if (rnc_buf_read(b, v, sizeof(*v)) != sizeof(*v))
+        goto invalid;
+
+    *v = le64toh(*v);
+
+    return 0;
+
+ invalid:
+    errno = EINVAL;
+    return -1;
+}
+
+
+static int get_f64(rnc_buf_t *b, double *d)
+{
+    uint64_t v;
+
+    if (get_u64(b, &v) < 0)
+        return -1;
+
+    memcpy(d, &v, sizeof(*d));
+
+    return 0;
+}
+
+
+static int hist_save(r128_hist_t *h, rnc_buf_t *b)
+{
+    uint32_t n;
+    int      bin;
+
+    for (bin = 0, n = 0; bin < R128_BINS; bin++)
+        if (h->count[bin])
+            n++;
+
+    if (put_u32(b, n) < 0)
+        return -1;
+
+    for (bin = 0; bin < R128_BINS; bin++) {
+        if (!h->count[bin])
+            continue;
+
+        if (put_u32(b, bin) < 0 || put_u32(b, h->count[bin]) < 0 ||
+            put_f64(b, h->energy[bin]) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+
+static int hist_load(r128_hist_t *h, rnc_buf_t *b)
+{
+    uint32_t n, bin;
+
+    if (get_u32(b, &n) < 0)
+        return -1;
+
+    while (n-- > 0) {
+        if (get_u32(b, &bin) < 0)
+            return -1;
+
+        if (bin >= R128_BINS)
+            goto invalid;
+
+        if (get_u32(b, &h->count[bin]) < 0 ||
+            get_f64(b, &h->energy[bin]) < 0)
+            return -1;
+    }
+
+    return 0;
+
+ invalid:
+    errno = EINVAL;
+    return -1;
+}
+
+
+static int r128_save(void *state, rnc_buf_t *b)
+{
+    r128_t *r = state;
+
+    if (put_u64(b, r->nblock) < 0 ||
+        put_f64(b, r->f.peak[0]) < 0 || put_f64(b, r->f.peak[1]) < 0 ||
+        put_f64(b, r->tp.peak[0]) < 0 || put_f64(b, r->tp.peak[1]) < 0)
+        return -1;
+
+    if (hist_save(&r->gate, b) < 0 || hist_save(&r->range, b) < 0)
+        return -1;
+
+    return 0;
+}
+
+
+static int r128_load(void *state, rnc_buf_t *b, uint32_t version)
+{
+    r128_t   *r = state;
+    uint64_t  nblock;
+
+    if (get_u64(b, &nblock) < 0 ||
+        get_f64(b, &r->f.peak[0]) < 0 || get_f64(b, &r->f.peak[1]) < 0)
+        return -1;
+
+    r->nblock = nblock;
+
+    /* version 1 had no true peaks, leave them for the sample peaks */
+    if (version >= 2 &&
+        (get_f64(b, &r->tp.peak[0]) < 0 || get_f64(b, &r->tp.peak[1]) < 0))
+        return -1;
+
+    if (hist_load(&r->gate, b) < 0 || hist_load(&r->range, b) < 0)
+        return -1;
+
+    return 0;
+}
+
+
+static gain_engine_t r128_engine = {
+    .name         = "native",
+    .create       = r128_create,
+    .destroy      = r128_destroy,
+    .add          = r128_add,
+    .add_segments = r128_add_segments,
+    .loudness     = r128_loudness,
+    .range        = r128_range,
+    .peak         = r128_peak,
+    .true_peak    = r128_true_peak,
+    .save         = r128_save,
+    .load         = r128_load,
+};
+
+
+int rnc_gain_get_formats(uint32_t *buf, size_t size)
+{
+    int endn[] = { RNC_ENDIAN_HOST, !RNC_ENDIAN_HOST };
+    int rate[] = { RNC_SAMPLERATE_44100, RNC_SAMPLERATE_48000,
+                   RNC_SAMPLERATE_96000, RNC_SAMPLERATE_192000 };
+    int e, r, n;
+
+    /* both engines take host-endian samples, others need swapping */
+    n = 0;
+    for (e = 0; e < (int)MRP_ARRAY_SIZE(endn); e++) {
+        for (r = 0; r < (int)MRP_ARRAY_SIZE(rate); r++, n++) {
+            if (n < (int)size)
+                buf[n] = RNC_FORMAT_ID(RNC_CHANNELMAP_LEFTRIGHT,
+                                       RNC_ENCODING_PCM, 2, rate[r], 16,
+                                       RNC_SAMPLE_SIGNED, endn[e]);
+        }
+    }
+
+    return n;
+}
+
+
+int rnc_gain_init(rnc_gain_t *g, int ntrack, uint32_t format, int flags)
+{
+    int cmap, chnl, rate, bits, smpl, endn, i;
+
+    mrp_clear(g);
+
+    cmap = RNC_FORMAT_CMAP(format);
+    chnl = RNC_FORMAT_CHNL(format);
+    rate = RNC_FORMAT_RATE(format);
+    bits = RNC_FORMAT_BITS(format);
+    smpl = RNC_FORMAT_SMPL(format);
+    endn = RNC_FORMAT_ENDN(format);
+
+
+    /*
+     * we only support 16-bit stereo with left-right channel map
+     */
+
+    if (cmap != RNC_CHANNELMAP_LEFTRIGHT)
+        goto unsupported_channelmap;
+
+    if (chnl != 2)
+        goto unsupported_channels;
+
+    if (bits != 16)
+        goto unsupported_bits;
+
+    if (smpl != RNC_SAMPLE_SIGNED)
+        goto unsupported_samples;
+
+    g->chnl = chnl;
+    g->rate = rate;
+    g->bits = bits;
+    g->smpl = smpl;
+    g->swap = (endn != RNC_ENDIAN_HOST);
+
+    if (g->swap &&
+        rnc_convert_init(&g->cvt, format,
+                         RNC_FORMAT_ID(cmap, 0, chnl, rate, bits, smpl,
+                                       RNC_ENDIAN_HOST), 0) < 0)
+        return -1;
+
+    if (flags & RNC_GAIN_EBUR128) {
+        g->engine = &ebur_engine;
+        g->mode   = EBUR128_MODE_I | EBUR128_MODE_LRA |
+            EBUR128_MODE_SAMPLE_PEAK;
+
+        if (flags & RNC_GAIN_TRUE_PEAK)
+            g->mode |= EBUR128_MODE_TRUE_PEAK;
+    }
+    else {
+        g->engine = &r128_engine;
+        g->kernel = r128_kernel(flags);
+        r128_coefficients(g);
+
+        if (flags & RNC_GAIN_TRUE_PEAK) {
+            r128_interpolator(g);
+
+            if (g->interp.factor > 1)
+                g->tp_kernel = r128_tp_kernel(flags);
+        }
+    }
+
+    g->ntrack = ntrack;
+    g->state  = mrp_allocz(ntrack * sizeof(g->state[0]));
+    g->label  = mrp_allocz(ntrack * sizeof(g->label[0]));
+
+    if (g->state == NULL || g->label == NULL)
+        goto nomem;
+
+    for (i = 0; i < ntrack; i++) {
+        g->state[i] = g->engine->create(g);
+
+        if (g->state[i] == NULL)
+            goto lib_error;
+    }
+
+    return 0;
+
+ unsupported_channelmap:
+ unsupported_channels:
+ unsupported_bits:
+ unsupported_samples:
+    errno = EOPNOTSUPP;
+    return -1;
+
+ lib_error:
+    errno = EINVAL;
+ nomem:
+    if (g->state != NULL) {
+        for (i = 0; i < ntrack; i++) {
+            if (g->state[i] != NULL)
+                g->engine->destroy(g->state[i]);
+        }
+        mrp_free(g->state);
+    }
+    mrp_free(g->label);
+    return -1;
+}
+
+
+void rnc_gain_exit(rnc_gain_t *g)
+{
+    int i;
+
+    if (g == NULL)
+        return;
+
+    gain_stop(g);
+
+    for (i = 0; i < g->ntrack; i++) {
+        g->engine->destroy(g->state[i]);
+        mrp_free(g->label[i]);
+    }
+
+    mrp_free(g->state);
+    mrp_free(g->label);
+    g->state = NULL;
+    g->label = NULL;
+}
+
+
+rnc_gain_t *rnc_gain_create(int ntrack, uint32_t format, int flags)
+{
+    rnc_gain_t *g;
+
+    if ((g = mrp_allocz(sizeof(*g))) == NULL)
+        goto fail;
+
+    if (rnc_gain_init(g, ntrack, format, flags) < 0)
+        goto fail;
+
+    return g;
+
+ fail:
+    mrp_free(g);
+    return NULL;
+}
+
+
+void rnc_gain_destroy(rnc_gain_t *g)
+{
+    rnc_gain_exit(g);
+    mrp_free(g);
+}
+
+
+const char *rnc_gain_engine(rnc_gain_t *g)
+{
+    return g->engine->name;
+}
+
+
+static int analyze(rnc_gain_t *g, int track, const char *samples,
+                   int nsample)
+{
+    void    *state = g->state[track];
+    int16_t  host[SWAP_FRAMES * 2];
+    void    *dst[1] = { host };
+    int      n;
+
+    if (!g->swap) {
+        if (g->engine->add(g, state, (const int16_t *)samples,
+                           (size_t)nsample) < 0)
+            goto lib_error;
+
+        return 0;
+    }
+
+    while (nsample > 0) {
+        n = nsample < SWAP_FRAMES ? nsample : SWAP_FRAMES;
+
+        rnc_convert(&g->cvt, dst, samples, n);
+
+        if (g->engine->add(g, state, host, (size_t)n) < 0)
+            goto lib_error;
+
+        samples += n * g->chnl * sizeof(host[0]);
+        nsample -= n;
+    }
+
+    return 0;
+
+ lib_error:
+    errno = EINVAL;
+    return -1;
+}
+
+
+int rnc_gain_analyze(rnc_gain_t *g, int track, const char *samples,
+                     int nsample)
+{
+    if (track >= g->ntrack)
+        goto invalid_track;
+
+    /* don't race with the analyzer for the same state */
+    if (g->jobs != NULL)
+        gain_wait(g, track);
+
+    return analyze(g, track, samples, nsample);
+
+ invalid_track:
+    errno = EINVAL;
+    return -1;
+}
+
+
+int rnc_gain_analyze_parallel(rnc_gain_t *g, int track, const char *samples,
+                              int nsample, int nthread)
+{
+    if (track >= g->ntrack)
+        goto invalid_track;
+
+    if (g->jobs != NULL)
+        gain_wait(g, track);
+
+    /* engines without segment support and swapped samples go serially */
+    if (g->engine->add_segments == NULL || g->swap || nthread <= 1)
+        return analyze(g, track, samples, nsample);
+
+    if (g->engine->add_segments(g, g->state[track], (const int16_t *)samples,
+                                (size_t)nsample, nthread) < 0)
+        return -1;
+
+    return 0;
+
+ invalid_track:
+    errno = EINVAL;
+    return -1;
+}
+
+
+static void *analyzer_thread(void *ptr)
+{
+    rnc_gain_t *g = ptr;
+    gain_job_t *j;
+    int         nsample, status;
+
+    while ((j = rnc_queue_pop(g->jobs)) != NULL) {
+        nsample = rnc_slice_size(j->samples) / (g->chnl * g->bits / 8);
+        status  = analyze(g, j->track, rnc_slice_data(j->samples), nsample);
+
+        rnc_slice_unref(j->samples);
+
+        pthread_mutex_lock(&g->lock);
+
+        if (status < 0 && !g->failed[j->track])
+            g->failed[j->track] = errno;
+
+        if (--g->pending[j->track] == 0)
+            pthread_cond_broadcast(&g->drained);
+
+        pthread_mutex_unlock(&g->lock);
+
+        mrp_free(j);
+    }
+
+    return NULL;
+}
+
+
+int rnc_gain_start(rnc_gain_t *g)
+{
+    if (g->jobs != NULL)
+        return 0;
 
-struct rnc_gain_s {
-    int             ntrack;              /* number of tracks on album */
-    ebur128_state **ebur;                /* libebur128 state */
-    int             rate;                /* rate */
-    int             bits;                /* bits per sample */
-    int             smpl;                /* sample type */
-    int             swap;                /* whether to swap endianness */
-};
+    g->pending = mrp_allocz(g->ntrack * sizeof(g->pending[0]));
+    g->failed  = mrp_allocz(g->ntrack * sizeof(g->failed[0]));
 
+    if (g->pending == NULL || g->failed == NULL)
+        goto nomem;
 
-int rnc_gain_init(rnc_gain_t *g, int ntrack, uint32_t format)
-{
-    int cmap, chnl, rate, bits, smpl, endn, swap, host, i, mode;
+    if ((g->jobs = rnc_queue_create(ANALYZER_QUEUE)) == NULL)
+        goto nomem;
 
-    mrp_clear(g);
+    pthread_mutex_init(&g->lock, NULL);
+    pthread_cond_init(&g->drained, NULL);
 
-    cmap = RNC_FORMAT_CMAP(format);
-    chnl = RNC_FORMAT_CHNL(format);
-    rate = RNC_FORMAT_RATE(format);
-    bits = RNC_FORMAT_BITS(format);
-    smpl = RNC_FORMAT_SMPL(format);
-    endn = RNC_FORMAT_ENDN(format);
+    if (pthread_create(&g->analyzer, NULL, analyzer_thread, g) != 0)
+        goto thread_error;
 
+    return 0;
 
-    /*
-     * we only support 16-bit stereo with left-right channel map
-     */
+ thread_error:
+    pthread_mutex_destroy(&g->lock);
+    pthread_cond_destroy(&g->drained);
+    rnc_queue_destroy(g->jobs);
+    g->jobs = NULL;
+    errno = EAGAIN;
+ nomem:
+    mrp_free(g->pending);
+    mrp_free(g->failed);
+    g->pending = NULL;
+    g->failed  = NULL;
+    return -1;
+}
 
-    if (cmap != RNC_CHANNELMAP_LEFTRIGHT)
-        goto unsupported_channelmap;
 
-    if (chnl != 2)
-        goto unsupported_channels;
+static void gain_stop(rnc_gain_t *g)
+{
+    if (g->jobs == NULL)
+        return;
 
-    if (bits != 16)
-        goto unsupported_bits;
+    rnc_queue_close(g->jobs);
+    pthread_join(g->analyzer, NULL);
+    rnc_queue_destroy(g->jobs);
+    g->jobs = NULL;
 
-    if (smpl != RNC_SAMPLE_SIGNED)
-        goto unsupported_samples;
+    pthread_mutex_destroy(&g->lock);
+    pthread_cond_destroy(&g->drained);
 
-    host = 0x1;
-    if (( *(char *)&host && endn == RNC_ENDIAN_BIG   ) ||
-        (!*(char *)&host && endn == RNC_ENDIAN_LITTLE))
-        swap = 1;
+    mrp_free(g->pending);
+    mrp_free(g->failed);
+    g->pending = NULL;
+    g->failed  = NULL;
+}
 
-    g->rate = rate;
-    g->bits = bits;
-    g->smpl = smpl;
-    g->swap = swap;
 
-    g->ntrack = ntrack;
-    g->ebur   = mrp_allocz(ntrack * sizeof(g->ebur[0]));
+static int gain_wait(rnc_gain_t *g, int track)
+{
+    int error;
 
-    if (g->ebur == NULL)
-        goto nomem;
+    pthread_mutex_lock(&g->lock);
 
-    mode = EBUR128_MODE_I | EBUR128_MODE_LRA | EBUR128_MODE_SAMPLE_PEAK;
+    while (g->pending[track] > 0)
+        pthread_cond_wait(&g->drained, &g->lock);
 
-    for (i = 0; i < ntrack; i++) {
-        g->ebur[i] = ebur128_init(chnl, rnc_id_freq(rate), mode);
+    error = g->failed[track];
 
-        if (g->ebur[i] == NULL)
-            goto lib_error;
+    pthread_mutex_unlock(&g->lock);
 
-        ebur128_set_channel(g->ebur[i], 0, EBUR128_LEFT);
-        ebur128_set_channel(g->ebur[i], 1, EBUR128_RIGHT);
+    if (error) {
+        errno = error;
+        return -1;
     }
 
     return 0;
+}
 
- unsupported_channelmap:
- unsupported_channels:
- unsupported_bits:
- unsupported_samples:
-    errno = EOPNOTSUPP;
-    return -1;
 
- lib_error:
-    errno = EINVAL;
- nomem:
-    if (g->ebur != NULL) {
-        for (i = 0; i < ntrack; i++) {
-            if (g->ebur[i] != NULL)
-                ebur128_destroy(g->ebur + i);
-        }
-        mrp_free(g->ebur);
+int rnc_gain_analyze_slice(rnc_gain_t *g, int track, rnc_slice_t *samples)
+{
+    gain_job_t *j;
+    int         nsample;
+
+    if (track >= g->ntrack)
+        goto invalid_track;
+
+    if (g->jobs == NULL) {
+        nsample = rnc_slice_size(samples) / (g->chnl * g->bits / 8);
+        return analyze(g, track, rnc_slice_data(samples), nsample);
     }
-    return -1;
-}
 
+    if ((j = mrp_allocz(sizeof(*j))) == NULL)
+        return -1;
 
-void rnc_gain_exit(rnc_gain_t *g)
-{
-    int i;
+    j->track   = track;
+    j->samples = rnc_slice_ref(samples);
 
-    if (g == NULL)
-        return;
+    pthread_mutex_lock(&g->lock);
+    g->pending[track]++;
+    pthread_mutex_unlock(&g->lock);
 
-    for (i = 0; i < g->ntrack; i++)
-        ebur128_destroy(g->ebur + i);
+    if (rnc_queue_push(g->jobs, j) < 0)
+        goto closed;
+
+    return 0;
+
+ invalid_track:
+    errno = EINVAL;
+    return -1;
+
+ closed:
+    pthread_mutex_lock(&g->lock);
+    if (--g->pending[track] == 0)
+        pthread_cond_broadcast(&g->drained);
+    pthread_mutex_unlock(&g->lock);
+    rnc_slice_unref(j->samples);
+    mrp_free(j);
+    errno = EPIPE;
+    return -1;
 }
 
 
-rnc_gain_t *rnc_gain_create(int ntrack, uint32_t format)
+static void gain_sync(rnc_gain_t *g, int track)
 {
-    rnc_gain_t *g;
+    if (g->jobs != NULL)
+        gain_wait(g, track);
+}
 
-    if ((g = mrp_allocz(sizeof(*g))) == NULL)
-        goto fail;
 
-    if (rnc_gain_init(g, ntrack, format) < 0)
-        goto fail;
+int rnc_gain_wait(rnc_gain_t *g, int track)
+{
+    if (track >= g->ntrack)
+        goto invalid_track;
 
-    return g;
+    if (g->jobs == NULL)
+        return 0;
 
- fail:
-    mrp_free(g);
-    return NULL;
+    return gain_wait(g, track);
+
+ invalid_track:
+    errno = EINVAL;
+    return -1;
 }
 
 
-void rnc_gain_destroy(rnc_gain_t *g)
+int rnc_gain_transfer(rnc_gain_t *dst, int dtrack, rnc_gain_t *src,
+                      int strack)
 {
-    rnc_gain_exit(g);
-    mrp_free(g);
-}
+    void *state;
 
+    if (dtrack >= dst->ntrack || strack >= src->ntrack)
+        goto invalid_track;
 
-int rnc_gain_analyze(rnc_gain_t *g, int track, char *samples, int nsample)
-{
-    ebur128_state *ebur = g->ebur[track];
-    int            r;
+    if (dst->chnl != src->chnl || dst->rate != src->rate ||
+        dst->engine != src->engine || dst->mode != src->mode)
+        goto invalid_format;
 
-    r = ebur128_add_frames_short(ebur, (short *)samples, (size_t)nsample);
+    gain_sync(dst, dtrack);
+    gain_sync(src, strack);
 
-    if (r != EBUR128_SUCCESS)
+    /*
+     * Hand over the analyzed state as is and give the source a fresh
+     * one, so it is ready to analyze its next track right away.
+     */
+
+    if ((state = src->engine->create(src)) == NULL)
         goto lib_error;
 
+    dst->engine->destroy(dst->state[dtrack]);
+    dst->state[dtrack] = src->state[strack];
+    src->state[strack] = state;
+
+    if (dst->failed != NULL)
+        dst->failed[dtrack] = src->failed ? src->failed[strack] : 0;
+    if (src->failed != NULL)
+        src->failed[strack] = 0;
+
     return 0;
 
- lib_error:
+ invalid_track:
+ invalid_format:
     errno = EINVAL;
     return -1;
+
+ lib_error:
+    errno = ENOMEM;
+    return -1;
 }
 
 
@@ -196,14 +1937,12 @@ static double replaygain(double loudness)
 
 double rnc_gain_track_range(rnc_gain_t *g, int track)
 {
-    double range;
-
     if (track >= g->ntrack)
         goto invalid_track;
 
-    ebur128_loudness_range(g->ebur[track], &range);
+    gain_sync(g, track);
 
-    return range;
+    return g->engine->range(g->state[track]);
 
  invalid_track:
     errno = EINVAL;
@@ -214,14 +1953,12 @@ double rnc_gain_track_range(rnc_gain_t *g, int track)
 
 double rnc_gain_track_loudness(rnc_gain_t *g, int track)
 {
-    double loudness;
-
     if (track >= g->ntrack)
         goto invalid_track;
 
-    ebur128_loudness_global(g->ebur[track], &loudness);
+    gain_sync(g, track);
 
-    return loudness;
+    return g->engine->loudness(g->state + track, 1);
 
  invalid_track:
     errno = EINVAL;
@@ -232,25 +1969,42 @@ double rnc_gain_track_loudness(rnc_gain_t *g, int track)
 
 double rnc_gain_track_gain(rnc_gain_t *g, int track)
 {
-    double loudness;
+    if (track >= g->ntrack)
+        goto invalid_track;
+
+    gain_sync(g, track);
 
-    ebur128_loudness_global(g->ebur[track], &loudness);
+    return replaygain(g->engine->loudness(g->state + track, 1));
 
-    return replaygain(loudness);
+ invalid_track:
+    errno = EINVAL;
+    return 0.0;
 }
 
 
 double rnc_gain_track_peak(rnc_gain_t *g, int track)
 {
-    double l, r;
+    if (track >= g->ntrack)
+        goto invalid_track;
+
+    gain_sync(g, track);
+
+    return g->engine->peak(g->state[track]);
 
+ invalid_track:
+    errno = EINVAL;
+    return 0.0;
+}
+
+
+double rnc_gain_track_true_peak(rnc_gain_t *g, int track)
+{
     if (track >= g->ntrack)
         goto invalid_track;
 
-    ebur128_sample_peak(g->ebur[track], 0, &l);
-    ebur128_sample_peak(g->ebur[track], 1, &r);
+    gain_sync(g, track);
 
-    return l > r ? l : r;
+    return g->engine->true_peak(g->state[track]);
 
  invalid_track:
     errno = EINVAL;
@@ -260,9 +2014,275 @@ double rnc_gain_track_peak(rnc_gain_t *g, int track)
 
 double rnc_gain_album_gain(rnc_gain_t *g)
 {
-    double loudness;
+    int i;
+
+    for (i = 0; i < g->ntrack; i++)
+        gain_sync(g, i);
+
+    return replaygain(g->engine->loudness(g->state, g->ntrack));
+}
+
+
+int rnc_gain_tracks(rnc_gain_t *g)
+{
+    return g->ntrack;
+}
+
+
+int rnc_gain_set_label(rnc_gain_t *g, int track, const char *label)
+{
+    char *l;
+
+    if (track >= g->ntrack)
+        goto invalid_track;
+
+    if (label != NULL && strlen(label) > STATE_LABEL_MAX)
+        goto invalid_label;
+
+    if ((l = mrp_strdup(label)) == NULL && label != NULL)
+        return -1;
+
+    mrp_free(g->label[track]);
+    g->label[track] = l;
+
+    return 0;
+
+ invalid_track:
+ invalid_label:
+    errno = EINVAL;
+    return -1;
+}
+
+
+const char *rnc_gain_track_label(rnc_gain_t *g, int track)
+{
+    if (track >= g->ntrack)
+        goto invalid_track;
+
+    return g->label[track];
+
+ invalid_track:
+    errno = EINVAL;
+    return NULL;
+}
+
+
+int rnc_gain_save(rnc_gain_t *g, const char *path)
+{
+    char       tmp[PATH_MAX];
+    rnc_buf_t *b;
+    uint32_t   n, len;
+    int        fd, i;
+
+    if (g->engine->save == NULL)
+        goto notsup;
+
+    for (i = 0; i < g->ntrack; i++)
+        gain_sync(g, i);
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+        goto nametoolong;
+
+    /* serialize in memory, so the file is written in one go below */
+    if ((b = rnc_buf_create("gain state", 0, 0)) == NULL)
+        return -1;
+
+    for (i = 0, n = 0; i < g->ntrack; i++)
+        if (g->label[i] != NULL)
+            n++;
+
+    if (rnc_buf_write(b, STATE_MAGIC, 8) < 0 ||
+        put_u32(b, STATE_VERSION) < 0 || put_u32(b, R128_BINS) < 0 ||
+        put_u32(b, rnc_id_freq(g->rate)) < 0 || put_u32(b, n) < 0)
+        goto fail;
+
+    /* only labelled tracks are saved, anything else couldn't be told apart */
+    for (i = 0; i < g->ntrack; i++) {
+        if (g->label[i] == NULL)
+            continue;
+
+        len = strlen(g->label[i]);
+
+        if (put_u32(b, len) < 0 ||
+            rnc_buf_write(b, g->label[i], len) < 0 ||
+            g->engine->save(g->state[i], b) < 0)
+            goto fail;
+    }
+
+    /* write a new file and move it in place, never leave a partial one */
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        goto fail;
+
+    if (rnc_buf_writev_to_fd(b, fd) < 0) {
+        close(fd);
+        goto ioerror;
+    }
 
-    ebur128_loudness_global_multiple(g->ebur, g->ntrack, &loudness);
+    if (close(fd) < 0)
+        goto ioerror;
 
-    return replaygain(loudness);
+    if (rename(tmp, path) < 0)
+        goto ioerror;
+
+    rnc_buf_close(b);
+
+    return 0;
+
+ notsup:
+    errno = ENOTSUP;
+    return -1;
+
+ nametoolong:
+    errno = ENAMETOOLONG;
+    return -1;
+
+ ioerror:
+    unlink(tmp);
+ fail:
+    rnc_buf_close(b);
+    return -1;
+}
+
+
+rnc_gain_t *rnc_gain_load(const char *path)
+{
+    rnc_gain_t *g;
+    rnc_buf_t  *b;
+    char        magic[8];
+    uint32_t    version, bins, freq, n, len, i;
+    off_t       offs, size;
+    int         rate;
+
+    g = NULL;
+
+    if ((b = rnc_buf_open(path, O_RDONLY, 0)) == NULL)
+        return NULL;
+
+    if (rnc_buf_read(b, magic, sizeof(magic)) != sizeof(magic) ||
+        memcmp(magic, STATE_MAGIC, sizeof(magic)))
+        goto invalid;
+
+    if (get_u32(b, &version) < 0 || get_u32(b, &bins) < 0 ||
+        get_u32(b, &freq) < 0 || get_u32(b, &n) < 0)
+        goto fail;
+
+    if (version < 1 || version > STATE_VERSION || bins != R128_BINS ||
+        (rate = rnc_freq_id(freq)) < 0)
+        goto invalid;
+
+    /* each track takes at least its label length, don't trust n blindly */
+    if ((offs = rnc_buf_rseek(b, 0, SEEK_CUR)) < 0 ||
+        (size = rnc_buf_rseek(b, 0, SEEK_END)) < 0 ||
+        rnc_buf_rseek(b, offs, SEEK_SET) != offs)
+        goto fail;
+
+    if (n > (uint64_t)(size - offs) / sizeof(len))
+        goto invalid;
+
+    g = rnc_gain_create(n, RNC_FORMAT_ID(RNC_CHANNELMAP_LEFTRIGHT,
+                                         RNC_ENCODING_PCM, 2, rate, 16,
+                                         RNC_SAMPLE_SIGNED, RNC_ENDIAN_HOST),
+                        0);
+
+    if (g == NULL)
+        goto fail;
+
+    for (i = 0; i < n; i++) {
+        if (get_u32(b, &len) < 0)
+            goto fail;
+
+        if (len > STATE_LABEL_MAX)
+            goto invalid;
+
+        if ((g->label[i] = mrp_allocz(len + 1)) == NULL)
+            goto fail;
+
+        if (rnc_buf_read(b, g->label[i], len) != (int)len)
+            goto invalid;
+
+        if (g->engine->load(g->state[i], b, version) < 0)
+            goto fail;
+    }
+
+    rnc_buf_close(b);
+
+    return g;
+
+ invalid:
+    errno = EINVAL;
+ fail:
+    rnc_gain_destroy(g);
+    rnc_buf_close(b);
+    return NULL;
+}
+
+
+int rnc_gain_merge(rnc_gain_t *dst, rnc_gain_t *src)
+{
+    void *state;
+    int   ntrack, n, i, j;
+
+    if (dst->chnl != src->chnl || dst->rate != src->rate ||
+        dst->engine != src->engine || dst->mode != src->mode)
+        goto invalid_format;
+
+    for (i = 0; i < dst->ntrack; i++)
+        gain_sync(dst, i);
+    for (i = 0; i < src->ntrack; i++)
+        gain_sync(src, i);
+
+    ntrack = dst->ntrack;
+
+    if (!mrp_reallocz(dst->state, ntrack, ntrack + src->ntrack) ||
+        !mrp_reallocz(dst->label, ntrack, ntrack + src->ntrack))
+        return -1;
+
+    if (dst->jobs != NULL) {
+        pthread_mutex_lock(&dst->lock);
+        if (!mrp_reallocz(dst->pending, ntrack, ntrack + src->ntrack) ||
+            !mrp_reallocz(dst->failed, ntrack, ntrack + src->ntrack)) {
+            pthread_mutex_unlock(&dst->lock);
+            return -1;
+        }
+        pthread_mutex_unlock(&dst->lock);
+    }
+
+    /*
+     * Take over the tracks of src, giving it fresh states in return,
+     * except the ones labelled the same as one of ours. Those we have
+     * analyzed again, so our results are the ones to keep.
+     */
+
+    for (i = 0, n = 0; i < src->ntrack; i++) {
+        if (src->label[i] != NULL) {
+            for (j = 0; j < ntrack; j++)
+                if (dst->label[j] && !strcmp(dst->label[j], src->label[i]))
+                    break;
+
+            if (j < ntrack)
+                continue;
+        }
+
+        if ((state = src->engine->create(src)) == NULL)
+            goto nomem;
+
+        dst->state[ntrack + n] = src->state[i];
+        dst->label[ntrack + n] = src->label[i];
+        src->state[i] = state;
+        src->label[i] = NULL;
+        n++;
+    }
+
+    dst->ntrack = ntrack + n;
+
+    return n;
+
+ invalid_format:
+    errno = EINVAL;
+    return -1;
+
+ nomem:
+    dst->ntrack = ntrack + n;
+    errno = ENOMEM;
+    return -1;
 }
@@ -38,6 +38,19 @@ MRP_CDECL_BEGIN
  * @brief Analyze album/tracks for EBU R128 loudness and replaygain.
  */
 
+/**
+ * @brief Analyzer context flags.
+ *
+ * By default loudness is analyzed with the built-in engine, using the
+ * fastest kernels the CPU supports. Its results are within 0.01 LU of
+ * those of libebur128.
+ */
+typedef enum {
+    RNC_GAIN_EBUR128   = 0x1,            /* analyze with libebur128 */
+    RNC_GAIN_SCALAR    = 0x2,            /* only use portable C kernels */
+    RNC_GAIN_TRUE_PEAK = 0x4,            /* also measure true peaks */
+} rnc_gain_flag_t;
+
 /**
  * @brief Create and initialize replaygain analyzer context.
  *
@@ -48,10 +61,26 @@ MRP_CDECL_BEGIN
  *
  * @param [in] ntrack  number of tracks to create calculator for
  * @param [in] format  format of tracks
+ * @param [in] flags   analyzer flags, a combination of rnc_gain_flag_t
  *
  * @return Returns a replaygain analyzer context.
  */
-rnc_gain_t *rnc_gain_create(int ntrack, uint32_t format);
+rnc_gain_t *rnc_gain_create(int ntrack, uint32_t format, int flags);
+
+/**
+ * @brief Get the sample formats supported by the analyzer.
+ *
+ * Get the sample formats replaygain analysis can be done for, in order
+ * of preference. Samples in the first format(s) are analyzed as is, the
+ * rest are converted before analysis.
+ *
+ * @param [out] buf   buffer to write supported formats into
+ * @param [in]  size  number of format entries buf has space for
+ *
+ * @return Returns the number of supported formats, which can be larger
+ *         than size.
+ */
+int rnc_gain_get_formats(uint32_t *buf, size_t size);
 
 /**
  * @brief Initialize given replaygain analyzer context.
@@ -61,10 +90,20 @@ rnc_gain_t *rnc_gain_create(int ntrack, uint32_t format);
  *
  * @param [in] ntrack  number of tracks to create calculator for
  * @param [in] format  format of tracks
+ * @param [in] flags   analyzer flags, a combination of rnc_gain_flag_t
  *
  * @return Returns a replaygain analyzer context.
  */
-int rnc_gain_init(rnc_gain_t *g, int ntrack, uint32_t format);
+int rnc_gain_init(rnc_gain_t *g, int ntrack, uint32_t format, int flags);
+
+/**
+ * @brief Get the name of the loudness analysis engine of a context.
+ *
+ * @param [in] g  replaygain analyzer context
+ *
+ * @return Returns the name of the engine the context analyzes with.
+ */
+const char *rnc_gain_engine(rnc_gain_t *g);
 
 /**
  * @brief Destroy an analyzer context.
@@ -102,7 +141,95 @@ void rnc_gain_exit(rnc_gain_t *g);
  *
  * @return Returns 0 on success, -1 otherwise.
  */
-int rnc_gain_analyze(rnc_gain_t *g, int track, char *samples, int nsample);
+int rnc_gain_analyze(rnc_gain_t *g, int track, const char *samples,
+                     int nsample);
+
+/**
+ * @brief Analyze the given samples of the given track in parallel.
+ *
+ * Like rnc_gain_analyze, but split the samples into up to nthread
+ * segments and analyze those on separate threads. This is meant for
+ * analyzing a long track in one go with cores to spare. The results
+ * are the same as if the samples were analyzed by rnc_gain_analyze.
+ * Samples too short to split, or not in the host byte order, and
+ * engines unable to split them are analyzed serially.
+ *
+ * @param [in] g        replaygain analyzer context
+ * @param [in] track    track to associate samples with
+ * @param [in] samples  interleaved sample buffer to analyze
+ * @param [in] nsample  number of samples per channel
+ * @param [in] nthread  maximum number of threads to use
+ *
+ * @return Returns 0 on success, -1 otherwise.
+ */
+int rnc_gain_analyze_parallel(rnc_gain_t *g, int track, const char *samples,
+                              int nsample, int nthread);
+
+/**
+ * @brief Analyze the given slice of samples of the given track.
+ *
+ * Like rnc_gain_analyze, but the samples are passed as a slice. If the
+ * context has been started with rnc_gain_start, the slice is queued for
+ * the analyzer thread, which keeps a reference to it until it is done
+ * with it, and this function returns right away. Otherwise the samples
+ * are analyzed before returning.
+ *
+ * @param [in] g        replaygain analyzer context
+ * @param [in] track    track to associate samples with
+ * @param [in] samples  slice of interleaved samples to analyze
+ *
+ * @return Returns 0 on success, -1 otherwise.
+ */
+int rnc_gain_analyze_slice(rnc_gain_t *g, int track, rnc_slice_t *samples);
+
+/**
+ * @brief Start analyzing asynchronously.
+ *
+ * Start a thread for the given context to analyze slices passed to
+ * rnc_gain_analyze_slice in the background. Once started, the rest of
+ * the functions querying or changing the state of a track first wait
+ * for all samples queued for that track to be analyzed. The thread is
+ * stopped by rnc_gain_exit.
+ *
+ * @param [in] g  replaygain analyzer context
+ *
+ * @return Returns 0 on success, -1 otherwise.
+ */
+int rnc_gain_start(rnc_gain_t *g);
+
+/**
+ * @brief Wait for the analysis of a track to catch up.
+ *
+ * Wait until all samples queued for the given track have been analyzed.
+ * Returns immediately for contexts not started with rnc_gain_start.
+ *
+ * @param [in] g      replaygain analyzer context
+ * @param [in] track  track to wait for
+ *
+ * @return Returns 0 on success, -1 if analyzing any of the queued samples
+ *         failed, in which case errno is also set.
+ */
+int rnc_gain_wait(rnc_gain_t *g, int track);
+
+/**
+ * @brief Move the analysis state of a track to another context.
+ *
+ * Move the analysis state of track strack in src to track dtrack in
+ * dst, replacing whatever dst had for that track. The source track is
+ * reset, ready to analyze a new track. This allows each thread to
+ * analyze tracks with its own context and collect the results into a
+ * single context for album gain calculation. Both contexts must have
+ * been created for the same format.
+ *
+ * @param [in] dst     context to move state to
+ * @param [in] dtrack  track to move state to
+ * @param [in] src     context to move state from
+ * @param [in] strack  track to move state from
+ *
+ * @return Returns 0 on success, -1 otherwise.
+ */
+int rnc_gain_transfer(rnc_gain_t *dst, int dtrack, rnc_gain_t *src,
+                      int strack);
 
 /**
  * @brief Calculate EBU R128 integrated loudness for the given track.
@@ -156,6 +283,21 @@ double rnc_gain_track_gain(rnc_gain_t *g, int track);
  */
 double rnc_gain_track_peak(rnc_gain_t *g, int track);
 
+/**
+ * @brief Calculate true peak for the given track.
+ *
+ * Calculate the ITU-R BS.1770 true peak, the peak of the 4x oversampled
+ * audio, for the given track. If the context was not created with
+ * RNC_GAIN_TRUE_PEAK, this is the same as the sample peak.
+ *
+ * @brief [in] g      replaygain analyzer context
+ * @brief [in] track  track to calculate true peak for
+ *
+ * @return Returns the calculated true peak on success, 0.0 on error
+ *         in which case errno is also set.
+ */
+double rnc_gain_track_true_peak(rnc_gain_t *g, int track);
+
 /**
  * @brief Calculate ReplayGain 1.0 gain for the whole album (all tracks).
  *
@@ -168,6 +310,85 @@ double rnc_gain_track_peak(rnc_gain_t *g, int track);
  */
 double rnc_gain_album_gain(rnc_gain_t *g);
 
+/**
+ * @brief Get the number of tracks of a replaygain analyzer context.
+ *
+ * @param [in] g  replaygain analyzer context
+ *
+ * @return Returns the number of tracks, including merged ones.
+ */
+int rnc_gain_tracks(rnc_gain_t *g);
+
+/**
+ * @brief Label the given track.
+ *
+ * Label a track, typically with the path of its output file. Labels
+ * are saved along with analyzer states and are used to tell tracks
+ * apart when merging them.
+ *
+ * @param [in] g      replaygain analyzer context
+ * @param [in] track  track to label
+ * @param [in] label  label to set, NULL to clear it
+ *
+ * @return Returns 0 on success, -1 otherwise.
+ */
+int rnc_gain_set_label(rnc_gain_t *g, int track, const char *label);
+
+/**
+ * @brief Get the label of the given track.
+ *
+ * @param [in] g      replaygain analyzer context
+ * @param [in] track  track to get label of
+ *
+ * @return Returns the label of the track, or NULL if it has none.
+ */
+const char *rnc_gain_track_label(rnc_gain_t *g, int track);
+
+/**
+ * @brief Save the analysis results of labelled tracks to a file.
+ *
+ * Save the loudness histograms and peaks of all labelled tracks to
+ * the given file, replacing it atomically. The saved state of a track
+ * is a few kilobytes at most, however long the track is. Only the
+ * native engine can save its state.
+ *
+ * @param [in] g     replaygain analyzer context
+ * @param [in] path  file to save analysis results to
+ *
+ * @return Returns 0 on success, -1 otherwise.
+ */
+int rnc_gain_save(rnc_gain_t *g, const char *path);
+
+/**
+ * @brief Load previously saved analysis results from a file.
+ *
+ * Create a replaygain analyzer context with the tracks saved in the
+ * given file. The loudness, range and peak of the loaded tracks can be
+ * queried, and they can be merged into other contexts, but they can't
+ * be analyzed any further.
+ *
+ * @param [in] path  file to load analysis results from
+ *
+ * @return Returns the loaded context, or NULL on error.
+ */
+rnc_gain_t *rnc_gain_load(const char *path);
+
+/**
+ * @brief Merge the tracks of one replaygain context into another.
+ *
+ * Append the tracks of src to those of dst, for instance to calculate
+ * album gain over several discs. The tracks of src labelled the same
+ * as a track of dst are skipped, those are taken to have been analyzed
+ * again in dst. The merged tracks are handed over to dst and replaced
+ * with fresh ones in src.
+ *
+ * @param [in] dst  replaygain analyzer context to merge to
+ * @param [in] src  replaygain analyzer context to merge from
+ *
+ * @return Returns the number of tracks merged, or -1 on error.
+ */
+int rnc_gain_merge(rnc_gain_t *dst, rnc_gain_t *src);
+
 MRP_CDECL_END
 
 #endif /* __RIPNCODE_REPLAYGAIN_H__ */
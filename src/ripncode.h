@@ -41,14 +41,20 @@
 
 typedef struct rnc_dev_api_s  rnc_dev_api_t;
 typedef struct rnc_dev_s      rnc_dev_t;
+typedef struct rnc_readahead_s rnc_readahead_t;
 typedef struct rnc_track_s    rnc_track_t;
 typedef struct rnc_meta_s     rnc_meta_t;
 typedef struct rnc_metadb_s   rnc_metadb_t;
 typedef struct rnc_meta_api_s rnc_meta_api_t;
 typedef struct rnc_buf_s      rnc_buf_t;
+typedef struct rnc_slice_s    rnc_slice_t;
 typedef struct rnc_enc_api_s  rnc_enc_api_t;
 typedef struct rnc_encoder_s  rnc_encoder_t;
 typedef struct rnc_gain_s     rnc_gain_t;
+typedef struct rnc_queue_s    rnc_queue_t;
+typedef struct rnc_convert_s  rnc_convert_t;
+typedef struct rnc_arena_s    rnc_arena_t;
+typedef struct rnc_pool_s     rnc_pool_t;
 typedef struct rnc_s          rnc_t;
 
 struct rnc_s {
@@ -62,6 +68,9 @@ struct rnc_s {
     int               ntrack;            /* number of tracks */
     rnc_encoder_t    *enc;               /* active encoder */
     rnc_gain_t       *gain;              /* replaygain calculator */
+    uint32_t          fid;               /* negotiated track format */
+    int               out_fd;            /* stdout, if encoding to it */
+    rnc_arena_t      *arena;             /* allocations for the whole rip */
     rnc_metadb_t     *db;                /* metadata DB */
 
     /* command line arguments */
@@ -77,8 +86,18 @@ struct rnc_s {
     int         log_mask;                /* what to log */
     const char *log_target;              /* where to log it to */
     int         dry_run;                 /* don't rip/encode */
+    int         pipeline;                /* rip, encode and write in parallel */
+    int         readahead;               /* device read-ahead depth */
+    int         threads;                 /* encoder threads per track */
+    int         workers;                 /* tracks to encode in parallel */
+    size_t      spill;                   /* in-memory buffer limit */
+    int         hugepages;               /* RNC_MEM_* flags for audio */
+    const char *spill_dir;               /* where to spill beyond that */
+    int         gain_flags;              /* RNC_GAIN_* analyzer flags */
+    const char *gain_state;              /* album gain state to merge with */
 };
 
+#include <ripncode/memory.h>
 #include <ripncode/format.h>
 #include <ripncode/device.h>
 #include <ripncode/track.h>
@@ -86,5 +105,7 @@ struct rnc_s {
 #include <ripncode/buffer.h>
 #include <ripncode/encoder.h>
 #include <ripncode/replaygain.h>
+#include <ripncode/queue.h>
+#include <ripncode/md5.h>
 
 #endif /* __RIPNCODE_H__ */
@@ -34,6 +34,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <limits.h>
+#include <pthread.h>
 
 #include <ripncode/ripncode.h>
 #include <ripncode/setup.h>
@@ -57,6 +58,29 @@
 
 
 
+static void setup_stdout(rnc_t *rnc)
+{
+    /*
+     * When encoding to stdout, keep the real stdout for the encoded data
+     * and send everything we would normally print there to stderr. Tracks
+     * must come out in order, so they can't be encoded in parallel.
+     */
+
+    if (strcmp(rnc->output, "-"))
+        return;
+
+    if ((rnc->out_fd = dup(STDOUT_FILENO)) < 0 ||
+        dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+        rnc_fatal(rnc, "failed to redirect stdout (%d: %s)", errno,
+                  strerror(errno));
+
+    if (rnc->workers > 1) {
+        rnc_warning(rnc, "can't use workers for encoding to stdout");
+        rnc->workers = 1;
+    }
+}
+
+
 static rnc_t *rnc_init(int argc, char *argv[], char *envp[])
 {
     static rnc_t rnc;
@@ -68,6 +92,10 @@ static rnc_t *rnc_init(int argc, char *argv[], char *envp[])
     rnc_meta_init(&rnc);
 
     rnc_cmdline_parse(&rnc, argc, argv, envp);
+    setup_stdout(&rnc);
+
+    if ((rnc.arena = rnc_arena_create("rip", 0, 0)) == NULL)
+        rnc_fatal(&rnc, "failed to create memory arena");
 
     return &rnc;
 }
@@ -87,7 +115,8 @@ static void discover_tracks(rnc_t *rnc)
     if (rnc->ntrack <= 0)
         rnc_fatal(rnc, "failed to find any audio tracks on '%s'", rnc->device);
 
-    rnc->tracks = mrp_allocz_array(typeof(rnc->tracks[0]), rnc-> ntrack);
+    rnc->tracks = rnc_arena_alloc_array(rnc->arena, typeof(rnc->tracks[0]),
+                                        rnc->ntrack);
 
     if (rnc->tracks == NULL)
         rnc_fatal(rnc, "failed to allocate %d tracks", rnc->ntrack);
@@ -99,163 +128,444 @@ static void discover_tracks(rnc_t *rnc)
 
     if (rnc->speed)
         rnc_device_set_speed(rnc->dev, rnc->speed);
+
+    if (rnc->readahead > 0 &&
+        rnc_device_set_readahead(rnc->dev, rnc->readahead, 0) < 0)
+        rnc_fatal(rnc, "failed to enable read-ahead for '%s'", rnc->device);
 }
 
 
-int encode_track(rnc_t *rnc, rnc_track_t *t)
+static void print_memory(rnc_t *rnc)
 {
-    rnc_encoder_t *enc;
-    rnc_meta_t    *meta;
-    int            cmpr, cmap, chnl, rate, bits, smpl, endn, fid;
-    int            blksize, bufsize, n, i;
-    char          *buf;
-    double         gain, peak, loud, range;
+    rnc_mem_stats_t st;
+
+    MRP_UNUSED(rnc);
+
+    rnc_mem_stats(&st);
+
+    printf("memory: peak %zu KB in %zu mappings (%zu with huge pages), "
+           "max RSS %ld KB, page faults %ld minor, %ld major\n",
+           st.peak / 1024, st.nmap, st.nhuge, st.maxrss, st.minflt,
+           st.majflt);
+}
+
+
+static void print_readahead(rnc_t *rnc)
+{
+    rnc_readahead_stats_t st;
+
+    if (rnc_device_readahead_stats(rnc->dev, &st) < 0)
+        return;
+
+    printf("read-ahead: %d x %zu bytes, average fill %.1f, "
+           "%llu underruns in %llu reads\n", st.depth, st.slotsize,
+           st.avgfill, (unsigned long long)st.underruns,
+           (unsigned long long)st.reads);
+}
 
-    if (rnc_device_seek(rnc->dev, t, 0) < 0) {
-        rnc_error(rnc, "failed to seek to beginning of track #%d", t->id);
-        return -1;
-    }
+
+#define MAX_FORMATS 32                   /* max. formats to negotiate from */
+
+/*
+ * Pick the sample format tracks are read, encoded and analyzed in. We
+ * prefer a format the device can produce and both the encoder and the
+ * replaygain analyzer take as is, so that samples are passed through
+ * the whole pipeline without conversion. If there is no such format,
+ * we settle for one needing as few conversions as possible.
+ */
+
+static void negotiate_format(rnc_t *rnc, int first)
+{
+    uint32_t dev[MAX_FORMATS], enc[MAX_FORMATS], gain[MAX_FORMATS];
+    int      ndev, nenc, ngain, cmpr, d, e, g, cost, best, bcost;
 
     cmpr = rnc_compress_id(rnc, rnc->format);
-    cmap = RNC_CHANNELMAP_LEFTRIGHT;
-    chnl = 2;
-    rate = RNC_SAMPLERATE_44100;
-    bits = 16;
-    smpl = RNC_SAMPLE_SIGNED;
-    endn = RNC_ENDIAN_LITTLE;
-
-    if (cmpr < 0) {
-        rnc_error(rnc, "failed to find encoder for format '%s'", rnc->format);
+
+    if (cmpr < 0)
+        rnc_fatal(rnc, "failed to find encoder for format '%s'", rnc->format);
+
+    /* disc images report the format of the current track, shared by all */
+    if (rnc_device_seek(rnc->dev, rnc->tracks + first, 0) < 0)
+        rnc_fatal(rnc, "failed to seek to track #%d", rnc->tracks[first].id);
+
+    ndev  = rnc_device_get_formats(rnc->dev, dev, MAX_FORMATS);
+    nenc  = rnc_encoder_get_formats(rnc, RNC_FORMAT_SET_CMPR(0, cmpr),
+                                    enc, MAX_FORMATS);
+    ngain = rnc_gain_get_formats(gain, MAX_FORMATS);
+
+    if (ndev > MAX_FORMATS)
+        ndev = MAX_FORMATS;
+    if (nenc > MAX_FORMATS)
+        nenc = MAX_FORMATS;
+    if (ngain > MAX_FORMATS)
+        ngain = MAX_FORMATS;
+
+    best  = -1;
+    bcost = 0;
+
+    /* cost is the rank in the encoder and analyzer lists, 0 is ideal */
+    for (d = 0; d < ndev; d++) {
+        for (e = 0; e < nenc; e++)
+            if (RNC_FORMAT_SAME_SAMPLES(dev[d], enc[e]))
+                break;
+        for (g = 0; g < ngain; g++)
+            if (RNC_FORMAT_SAME_SAMPLES(dev[d], gain[g]))
+                break;
+
+        if (e >= nenc || g >= ngain)
+            continue;
+
+        cost = e + g;
+
+        if (best < 0 || cost < bcost) {
+            best  = d;
+            bcost = cost;
+        }
+    }
+
+    if (best < 0)
+        rnc_fatal(rnc, "no common sample format for device '%s' and "
+                  "format '%s'", rnc->device, rnc->format);
+
+    if (rnc_device_set_format(rnc->dev, dev[best]) < 0)
+        rnc_fatal(rnc, "failed to set format 0x%x for device '%s'",
+                  dev[best], rnc->device);
+
+    rnc->fid = RNC_FORMAT_SET_CMPR(dev[best], cmpr);
+
+    mrp_debug("negotiated format 0x%x (device format 0x%x, cost %d)",
+              rnc->fid, dev[best], bcost);
+}
+
+
+static void create_gain(rnc_t *rnc, uint32_t fid)
+{
+    if (rnc->gain == NULL) {
+        rnc->gain = rnc_gain_create(rnc->ntrack, fid, rnc->gain_flags);
+
+        if (rnc->gain == NULL)
+            rnc_error(&rnc, "failed to initialize replaygain calculation");
+
+        /* pooled workers analyze in parallel already, others offload it */
+        if (rnc->workers <= 1 && rnc_gain_start(rnc->gain) < 0)
+            rnc_warning(rnc, "failed to start replaygain analyzer thread");
+    }
+}
+
+
+static int output_path(rnc_t *rnc, rnc_track_t *t, char *path, size_t size)
+{
+    int n;
+
+    n = snprintf(path, size, "%s-%d.%s", rnc->output, t->id, rnc->format);
+
+    if (n < 0 || n >= (int)size) {
+        rnc_error(rnc, "invalid output file name for track #%d", t->id);
         return -1;
     }
 
-    fid = RNC_FORMAT_ID(cmap, cmpr, chnl, rate, bits, smpl, endn);
-    enc = rnc_encoder_create(rnc, fid);
+    return 0;
+}
+
+
+static rnc_encoder_t *create_encoder(rnc_t *rnc, rnc_track_t *t)
+{
+    rnc_encoder_t *enc;
+    rnc_meta_t    *meta, none;
+    char           path[PATH_MAX];
+    int            flags;
+    if (output_path(rnc, t, path, sizeof(path)) < 0)
+        return NULL;
+
+    enc = rnc_encoder_create(rnc, rnc->fid);
 
     if (enc == NULL) {
         rnc_error(rnc, "failed to create encoder for format '%s'", rnc->format);
-        return -1;
+        return NULL;
     }
 
     rnc_encoder_set_quality(enc, 0xffffU, 0xffffU);
 
-    meta = rnc_meta_lookup(rnc->db, t->id);
+    if (rnc->threads > 1 && rnc_encoder_set_threads(enc, rnc->threads) < 0)
+        rnc_warning(rnc, "failed to set encoder threads to %d", rnc->threads);
+
+    /*
+     * Let the encoder stream straight to the output file if it can, so
+     * memory use does not grow with the track and data hits the disk as
+     * it is encoded. Otherwise the encoded track is collected in memory
+     * and copied to the output file by write_output once finished. This
+     * is always the case when we write to stdout.
+     */
+
+    if (rnc->out_fd < 0 && rnc_encoder_set_output(enc, path) < 0 &&
+        errno != ENOTSUP) {
+        rnc_error(rnc, "failed to open '%s' (%d: %s)", path, errno,
+                  strerror(errno));
+        rnc_encoder_destroy(enc);
+        return NULL;
+    }
 
-    if (meta != NULL)
-        rnc_encoder_set_metadata(enc, meta);
+    create_gain(rnc, rnc->fid);
 
-    if (rnc->gain == NULL) {
-        rnc->gain = rnc_gain_create(rnc->ntrack, fid);
+    /*
+     * Always set metadata, even if empty, to reserve replaygain tags. The
+     * album gain can only be filled in if we write to a file we can patch
+     * once all tracks are done.
+     */
 
-        if (rnc->gain == NULL)
-            rnc_error(&rnc, "failed to initialize replaygain calculation");
+    flags = 0;
+
+    if (rnc->out_fd < 0 && rnc->gain != NULL)
+        flags |= RNC_META_ALBUM_GAIN;
+
+    meta = rnc_meta_lookup(rnc->db, t->id);
+
+    if (meta != NULL) {
+        rnc_encoder_set_metadata(enc, meta, flags);
+        rnc_meta_free(meta);
+    }
+    else {
+        mrp_clear(&none);
+        rnc_encoder_set_metadata(enc, &none, flags);
     }
 
-    blksize = rnc_device_get_blocksize(rnc->dev);
-    bufsize = (256 + 128) * blksize;
-    buf     = alloca(bufsize);
+    return enc;
+}
 
-    for (i = 0; i < (int)t->nblk; i += n / blksize) {
-        n = rnc_device_read(rnc->dev, buf, bufsize);
 
-        if (n < 0) {
-            rnc_error(rnc, "failed to read block #%d of track #%d", i, t->id);
-            goto fail;
-        }
+static int encode_chunk(rnc_t *rnc, rnc_encoder_t *enc, rnc_track_t *t,
+                        int blk, rnc_slice_t *s)
+{
+    int         blksize = rnc_device_get_blocksize(rnc->dev);
+    const void *buf     = rnc_slice_data(s);
+    int         size    = rnc_slice_size(s);
 
-        if (rnc_encoder_write(enc, buf, n) < 0) {
-            rnc_error(rnc, "failed to encode blocks #%d-%d of track #%d",
-                      i, i + bufsize / blksize, t->id);
-            goto fail;
-        }
+    /* queue for analysis first, so that it runs while we encode */
+    if (rnc_gain_analyze_slice(rnc->gain, t->idx, s) < 0)
+        rnc_error(rnc, "replaygain analysis failed");
 
-        if (rnc_gain_analyze(rnc->gain, t->idx, buf, n / (2 * 2)) < 0)
-            rnc_error(rnc, "replaygain analysis failed");
+    if (rnc_encoder_write(enc, buf, size) < 0) {
+        rnc_error(rnc, "failed to encode blocks #%d-%d of track #%d",
+                  blk, blk + size / blksize, t->id);
+        return -1;
+    }
 
+    /* only update progress when it crosses a full percent */
+    if ((100 * blk) / (int)t->nblk !=
+        (100 * (blk + size / blksize)) / (int)t->nblk) {
         printf("\rtrack #%d: %.2f %%", t->id,
-               (100.0 * (i + n / blksize)) / t->nblk);
+               (100.0 * (blk + size / blksize)) / t->nblk);
         fflush(stdout);
     }
 
-    loud  = rnc_gain_track_loudness(rnc->gain, t->idx);
-    range = rnc_gain_track_range(rnc->gain, t->idx);
-    gain  = rnc_gain_track_gain(rnc->gain, t->idx);
-    peak  = rnc_gain_track_peak(rnc->gain, t->idx);
+    return 0;
+}
+
+
+static int finish_encoder(rnc_t *rnc, rnc_encoder_t *enc, rnc_gain_t *g,
+                          int gidx, rnc_track_t *t)
+{
+    double gain, peak, loud, range;
+
+    if (rnc_gain_wait(g, gidx) < 0)
+        rnc_error(rnc, "replaygain analysis of track #%d failed", t->id);
+
+    loud  = rnc_gain_track_loudness(g, gidx);
+    range = rnc_gain_track_range(g, gidx);
+    gain  = rnc_gain_track_gain(g, gidx);
+
+    if (rnc->gain_flags & RNC_GAIN_TRUE_PEAK)
+        peak = rnc_gain_track_true_peak(g, gidx);
+    else
+        peak = rnc_gain_track_peak(g, gidx);
 
     rnc_encoder_set_gain(enc, gain, peak, 0);
 
     if (rnc_encoder_finish(enc) < 0) {
         rnc_error(rnc, "failed to finalize encoding of track #%d", t->id);
-        goto fail;
+        return -1;
     }
 
-    rnc_meta_free(meta);
-
+    flockfile(stdout);
     printf("\rtrack #%d: done     \n", t->id);
     printf("    loudness: %2.2f, range: %2.2f, peak: %2.2f, replaygain: %2.2f\n",
            loud, range, peak, gain);
     fflush(stdout);
+    funlockfile(stdout);
 
-    rnc->enc = enc;
     return 0;
+}
 
- fail:
-    rnc_encoder_destroy(enc);
-    return -1;
+
+static int read_size(rnc_t *rnc, rnc_track_t *t, int blk, int bufsize)
+{
+    int blksize = rnc_device_get_blocksize(rnc->dev);
+
+    if (bufsize > ((int)t->nblk - blk) * blksize)
+        return ((int)t->nblk - blk) * blksize;
+    else
+        return bufsize;
 }
 
 
-int write_track(rnc_t *rnc, rnc_track_t *t)
+static void release_chunk(void *data, size_t size, void *user_data)
 {
-    char path[PATH_MAX], buf[64 * 1024];
-    int  r, w, n, fd;
+    MRP_UNUSED(size);
 
-    n = snprintf(path, sizeof(path), "%s-%d.%s", rnc->output, t->id,
-                 rnc->format);
+    rnc_pool_put(user_data, data);
+}
 
-    if (n < 0 || n >= (int)sizeof(path)) {
-        rnc_error(rnc, "invalid output file name for track #%d", t->id);
-        goto fail;
+
+/*
+ * Read the next size bytes of audio into a chunk from the given pool.
+ * The chunk is owned by the returned slice, and goes back to the pool
+ * once both the encoder and the analyzer are done with it.
+ */
+static rnc_slice_t *read_chunk(rnc_t *rnc, rnc_pool_t *chunks, int size)
+{
+    rnc_slice_t *s;
+    char        *buf;
+    int          n;
+
+    if ((buf = rnc_pool_get(chunks)) == NULL)
+        return NULL;
+
+    n = rnc_device_read(rnc->dev, buf, size);
+
+    if (n <= 0) {
+        rnc_pool_put(chunks, buf);
+        return NULL;
     }
 
-    fd = open(path, O_WRONLY | O_CREAT, 0644);
+    s = rnc_slice_create(buf, n, release_chunk, chunks);
 
-    if (fd < 0) {
-        rnc_error(rnc, "failed to open '%s'", path);
-        goto fail;
+    if (s == NULL)
+        rnc_pool_put(chunks, buf);
+
+    return s;
+}
+
+
+int encode_track(rnc_t *rnc, rnc_track_t *t)
+{
+    rnc_encoder_t *enc;
+    rnc_pool_t    *chunks;
+    rnc_slice_t   *s;
+    int            blksize, bufsize, status, n, i;
+
+    if (rnc_device_seek(rnc->dev, t, 0) < 0) {
+        rnc_error(rnc, "failed to seek to beginning of track #%d", t->id);
+        return -1;
     }
 
-    while ((r = rnc_encoder_read(rnc->enc, buf, sizeof(buf))) > 0) {
-        w = 0;
+    enc = create_encoder(rnc, t);
 
-        while (w < r) {
-            n = write(fd, buf + w, r - w);
+    if (enc == NULL)
+        return -1;
 
-            if (n < 0) {
-                if (errno == EINTR)
-                    continue;
-                else {
-                    rnc_error(rnc, "failed to write to '%s' (%d: %s)", path,
-                              errno, strerror(errno));
-                    goto fail;
-                }
-            }
+    blksize = rnc_device_get_blocksize(rnc->dev);
+    bufsize = (256 + 128) * blksize;
+    chunks  = rnc_pool_create("track", bufsize, 4, rnc->hugepages);
+
+    if (chunks == NULL)
+        goto fail;
+
+    /*
+     * Read the track a chunk at a time into buffers of our own. Each
+     * chunk stays around until the analyzer is done with it, so analysis
+     * of a chunk overlaps with encoding and reading the next ones, and
+     * we only need to wait for the analyzer once, at the end of the
+     * track. The number of chunks in flight is bounded by the depth of
+     * the analyzer queue.
+     */
 
-            w += n;
+    for (i = 0; i < (int)t->nblk; i += n / blksize) {
+        s = read_chunk(rnc, chunks, read_size(rnc, t, i, bufsize));
+
+        if (s == NULL) {
+            rnc_error(rnc, "failed to read block #%d of track #%d", i, t->id);
+            goto fail;
         }
+
+        n = rnc_slice_size(s);
+
+        status = encode_chunk(rnc, enc, t, i, s);
+        rnc_slice_unref(s);
+
+        if (status < 0)
+            goto fail;
     }
 
-    close(fd);
-    rnc_encoder_destroy(rnc->enc);
-    rnc->enc = NULL;
+    if (finish_encoder(rnc, enc, rnc->gain, t->idx, t) < 0)
+        goto fail;
+
+    rnc_pool_destroy(chunks);
 
+    rnc->enc = enc;
     return 0;
 
  fail:
+    if (chunks != NULL) {
+        /* the analyzer might still hold some of our chunks */
+        if (rnc->gain != NULL)
+            rnc_gain_wait(rnc->gain, t->idx);
+        rnc_pool_destroy(chunks);
+    }
+    rnc_encoder_destroy(enc);
+    return -1;
+}
+
+
+static int write_output(rnc_t *rnc, rnc_track_t *t, rnc_encoder_t *enc)
+{
+    char path[PATH_MAX];
+    int  fd;
+
+    /* already written by the encoder */
+    if (enc->output)
+        return 0;
+
+    if (rnc->out_fd >= 0) {
+        fd = rnc->out_fd;
+        snprintf(path, sizeof(path), "<stdout>");
+    }
+    else {
+        if (output_path(rnc, t, path, sizeof(path)) < 0)
+            return -1;
+
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+        if (fd < 0) {
+            rnc_error(rnc, "failed to open '%s'", path);
+            return -1;
+        }
+    }
+
+    if (rnc_encoder_write_to_fd(enc, fd) < 0) {
+        rnc_error(rnc, "failed to write to '%s' (%d: %s)", path, errno,
+                  strerror(errno));
+        if (fd != rnc->out_fd)
+            close(fd);
+        return -1;
+    }
+
+    if (fd != rnc->out_fd)
+        close(fd);
+
+    return 0;
+}
+
+
+int write_track(rnc_t *rnc, rnc_track_t *t)
+{
+    int status;
+
+    status = write_output(rnc, t, rnc->enc);
+
     rnc_encoder_destroy(rnc->enc);
     rnc->enc = NULL;
 
-    return -1;
+    return status;
 }
 
 
@@ -271,6 +581,748 @@ int rip_track(rnc_t *rnc, int idx)
 }
 
 
+/*
+ * pipelined ripping
+ *
+ * In pipelined mode ripping is split into three stages, each running in
+ * its own thread: a reader which reads audio from the device, an encoder
+ * which encodes the audio, and a writer which writes the encoded tracks
+ * to their final destination. The reader passes audio to the encoder in
+ * a fixed set of chunks, cycling between a free and a full queue. The
+ * encoder queues the audio of each chunk for loudness analysis, which
+ * runs in the replaygain analyzer thread. The audio is handed out as a
+ * slice, and the chunk is recycled to the free queue once both the
+ * encoder and the analyzer have dropped their reference to it. The
+ * encoder passes finished tracks to the writer in a queue of its own.
+ * Since the reader only ever waits for free chunks, it carries on
+ * reading the next track while the previous one is still being encoded.
+ */
+
+#define PIPELINE_CHUNKS 16               /* number of chunks in flight */
+#define PIPELINE_TRACKS 2                /* number of tracks to write queue */
+
+typedef struct {
+    rnc_track_t *t;                      /* track data belongs to */
+    int          blk;                    /* first block within track */
+    rnc_slice_t *audio;                  /* audio read, NULL on error */
+    rnc_queue_t *free;                   /* queue to recycle chunk to */
+    unsigned int eot : 1;                /* last chunk of track */
+    unsigned int error : 1;              /* failed to read track */
+    char         data[0];                /* chunk data */
+} pipe_chunk_t;
+
+typedef struct {
+    rnc_track_t   *t;                    /* encoded track */
+    rnc_encoder_t *enc;                  /* encoder with encoded data */
+} pipe_track_t;
+
+typedef struct {
+    rnc_t       *rnc;                    /* RNC instance */
+    int          first;                  /* first track to rip */
+    int          last;                   /* last track to rip */
+    int          bufsize;                /* chunk buffer size */
+    rnc_queue_t *free;                   /* free chunks */
+    rnc_queue_t *full;                   /* chunks with audio to encode */
+    rnc_queue_t *done;                   /* encoded tracks to write */
+    rnc_pool_t  *chunks;                 /* chunk buffers */
+} pipeline_t;
+
+
+static void recycle_chunk(void *data, size_t size, void *user_data)
+{
+    pipe_chunk_t *c = user_data;
+
+    MRP_UNUSED(data);
+    MRP_UNUSED(size);
+
+    rnc_queue_push(c->free, c);
+}
+
+
+static void *pipeline_reader(void *ptr)
+{
+    pipeline_t   *p   = ptr;
+    rnc_t        *rnc = p->rnc;
+    int           blksize, idx, i, n, error;
+    rnc_track_t  *t;
+    pipe_chunk_t *c;
+
+    blksize = rnc_device_get_blocksize(rnc->dev);
+
+    for (idx = p->first; idx <= p->last; idx++) {
+        t = rnc->tracks + idx;
+
+        if (rnc_device_seek(rnc->dev, t, 0) < 0) {
+            rnc_error(rnc, "failed to seek to beginning of track #%d", t->id);
+
+            /* fail the track in the encoder, and move on to the next one */
+            if ((c = rnc_queue_pop(p->free)) == NULL)
+                goto out;
+
+            c->t     = t;
+            c->blk   = 0;
+            c->free  = p->free;
+            c->audio = NULL;
+            c->error = 1;
+            c->eot   = 1;
+
+            if (rnc_queue_push(p->full, c) < 0)
+                goto out;
+
+            continue;
+        }
+
+        for (i = 0; i < (int)t->nblk; i += n / blksize) {
+            if ((c = rnc_queue_pop(p->free)) == NULL)
+                goto out;
+
+            n = rnc_device_read(rnc->dev, c->data,
+                                read_size(rnc, t, i, p->bufsize));
+
+            c->t     = t;
+            c->blk   = i;
+            c->free  = p->free;
+            c->audio = n < 0 ? NULL :
+                rnc_slice_create(c->data, n, recycle_chunk, c);
+            c->error = error = c->audio == NULL;
+            c->eot   = error || i + n / blksize >= (int)t->nblk;
+
+            if (error)
+                rnc_error(rnc, "failed to read block #%d of track #%d",
+                          i, t->id);
+
+            if (rnc_queue_push(p->full, c) < 0)
+                goto out;
+
+            if (error)
+                break;
+        }
+    }
+
+ out:
+    rnc_queue_close(p->full);
+
+    return NULL;
+}
+
+
+/*
+ * Drop the encoder of a failed track. The analyzer may still hold slices
+ * of the earlier chunks of the track, let it finish with those first.
+ */
+static void drop_encoder(rnc_t *rnc, rnc_encoder_t *enc, rnc_track_t *t)
+{
+    rnc_gain_wait(rnc->gain, t->idx);
+    rnc_encoder_destroy(enc);
+}
+
+
+static void *pipeline_encoder(void *ptr)
+{
+    pipeline_t    *p   = ptr;
+    rnc_t         *rnc = p->rnc;
+    rnc_encoder_t *enc;
+    rnc_track_t   *t;
+    pipe_chunk_t  *c;
+    pipe_track_t  *d;
+
+    enc = NULL;
+    t   = NULL;
+
+    while ((c = rnc_queue_pop(p->full)) != NULL) {
+        if (c->t != t) {
+            if (enc != NULL)
+                drop_encoder(rnc, enc, t);
+            t   = c->t;
+            enc = create_encoder(rnc, t);
+        }
+
+        if (enc != NULL && !c->error) {
+            if (encode_chunk(rnc, enc, t, c->blk, c->audio) < 0) {
+                drop_encoder(rnc, enc, t);
+                enc = NULL;
+            }
+        }
+
+        if (enc != NULL && c->error) {
+            drop_encoder(rnc, enc, t);
+            enc = NULL;
+        }
+
+        if (c->eot && enc != NULL) {
+            if (finish_encoder(rnc, enc, rnc->gain, t->idx, t) < 0 ||
+                (d = rnc_arena_alloc(rnc->arena, sizeof(*d))) == NULL) {
+                drop_encoder(rnc, enc, t);
+            }
+            else {
+                d->t   = t;
+                d->enc = enc;
+
+                if (rnc_queue_push(p->done, d) < 0)
+                    rnc_encoder_destroy(enc);
+            }
+
+            enc = NULL;
+        }
+
+        if (c->audio != NULL)
+            rnc_slice_unref(c->audio);
+        else
+            rnc_queue_push(p->free, c);
+    }
+
+    if (enc != NULL)
+        drop_encoder(rnc, enc, t);
+    rnc_queue_close(p->done);
+
+    return NULL;
+}
+
+
+static void *pipeline_writer(void *ptr)
+{
+    pipeline_t   *p   = ptr;
+    pipe_track_t *d;
+
+    while ((d = rnc_queue_pop(p->done)) != NULL) {
+        write_output(p->rnc, d->t, d->enc);
+        rnc_encoder_destroy(d->enc);
+    }
+
+    return NULL;
+}
+
+
+int rip_pipelined(rnc_t *rnc, int first, int last)
+{
+    pipeline_t    p;
+    pthread_t     reader, encoder, writer;
+    pipe_chunk_t *c;
+    double        rstall, estall, wstall, s;
+    int           i, status;
+
+    mrp_clear(&p);
+    p.rnc     = rnc;
+    p.first   = first;
+    p.last    = last;
+    p.bufsize = (256 + 128) * rnc_device_get_blocksize(rnc->dev);
+    p.free    = rnc_queue_create(PIPELINE_CHUNKS);
+    p.full    = rnc_queue_create(PIPELINE_CHUNKS);
+    p.done    = rnc_queue_create(PIPELINE_TRACKS);
+    status    = -1;
+
+    if (p.free == NULL || p.full == NULL || p.done == NULL)
+        goto out;
+
+    /* all chunks come from a single, possibly huge page backed, slab */
+    p.chunks = rnc_pool_create("pipeline", sizeof(*c) + p.bufsize,
+                               PIPELINE_CHUNKS, rnc->hugepages);
+
+    if (p.chunks == NULL)
+        goto out;
+
+    for (i = 0; i < PIPELINE_CHUNKS; i++) {
+        if ((c = rnc_pool_get(p.chunks)) == NULL)
+            goto out;
+
+        rnc_queue_push(p.free, c);
+    }
+
+    /* the encoder would lazily create the gain calculator, don't race */
+    create_gain(rnc, rnc->fid);
+
+    if (pthread_create(&writer, NULL, pipeline_writer, &p) != 0)
+        goto out;
+
+    if (pthread_create(&encoder, NULL, pipeline_encoder, &p) != 0) {
+        rnc_queue_close(p.done);
+        pthread_join(writer, NULL);
+        goto out;
+    }
+
+    if (pthread_create(&reader, NULL, pipeline_reader, &p) != 0) {
+        rnc_queue_close(p.full);
+        pthread_join(encoder, NULL);
+        pthread_join(writer, NULL);
+        goto out;
+    }
+
+    pthread_join(reader, NULL);
+    pthread_join(encoder, NULL);
+    pthread_join(writer, NULL);
+
+    rnc_queue_stalls(p.free, NULL, &rstall);
+    rnc_queue_stalls(p.full, NULL, &estall);
+    rnc_queue_stalls(p.done, &s, &wstall);
+    estall += s;
+
+    printf("pipeline stalls: reader %.2f s, encoder %.2f s, writer %.2f s\n",
+           rstall, estall, wstall);
+
+    status = 0;
+
+ out:
+    /* chunks may still be queued for analysis, don't pull them away */
+    if (rnc->gain != NULL)
+        for (i = first; i <= last; i++)
+            rnc_gain_wait(rnc->gain, rnc->tracks[i].idx);
+
+    if (p.free != NULL) {
+        rnc_queue_close(p.free);
+        while ((c = rnc_queue_pop(p.free)) != NULL)
+            rnc_pool_put(p.chunks, c);
+    }
+
+    rnc_pool_destroy(p.chunks);
+
+    rnc_queue_destroy(p.free);
+    rnc_queue_destroy(p.full);
+    rnc_queue_destroy(p.done);
+
+    if (status < 0)
+        rnc_error(rnc, "failed to set up ripping pipeline");
+
+    return status;
+}
+
+
+/*
+ * pooled ripping
+ *
+ * In pooled mode a reader thread reads complete tracks into memory and
+ * hands them over to a pool of encoder workers. Each worker encodes and
+ * writes a different track while the reader carries on with the next
+ * one. Tracks are read, and hence picked up by the workers, in order of
+ * decreasing length, so that the last track to finish is a short one and
+ * the other workers are not left idle while a long one is still being
+ * encoded. Each worker analyzes loudness with a replaygain context of its
+ * own and transfers the results of each finished track to the album-wide
+ * context, so no analyzer state is ever shared between threads. If there
+ * are fewer tracks than workers, the cores left idle are put to use by
+ * analyzing the tracks in parallel segments. The reader holds off mapping
+ * the next track while the tracks already mapped take up more than
+ * POOL_MAPPED bytes, unless it would be the only one.
+ */
+
+#define POOL_READY  1                    /* tracks read ahead of workers */
+#define POOL_MAPPED (256 * 1024 * 1024)  /* max. track audio mapped at once */
+
+typedef struct {
+    rnc_track_t *t;                      /* track read */
+    int          size;                   /* amount of audio */
+    char        *data;                   /* track audio */
+    size_t       alloc;                  /* size of track audio buffer */
+    rnc_slice_t *audio;                  /* track audio, once read */
+} pool_track_t;
+
+typedef struct {
+    rnc_t        *rnc;                   /* RNC instance */
+    rnc_track_t **order;                 /* tracks in ripping order */
+    int           ntrack;                /* number of tracks to rip */
+    int           bufsize;               /* read and encode chunk size */
+    int           split;                 /* threads to analyze tracks with */
+    rnc_queue_t  *ready;                 /* tracks read, waiting for workers */
+    pthread_mutex_t lock;                /* lock for mapped */
+    pthread_cond_t  unmapped;            /* signalled when audio is unmapped */
+    size_t          mapped;              /* amount of track audio mapped */
+} pool_t;
+
+typedef struct {
+    pool_t       *p;                     /* pool the worker belongs to */
+    rnc_gain_t   *g;                     /* worker replaygain context */
+    pthread_t     tid;                   /* worker thread */
+} pool_worker_t;
+
+
+static int longest_first(const void *a, const void *b)
+{
+    const rnc_track_t *ta = *(rnc_track_t **)a;
+    const rnc_track_t *tb = *(rnc_track_t **)b;
+
+    if (ta->nblk != tb->nblk)
+        return ta->nblk > tb->nblk ? -1 : 1;
+    else
+        return ta->idx - tb->idx;
+}
+
+
+static void *map_track(pool_t *p, size_t size)
+{
+    void *data;
+
+    pthread_mutex_lock(&p->lock);
+
+    while (p->mapped > 0 && p->mapped + size > POOL_MAPPED)
+        pthread_cond_wait(&p->unmapped, &p->lock);
+
+    if ((data = rnc_mem_map(size, p->rnc->hugepages)) != NULL)
+        p->mapped += size;
+
+    pthread_mutex_unlock(&p->lock);
+
+    return data;
+}
+
+
+static void unmap_track(void *data, size_t size, void *user_data)
+{
+    pool_t *p = user_data;
+
+    rnc_mem_unmap(data, size, p->rnc->hugepages);
+
+    pthread_mutex_lock(&p->lock);
+    p->mapped -= size;
+    pthread_cond_broadcast(&p->unmapped);
+    pthread_mutex_unlock(&p->lock);
+}
+
+
+static void *pool_reader(void *ptr)
+{
+    pool_t       *p   = ptr;
+    rnc_t        *rnc = p->rnc;
+    int           blksize, idx, i, n;
+    rnc_track_t  *t;
+    pool_track_t *d;
+
+    blksize = rnc_device_get_blocksize(rnc->dev);
+
+    for (idx = 0; idx < p->ntrack; idx++) {
+        t = p->order[idx];
+        d = rnc_arena_alloc(rnc->arena, sizeof(*d));
+
+        if (d != NULL) {
+            d->alloc = (size_t)t->nblk * blksize;
+            d->data  = map_track(p, d->alloc);
+        }
+
+        if (d == NULL || d->data == NULL) {
+            rnc_error(rnc, "failed to allocate buffer for track #%d", t->id);
+            continue;
+        }
+
+        d->t = t;
+
+        /*
+         * Skip tracks we fail to get to or read. They never make it to
+         * a worker, so their loudness is never transferred to the album
+         * context and they are left out of the album gain.
+         */
+
+        if (rnc_device_seek(rnc->dev, t, 0) < 0) {
+            rnc_error(rnc, "failed to seek to beginning of track #%d", t->id);
+            unmap_track(d->data, d->alloc, p);
+            continue;
+        }
+
+        for (i = 0; i < (int)t->nblk; i += n / blksize) {
+            n = rnc_device_read(rnc->dev, d->data + d->size,
+                                read_size(rnc, t, i, p->bufsize));
+
+            if (n <= 0) {
+                rnc_error(rnc, "failed to read block #%d of track #%d",
+                          i, t->id);
+                break;
+            }
+
+            d->size += n;
+        }
+
+        if (i < (int)t->nblk ||
+            (d->audio = rnc_slice_create(d->data, d->alloc, unmap_track,
+                                         p)) == NULL) {
+            unmap_track(d->data, d->alloc, p);
+            continue;
+        }
+
+        if (rnc_queue_push(p->ready, d) < 0)
+            rnc_slice_unref(d->audio);
+    }
+
+    rnc_queue_close(p->ready);
+
+    return NULL;
+}
+
+
+static int pool_encode(pool_t *p, rnc_gain_t *g, pool_track_t *d)
+{
+    rnc_t         *rnc = p->rnc;
+    rnc_track_t   *t   = d->t;
+    rnc_encoder_t *enc;
+    rnc_slice_t   *s;
+    int            frame, offs, n, status;
+
+    if ((enc = create_encoder(rnc, t)) == NULL)
+        return -1;
+
+    if (p->split > 1) {
+        frame = RNC_FORMAT_CHNL(rnc->fid) * RNC_FORMAT_BITS(rnc->fid) / 8;
+
+        if (rnc_gain_analyze_parallel(g, 0, d->data, d->size / frame,
+                                      p->split) < 0)
+            rnc_error(rnc, "replaygain analysis failed");
+    }
+
+    for (offs = 0; offs < d->size; offs += n) {
+        n = d->size - offs;
+
+        if (n > p->bufsize)
+            n = p->bufsize;
+
+        if ((s = rnc_slice_cut(d->audio, offs, n)) == NULL) {
+            rnc_error(rnc, "failed to encode track #%d", t->id);
+            goto fail;
+        }
+
+        status = rnc_encoder_write(enc, rnc_slice_data(s), n);
+
+        if (status < 0)
+            rnc_error(rnc, "failed to encode track #%d", t->id);
+        else if (p->split <= 1 && rnc_gain_analyze_slice(g, 0, s) < 0)
+            rnc_error(rnc, "replaygain analysis failed");
+
+        rnc_slice_unref(s);
+
+        if (status < 0)
+            goto fail;
+    }
+
+    if (finish_encoder(rnc, enc, g, 0, t) < 0)
+        goto fail;
+
+    if (rnc_gain_transfer(rnc->gain, t->idx, g, 0) < 0)
+        rnc_error(rnc, "failed to collect replaygain of track #%d", t->id);
+
+    write_output(rnc, t, enc);
+    rnc_encoder_destroy(enc);
+
+    return 0;
+
+ fail:
+    rnc_encoder_destroy(enc);
+    return -1;
+}
+
+
+static void *pool_worker(void *ptr)
+{
+    pool_worker_t *w = ptr;
+    pool_track_t  *d;
+
+    while ((d = rnc_queue_pop(w->p->ready)) != NULL) {
+        pool_encode(w->p, w->g, d);
+        rnc_slice_unref(d->audio);
+    }
+
+    return NULL;
+}
+
+
+int rip_pooled(rnc_t *rnc, int first, int last)
+{
+    pool_t         p;
+    pthread_t      reader;
+    pool_worker_t *workers;
+    pool_track_t  *d;
+    int            nworker, ngain, i, status;
+
+    mrp_clear(&p);
+    p.rnc     = rnc;
+    p.ntrack  = last - first + 1;
+    p.bufsize = (256 + 128) * rnc_device_get_blocksize(rnc->dev);
+    p.split   = p.ntrack < rnc->workers ? rnc->workers / p.ntrack : 1;
+    p.order   = rnc_arena_alloc_array(rnc->arena, rnc_track_t *, p.ntrack);
+    p.ready   = rnc_queue_create(POOL_READY);
+    workers   = rnc_arena_alloc_array(rnc->arena, pool_worker_t,
+                                      rnc->workers);
+    nworker   = 0;
+    ngain     = 0;
+    status    = -1;
+
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.unmapped, NULL);
+
+    if (p.order == NULL || p.ready == NULL || workers == NULL)
+        goto out;
+
+    for (i = 0; i < p.ntrack; i++)
+        p.order[i] = rnc->tracks + first + i;
+
+    qsort(p.order, p.ntrack, sizeof(p.order[0]), longest_first);
+
+    /* workers only transfer their results, create the album context here */
+    create_gain(rnc, rnc->fid);
+
+    if (rnc->gain == NULL)
+        goto out;
+
+    /*
+     * Set up the worker contexts before starting any of the workers, so
+     * that a worker can't fail and leave the reader blocked on a queue
+     * nobody is popping from anymore.
+     */
+
+    for (ngain = 0; ngain < rnc->workers; ngain++) {
+        workers[ngain].p = &p;
+        workers[ngain].g = rnc_gain_create(1, rnc->fid, rnc->gain_flags);
+
+        if (workers[ngain].g == NULL) {
+            rnc_error(rnc, "failed to initialize replaygain calculation");
+            break;
+        }
+    }
+
+    for (nworker = 0; nworker < ngain; nworker++)
+        if (pthread_create(&workers[nworker].tid, NULL, pool_worker,
+                           workers + nworker) != 0)
+            break;
+
+    if (nworker == 0)
+        goto out;
+
+    if (pthread_create(&reader, NULL, pool_reader, &p) != 0) {
+        rnc_queue_close(p.ready);
+        goto out;
+    }
+
+    pthread_join(reader, NULL);
+    status = 0;
+
+ out:
+    for (i = 0; i < nworker; i++)
+        pthread_join(workers[i].tid, NULL);
+
+    for (i = 0; i < ngain; i++)
+        rnc_gain_destroy(workers[i].g);
+
+    if (p.ready != NULL) {
+        rnc_queue_close(p.ready);
+        while ((d = rnc_queue_pop(p.ready)) != NULL)
+            rnc_slice_unref(d->audio);
+    }
+
+    rnc_queue_destroy(p.ready);
+
+    pthread_cond_destroy(&p.unmapped);
+    pthread_mutex_destroy(&p.lock);
+
+    if (status < 0)
+        rnc_error(rnc, "failed to set up encoder pool");
+
+    return status;
+}
+
+
+/*
+ * Merge the results of tracks ripped earlier, for instance from the other
+ * discs of a set, saved in the gain state file, with the current ones.
+ * Tracks are labelled with the path of their output, so tracks ripped
+ * again replace their earlier results instead of being counted twice.
+ */
+
+static void merge_gain_state(rnc_t *rnc, int first, int last)
+{
+    rnc_gain_t *saved;
+    char        path[PATH_MAX], abs[PATH_MAX];
+    int         i;
+
+    /* absolute paths, so later runs can patch them from anywhere */
+    for (i = first; i <= last; i++) {
+        if (output_path(rnc, rnc->tracks + i, path, sizeof(path)) < 0 ||
+            rnc_gain_set_label(rnc->gain, i,
+                               realpath(path, abs) ? abs : path) < 0)
+            rnc_warning(rnc, "failed to label replaygain of track #%d",
+                        rnc->tracks[i].id);
+    }
+
+    /* nothing saved yet, this is the first disc of the set */
+    if (access(rnc->gain_state, F_OK) < 0 && errno == ENOENT)
+        return;
+
+    if ((saved = rnc_gain_load(rnc->gain_state)) == NULL) {
+        rnc_warning(rnc, "failed to load gain state '%s' (%d: %s)",
+                    rnc->gain_state, errno, strerror(errno));
+        return;
+    }
+
+    if (rnc_gain_merge(rnc->gain, saved) < 0)
+        rnc_warning(rnc, "failed to merge gain state '%s' (%d: %s)",
+                    rnc->gain_state, errno, strerror(errno));
+
+    rnc_gain_destroy(saved);
+}
+
+
+static void save_gain_state(rnc_t *rnc)
+{
+    if (rnc_gain_save(rnc->gain, rnc->gain_state) < 0)
+        rnc_warning(rnc, "failed to save gain state '%s' (%d: %s)",
+                    rnc->gain_state, errno, strerror(errno));
+}
+
+
+void patch_album_gain(rnc_t *rnc, int first, int last)
+{
+    rnc_track_t *t;
+    const char  *saved;
+    char         path[PATH_MAX];
+    double       gain;
+    int          i;
+
+    if (rnc->gain == NULL)
+        return;
+
+    /* tracks written to stdout have no path to tell them apart by */
+    if (rnc->gain_state != NULL && rnc->out_fd >= 0) {
+        rnc_warning(rnc, "can't merge gain state of tracks sent to stdout");
+        rnc->gain_state = NULL;
+    }
+
+    if (rnc->gain_state != NULL)
+        merge_gain_state(rnc, first, last);
+
+    gain = rnc_gain_album_gain(rnc->gain);
+
+    printf("album gain: %2.2f dB\n", gain);
+
+    /* tracks written to stdout are gone, we can't patch them */
+    if (rnc->out_fd >= 0)
+        return;
+
+    /*
+     * The album gain is only known once all tracks are done. Fill it in
+     * to the already written output files, overwriting the placeholder
+     * reserved for it at encoding time.
+     */
+
+    for (i = first; i <= last; i++) {
+        t = rnc->tracks + i;
+
+        if (output_path(rnc, t, path, sizeof(path)) < 0)
+            continue;
+
+        if (rnc_encoder_patch_gain(rnc, rnc->fid, path, gain) < 0)
+            rnc_warning(rnc, "failed to set album gain in '%s' (%d: %s)",
+                        path, errno, strerror(errno));
+    }
+
+    if (rnc->gain_state == NULL)
+        return;
+
+    /* bring the album gain of the tracks merged in up to date, too */
+    for (i = rnc->ntrack; i < rnc_gain_tracks(rnc->gain); i++) {
+        saved = rnc_gain_track_label(rnc->gain, i);
+
+        if (rnc_encoder_patch_gain(rnc, rnc->fid, saved, gain) < 0)
+            rnc_warning(rnc, "failed to set album gain in '%s' (%d: %s)",
+                        saved, errno, strerror(errno));
+    }
+
+    save_gain_state(rnc);
+}
+
+
 void select_tracks(rnc_t *rnc, int *first, int *last)
 {
     char *e;
@@ -365,6 +1417,7 @@ int main(int argc, char *argv[], char *envp[])
 
     discover_tracks(rnc);
     select_tracks(rnc, &first, &last);
+    negotiate_format(rnc, first);
     fetch_metadata(rnc);
 
     printf("Track Selection:\n");
@@ -377,10 +1430,31 @@ int main(int argc, char *argv[], char *envp[])
                t->fblk, t->fblk + t->nblk - 1);
     }
 
-    for (i = first; i <= last; i++)
-        rip_track(rnc, i);
+    if (rnc->workers > 1)
+        rip_pooled(rnc, first, last);
+    else if (rnc->pipeline)
+        rip_pipelined(rnc, first, last);
+    else {
+        for (i = first; i <= last; i++)
+            rip_track(rnc, i);
+    }
+
+    patch_album_gain(rnc, first, last);
+
+    if (rnc->readahead > 0)
+        print_readahead(rnc);
+
+    print_memory(rnc);
+
+    rnc_gain_destroy(rnc->gain);
+    rnc->gain = NULL;
+
+    rnc_device_close(rnc->dev);
+    rnc->dev = NULL;
 
-    printf("album gain: %2.2f dB\n", rnc_gain_album_gain(rnc->gain));
+    rnc_arena_destroy(rnc->arena);
+    rnc->arena  = NULL;
+    rnc->tracks = NULL;
 
 
     return 0;
@@ -31,6 +31,7 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
 #define __GNU_SOURCE
 #include <getopt.h>
 
@@ -55,6 +56,22 @@ static const char *argv0_base(const char *argv0)
 }
 
 
+static size_t parse_size(const char *str, char **end)
+{
+    size_t size;
+
+    size = strtoull(str, end, 10);
+
+    switch (**end) {
+    case 'k': case 'K': size *= 1024;               (*end)++; break;
+    case 'm': case 'M': size *= 1024 * 1024;        (*end)++; break;
+    case 'g': case 'G': size *= 1024 * 1024 * 1024; (*end)++; break;
+    }
+
+    return size;
+}
+
+
 static void print_usage(rnc_t *rnc, int exit_code, const char *fmt, ...)
 {
     va_list     ap;
@@ -70,6 +87,7 @@ static void print_usage(rnc_t *rnc, int exit_code, const char *fmt, ...)
     base = argv0_base(rnc->argv0);
 
     printf("usage: %s [options] <input> [<output>]\n", base);
+    printf("Use - as <output> to write the encoded tracks to stdout.\n");
     printf("The possible options are:\n");
     printf("  -d, --driver=<DRIVER>        use <DRIVER> to open <input>\n"
            "  -s, --speed=<SPEEDT>         device speed\n"
@@ -77,6 +95,21 @@ static void print_usage(rnc_t *rnc, int exit_code, const char *fmt, ...)
            "  -t, --tracks=<FIRST[-LAST]>  ripncode given tracks\n"
            "  -m, --metadata=<FILE>        read album metadata from <FILE>\n"
            "  -p, --pattern=<PATTERN>      tracks naming <PATTERN>\n"
+           "  -P, --pipeline               rip, encode and write in parallel\n"
+           "  -r, --readahead=<DEPTH>      read up to <DEPTH> chunks ahead\n"
+           "  -j, --threads=<N>            encode each track with <N> threads\n"
+           "  -w, --workers=<N>            encode up to <N> tracks in parallel\n"
+           "  -S, --spill=<SIZE>[:<DIR>]   buffer up to <SIZE> in memory, the\n"
+           "                               rest in <DIR>, 0 for no limit\n"
+           "  -H, --hugepages=<MODE>       use huge pages (none, thp, hugetlb)\n"
+           "                               for audio buffers\n"
+           "  -g, --gain-engine=<ENGINE>   analyze loudness with <ENGINE>\n"
+           "                               (native, ebur128)\n"
+           "  -e, --true-peak              tag true peaks instead of sample\n"
+           "                               peaks\n"
+           "  -G, --gain-state=<FILE>      calculate album gain together with\n"
+           "                               the tracks saved in <FILE>, then\n"
+           "                               save these tracks there, too\n"
            "  -L, --log-level=<LEVELS>     what messages to log\n"
            "  -v, --verbose                increase logging verbosity\n"
            "  -T, --log-target=<TARGET>    where to log messages to \n"
@@ -95,6 +128,10 @@ static void setup_defaults(rnc_t *rnc, const char *argv0)
     rnc->argv0      = argv0;
     rnc->device     = "/dev/cdrom";
     rnc->speed      = 0;
+    rnc->threads    = 1;
+    rnc->workers    = 1;
+    rnc->spill      = 64 * 1024 * 1024;
+    rnc->out_fd     = -1;
     rnc->log_mask   = MRP_LOG_UPTO(MRP_LOG_WARNING);
     rnc->log_target = "stdout";
 
@@ -109,7 +146,7 @@ static void setup_defaults(rnc_t *rnc, const char *argv0)
 
 void rnc_cmdline_parse(rnc_t *rnc, int argc, char **argv, char **envp)
 {
-#   define OPTIONS "d:s:o:f:t:m:p:L:vT:D:n:h"
+#   define OPTIONS "d:s:o:f:t:m:p:Pr:j:w:S:H:g:eG:L:vT:D:n:h"
     struct option options[] = {
         { "driver"           , required_argument, NULL, 'd' },
         { "speed"            , required_argument, NULL, 's' },
@@ -118,6 +155,15 @@ void rnc_cmdline_parse(rnc_t *rnc, int argc, char **argv, char **envp)
         { "tracks"           , required_argument, NULL, 't' },
         { "metadata"         , required_argument, NULL, 'm' },
         { "pattern"          , required_argument, NULL, 'p' },
+        { "pipeline"         , no_argument      , NULL, 'P' },
+        { "readahead"        , required_argument, NULL, 'r' },
+        { "threads"          , required_argument, NULL, 'j' },
+        { "workers"          , required_argument, NULL, 'w' },
+        { "spill"            , required_argument, NULL, 'S' },
+        { "hugepages"        , required_argument, NULL, 'H' },
+        { "gain-engine"      , required_argument, NULL, 'g' },
+        { "true-peak"        , no_argument      , NULL, 'e' },
+        { "gain-state"       , required_argument, NULL, 'G' },
         { "log-level"        , required_argument, NULL, 'L' },
         { "verbose"          , no_argument      , NULL, 'v' },
         { "log-target"       , required_argument, NULL, 'T' },
@@ -165,6 +211,68 @@ void rnc_cmdline_parse(rnc_t *rnc, int argc, char **argv, char **envp)
             rnc->pattern = optarg;
             break;
 
+        case 'P':
+            rnc->pipeline = 1;
+            break;
+
+        case 'r':
+            rnc->readahead = strtol(optarg, &e, 10);
+            if ((e && *e) || rnc->readahead < 0)
+                print_usage(rnc, EINVAL, "invalid read-ahead '%s'", optarg);
+            break;
+
+        case 'j':
+            rnc->threads = strtol(optarg, &e, 10);
+            if ((e && *e) || rnc->threads < 0)
+                print_usage(rnc, EINVAL, "invalid threads '%s'", optarg);
+            if (rnc->threads == 0)
+                rnc->threads = sysconf(_SC_NPROCESSORS_ONLN);
+            break;
+
+        case 'w':
+            rnc->workers = strtol(optarg, &e, 10);
+            if ((e && *e) || rnc->workers < 0)
+                print_usage(rnc, EINVAL, "invalid workers '%s'", optarg);
+            if (rnc->workers == 0)
+                rnc->workers = sysconf(_SC_NPROCESSORS_ONLN);
+            break;
+
+        case 'S':
+            rnc->spill = parse_size(optarg, &e);
+            if (e && *e == ':' && e[1])
+                rnc->spill_dir = e + 1;
+            else if (e && *e)
+                print_usage(rnc, EINVAL, "invalid spill limit '%s'", optarg);
+            break;
+
+        case 'H':
+            if (!strcmp(optarg, "none"))
+                rnc->hugepages = 0;
+            else if (!strcmp(optarg, "thp"))
+                rnc->hugepages = RNC_MEM_THP;
+            else if (!strcmp(optarg, "hugetlb"))
+                rnc->hugepages = RNC_MEM_HUGETLB;
+            else
+                print_usage(rnc, EINVAL, "invalid huge page mode '%s'", optarg);
+            break;
+
+        case 'g':
+            if (!strcmp(optarg, "native"))
+                rnc->gain_flags &= ~RNC_GAIN_EBUR128;
+            else if (!strcmp(optarg, "ebur128"))
+                rnc->gain_flags |= RNC_GAIN_EBUR128;
+            else
+                print_usage(rnc, EINVAL, "invalid gain engine '%s'", optarg);
+            break;
+
+        case 'e':
+            rnc->gain_flags |= RNC_GAIN_TRUE_PEAK;
+            break;
+
+        case 'G':
+            rnc->gain_state = optarg;
+            break;
+
         case 'L':
             dbg = mrp_log_enable(0) & MRP_LOG_MASK_DEBUG;
             rnc->log_mask = mrp_log_parse_levels(optarg);
@@ -0,0 +1,290 @@
+/*
+ * Copyright (c) 2015, Krisztian Litkey, <kli@iki.fi>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <murphy/common/log.h>
+#include <murphy/common/debug.h>
+#include <ripncode/ripncode.h>
+
+#define CHUNK_SIZE  (64 * 1024)           /* what the FLAC encoder uses */
+#define HEADER_SIZE 42                    /* fLaC + STREAMINFO */
+#define MAX_FRAME   (14 * 1024)           /* largest simulated frame */
+
+
+/*
+ * the original realloc-growth in-memory buffer, for reference
+ */
+typedef struct {
+    size_t  chunk;
+    char   *buf;
+    size_t  size;
+    size_t  data;
+    char   *w;
+    size_t  moved;                       /* bytes moved by reallocation */
+    int     nrealloc;                    /* number of reallocations */
+} old_buf_t;
+
+
+static int old_write(old_buf_t *m, const void *buf, size_t size)
+{
+    size_t diff, woffs;
+    char  *old;
+
+    if (m->w + size > m->buf + m->size) {
+        diff = m->w + size - (m->buf + m->size);
+
+        if (diff < m->chunk)
+            diff = m->chunk;
+
+        woffs = m->w - m->buf;
+        old   = m->buf;
+
+        if (!mrp_reallocz(m->buf, m->size, m->size + diff))
+            return -1;
+
+        if (old != NULL && old != m->buf)
+            m->moved += m->data;
+
+        m->nrealloc++;
+        m->size += diff;
+        m->w     = m->buf + woffs;
+    }
+
+    memcpy(m->w, buf, size);
+    m->w += size;
+
+    if (m->w - m->buf > (ptrdiff_t)m->data)
+        m->data = m->w - m->buf;
+
+    return size;
+}
+
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+
+/*
+ * deterministic FLAC-like frame sizes
+ */
+static size_t frame_size(uint32_t *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+
+    return 2048 + (*seed >> 8) % (MAX_FRAME - 2048);
+}
+
+
+static double bench_old(size_t total, size_t chunk, const char *frame,
+                        size_t *moved, int *nrealloc)
+{
+    old_buf_t m;
+    uint32_t  seed = 1;
+    size_t    n;
+    double    start, end;
+
+    memset(&m, 0, sizeof(m));
+    m.chunk = chunk;
+
+    start = now();
+
+    while (m.data < total) {
+        n = frame_size(&seed);
+
+        if (old_write(&m, frame, n) < 0)
+            return -1;
+    }
+
+    m.w = m.buf;
+    old_write(&m, frame, HEADER_SIZE);
+
+    end = now();
+
+    *moved    = m.moved;
+    *nrealloc = m.nrealloc;
+
+    mrp_free(m.buf);
+
+    return end - start;
+}
+
+
+static double bench_new(size_t total, size_t chunk, const char *frame)
+{
+    rnc_buf_t *b;
+    uint32_t   seed = 1;
+    size_t     n, data;
+    double     start, end;
+
+    start = now();
+
+    b = rnc_buf_create("bench", 0, chunk);
+
+    if (b == NULL)
+        return -1;
+
+    data = 0;
+    while (data < total) {
+        n = frame_size(&seed);
+
+        if (rnc_buf_write(b, frame, n) < 0)
+            return -1;
+
+        data += n;
+    }
+
+    rnc_buf_wseek(b, 0, SEEK_SET);
+    rnc_buf_write(b, frame, HEADER_SIZE);
+
+    end = now();
+
+    rnc_buf_close(b);
+
+    return end - start;
+}
+
+
+static double bench_file(size_t total, const char *frame, int map)
+{
+    const char *path = "/tmp/buffer-bench.out";
+    rnc_buf_t  *b;
+    uint32_t    seed = 1;
+    size_t      n, data;
+    double      start, end;
+
+    start = now();
+
+    if (map)
+        b = rnc_buf_map(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    else
+        b = rnc_buf_open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if (b == NULL)
+        return -1;
+
+    data = 0;
+    while (data < total) {
+        n = frame_size(&seed);
+
+        if (rnc_buf_write(b, frame, n) < 0)
+            return -1;
+
+        data += n;
+    }
+
+    rnc_buf_wseek(b, 0, SEEK_SET);
+    rnc_buf_write(b, frame, HEADER_SIZE);
+
+    rnc_buf_unlink(b);
+
+    end = now();
+
+    return end - start;
+}
+
+
+int main(int argc, char *argv[])
+{
+    size_t  sizes[] = { 10, 20, 40, 80 }, *s, total, chunk, moved;
+    size_t  one;
+    int     nrealloc, i;
+    char   *e, frame[MAX_FRAME];
+    double  told, tnew;
+
+    chunk = CHUNK_SIZE;
+    one   = 0;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-c") && i < argc - 1)
+            chunk = strtoul(argv[++i], &e, 10) * 1024;
+        else if (!strcmp(argv[i], "-s") && i < argc - 1)
+            one = strtoul(argv[++i], &e, 10);
+        else {
+            printf("usage: %s [-c <chunk KB>] [-s <track MB>]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    memset(frame, 0x5a, sizeof(frame));
+
+    printf("chunk size: %zu KB\n", chunk / 1024);
+    printf("%8s %12s %12s %10s %14s %12s\n", "track", "realloc",
+           "chunked", "speedup", "bytes moved", "reallocs");
+
+    for (s = sizes; s < sizes + MRP_ARRAY_SIZE(sizes); s++) {
+        if (one && s > sizes)
+            break;
+
+        total = (one ? one : *s) * 1024 * 1024;
+        told  = bench_old(total, chunk, frame, &moved, &nrealloc);
+        tnew  = bench_new(total, chunk, frame);
+
+        if (told < 0 || tnew < 0) {
+            printf("benchmark failed\n");
+            exit(1);
+        }
+
+        printf("%5zu MB %9.2f ms %9.2f ms %9.2fx %11zu MB %12d\n",
+               total / (1024 * 1024), 1000 * told, 1000 * tnew,
+               told / tnew, moved / (1024 * 1024), nrealloc);
+    }
+
+    printf("\n%8s %12s %12s %10s %14s\n", "track", "file", "mapped",
+           "speedup", "writes");
+
+    for (s = sizes; s < sizes + MRP_ARRAY_SIZE(sizes); s++) {
+        if (one && s > sizes)
+            break;
+
+        total = (one ? one : *s) * 1024 * 1024;
+        told  = bench_file(total, frame, 0);
+        tnew  = bench_file(total, frame, 1);
+
+        if (told < 0 || tnew < 0) {
+            printf("benchmark failed\n");
+            exit(1);
+        }
+
+        printf("%5zu MB %9.2f ms %9.2f ms %9.2fx %14zu\n",
+               total / (1024 * 1024), 1000 * told, 1000 * tnew,
+               told / tnew, total / ((2048 + MAX_FRAME) / 2));
+    }
+
+    return 0;
+}
@@ -28,6 +28,8 @@
  */
 
 #include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
 #include <check.h>
 
 #include <murphy/common/log.h>
@@ -104,6 +106,49 @@ char none[] =                                                   \
     ".................................................."        \
     "..................................................";
 
+START_TEST(file_staged)
+{
+    struct stat st;
+    char        c;
+    int         i, len, fd;
+
+    /* small writes are staged, seeking and reading must still see them */
+    b = rnc_buf_open("/tmp/test.buf", O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    ck_assert_ptr_ne(b, NULL);
+
+    len = sizeof(pattern) - 1;
+
+    for (i = 0; i < 50 * len; i++)
+        ck_assert_int_ge(rnc_buf_write(b, pattern + i % len, 1), 0);
+
+    ck_assert_int_eq(rnc_buf_tell(b), 50 * len);
+
+    for (i = 0; i < 50 * len; i++) {
+        ck_assert_int_eq(rnc_buf_read(b, &c, 1), 1);
+        ck_assert_int_eq(c, pattern[i % len]);
+    }
+
+    ck_assert_int_eq(rnc_buf_read(b, &c, 1), 0);
+    ck_assert_int_eq(rnc_buf_wseek(b, 0, SEEK_SET), 0);
+    ck_assert_int_ge(rnc_buf_write(b, none, 1), 0);
+    ck_assert_int_eq(rnc_buf_close(b), 0);
+    b = NULL;
+
+    /* whatever was still staged must have been written out on close */
+    ck_assert_int_eq(stat("/tmp/test.buf", &st), 0);
+    ck_assert_int_eq(st.st_size, 50 * len);
+
+    fd = open("/tmp/test.buf", O_RDONLY);
+    ck_assert_int_ge(fd, 0);
+    ck_assert_int_eq(pread(fd, &c, 1, 0), 1);
+    ck_assert_int_eq(c, none[0]);
+    close(fd);
+
+    unlink("/tmp/test.buf");
+}
+END_TEST
+
 START_TEST(mem_seqwrite)
 {
     int i, len;
@@ -195,6 +240,592 @@ START_TEST(mem_rndread)
 END_TEST
 
 
+static void check_overwrite(rnc_buf_t *b)
+{
+    int i, len;
+
+    len = sizeof(pattern) - 1;
+
+    for (i = 0; i < 50; i++)
+        ck_assert_int_eq(rnc_buf_write(b, none, len), len);
+
+    for (i = 49; i >= 0; i--) {
+        ck_assert_int_eq(rnc_buf_wseek(b, i * len, SEEK_SET), i * len);
+        ck_assert_int_eq(rnc_buf_write(b, pattern, len), len);
+    }
+
+    ck_assert_int_eq(rnc_buf_wseek(b, 0, SEEK_END), 50 * len);
+    ck_assert_int_eq(rnc_buf_wseek(b, 1, SEEK_END), -1);
+    ck_assert_int_eq(rnc_buf_tell(b), 50 * len);
+}
+
+static void check_overread(rnc_buf_t *b)
+{
+    char c;
+    int  i, len, n;
+
+    len = sizeof(pattern) - 1;
+    for (i = 0; i < 50 * len; i++) {
+        n = rnc_buf_read(b, &c, 1);
+
+        ck_assert_int_eq(n, 1);
+        ck_assert_int_eq(c, pattern[i % len]);
+    }
+
+    ck_assert_int_eq(rnc_buf_read(b, &c, 1), 0);
+}
+
+START_TEST(mem_overwrite)
+{
+    REQUIRE(mem_create);
+
+    check_overwrite(b);
+}
+END_TEST
+
+START_TEST(mem_overread)
+{
+    REQUIRE(mem_overwrite);
+
+    check_overread(b);
+}
+END_TEST
+
+
+START_TEST(map_open)
+{
+    b = rnc_buf_map("/tmp/test.map", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    ck_assert_ptr_ne(b, NULL);
+}
+END_TEST
+
+START_TEST(map_overwrite)
+{
+    REQUIRE(map_open);
+
+    check_overwrite(b);
+}
+END_TEST
+
+START_TEST(map_overread)
+{
+    REQUIRE(map_overwrite);
+
+    check_overread(b);
+
+    ck_assert_int_eq(rnc_buf_close(b), 0);
+    b = NULL;
+}
+END_TEST
+
+START_TEST(map_large)
+{
+    struct stat st;
+    char        frame[1000], c;
+    int         i, fd;
+
+    /* cross several mapping windows, then patch the beginning */
+    REQUIRE(map_open);
+
+    memset(frame, 'x', sizeof(frame));
+
+    for (i = 0; i < 20000; i++)
+        ck_assert_int_eq(rnc_buf_write(b, frame, sizeof(frame)),
+                         sizeof(frame));
+
+    ck_assert_int_eq(rnc_buf_wseek(b, 0, SEEK_SET), 0);
+    ck_assert_int_eq(rnc_buf_write(b, "y", 1), 1);
+    ck_assert_int_eq(rnc_buf_wseek(b, 0, SEEK_END), 20000 * sizeof(frame));
+    ck_assert_int_eq(rnc_buf_write(b, "z", 1), 1);
+    ck_assert_int_eq(rnc_buf_close(b), 0);
+    b = NULL;
+
+    /* preallocated space must be gone, the data must be in the file */
+    ck_assert_int_eq(stat("/tmp/test.map", &st), 0);
+    ck_assert_int_eq(st.st_size, 20000 * sizeof(frame) + 1);
+
+    fd = open("/tmp/test.map", O_RDONLY);
+    ck_assert_int_ge(fd, 0);
+    ck_assert_int_eq(pread(fd, &c, 1, 0), 1);
+    ck_assert_int_eq(c, 'y');
+    ck_assert_int_eq(pread(fd, &c, 1, 8 * 1024 * 1024), 1);
+    ck_assert_int_eq(c, 'x');
+    ck_assert_int_eq(pread(fd, &c, 1, st.st_size - 1), 1);
+    ck_assert_int_eq(c, 'z');
+    close(fd);
+
+    unlink("/tmp/test.map");
+}
+END_TEST
+
+
+START_TEST(spill_create)
+{
+    b = rnc_buf_spill("test spill", 32, 1000, "/tmp");
+
+    ck_assert_ptr_ne(b, NULL);
+}
+END_TEST
+
+START_TEST(spill_overwrite)
+{
+    /* spills over to disk half-way through the first pass */
+    REQUIRE(spill_create);
+
+    check_overwrite(b);
+}
+END_TEST
+
+START_TEST(spill_overread)
+{
+    char c;
+    int  len;
+
+    REQUIRE(spill_overwrite);
+
+    check_overread(b);
+
+    len = sizeof(pattern) - 1;
+    ck_assert_int_eq(rnc_buf_rseek(b, 10 * len, SEEK_SET), 10 * len);
+    ck_assert_int_eq(rnc_buf_read(b, &c, 1), 1);
+    ck_assert_int_eq(c, pattern[0]);
+    ck_assert_int_eq(rnc_buf_unlink(b), 0);
+    b = NULL;
+}
+END_TEST
+
+START_TEST(spill_nodir)
+{
+    int len;
+
+    /* fits in memory, then fails to spill */
+    b = rnc_buf_spill("test spill", 32, 200, "/tmp/no-such-directory");
+
+    ck_assert_ptr_ne(b, NULL);
+
+    len = sizeof(pattern) - 1;
+
+    ck_assert_int_eq(rnc_buf_write(b, pattern, len), len);
+    ck_assert_int_eq(rnc_buf_write(b, pattern, len), -1);
+    ck_assert_int_eq(errno, ENOENT);
+    ck_assert_int_eq(rnc_buf_tell(b), len);
+    ck_assert_int_eq(rnc_buf_close(b), 0);
+    b = NULL;
+}
+END_TEST
+
+START_TEST(ring_create)
+{
+    b = rnc_buf_ring("test ring", 100);
+
+    ck_assert_ptr_ne(b, NULL);
+}
+END_TEST
+
+START_TEST(ring_wrap)
+{
+    unsigned char buf[256];
+    size_t        w, r, i;
+    int           n;
+
+    REQUIRE(ring_create);
+
+    ck_assert_int_eq(rnc_buf_read(b, buf, sizeof(buf)), 0);
+
+    /* 100 gets rounded up to 128 */
+    for (i = 0; i < sizeof(buf); i++)
+        buf[i] = (unsigned char)i;
+
+    ck_assert_int_eq(rnc_buf_write(b, buf, sizeof(buf)), 128);
+    ck_assert_int_eq(rnc_buf_write(b, buf, sizeof(buf)), 0);
+
+    w = 128;
+    r = 0;
+
+    for (i = 0; i < 20; i++) {
+        n = rnc_buf_read(b, buf, 100);
+        ck_assert_int_eq(n, 100);
+
+        for (n = 0; n < 100; n++)
+            ck_assert_int_eq(buf[n], (unsigned char)(r + n));
+        r += 100;
+
+        for (n = 0; n < 100; n++)
+            buf[n] = (unsigned char)(w + n);
+
+        ck_assert_int_eq(rnc_buf_write(b, buf, 101), 100);
+        w += 100;
+    }
+
+    ck_assert_int_eq(rnc_buf_wseek(b, 0, SEEK_SET), -1);
+    ck_assert_int_eq(rnc_buf_tell(b), w);
+    ck_assert_int_eq(rnc_buf_rseek(b, 0, SEEK_CUR), r);
+
+    ck_assert_int_eq(rnc_buf_close(b), 0);
+    b = NULL;
+}
+END_TEST
+
+
+#define RING_TOTAL (16 * 1024 * 1024)
+
+static void *ring_producer(void *ptr)
+{
+    rnc_buf_t     *r = ptr;
+    unsigned char  buf[4096];
+    size_t         total, size, i;
+    uint32_t       seed;
+    int            n;
+
+    total = 0;
+    seed  = 1;
+
+    while (total < RING_TOTAL) {
+        seed = seed * 1103515245 + 12345;
+        size = 1 + (seed >> 8) % sizeof(buf);
+
+        if (size > RING_TOTAL - total)
+            size = RING_TOTAL - total;
+
+        for (i = 0; i < size; i++)
+            buf[i] = (unsigned char)((total + i) * 31);
+
+        for (i = 0; i < size; i += n) {
+            if (rnc_buf_wait(r, RNC_BUF_WRITABLE, 1) <= 0)
+                return NULL;
+            n = rnc_buf_write(r, buf + i, size - i);
+        }
+
+        total += size;
+    }
+
+    rnc_buf_shutdown(r);
+
+    return NULL;
+}
+
+START_TEST(ring_threaded)
+{
+    pthread_t      tid;
+    unsigned char  buf[3000];
+    size_t         total;
+    int            i, n;
+
+    b = rnc_buf_ring("test ring", 8192);
+
+    ck_assert_ptr_ne(b, NULL);
+    ck_assert_int_eq(pthread_create(&tid, NULL, ring_producer, b), 0);
+
+    total = 0;
+    while ((n = rnc_buf_wait(b, RNC_BUF_READABLE, sizeof(buf))) > 0) {
+        n = rnc_buf_read(b, buf, sizeof(buf));
+
+        for (i = 0; i < n; i++)
+            ck_assert_int_eq(buf[i], (unsigned char)((total + i) * 31));
+
+        total += n;
+    }
+
+    pthread_join(tid, NULL);
+
+    ck_assert_int_eq(n, 0);
+    ck_assert_int_eq(total, RING_TOTAL);
+
+    ck_assert_int_eq(rnc_buf_close(b), 0);
+    b = NULL;
+}
+END_TEST
+
+START_TEST(mem_peek)
+{
+    struct iovec iov[3];
+    int          i, len;
+
+    REQUIRE(mem_create);
+
+    len = sizeof(pattern) - 1;
+    ck_assert_int_eq(rnc_buf_write(b, pattern, len), len);
+
+    /* 32-byte chunks, so we get a region per chunk */
+    ck_assert_int_eq(rnc_buf_peek(b, iov, 3), 3);
+
+    for (i = 0; i < 3; i++) {
+        ck_assert_int_eq(iov[i].iov_len, 32);
+        ck_assert(!memcmp(iov[i].iov_base, pattern + 32 * i, 32));
+    }
+
+    ck_assert_int_eq(rnc_buf_consume(b, 40), 0);
+    ck_assert_int_eq(rnc_buf_peek(b, iov, 3), 3);
+    ck_assert_int_eq(iov[0].iov_len, 24);
+    ck_assert(!memcmp(iov[0].iov_base, pattern + 40, 24));
+
+    ck_assert_int_eq(rnc_buf_consume(b, len - 41), 0);
+    ck_assert_int_eq(rnc_buf_peek(b, iov, 3), 1);
+    ck_assert_int_eq(iov[0].iov_len, 1);
+    ck_assert_int_eq(*(char *)iov[0].iov_base, pattern[len - 1]);
+
+    ck_assert_int_eq(rnc_buf_consume(b, 2), -1);
+    ck_assert_int_eq(rnc_buf_consume(b, 1), 0);
+    ck_assert_int_eq(rnc_buf_peek(b, iov, 3), 0);
+
+    ck_assert_int_eq(rnc_buf_close(b), 0);
+    b = NULL;
+}
+END_TEST
+
+START_TEST(ring_peek)
+{
+    struct iovec iov[2];
+    char         buf[100];
+
+    REQUIRE(ring_create);
+
+    memset(buf, 'a', sizeof(buf));
+    ck_assert_int_eq(rnc_buf_write(b, buf, sizeof(buf)), 100);
+    ck_assert_int_eq(rnc_buf_read(b, buf, sizeof(buf)), 100);
+    ck_assert_int_eq(rnc_buf_peek(b, iov, 2), 0);
+
+    /* wraps around the end of the 128-byte ring */
+    memset(buf, 'b', sizeof(buf));
+    ck_assert_int_eq(rnc_buf_write(b, buf, sizeof(buf)), 100);
+    ck_assert_int_eq(rnc_buf_peek(b, iov, 2), 2);
+    ck_assert_int_eq(iov[0].iov_len, 28);
+    ck_assert_int_eq(iov[1].iov_len, 72);
+    ck_assert_int_eq(*(char *)iov[0].iov_base, 'b');
+    ck_assert_int_eq(*(char *)iov[1].iov_base, 'b');
+
+    ck_assert_int_eq(rnc_buf_consume(b, 28), 0);
+    ck_assert_int_eq(rnc_buf_peek(b, iov, 2), 1);
+    ck_assert_int_eq(iov[0].iov_len, 72);
+    ck_assert_int_eq(rnc_buf_consume(b, 73), -1);
+    ck_assert_int_eq(rnc_buf_consume(b, 72), 0);
+    ck_assert_int_eq(rnc_buf_rseek(b, 0, SEEK_CUR), 200);
+
+    /* we made room for the producer */
+    ck_assert_int_eq(rnc_buf_write(b, buf, sizeof(buf)), 100);
+
+    ck_assert_int_eq(rnc_buf_close(b), 0);
+    b = NULL;
+}
+END_TEST
+
+static void check_writev(ssize_t (*write_to_fd)(rnc_buf_t *, int))
+{
+    char buf[sizeof(pattern)];
+    int  i, len, fd;
+
+    len = sizeof(pattern) - 1;
+
+    for (i = 0; i < 50; i++)
+        ck_assert_int_eq(rnc_buf_write(b, pattern, len), len);
+
+    fd = open("/tmp/test.out", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    ck_assert_int_ge(fd, 0);
+
+    ck_assert_int_eq(write_to_fd(b, fd), 50 * len);
+    ck_assert_int_eq(write_to_fd(b, fd), 0);
+
+    for (i = 0; i < 50; i++) {
+        ck_assert_int_eq(pread(fd, buf, len, i * len), len);
+        ck_assert(!memcmp(buf, pattern, len));
+    }
+
+    ck_assert_int_eq(pread(fd, buf, 1, 50 * len), 0);
+
+    close(fd);
+    unlink("/tmp/test.out");
+
+    ck_assert_int_eq(rnc_buf_unlink(b), 0);
+    b = NULL;
+}
+
+START_TEST(mem_writev)
+{
+    REQUIRE(mem_create);
+
+    check_writev(rnc_buf_writev_to_fd);
+}
+END_TEST
+
+START_TEST(map_writev)
+{
+    REQUIRE(map_open);
+
+    check_writev(rnc_buf_writev_to_fd);
+}
+END_TEST
+
+START_TEST(spill_writev)
+{
+    /* spilled to disk, has to fall back to copying */
+    REQUIRE(spill_create);
+
+    check_writev(rnc_buf_writev_to_fd);
+}
+END_TEST
+
+START_TEST(spill_copy)
+{
+    REQUIRE(spill_create);
+
+    check_writev(rnc_buf_copy_to_fd);
+}
+END_TEST
+
+START_TEST(mem_copy)
+{
+    /* nothing for the kernel to copy from */
+    REQUIRE(mem_create);
+
+    check_writev(rnc_buf_copy_to_fd);
+}
+END_TEST
+
+START_TEST(map_splice)
+{
+    char buf[sizeof(pattern)];
+    int  i, len, fds[2];
+
+    REQUIRE(map_open);
+
+    len = sizeof(pattern) - 1;
+
+    for (i = 0; i < 50; i++)
+        ck_assert_int_eq(rnc_buf_write(b, pattern, len), len);
+
+    ck_assert_int_eq(pipe(fds), 0);
+    ck_assert_int_eq(rnc_buf_copy_to_fd(b, fds[1]), 50 * len);
+    close(fds[1]);
+
+    for (i = 0; i < 50; i++) {
+        ck_assert_int_eq(read(fds[0], buf, len), len);
+        ck_assert(!memcmp(buf, pattern, len));
+    }
+
+    ck_assert_int_eq(read(fds[0], buf, 1), 0);
+    close(fds[0]);
+
+    ck_assert_int_eq(rnc_buf_unlink(b), 0);
+    b = NULL;
+}
+END_TEST
+
+#define SLICE_USERS 4
+
+static int released;
+
+
+static void slice_release(void *data, size_t size, void *user_data)
+{
+    ck_assert_ptr_eq(data, pattern);
+    ck_assert_int_eq(size, sizeof(pattern) - 1);
+    ck_assert_ptr_eq(user_data, &released);
+
+    __atomic_add_fetch(&released, 1, __ATOMIC_RELAXED);
+}
+
+
+START_TEST(slice_refcount)
+{
+    rnc_slice_t *s;
+
+    released = 0;
+    s = rnc_slice_create(pattern, sizeof(pattern) - 1, slice_release,
+                         &released);
+
+    ck_assert_ptr_ne(s, NULL);
+    ck_assert_ptr_eq(rnc_slice_data(s), pattern);
+    ck_assert_int_eq(rnc_slice_size(s), sizeof(pattern) - 1);
+
+    ck_assert_ptr_eq(rnc_slice_ref(s), s);
+    rnc_slice_unref(s);
+    ck_assert_int_eq(released, 0);
+    rnc_slice_unref(s);
+    ck_assert_int_eq(released, 1);
+}
+END_TEST
+
+
+START_TEST(slice_cut)
+{
+    rnc_slice_t *s, *c1, *c2;
+
+    released = 0;
+    s = rnc_slice_create(pattern, sizeof(pattern) - 1, slice_release,
+                         &released);
+
+    ck_assert_ptr_ne(s, NULL);
+
+    c1 = rnc_slice_cut(s, 10, 20);
+    c2 = rnc_slice_cut(c1, 5, 15);
+
+    ck_assert_ptr_ne(c1, NULL);
+    ck_assert_ptr_ne(c2, NULL);
+    ck_assert_ptr_eq(rnc_slice_data(c2), pattern + 15);
+    ck_assert_int_eq(rnc_slice_size(c2), 15);
+
+    ck_assert_ptr_eq(rnc_slice_cut(c1, 5, 16), NULL);
+    ck_assert_int_eq(errno, EINVAL);
+
+    /* cuts keep the original alive */
+    rnc_slice_unref(s);
+    rnc_slice_unref(c1);
+    ck_assert_int_eq(released, 0);
+    ck_assert(!memcmp(rnc_slice_data(c2), pattern + 15, 15));
+    rnc_slice_unref(c2);
+    ck_assert_int_eq(released, 1);
+}
+END_TEST
+
+
+static void *slice_user(void *ptr)
+{
+    rnc_slice_t *s = ptr;
+    const char  *p = rnc_slice_data(s);
+    size_t       i, sum;
+
+    for (i = sum = 0; i < rnc_slice_size(s); i++)
+        sum += p[i];
+
+    rnc_slice_unref(s);
+
+    return (void *)sum;
+}
+
+
+START_TEST(slice_fanout)
+{
+    pthread_t    tid[SLICE_USERS];
+    rnc_slice_t *s;
+    void        *sum;
+    int          round, i;
+
+    released = 0;
+
+    for (round = 0; round < 100; round++) {
+        s = rnc_slice_create(pattern, sizeof(pattern) - 1, slice_release,
+                             &released);
+
+        ck_assert_ptr_ne(s, NULL);
+
+        for (i = 0; i < SLICE_USERS; i++)
+            ck_assert_int_eq(pthread_create(tid + i, NULL, slice_user,
+                                            rnc_slice_ref(s)), 0);
+
+        rnc_slice_unref(s);
+
+        for (i = 0; i < SLICE_USERS; i++) {
+            pthread_join(tid[i], &sum);
+            ck_assert(sum != NULL);
+        }
+
+        ck_assert_int_eq(released, round + 1);
+    }
+}
+END_TEST
+
+
 void basic_tests(Suite *s)
 {
     TCase *c;
@@ -220,6 +851,7 @@ void sequential_tests(Suite *s)
 
     tcase_add_test(c, mem_seqwrite);
     tcase_add_test(c, mem_seqread);
+    tcase_add_test(c, file_staged);
 
     suite_add_tcase(s, c);
 }
@@ -233,6 +865,74 @@ void randomaccess_tests(Suite *s)
 
     tcase_add_test(c, mem_rndwrite);
     tcase_add_test(c, mem_rndread);
+    tcase_add_test(c, mem_overwrite);
+    tcase_add_test(c, mem_overread);
+
+    suite_add_tcase(s, c);
+}
+
+
+void map_tests(Suite *s)
+{
+    TCase *c;
+
+    c = tcase_create("Mapped File Tests");
+
+    tcase_add_test(c, map_open);
+    tcase_add_test(c, map_overwrite);
+    tcase_add_test(c, map_overread);
+    tcase_add_test(c, map_large);
+
+    suite_add_tcase(s, c);
+}
+
+
+void spill_tests(Suite *s)
+{
+    TCase *c;
+
+    c = tcase_create("Spilling Buffer Tests");
+
+    tcase_add_test(c, spill_create);
+    tcase_add_test(c, spill_overwrite);
+    tcase_add_test(c, spill_overread);
+    tcase_add_test(c, spill_nodir);
+
+    suite_add_tcase(s, c);
+}
+
+
+void ring_tests(Suite *s)
+{
+    TCase *c;
+
+    c = tcase_create("SPSC Ring Tests");
+
+    tcase_add_test(c, ring_create);
+    tcase_add_test(c, ring_wrap);
+    tcase_add_test(c, ring_threaded);
+
+    suite_add_tcase(s, c);
+}
+
+
+void zerocopy_tests(Suite *s)
+{
+    TCase *c;
+
+    c = tcase_create("Zero-copy Tests");
+
+    tcase_add_test(c, mem_peek);
+    tcase_add_test(c, ring_peek);
+    tcase_add_test(c, mem_writev);
+    tcase_add_test(c, map_writev);
+    tcase_add_test(c, spill_writev);
+    tcase_add_test(c, spill_copy);
+    tcase_add_test(c, mem_copy);
+    tcase_add_test(c, map_splice);
+    tcase_add_test(c, slice_refcount);
+    tcase_add_test(c, slice_cut);
+    tcase_add_test(c, slice_fanout);
 
     suite_add_tcase(s, c);
 }
@@ -258,6 +958,10 @@ int main(int argc, char *argv[])
     basic_tests(s);
     sequential_tests(s);
     randomaccess_tests(s);
+    map_tests(s);
+    spill_tests(s);
+    ring_tests(s);
+    zerocopy_tests(s);
 
     srunner_run_all(r, CK_NORMAL);
     f = srunner_ntests_failed(r);
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2015, Krisztian Litkey, <kli@iki.fi>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <murphy/common/log.h>
+#include <murphy/common/debug.h>
+#include <ripncode/ripncode.h>
+
+#define NFRAME   (64 * 1024)              /* frames converted per call */
+#define MAX_CHNL 2
+
+#define FORMAT(_chnl, _bits, _smpl, _endn) \
+    RNC_FORMAT_ID(0, 0, _chnl, 0, _bits, RNC_SAMPLE_##_smpl, RNC_ENDIAN_##_endn)
+
+typedef struct {
+    const char *name;
+    uint32_t    src;
+    uint32_t    dst;
+    int         flags;
+} conversion_t;
+
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+
+/*
+ * convert for roughly the given time, return throughput in Msamples/s
+ */
+static double bench(conversion_t *cv, int flags, double secs,
+                    const int16_t *src, void *const *dst, const char **kernel)
+{
+    rnc_convert_t c;
+    double        start, end;
+    size_t        nround;
+
+    if (rnc_convert_init(&c, cv->src, cv->dst, cv->flags | flags) < 0)
+        return -1;
+
+    *kernel = c.name;
+    nround  = 0;
+    start   = now();
+
+    do {
+        rnc_convert(&c, dst, src, NFRAME);
+        nround++;
+    } while ((end = now()) - start < secs);
+
+    return nround * NFRAME * c.chnl / (end - start) / 1000000.0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    conversion_t cvs[] = {
+        { "s16le -> s16be"      , FORMAT(2, 16, SIGNED, LITTLE),
+                                  FORMAT(2, 16, SIGNED, BIG   ), 0 },
+        { "s16le -> s32"        , FORMAT(2, 16, SIGNED, LITTLE),
+                                  FORMAT(2, 32, SIGNED, HOST  ), 0 },
+        { "s16be -> s32"        , FORMAT(2, 16, SIGNED, BIG   ),
+                                  FORMAT(2, 32, SIGNED, HOST  ), 0 },
+        { "s16le -> f32"        , FORMAT(2, 16, SIGNED, LITTLE),
+                                  FORMAT(2, 32, FLOATING, HOST), 0 },
+        { "s16le -> s32 planar" , FORMAT(2, 16, SIGNED, LITTLE),
+                                  FORMAT(2, 32, SIGNED, HOST  ),
+                                  RNC_CONVERT_PLANAR },
+        { "s16be -> f32 planar" , FORMAT(2, 16, SIGNED, BIG   ),
+                                  FORMAT(2, 32, FLOATING, HOST),
+                                  RNC_CONVERT_PLANAR },
+    }, *cv;
+    int          flags[] = { RNC_CONVERT_SCALAR, RNC_CONVERT_NOAVX2, 0 }, i;
+    int16_t     *src;
+    void        *dst[MAX_CHNL];
+    const char  *kernel[MRP_ARRAY_SIZE(flags)];
+    double       rate[MRP_ARRAY_SIZE(flags)], secs;
+    char        *e;
+
+    secs = 0.5;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-s") && i < argc - 1)
+            secs = strtod(argv[++i], &e);
+        else {
+            printf("usage: %s [-s <seconds per conversion>]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    src    = mrp_alloc(NFRAME * MAX_CHNL * sizeof(src[0]));
+    dst[0] = mrp_alloc(NFRAME * MAX_CHNL * sizeof(float));
+    dst[1] = mrp_alloc(NFRAME * MAX_CHNL * sizeof(float));
+
+    if (src == NULL || dst[0] == NULL || dst[1] == NULL) {
+        printf("failed to allocate buffers\n");
+        exit(1);
+    }
+
+    for (i = 0; i < NFRAME * MAX_CHNL; i++)
+        src[i] = (int16_t)(i * 7919);
+
+    printf("%-20s %12s %12s %12s %9s  %s\n", "conversion", "scalar",
+           "no AVX2", "best", "speedup", "kernel");
+
+    for (cv = cvs; cv < cvs + MRP_ARRAY_SIZE(cvs); cv++) {
+        for (i = 0; i < (int)MRP_ARRAY_SIZE(flags); i++) {
+            rate[i] = bench(cv, flags[i], secs, src, dst, kernel + i);
+
+            if (rate[i] < 0) {
+                printf("%s: conversion not supported\n", cv->name);
+                exit(1);
+            }
+        }
+
+        printf("%-20s %8.0f MS/s %8.0f MS/s %8.0f MS/s %8.2fx  %s\n",
+               cv->name, rate[0], rate[1], rate[2], rate[2] / rate[0],
+               kernel[2]);
+    }
+
+    mrp_free(src);
+    mrp_free(dst[0]);
+    mrp_free(dst[1]);
+
+    return 0;
+}
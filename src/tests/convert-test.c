@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2015, Krisztian Litkey, <kli@iki.fi>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <byteswap.h>
+#include <check.h>
+
+#include <murphy/common/log.h>
+#include <murphy/common/debug.h>
+#include <ripncode/ripncode.h>
+
+#define MAX_FRAMES 4099
+#define MAX_CHNL   6
+
+#define FORMAT(_chnl, _bits, _smpl, _endn) \
+    RNC_FORMAT_ID(0, 0, _chnl, 0, _bits, RNC_SAMPLE_##_smpl, RNC_ENDIAN_##_endn)
+
+static int16_t src[MAX_FRAMES * MAX_CHNL + 1];
+static int16_t *in = src + 1;             /* misaligned input */
+
+
+static void fill_samples(void)
+{
+    uint32_t seed = 1;
+    size_t   i;
+
+    for (i = 0; i < MRP_ARRAY_SIZE(src); i++) {
+        seed   = seed * 1103515245 + 12345;
+        src[i] = (int16_t)(seed >> 8);
+    }
+
+    /* make sure the extremes are covered */
+    in[0] = -32768;
+    in[1] = 32767;
+    in[2] = 0;
+    in[3] = -1;
+}
+
+
+/*
+ * reference value of sample i of channel c in the destination format
+ */
+static double reference(uint32_t sfmt, uint32_t dfmt, size_t i, int c)
+{
+    int     chnl = RNC_FORMAT_CHNL(sfmt);
+    int16_t v    = in[i * chnl + c];
+
+    if (RNC_FORMAT_ENDN(sfmt) != RNC_ENDIAN_HOST)
+        v = (int16_t)bswap_16(v);
+
+    if (RNC_FORMAT_SMPL(dfmt) == RNC_SAMPLE_FLOATING)
+        return v / 32768.0;
+
+    if (RNC_FORMAT_BITS(dfmt) == 16 && RNC_FORMAT_ENDN(dfmt) != RNC_ENDIAN_HOST)
+        return (int16_t)bswap_16(v);
+
+    return v;
+}
+
+
+static double sample(uint32_t dfmt, void *const *dst, int planar, int chnl,
+                     size_t i, int c)
+{
+    size_t idx = planar ? i : i * chnl + c;
+    void  *buf = planar ? dst[c] : dst[0];
+
+    if (RNC_FORMAT_SMPL(dfmt) == RNC_SAMPLE_FLOATING)
+        return ((float *)buf)[idx];
+    if (RNC_FORMAT_BITS(dfmt) == 16)
+        return ((int16_t *)buf)[idx];
+
+    return ((int32_t *)buf)[idx];
+}
+
+
+static void check_conversion(uint32_t sfmt, uint32_t dfmt, int flags)
+{
+    static char    buf[MAX_CHNL][MAX_FRAMES * MAX_CHNL * sizeof(float) + 64];
+    void          *dst[MAX_CHNL];
+    rnc_convert_t  c;
+    int            chnl, planar, n, k;
+    size_t         lengths[] = { 0, 1, 2, 3, 7, 8, 9, 15, 16, 17, 31, 33, 63,
+                                 65, 1000, MAX_FRAMES };
+    size_t         i, nframe;
+
+    chnl   = RNC_FORMAT_CHNL(sfmt);
+    planar = flags & RNC_CONVERT_PLANAR;
+
+    ck_assert_int_eq(rnc_convert_init(&c, sfmt, dfmt, flags), 0);
+    ck_assert_ptr_ne(c.name, NULL);
+
+    for (n = 0; n < (int)MRP_ARRAY_SIZE(lengths); n++) {
+        nframe = lengths[n];
+
+        /* misalign destinations to exercise unaligned stores */
+        for (k = 0; k < MAX_CHNL; k++) {
+            memset(buf[k], 0x5a, sizeof(buf[k]));
+            dst[k] = buf[k] + 4;
+        }
+
+        rnc_convert(&c, dst, in, nframe);
+
+        for (i = 0; i < nframe; i++)
+            for (k = 0; k < chnl; k++)
+                ck_assert_msg(sample(dfmt, dst, planar, chnl, i, k) ==
+                              reference(sfmt, dfmt, i, k),
+                              "%s: frame %zu, channel %d", c.name, i, k);
+
+        /* nothing written past the end */
+        for (k = 0; k < (planar ? chnl : 1); k++)
+            ck_assert_int_eq(((unsigned char *)dst[k])
+                             [nframe * (planar ? 1 : chnl) *
+                              (RNC_FORMAT_BITS(dfmt) / 8)], 0x5a);
+    }
+}
+
+
+static void check_all(int flags)
+{
+    int chnls[] = { 1, 2, 6 }, i;
+
+    for (i = 0; i < (int)MRP_ARRAY_SIZE(chnls); i++) {
+        int n = chnls[i];
+
+        check_conversion(FORMAT(n, 16, SIGNED, LITTLE),
+                         FORMAT(n, 16, SIGNED, LITTLE), flags);
+        check_conversion(FORMAT(n, 16, SIGNED, LITTLE),
+                         FORMAT(n, 16, SIGNED, BIG), flags);
+        check_conversion(FORMAT(n, 16, SIGNED, BIG),
+                         FORMAT(n, 16, SIGNED, LITTLE), flags);
+        check_conversion(FORMAT(n, 16, SIGNED, LITTLE),
+                         FORMAT(n, 32, SIGNED, HOST), flags);
+        check_conversion(FORMAT(n, 16, SIGNED, BIG),
+                         FORMAT(n, 32, SIGNED, HOST), flags);
+        check_conversion(FORMAT(n, 16, SIGNED, LITTLE),
+                         FORMAT(n, 32, FLOATING, HOST), flags);
+        check_conversion(FORMAT(n, 16, SIGNED, BIG),
+                         FORMAT(n, 32, FLOATING, HOST), flags);
+    }
+}
+
+
+START_TEST(scalar_interleaved)
+{
+    fill_samples();
+    check_all(RNC_CONVERT_SCALAR);
+}
+END_TEST
+
+START_TEST(scalar_planar)
+{
+    fill_samples();
+    check_all(RNC_CONVERT_SCALAR | RNC_CONVERT_PLANAR);
+}
+END_TEST
+
+START_TEST(noavx2_interleaved)
+{
+    fill_samples();
+    check_all(RNC_CONVERT_NOAVX2);
+}
+END_TEST
+
+START_TEST(noavx2_planar)
+{
+    fill_samples();
+    check_all(RNC_CONVERT_NOAVX2 | RNC_CONVERT_PLANAR);
+}
+END_TEST
+
+START_TEST(best_interleaved)
+{
+    fill_samples();
+    check_all(0);
+}
+END_TEST
+
+START_TEST(best_planar)
+{
+    fill_samples();
+    check_all(RNC_CONVERT_PLANAR);
+}
+END_TEST
+
+START_TEST(unsupported)
+{
+    rnc_convert_t c;
+
+    /* no 24-bit or unsigned source, no byte-swapped wide output */
+    ck_assert_int_eq(rnc_convert_init(&c, FORMAT(2, 24, SIGNED, LITTLE),
+                                      FORMAT(2, 32, SIGNED, HOST), 0), -1);
+    ck_assert_int_eq(errno, EOPNOTSUPP);
+    ck_assert_int_eq(rnc_convert_init(&c, FORMAT(2, 16, UNSIGNED, LITTLE),
+                                      FORMAT(2, 32, SIGNED, HOST), 0), -1);
+    ck_assert_int_eq(errno, EOPNOTSUPP);
+    ck_assert_int_eq(rnc_convert_init(&c, FORMAT(2, 16, SIGNED, LITTLE),
+                                      FORMAT(2, 16, FLOATING, HOST), 0), -1);
+    ck_assert_int_eq(errno, EOPNOTSUPP);
+
+    /* no channel remapping */
+    ck_assert_int_eq(rnc_convert_init(&c, FORMAT(2, 16, SIGNED, LITTLE),
+                                      FORMAT(1, 16, SIGNED, LITTLE), 0), -1);
+    ck_assert_int_eq(errno, EINVAL);
+}
+END_TEST
+
+
+void conversion_tests(Suite *s)
+{
+    TCase *c;
+
+    c = tcase_create("Sample Conversion Tests");
+
+    tcase_add_test(c, scalar_interleaved);
+    tcase_add_test(c, scalar_planar);
+    tcase_add_test(c, noavx2_interleaved);
+    tcase_add_test(c, noavx2_planar);
+    tcase_add_test(c, best_interleaved);
+    tcase_add_test(c, best_planar);
+    tcase_add_test(c, unsupported);
+
+    suite_add_tcase(s, c);
+}
+
+
+int main(int argc, char *argv[])
+{
+    Suite   *s;
+    SRunner *r;
+    int      f, i;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-d") && i < argc - 1) {
+            mrp_log_set_mask(MRP_LOG_UPTO(MRP_LOG_WARNING) | MRP_LOG_MASK_DEBUG);
+            mrp_debug_set(argv[i + 1]);
+            mrp_debug_enable(TRUE);
+        }
+    }
+
+    s = suite_create("Convert");
+    r = srunner_create(s);
+
+    conversion_tests(s);
+
+    srunner_run_all(r, CK_NORMAL);
+    f = srunner_ntests_failed(r);
+    srunner_free(r);
+
+    exit(f == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
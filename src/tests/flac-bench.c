@@ -0,0 +1,285 @@
+/*
+ * Copyright (c) 2015, Krisztian Litkey, <kli@iki.fi>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <byteswap.h>
+
+#include <murphy/common/log.h>
+#include <murphy/common/debug.h>
+#include <ripncode/ripncode.h>
+
+#define SECTOR_SIZE 2352                 /* CD-DA sector, 588 stereo samples */
+#define FEED_FRAMES (4 * 4096)           /* what the FLAC encoder feeds */
+
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+
+/*
+ * deterministic, vaguely music-like 16-bit stereo audio
+ */
+static int16_t *make_audio(size_t nsample)
+{
+    int16_t  *buf;
+    uint32_t  seed = 1;
+    int32_t   l = 0, r = 0;
+    size_t    i;
+
+    if ((buf = mrp_alloc(nsample * 2 * sizeof(buf[0]))) == NULL)
+        return NULL;
+
+    for (i = 0; i < nsample; i++) {
+        seed = seed * 1103515245 + 12345;
+        l    = (l * 7 + (int16_t)(seed >> 16)) / 8;
+        seed = seed * 1103515245 + 12345;
+        r    = (r * 7 + (int16_t)(seed >> 16)) / 8;
+
+        buf[2 * i]     = l;
+        buf[2 * i + 1] = r;
+    }
+
+    return buf;
+}
+
+
+/*
+ * the original per-call deinterleaving into planar buffers, for reference
+ * (the original had the planar buffers as VLAs on the stack)
+ */
+static void old_feed(const void *buf, size_t size, int swap,
+                     int32_t *l, int32_t *r)
+{
+    const int16_t *p = buf;
+    unsigned       nsample, i;
+
+    nsample = size / (2 * 2);
+
+    i = 0;
+    if (swap) {
+        while (i < nsample) {
+            l[i] = bswap_16(*p++);
+            r[i] = bswap_16(*p++);
+            i++;
+        }
+    }
+    else {
+        while (i < nsample) {
+            l[i] = *p++;
+            r[i] = *p++;
+            i++;
+        }
+    }
+}
+
+
+/*
+ * the current widening into a fixed interleaved buffer, with the same
+ * conversion the encoder sets up for the format
+ */
+static void new_feed(rnc_convert_t *cvt, const void *buf, size_t size,
+                     int32_t *pcm)
+{
+    const int16_t *p = buf;
+    void          *dst[1] = { pcm };
+    size_t         nsample, n;
+
+    nsample = size / (2 * 2);
+
+    while (nsample > 0) {
+        n = nsample < FEED_FRAMES ? nsample : FEED_FRAMES;
+
+        rnc_convert(cvt, dst, p, n);
+
+        p       += 2 * n;
+        nsample -= n;
+    }
+}
+
+
+static double bench_feed(uint32_t fid, const char *audio, size_t total,
+                         size_t chunk, int old)
+{
+    rnc_convert_t cvt;
+    int32_t      *l, *r, *pcm;
+    size_t        offs, n;
+    double        start, end;
+
+    if (rnc_convert_init(&cvt, fid,
+                         RNC_FORMAT_ID(0, 0, 2, 0, 32, RNC_SAMPLE_SIGNED,
+                                       RNC_ENDIAN_HOST), 0) < 0)
+        return -1;
+
+    l   = mrp_alloc(chunk / 4 * sizeof(*l));
+    r   = mrp_alloc(chunk / 4 * sizeof(*r));
+    pcm = mrp_alloc(2 * FEED_FRAMES * sizeof(*pcm));
+
+    if (l == NULL || r == NULL || pcm == NULL)
+        return -1;
+
+    start = now();
+
+    for (offs = 0; offs < total; offs += n) {
+        n = total - offs < chunk ? total - offs : chunk;
+
+        if (old)
+            old_feed(audio + offs, n, 0, l, r);
+        else
+            new_feed(&cvt, audio + offs, n, pcm);
+    }
+
+    end = now();
+
+    mrp_free(l);
+    mrp_free(r);
+    mrp_free(pcm);
+
+    return end - start;
+}
+
+
+static double bench_encode(rnc_t *rnc, uint32_t fid, const char *audio,
+                           size_t total, size_t chunk, int nthread)
+{
+    rnc_encoder_t *enc;
+    size_t         offs, n;
+    double         start, end;
+
+    if ((enc = rnc_encoder_create(rnc, fid)) == NULL)
+        return -1;
+
+    rnc_encoder_set_quality(enc, 0xffffU, 0xffffU);
+
+    if (nthread > 1 && rnc_encoder_set_threads(enc, nthread) < 0)
+        goto fail;
+
+    start = now();
+
+    for (offs = 0; offs < total; offs += n) {
+        n = total - offs < chunk ? total - offs : chunk;
+
+        if (rnc_encoder_write(enc, audio + offs, n) < 0)
+            goto fail;
+    }
+
+    if (rnc_encoder_finish(enc) < 0)
+        goto fail;
+
+    end = now();
+
+    rnc_encoder_destroy(enc);
+
+    return end - start;
+
+ fail:
+    rnc_encoder_destroy(enc);
+    return -1;
+}
+
+
+int main(int argc, char *argv[])
+{
+    int      sectors[] = { 1, 16, 64, 384 }, *s;
+    rnc_t    rnc;
+    uint32_t fid;
+    size_t   secs, total, chunk, calls;
+    int      cmpr, nthread, i;
+    char    *e, *audio;
+    double   told, tnew, tenc;
+
+    secs    = 60;
+    nthread = 1;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-s") && i < argc - 1)
+            secs = strtoul(argv[++i], &e, 10);
+        else if (!strcmp(argv[i], "-t") && i < argc - 1)
+            nthread = strtoul(argv[++i], &e, 10);
+        else {
+            printf("usage: %s [-s <seconds of audio>] [-t <threads>]\n",
+                   argv[0]);
+            exit(1);
+        }
+    }
+
+    mrp_clear(&rnc);
+    rnc_format_init(&rnc);
+    rnc_encoder_init(&rnc);
+
+    if ((cmpr = rnc_compress_id(&rnc, "flac")) < 0) {
+        printf("FLAC encoder not available\n");
+        exit(1);
+    }
+
+    fid = RNC_FORMAT_ID(RNC_CHANNELMAP_LEFTRIGHT, cmpr, 2,
+                        RNC_SAMPLERATE_44100, 16, RNC_SAMPLE_SIGNED,
+                        RNC_ENDIAN_LITTLE);
+
+    total = secs * 44100 * 2 * 2;
+
+    if ((audio = (char *)make_audio(total / 4)) == NULL) {
+        printf("failed to generate audio\n");
+        exit(1);
+    }
+
+    printf("%zu seconds of 16-bit stereo audio, %d encoder thread(s)\n", secs,
+           nthread);
+    printf("%8s %8s %12s %12s %12s %12s\n", "sectors", "calls",
+           "old feed", "new feed", "old stack", "encode");
+
+    for (s = sectors; s < sectors + MRP_ARRAY_SIZE(sectors); s++) {
+        chunk = *s * SECTOR_SIZE;
+        calls = (total + chunk - 1) / chunk;
+        told  = bench_feed(fid, audio, total, chunk, 1);
+        tnew  = bench_feed(fid, audio, total, chunk, 0);
+        tenc  = bench_encode(&rnc, fid, audio, total, chunk, nthread);
+
+        if (told < 0 || tnew < 0 || tenc < 0) {
+            printf("benchmark failed\n");
+            exit(1);
+        }
+
+        printf("%8d %8zu %9.2f us %9.2f us %9zu KB %9.2f us\n", *s, calls,
+               1000000 * told / calls, 1000000 * tnew / calls,
+               2 * chunk * sizeof(int32_t) / 1024, 1000000 * tenc / calls);
+    }
+
+    mrp_free(audio);
+
+    return 0;
+}
@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2015, Krisztian Litkey, <kli@iki.fi>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <check.h>
+
+#include <murphy/common/log.h>
+#include <murphy/common/debug.h>
+#include <ripncode/ripncode.h>
+
+#define SECTOR_FRAMES 588                /* stereo frames in a CD-DA sector */
+#define SEGMENT       (32 * 4096)        /* frames in a parallel segment */
+
+static rnc_t    rnc;
+static uint32_t fid;
+
+
+static void setup(void)
+{
+    int cmpr;
+
+    if (fid != 0)
+        return;
+
+    mrp_clear(&rnc);
+    rnc_format_init(&rnc);
+    rnc_encoder_init(&rnc);
+
+    cmpr = rnc_compress_id(&rnc, "flac");
+    ck_assert_int_ge(cmpr, 0);
+
+    fid = RNC_FORMAT_ID(RNC_CHANNELMAP_LEFTRIGHT, cmpr, 2,
+                        RNC_SAMPLERATE_44100, 16, RNC_SAMPLE_SIGNED,
+                        RNC_ENDIAN_LITTLE);
+}
+
+
+/*
+ * deterministic, vaguely music-like 16-bit stereo audio
+ */
+static int16_t *make_audio(size_t nframe)
+{
+    int16_t  *buf;
+    uint32_t  seed = 1;
+    int32_t   l = 0, r = 0;
+    size_t    i;
+
+    buf = mrp_alloc(nframe * 2 * sizeof(buf[0]));
+    ck_assert_ptr_ne(buf, NULL);
+
+    for (i = 0; i < nframe; i++) {
+        seed = seed * 1103515245 + 12345;
+        l    = (l * 7 + (int16_t)(seed >> 16)) / 8;
+        seed = seed * 1103515245 + 12345;
+        r    = (r * 7 + (int16_t)(seed >> 16)) / 8;
+
+        buf[2 * i]     = l;
+        buf[2 * i + 1] = r;
+    }
+
+    return buf;
+}
+
+
+/*
+ * encode nframe frames of audio with nthread threads, in writes of chunk
+ * frames, to a file, and return the contents of the file
+ */
+static char *encode(const int16_t *audio, size_t nframe, size_t chunk,
+                    int nthread, size_t *sizep)
+{
+    rnc_encoder_t *enc;
+    rnc_meta_t     meta;
+    char           path[64], *data;
+    struct stat    st;
+    size_t         offs, n;
+    int            fd;
+
+    snprintf(path, sizeof(path), "/tmp/flac-test-%d.flac", nthread);
+
+    enc = rnc_encoder_create(&rnc, fid);
+    ck_assert_ptr_ne(enc, NULL);
+
+    rnc_encoder_set_quality(enc, 0xffffU, 0xffffU);
+
+    if (nthread > 1)
+        ck_assert_int_eq(rnc_encoder_set_threads(enc, nthread), 0);
+
+    ck_assert_int_eq(rnc_encoder_set_output(enc, path), 0);
+
+    mrp_clear(&meta);
+    meta.track = 1;
+    meta.title = "flac-test";
+    ck_assert_int_eq(rnc_encoder_set_metadata(enc, &meta, 0), 0);
+
+    for (offs = 0; offs < nframe; offs += n) {
+        n = nframe - offs < chunk ? nframe - offs : chunk;
+
+        ck_assert_int_eq(rnc_encoder_write(enc, audio + 2 * offs, 4 * n), 0);
+    }
+
+    ck_assert_int_eq(rnc_encoder_set_gain(enc, -6.5, 0.75, 0), 0);
+    ck_assert_int_eq(rnc_encoder_finish(enc), 0);
+
+    rnc_encoder_destroy(enc);
+
+    fd = open(path, O_RDONLY);
+    ck_assert_int_ge(fd, 0);
+    ck_assert_int_eq(fstat(fd, &st), 0);
+    ck_assert_int_gt(st.st_size, 0);
+
+    data = mrp_alloc(st.st_size);
+    ck_assert_ptr_ne(data, NULL);
+    ck_assert_int_eq(read(fd, data, st.st_size), st.st_size);
+
+    close(fd);
+    unlink(path);
+
+    *sizep = st.st_size;
+
+    return data;
+}
+
+
+/*
+ * check that encoding with nthread threads produces the exact same
+ * stream as encoding with a single one
+ */
+static void check_threads(size_t nframe, size_t chunk, int nthread)
+{
+    int16_t *audio;
+    char    *one, *many;
+    size_t   none, nmany;
+
+    setup();
+
+    audio = make_audio(nframe);
+    one   = encode(audio, nframe, chunk, 1, &none);
+    many  = encode(audio, nframe, chunk, nthread, &nmany);
+
+    ck_assert_int_eq(none, nmany);
+    ck_assert_int_eq(memcmp(one, many, none), 0);
+
+    mrp_free(one);
+    mrp_free(many);
+    mrp_free(audio);
+}
+
+
+START_TEST(short_stream)
+{
+    /* less than a single block, let alone a segment */
+    check_threads(1000, SECTOR_FRAMES, 4);
+}
+END_TEST
+
+START_TEST(single_segment)
+{
+    check_threads(SEGMENT, 16 * SECTOR_FRAMES, 2);
+}
+END_TEST
+
+START_TEST(segment_boundaries)
+{
+    /* a partial last block and segment, one sector writes */
+    check_threads(3 * SEGMENT + 1234, SECTOR_FRAMES, 2);
+}
+END_TEST
+
+START_TEST(many_segments)
+{
+    /* writes that straddle segments, more segments than threads */
+    check_threads(10 * SEGMENT + 4095, 384 * SECTOR_FRAMES, 3);
+}
+END_TEST
+
+START_TEST(many_threads)
+{
+    check_threads(5 * SEGMENT + 17, 64 * SECTOR_FRAMES, 8);
+}
+END_TEST
+
+
+void thread_tests(Suite *s)
+{
+    TCase *c;
+
+    c = tcase_create("Parallel FLAC Encoding Tests");
+
+    tcase_set_timeout(c, 60);
+    tcase_add_test(c, short_stream);
+    tcase_add_test(c, single_segment);
+    tcase_add_test(c, segment_boundaries);
+    tcase_add_test(c, many_segments);
+    tcase_add_test(c, many_threads);
+
+    suite_add_tcase(s, c);
+}
+
+
+int main(int argc, char *argv[])
+{
+    Suite   *s;
+    SRunner *r;
+    int      f, i;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-d") && i < argc - 1) {
+            mrp_log_set_mask(MRP_LOG_UPTO(MRP_LOG_WARNING) | MRP_LOG_MASK_DEBUG);
+            mrp_debug_set(argv[i + 1]);
+            mrp_debug_enable(TRUE);
+        }
+    }
+
+    s = suite_create("FLAC");
+    r = srunner_create(s);
+
+    thread_tests(s);
+
+    srunner_run_all(r, CK_NORMAL);
+    f = srunner_ntests_failed(r);
+    srunner_free(r);
+
+    exit(f == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,440 @@
+/*
+ * Copyright (c) 2015, Krisztian Litkey, <kli@iki.fi>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <murphy/common/log.h>
+#include <murphy/common/debug.h>
+#include <ripncode/ripncode.h>
+
+#define MAX_FORMATS 32                   /* max. formats to pick from */
+#define READ_BLOCKS 64                   /* blocks to read/analyze at once */
+#define TOLERANCE   0.01                 /* max. accepted difference, LU */
+#define ROUNDING    1e-9                 /* max. rounding difference, LU */
+#define TRUE_PEAK   1e-5                 /* max. true peak difference */
+#define STATE_PATH  "/tmp/gain-bench.state" /* where to save states to */
+
+#define DEFAULT_CORPUS \
+    "synthetic:tracks=music/120,loud/120,pink/60,tone/30,white/30,silence/10"
+
+
+/*
+ * engines to compare against the reference engine they are marked with,
+ * segmented analysis must give the same results as the engine it is marked
+ * same as, up to floating point rounding
+ */
+#define TP RNC_GAIN_TRUE_PEAK
+
+static struct {
+    const char *label;
+    int         flags;
+    int         nthread;
+    int         ref;
+    int         same;
+} engines[] = {
+    { "libebur128" , RNC_GAIN_EBUR128     , 1, 0, -1 },
+    { "scalar"     , RNC_GAIN_SCALAR      , 1, 0, -1 },
+    { "simd"       , 0                    , 1, 0, -1 },
+    { "segmented"  , 0                    , 4, 0,  2 },
+    { "libebur128T", RNC_GAIN_EBUR128 | TP, 1, 4, -1 },
+    { "scalarT"    , RNC_GAIN_SCALAR | TP , 1, 4, -1 },
+    { "simdT"      , TP                   , 1, 4, -1 },
+    { "segmentedT" , TP                   , 4, 4,  6 },
+};
+
+#define NENGINE MRP_ARRAY_SIZE(engines)
+
+
+typedef struct {
+    int     id;                          /* track id */
+    char   *data;                        /* track audio */
+    size_t  size;                        /* amount of audio */
+} track_t;
+
+
+typedef struct {
+    double  time;                        /* total analysis time */
+    double  ldiff;                       /* max. loudness difference */
+    double  rdiff;                       /* max. range difference */
+    double  pdiff;                       /* max. peak difference */
+    double  tdiff;                       /* max. true peak difference */
+    int     nbad;                        /* results beyond tolerance */
+    int     nsame;                       /* results not the same */
+    size_t  saved;                       /* size of saved states */
+} result_t;
+
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+
+/*
+ * differences between -inf loudnesses (silence) are no differences
+ */
+static double diff(double a, double b)
+{
+    if (isinf(a) && isinf(b) && (a < 0) == (b < 0))
+        return 0;
+
+    return fabs(a - b);
+}
+
+
+static uint32_t pick_format(rnc_dev_t *dev, rnc_track_t *t)
+{
+    uint32_t dfmt[MAX_FORMATS], gfmt[MAX_FORMATS];
+    int      ndev, ngain, d, g;
+
+    if (rnc_device_seek(dev, t, 0) < 0)
+        return 0;
+
+    ndev  = rnc_device_get_formats(dev, dfmt, MAX_FORMATS);
+    ngain = rnc_gain_get_formats(gfmt, MAX_FORMATS);
+
+    for (g = 0; g < ngain && g < MAX_FORMATS; g++)
+        for (d = 0; d < ndev && d < MAX_FORMATS; d++)
+            if (RNC_FORMAT_SAME_SAMPLES(dfmt[d], gfmt[g]))
+                return rnc_device_set_format(dev, dfmt[d]) < 0 ? 0 : dfmt[d];
+
+    return 0;
+}
+
+
+static int read_track(rnc_dev_t *dev, rnc_track_t *t, track_t *trk)
+{
+    int blksize, i, n;
+
+    blksize = rnc_device_get_blocksize(dev);
+
+    trk->id   = t->id;
+    trk->size = 0;
+    trk->data = mrp_alloc((size_t)t->nblk * blksize);
+
+    if (trk->data == NULL || rnc_device_seek(dev, t, 0) < 0)
+        return -1;
+
+    for (i = 0; i < (int)t->nblk; i += n / blksize) {
+        n = (int)t->nblk - i < READ_BLOCKS ? (int)t->nblk - i : READ_BLOCKS;
+        n = rnc_device_read(dev, trk->data + trk->size, n * blksize);
+
+        if (n <= 0)
+            return -1;
+
+        trk->size += n;
+    }
+
+    return 0;
+}
+
+
+/*
+ * save, reload and compare the state of a native engine
+ */
+static int check_state(rnc_gain_t *g, int ntrack, result_t *res)
+{
+    rnc_gain_t  *l;
+    struct stat  st;
+    char         label[32];
+    int          i;
+
+    for (i = 0; i < ntrack; i++) {
+        snprintf(label, sizeof(label), "track-%d", i);
+
+        if (rnc_gain_set_label(g, i, label) < 0)
+            return -1;
+    }
+
+    if (rnc_gain_save(g, STATE_PATH) < 0 || stat(STATE_PATH, &st) < 0 ||
+        (l = rnc_gain_load(STATE_PATH)) == NULL) {
+        printf("failed to save and reload state\n");
+        return -1;
+    }
+
+    unlink(STATE_PATH);
+    res->saved += st.st_size;
+
+    for (i = 0; i < ntrack; i++) {
+        if (diff(rnc_gain_track_loudness(g, i),
+                 rnc_gain_track_loudness(l, i)) != 0 ||
+            diff(rnc_gain_track_range(g, i), rnc_gain_track_range(l, i)) ||
+            diff(rnc_gain_track_peak(g, i), rnc_gain_track_peak(l, i)) ||
+            diff(rnc_gain_track_true_peak(g, i),
+                 rnc_gain_track_true_peak(l, i))) {
+            printf("reloaded state of track #%d differs\n", i);
+            res->nsame++;
+        }
+    }
+
+    if (rnc_gain_album_gain(g) != rnc_gain_album_gain(l)) {
+        printf("reloaded album gain differs\n");
+        res->nsame++;
+    }
+
+    rnc_gain_destroy(l);
+
+    return 0;
+}
+
+
+static int bench_corpus(rnc_t *rnc, const char *corpus, result_t *res,
+                        double *secs)
+{
+    rnc_dev_t   *dev;
+    rnc_track_t *tracks;
+    track_t     *trk;
+    rnc_gain_t  *g[NENGINE];
+    uint32_t     fid;
+    size_t       frame, chunk, offs, n;
+    double       start, l[NENGINE], r[NENGINE], p[NENGINE], t[NENGINE], d;
+    int          ntrack, i, e, f, s, status;
+
+    status = -1;
+    tracks = NULL;
+    trk    = NULL;
+    memset(g, 0, sizeof(g));
+
+    if ((dev = rnc_device_open(rnc, corpus)) == NULL) {
+        printf("failed to open '%s'\n", corpus);
+        return -1;
+    }
+
+    if ((ntrack = rnc_device_get_tracks(dev, NULL, 0)) <= 0)
+        goto out;
+
+    tracks = mrp_allocz_array(rnc_track_t, ntrack);
+    trk    = mrp_allocz_array(track_t, ntrack);
+
+    if (tracks == NULL || trk == NULL ||
+        rnc_device_get_tracks(dev, tracks, ntrack) != ntrack)
+        goto out;
+
+    if ((fid = pick_format(dev, tracks)) == 0) {
+        printf("no suitable sample format for '%s'\n", corpus);
+        goto out;
+    }
+
+    for (i = 0; i < ntrack; i++) {
+        if (read_track(dev, tracks + i, trk + i) < 0) {
+            printf("failed to read track #%d of '%s'\n", tracks[i].id,
+                   corpus);
+            goto out;
+        }
+    }
+
+    frame = RNC_FORMAT_CHNL(fid) * RNC_FORMAT_BITS(fid) / 8;
+    chunk = READ_BLOCKS * rnc_device_get_blocksize(dev);
+
+    for (i = 0; i < ntrack; i++)
+        *secs += 1.0 * trk[i].size / frame /
+            rnc_id_freq(RNC_FORMAT_RATE(fid));
+
+    for (e = 0; e < (int)NENGINE; e++) {
+        if ((g[e] = rnc_gain_create(ntrack, fid, engines[e].flags)) == NULL)
+            goto out;
+
+        start = now();
+
+        for (i = 0; i < ntrack; i++) {
+            if (engines[e].nthread > 1) {
+                if (rnc_gain_analyze_parallel(g[e], i, trk[i].data,
+                                              trk[i].size / frame,
+                                              engines[e].nthread) < 0)
+                    goto out;
+            }
+            else {
+                for (offs = 0; offs < trk[i].size; offs += n) {
+                    n = trk[i].size - offs;
+                    if (n > chunk)
+                        n = chunk;
+
+                    if (rnc_gain_analyze(g[e], i, trk[i].data + offs,
+                                         n / frame) < 0)
+                        goto out;
+                }
+            }
+
+            /* results are part of the work, range in particular */
+            rnc_gain_track_loudness(g[e], i);
+            rnc_gain_track_range(g[e], i);
+        }
+
+        rnc_gain_album_gain(g[e]);
+
+        res[e].time += now() - start;
+    }
+
+    printf("%s\n", corpus);
+    printf("%6s %-11s %10s %8s %8s %8s\n", "track", "engine", "loudness",
+           "range", "peak", "truepeak");
+
+    for (i = 0; i < ntrack; i++) {
+        for (e = 0; e < (int)NENGINE; e++) {
+            l[e] = rnc_gain_track_loudness(g[e], i);
+            r[e] = rnc_gain_track_range(g[e], i);
+            p[e] = rnc_gain_track_peak(g[e], i);
+            t[e] = rnc_gain_track_true_peak(g[e], i);
+
+            printf("%6d %-11s %10.4f %8.4f %8.6f %8.6f", trk[i].id,
+                   engines[e].label, l[e], r[e], p[e], t[e]);
+
+            if ((f = engines[e].ref) != e) {
+                if ((d = diff(l[f], l[e])) > res[e].ldiff)
+                    res[e].ldiff = d;
+                if (d > TOLERANCE) {
+                    printf("  loudness off by %.4f LU", d);
+                    res[e].nbad++;
+                }
+
+                if ((d = diff(r[f], r[e])) > res[e].rdiff)
+                    res[e].rdiff = d;
+                if (d > TOLERANCE) {
+                    printf("  range off by %.4f LU", d);
+                    res[e].nbad++;
+                }
+
+                if ((d = diff(p[f], p[e])) > res[e].pdiff)
+                    res[e].pdiff = d;
+
+                if ((d = diff(t[f], t[e])) > res[e].tdiff)
+                    res[e].tdiff = d;
+                if (d > TRUE_PEAK) {
+                    printf("  true peak off by %.6f", d);
+                    res[e].nbad++;
+                }
+            }
+
+            if ((s = engines[e].same) >= 0 &&
+                (diff(l[e], l[s]) > ROUNDING || diff(r[e], r[s]) > ROUNDING ||
+                 diff(p[e], p[s]) > ROUNDING || diff(t[e], t[s]) > ROUNDING)) {
+                printf("  differs from %s", engines[s].label);
+                res[e].nsame++;
+            }
+
+            printf("\n");
+        }
+    }
+
+    for (e = 0; e < (int)NENGINE; e++)
+        if (!(engines[e].flags & RNC_GAIN_EBUR128) &&
+            check_state(g[e], ntrack, res + e) < 0)
+            goto out;
+
+    status = 0;
+
+ out:
+    for (e = 0; e < (int)NENGINE; e++)
+        rnc_gain_destroy(g[e]);
+
+    if (trk != NULL)
+        for (i = 0; i < ntrack; i++)
+            mrp_free(trk[i].data);
+
+    mrp_free(trk);
+    mrp_free(tracks);
+    rnc_device_close(dev);
+
+    return status;
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *def[] = { DEFAULT_CORPUS }, **corpora;
+    result_t    res[NENGINE];
+    rnc_t       rnc;
+    double      audio;
+    int         ncorpus, i, e, nbad;
+
+    if (argc > 1 && argv[1][0] == '-') {
+        printf("usage: %s [<image or device> ...]\n", argv[0]);
+        printf("The default corpus is '%s'.\n", DEFAULT_CORPUS);
+        exit(1);
+    }
+
+    if (argc > 1) {
+        corpora = (const char **)argv + 1;
+        ncorpus = argc - 1;
+    }
+    else {
+        corpora = def;
+        ncorpus = 1;
+    }
+
+    mrp_clear(&rnc);
+    rnc_format_init(&rnc);
+    rnc_device_init(&rnc);
+
+    memset(res, 0, sizeof(res));
+
+    audio = 0;
+    for (i = 0; i < ncorpus; i++)
+        if (bench_corpus(&rnc, corpora[i], res, &audio) < 0) {
+            printf("benchmark failed\n");
+            exit(1);
+        }
+
+    printf("\n%.1f seconds of audio, max. differences to libebur128\n",
+           audio);
+    printf("%-11s %10s %10s %9s %10s %10s %10s %10s\n", "engine", "time",
+           "realtime", "speedup", "loudness", "range", "peak", "truepeak");
+
+    nbad = 0;
+    for (e = 0; e < (int)NENGINE; e++) {
+        printf("%-11s %7.2f ms %9.0fx %8.2fx %10.4f %10.4f %10.6f %10.6f",
+               engines[e].label, 1000 * res[e].time, audio / res[e].time,
+               res[engines[e].ref].time / res[e].time, res[e].ldiff,
+               res[e].rdiff, res[e].pdiff, res[e].tdiff);
+
+        if (res[e].saved)
+            printf(" %7zu bytes saved", res[e].saved);
+
+        printf("\n");
+        nbad += res[e].nbad + res[e].nsame;
+    }
+
+    if (nbad > 0) {
+        printf("%d results differ from libebur128 by more than %.2f LU, or "
+               "from the serial ones\n", nbad, TOLERANCE);
+        exit(1);
+    }
+
+    return 0;
+}
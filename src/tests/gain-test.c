@@ -0,0 +1,440 @@
+/*
+ * Copyright (c) 2015, Krisztian Litkey, <kli@iki.fi>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <check.h>
+
+#include <murphy/common/log.h>
+#include <murphy/common/debug.h>
+#include <ripncode/ripncode.h>
+
+#define MAX_FORMATS 32                   /* max. formats to pick from */
+#define READ_BLOCKS 64                   /* blocks to read/analyze at once */
+#define CHUNK       (READ_BLOCKS * 588)  /* frames to analyze at once */
+#define TOLERANCE   0.01                 /* max. accepted difference, LU */
+#define ROUNDING    1e-9                 /* max. rounding difference, LU */
+#define TRUE_PEAK   1e-5                 /* max. true peak difference */
+#define STATE_PATH  "/tmp/gain-test.state" /* where to save states to */
+#define NSEGMENT    4                    /* segments for parallel analysis */
+
+#define CORPUS \
+    "synthetic:tracks=music/12,loud/8,pink/6,tone/4,white/4,silence/2:seed=7"
+
+#define TP RNC_GAIN_TRUE_PEAK
+
+
+typedef struct {
+    char   *data;                        /* track audio */
+    size_t  nframe;                      /* amount of audio, in frames */
+} track_t;
+
+static rnc_t    rnc;
+static track_t *tracks;
+static int      ntrack;
+static uint32_t fid;
+
+
+/*
+ * differences between -inf loudnesses (silence) are no differences
+ */
+static double diff(double a, double b)
+{
+    if (isinf(a) && isinf(b) && (a < 0) == (b < 0))
+        return 0;
+
+    return fabs(a - b);
+}
+
+
+static uint32_t pick_format(rnc_dev_t *dev, rnc_track_t *t)
+{
+    uint32_t dfmt[MAX_FORMATS], gfmt[MAX_FORMATS];
+    int      ndev, ngain, d, g;
+
+    if (rnc_device_seek(dev, t, 0) < 0)
+        return 0;
+
+    ndev  = rnc_device_get_formats(dev, dfmt, MAX_FORMATS);
+    ngain = rnc_gain_get_formats(gfmt, MAX_FORMATS);
+
+    for (g = 0; g < ngain && g < MAX_FORMATS; g++)
+        for (d = 0; d < ndev && d < MAX_FORMATS; d++)
+            if (RNC_FORMAT_SAME_SAMPLES(dfmt[d], gfmt[g]))
+                return rnc_device_set_format(dev, dfmt[d]) < 0 ? 0 : dfmt[d];
+
+    return 0;
+}
+
+
+/*
+ * read the whole corpus into memory, once
+ */
+static void setup(void)
+{
+    rnc_dev_t   *dev;
+    rnc_track_t *t;
+    size_t       frame, size;
+    int          blksize, i, b, n;
+
+    if (tracks != NULL)
+        return;
+
+    mrp_clear(&rnc);
+    rnc_format_init(&rnc);
+    rnc_device_init(&rnc);
+
+    dev = rnc_device_open(&rnc, CORPUS);
+    ck_assert_ptr_ne(dev, NULL);
+
+    ntrack = rnc_device_get_tracks(dev, NULL, 0);
+    ck_assert_int_gt(ntrack, 0);
+
+    t      = mrp_allocz_array(rnc_track_t, ntrack);
+    tracks = mrp_allocz_array(track_t, ntrack);
+    ck_assert_ptr_ne(t, NULL);
+    ck_assert_ptr_ne(tracks, NULL);
+    ck_assert_int_eq(rnc_device_get_tracks(dev, t, ntrack), ntrack);
+
+    fid = pick_format(dev, t);
+    ck_assert_int_ne(fid, 0);
+
+    blksize = rnc_device_get_blocksize(dev);
+    frame   = RNC_FORMAT_CHNL(fid) * RNC_FORMAT_BITS(fid) / 8;
+
+    for (i = 0; i < ntrack; i++) {
+        tracks[i].data = mrp_alloc((size_t)t[i].nblk * blksize);
+        ck_assert_ptr_ne(tracks[i].data, NULL);
+        ck_assert_int_ge(rnc_device_seek(dev, t + i, 0), 0);
+
+        size = 0;
+        for (b = 0; b < (int)t[i].nblk; b += n / blksize) {
+            n = (int)t[i].nblk - b < READ_BLOCKS ?
+                (int)t[i].nblk - b : READ_BLOCKS;
+            n = rnc_device_read(dev, tracks[i].data + size, n * blksize);
+            ck_assert_int_gt(n, 0);
+
+            size += n;
+        }
+
+        tracks[i].nframe = size / frame;
+    }
+
+    mrp_free(t);
+    rnc_device_close(dev);
+}
+
+
+/*
+ * analyze tracks [first, last) of the corpus, serially or in segments
+ */
+static rnc_gain_t *analyze(int flags, int first, int last, int nsegment)
+{
+    rnc_gain_t *g;
+    size_t      frame, offs, n;
+    int         i;
+
+    g = rnc_gain_create(last - first, fid, flags);
+    ck_assert_ptr_ne(g, NULL);
+
+    frame = RNC_FORMAT_CHNL(fid) * RNC_FORMAT_BITS(fid) / 8;
+
+    for (i = first; i < last; i++) {
+        if (nsegment > 1) {
+            ck_assert_int_eq(rnc_gain_analyze_parallel(g, i - first,
+                                                       tracks[i].data,
+                                                       tracks[i].nframe,
+                                                       nsegment), 0);
+            continue;
+        }
+
+        for (offs = 0; offs < tracks[i].nframe; offs += n) {
+            n = tracks[i].nframe - offs;
+            if (n > CHUNK)
+                n = CHUNK;
+
+            ck_assert_int_eq(rnc_gain_analyze(g, i - first,
+                                              tracks[i].data + offs * frame,
+                                              n), 0);
+        }
+    }
+
+    return g;
+}
+
+
+/*
+ * check that two analyzers agree on every track, within the given limits
+ */
+static void check_agree(rnc_gain_t *g, rnc_gain_t *ref, double loud,
+                        double peak, double true_peak)
+{
+    int i;
+
+    ck_assert_int_eq(rnc_gain_tracks(g), rnc_gain_tracks(ref));
+
+    for (i = 0; i < rnc_gain_tracks(ref); i++) {
+        ck_assert_msg(diff(rnc_gain_track_loudness(g, i),
+                           rnc_gain_track_loudness(ref, i)) <= loud,
+                      "loudness of track #%d: %.4f vs. %.4f", i,
+                      rnc_gain_track_loudness(g, i),
+                      rnc_gain_track_loudness(ref, i));
+        ck_assert_msg(diff(rnc_gain_track_range(g, i),
+                           rnc_gain_track_range(ref, i)) <= loud,
+                      "range of track #%d: %.4f vs. %.4f", i,
+                      rnc_gain_track_range(g, i),
+                      rnc_gain_track_range(ref, i));
+        ck_assert_msg(diff(rnc_gain_track_peak(g, i),
+                           rnc_gain_track_peak(ref, i)) <= peak,
+                      "peak of track #%d: %.6f vs. %.6f", i,
+                      rnc_gain_track_peak(g, i),
+                      rnc_gain_track_peak(ref, i));
+        ck_assert_msg(diff(rnc_gain_track_true_peak(g, i),
+                           rnc_gain_track_true_peak(ref, i)) <= true_peak,
+                      "true peak of track #%d: %.6f vs. %.6f", i,
+                      rnc_gain_track_true_peak(g, i),
+                      rnc_gain_track_true_peak(ref, i));
+    }
+
+    ck_assert_msg(diff(rnc_gain_album_gain(g), rnc_gain_album_gain(ref))
+                  <= loud, "album gain: %.4f vs. %.4f",
+                  rnc_gain_album_gain(g), rnc_gain_album_gain(ref));
+}
+
+
+static void check_reference(int flags)
+{
+    rnc_gain_t *ref, *g;
+
+    ref = analyze(RNC_GAIN_EBUR128 | (flags & TP), 0, ntrack, 1);
+    g   = analyze(flags, 0, ntrack, 1);
+
+    check_agree(g, ref, TOLERANCE, ROUNDING, (flags & TP) ? TRUE_PEAK : 0);
+
+    rnc_gain_destroy(g);
+    rnc_gain_destroy(ref);
+}
+
+
+static void label_tracks(rnc_gain_t *g, int first)
+{
+    char label[32];
+    int  i;
+
+    for (i = 0; i < rnc_gain_tracks(g); i++) {
+        snprintf(label, sizeof(label), "track-%d", first + i);
+        ck_assert_int_eq(rnc_gain_set_label(g, i, label), 0);
+    }
+}
+
+
+START_TEST(scalar_vs_libebur128)
+{
+    check_reference(RNC_GAIN_SCALAR);
+}
+END_TEST
+
+START_TEST(simd_vs_libebur128)
+{
+    check_reference(0);
+}
+END_TEST
+
+START_TEST(scalar_true_peak_vs_libebur128)
+{
+    check_reference(RNC_GAIN_SCALAR | TP);
+}
+END_TEST
+
+START_TEST(simd_true_peak_vs_libebur128)
+{
+    check_reference(TP);
+}
+END_TEST
+
+START_TEST(segmented_vs_serial)
+{
+    rnc_gain_t *serial, *segmented;
+    int         flags[] = { 0, TP }, i;
+
+    for (i = 0; i < (int)MRP_ARRAY_SIZE(flags); i++) {
+        serial    = analyze(flags[i], 0, ntrack, 1);
+        segmented = analyze(flags[i], 0, ntrack, NSEGMENT);
+
+        check_agree(segmented, serial, ROUNDING, ROUNDING, ROUNDING);
+
+        rnc_gain_destroy(segmented);
+        rnc_gain_destroy(serial);
+    }
+}
+END_TEST
+
+START_TEST(save_and_load)
+{
+    rnc_gain_t *g, *l;
+    int         i;
+
+    g = analyze(TP, 0, ntrack, 1);
+    label_tracks(g, 0);
+
+    ck_assert_int_eq(rnc_gain_save(g, STATE_PATH), 0);
+    l = rnc_gain_load(STATE_PATH);
+    unlink(STATE_PATH);
+    ck_assert_ptr_ne(l, NULL);
+
+    /* a reloaded state must give the exact same results */
+    check_agree(l, g, 0, 0, 0);
+
+    for (i = 0; i < ntrack; i++)
+        ck_assert_int_eq(strcmp(rnc_gain_track_label(l, i),
+                                rnc_gain_track_label(g, i)), 0);
+
+    rnc_gain_destroy(l);
+    rnc_gain_destroy(g);
+}
+END_TEST
+
+START_TEST(load_bogus_count)
+{
+    rnc_gain_t *g, *l;
+    uint32_t    n;
+    int         fd;
+
+    g = analyze(0, 0, ntrack, 1);
+    label_tracks(g, 0);
+
+    ck_assert_int_eq(rnc_gain_save(g, STATE_PATH), 0);
+    rnc_gain_destroy(g);
+
+    /* claim way more tracks than the file could possibly hold */
+    n  = 0xffffffff;
+    fd = open(STATE_PATH, O_WRONLY);
+    ck_assert_int_ge(fd, 0);
+    ck_assert_int_eq(pwrite(fd, &n, sizeof(n), 8 + 3 * sizeof(n)), sizeof(n));
+    close(fd);
+
+    l = rnc_gain_load(STATE_PATH);
+    unlink(STATE_PATH);
+
+    ck_assert_ptr_eq(l, NULL);
+    ck_assert_int_eq(errno, EINVAL);
+}
+END_TEST
+
+START_TEST(merge_discs)
+{
+    rnc_gain_t *all, *disc1, *disc2, *saved;
+    int         split;
+
+    /* analyze the corpus as a whole, and as two separate discs */
+    split = ntrack / 2;
+    all   = analyze(0, 0, ntrack, 1);
+    disc1 = analyze(0, 0, split, 1);
+    disc2 = analyze(0, split, ntrack, 1);
+
+    label_tracks(all, 0);
+    label_tracks(disc1, 0);
+    label_tracks(disc2, split);
+
+    /* merge the saved first disc into the second one */
+    ck_assert_int_eq(rnc_gain_save(disc1, STATE_PATH), 0);
+    saved = rnc_gain_load(STATE_PATH);
+    unlink(STATE_PATH);
+    ck_assert_ptr_ne(saved, NULL);
+
+    ck_assert_int_eq(rnc_gain_merge(disc2, saved), split);
+    ck_assert_int_eq(rnc_gain_tracks(disc2), ntrack);
+
+    ck_assert_msg(diff(rnc_gain_album_gain(disc2), rnc_gain_album_gain(all))
+                  <= ROUNDING, "merged album gain: %.6f vs. %.6f",
+                  rnc_gain_album_gain(disc2), rnc_gain_album_gain(all));
+
+    /* tracks already present are not merged again */
+    ck_assert_int_eq(rnc_gain_merge(disc2, disc1), 0);
+    ck_assert_int_eq(rnc_gain_tracks(disc2), ntrack);
+
+    rnc_gain_destroy(saved);
+    rnc_gain_destroy(disc2);
+    rnc_gain_destroy(disc1);
+    rnc_gain_destroy(all);
+}
+END_TEST
+
+
+void gain_tests(Suite *s)
+{
+    TCase *c;
+
+    c = tcase_create("Replaygain Analysis Tests");
+
+    tcase_set_timeout(c, 120);
+    tcase_add_checked_fixture(c, setup, NULL);
+    tcase_add_test(c, scalar_vs_libebur128);
+    tcase_add_test(c, simd_vs_libebur128);
+    tcase_add_test(c, scalar_true_peak_vs_libebur128);
+    tcase_add_test(c, simd_true_peak_vs_libebur128);
+    tcase_add_test(c, segmented_vs_serial);
+    tcase_add_test(c, save_and_load);
+    tcase_add_test(c, load_bogus_count);
+    tcase_add_test(c, merge_discs);
+
+    suite_add_tcase(s, c);
+}
+
+
+int main(int argc, char *argv[])
+{
+    Suite   *s;
+    SRunner *r;
+    int      f, i;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-d") && i < argc - 1) {
+            mrp_log_set_mask(MRP_LOG_UPTO(MRP_LOG_WARNING) | MRP_LOG_MASK_DEBUG);
+            mrp_debug_set(argv[i + 1]);
+            mrp_debug_enable(TRUE);
+        }
+    }
+
+    s = suite_create("Replaygain");
+    r = srunner_create(s);
+
+    gain_tests(s);
+
+    srunner_run_all(r, CK_NORMAL);
+    f = srunner_ntests_failed(r);
+    srunner_free(r);
+
+    exit(f == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2015, Krisztian Litkey, <kli@iki.fi>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <check.h>
+
+#include <murphy/common/log.h>
+#include <murphy/common/debug.h>
+#include <ripncode/ripncode.h>
+
+#define ALIGNED(_p) (((uintptr_t)(_p) & 63) == 0)
+
+
+static int zeroed(const void *ptr, size_t size)
+{
+    const char *p = ptr;
+
+    while (size-- > 0)
+        if (*p++)
+            return 0;
+
+    return 1;
+}
+
+
+START_TEST(mem_map)
+{
+    rnc_mem_stats_t before, after;
+    char           *p;
+
+    rnc_mem_stats(&before);
+
+    p = rnc_mem_map(10000, 0);
+    ck_assert_ptr_ne(p, NULL);
+    ck_assert(zeroed(p, 10000));
+    memset(p, 0xff, 10000);
+
+    rnc_mem_stats(&after);
+    ck_assert_int_ge(after.mapped - before.mapped, 10000);
+    ck_assert_int_ge(after.peak, after.mapped);
+    ck_assert_int_eq(after.nmap, before.nmap + 1);
+
+    rnc_mem_unmap(p, 10000, 0);
+
+    rnc_mem_stats(&after);
+    ck_assert_int_eq(after.mapped, before.mapped);
+}
+END_TEST
+
+START_TEST(mem_hugepages)
+{
+    rnc_mem_stats_t before, after;
+    char           *p;
+
+    /* must work whether or not there are any huge pages to get */
+    rnc_mem_stats(&before);
+
+    p = rnc_mem_map(3 * 1024 * 1024, RNC_MEM_HUGETLB);
+    ck_assert_ptr_ne(p, NULL);
+    memset(p, 0xff, 3 * 1024 * 1024);
+
+    rnc_mem_stats(&after);
+    ck_assert_int_eq(after.mapped - before.mapped, 4 * 1024 * 1024);
+
+    rnc_mem_unmap(p, 3 * 1024 * 1024, RNC_MEM_HUGETLB);
+
+    p = rnc_mem_map(1, RNC_MEM_THP);
+    ck_assert_ptr_ne(p, NULL);
+    rnc_mem_unmap(p, 1, RNC_MEM_THP);
+
+    rnc_mem_stats(&after);
+    ck_assert_int_eq(after.mapped, before.mapped);
+}
+END_TEST
+
+START_TEST(arena_alloc)
+{
+    rnc_arena_t *a;
+    char        *p[100], *big;
+    int          i;
+
+    a = rnc_arena_create("test", 4096, 0);
+    ck_assert_ptr_ne(a, NULL);
+
+    for (i = 0; i < 100; i++) {
+        p[i] = rnc_arena_alloc(a, i + 1);
+        ck_assert_ptr_ne(p[i], NULL);
+        ck_assert(ALIGNED(p[i]));
+        ck_assert(zeroed(p[i], i + 1));
+        memset(p[i], i, i + 1);
+    }
+
+    /* larger than a block, gets one of its own */
+    big = rnc_arena_alloc(a, 100000);
+    ck_assert_ptr_ne(big, NULL);
+    ck_assert(zeroed(big, 100000));
+    memset(big, 0xff, 100000);
+
+    for (i = 0; i < 100; i++) {
+        ck_assert_int_eq(p[i][0], i);
+        ck_assert_int_eq(p[i][i], i);
+    }
+
+    rnc_arena_reset(a);
+
+    p[0] = rnc_arena_alloc(a, 64);
+    ck_assert_ptr_ne(p[0], NULL);
+    ck_assert(zeroed(p[0], 64));
+
+    rnc_arena_destroy(a);
+}
+END_TEST
+
+START_TEST(pool_recycle)
+{
+    rnc_pool_t *p;
+    void       *b[10], *c;
+    int         i, j;
+
+    p = rnc_pool_create("test", 1000, 4, 0);
+    ck_assert_ptr_ne(p, NULL);
+
+    /* grows beyond the first slab */
+    for (i = 0; i < 10; i++) {
+        b[i] = rnc_pool_get(p);
+        ck_assert_ptr_ne(b[i], NULL);
+        ck_assert(ALIGNED(b[i]));
+        memset(b[i], i, 1000);
+
+        for (j = 0; j < i; j++)
+            ck_assert_ptr_ne(b[i], b[j]);
+    }
+
+    for (i = 0; i < 10; i++)
+        ck_assert_int_eq(((char *)b[i])[999], i);
+
+    rnc_pool_put(p, b[3]);
+    c = rnc_pool_get(p);
+    ck_assert_ptr_eq(c, b[3]);
+
+    for (i = 0; i < 10; i++)
+        rnc_pool_put(p, b[i]);
+
+    rnc_pool_destroy(p);
+
+    ck_assert_ptr_eq(rnc_pool_create("test", 0, 4, 0), NULL);
+    ck_assert_ptr_eq(rnc_pool_create("test", 10, 0, 0), NULL);
+}
+END_TEST
+
+
+void memory_tests(Suite *s)
+{
+    TCase *c;
+
+    c = tcase_create("Memory Tests");
+
+    tcase_add_test(c, mem_map);
+    tcase_add_test(c, mem_hugepages);
+    tcase_add_test(c, arena_alloc);
+    tcase_add_test(c, pool_recycle);
+
+    suite_add_tcase(s, c);
+}
+
+
+int main(int argc, char *argv[])
+{
+    Suite   *s;
+    SRunner *r;
+    int      f, i;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-d") && i < argc - 1) {
+            mrp_log_set_mask(MRP_LOG_UPTO(MRP_LOG_WARNING) | MRP_LOG_MASK_DEBUG);
+            mrp_debug_set(argv[i + 1]);
+            mrp_debug_enable(TRUE);
+        }
+    }
+
+    s = suite_create("Memory");
+    r = srunner_create(s);
+
+    memory_tests(s);
+
+    srunner_run_all(r, CK_NORMAL);
+    f = srunner_ntests_failed(r);
+    srunner_free(r);
+
+    exit(f == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,289 @@
+/*
+ * Copyright (c) 2015, Krisztian Litkey, <kli@iki.fi>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <check.h>
+
+#include <murphy/common/log.h>
+#include <murphy/common/debug.h>
+#include <ripncode/ripncode.h>
+
+#define READ_BLOCKS 64                   /* blocks to read at once */
+#define NTHREAD     4                    /* devices to open in parallel */
+
+#define DEVICE \
+    "synthetic:tracks=silence/1,tone/2,white/2,pink/2,music/3,loud/3:seed=42"
+
+/*
+ * MD5 sums of the tracks of DEVICE. All audio is a pure function of the
+ * device config and the sample position, so these must never change
+ * unless the generators themselves are changed on purpose.
+ */
+static const char *checksums[] = {
+    "d2b120199019b639d5a7e2b3463e9c97",  /* silence */
+    "de2ae1e3c7a0cf712c3043801a58c00f",  /* tone */
+    "b409914238bcbd016e3212b148cc9a22",  /* white */
+    "44b9dafb5c4beeaa1899698c96970454",  /* pink */
+    "0a30413787713ad89aad70190989aa83",  /* music */
+    "3a871d1e077ca09decf65455b913ae85",  /* loud */
+};
+
+#define NTRACK MRP_ARRAY_SIZE(checksums)
+
+static rnc_t rnc;
+
+
+static void setup(void)
+{
+    static int done;
+
+    if (done)
+        return;
+
+    mrp_clear(&rnc);
+    rnc_format_init(&rnc);
+    rnc_device_init(&rnc);
+
+    done = 1;
+}
+
+
+static void hex_digest(rnc_md5_t *md5, char *buf)
+{
+    uint8_t digest[16];
+    int     i;
+
+    rnc_md5_final(md5, digest);
+
+    for (i = 0; i < 16; i++)
+        sprintf(buf + 2 * i, "%2.2x", digest[i]);
+}
+
+
+/*
+ * read a whole track, nblk blocks at a time, starting from block first
+ */
+static char *read_track(rnc_dev_t *dev, rnc_track_t *t, int first, int nblk)
+{
+    char *buf;
+    int   blksize, b, n;
+
+    blksize = rnc_device_get_blocksize(dev);
+    buf     = mrp_alloc((size_t)t->nblk * blksize);
+
+    if (buf == NULL || rnc_device_seek(dev, t, first) < 0)
+        goto fail;
+
+    for (b = first; b < (int)t->nblk; b += n / blksize) {
+        n = (int)t->nblk - b < nblk ? (int)t->nblk - b : nblk;
+        n = rnc_device_read(dev, buf + (size_t)b * blksize, n * blksize);
+
+        if (n <= 0 || n % blksize)
+            goto fail;
+    }
+
+    return buf;
+
+ fail:
+    mrp_free(buf);
+    return NULL;
+}
+
+
+/*
+ * rip the whole device and check the MD5 sum of every track
+ */
+static int rip_device(char sums[][33])
+{
+    rnc_dev_t   *dev;
+    rnc_track_t  tracks[NTRACK];
+    rnc_md5_t    md5;
+    char        *buf;
+    int          status, i;
+
+    if ((dev = rnc_device_open(&rnc, DEVICE)) == NULL)
+        return -1;
+
+    status = -1;
+
+    if (rnc_device_get_tracks(dev, tracks, NTRACK) != (int)NTRACK)
+        goto out;
+
+    for (i = 0; i < (int)NTRACK; i++) {
+        if ((buf = read_track(dev, tracks + i, 0, READ_BLOCKS)) == NULL)
+            goto out;
+
+        rnc_md5_init(&md5);
+        rnc_md5_update(&md5, buf,
+                       (size_t)tracks[i].nblk * rnc_device_get_blocksize(dev));
+        hex_digest(&md5, sums[i]);
+
+        mrp_free(buf);
+    }
+
+    status = 0;
+
+ out:
+    rnc_device_close(dev);
+
+    return status;
+}
+
+
+static void *rip_thread(void *data)
+{
+    char (*sums)[33] = data;
+
+    return rip_device(sums) < 0 ? data : NULL;
+}
+
+
+START_TEST(parallel_rips)
+{
+    /* this runs first, so the devices race to set up the generators */
+    pthread_t tid[NTHREAD];
+    char      sums[NTHREAD][NTRACK][33];
+    void     *status;
+    int       i, j;
+
+    for (i = 0; i < NTHREAD; i++)
+        ck_assert_int_eq(pthread_create(tid + i, NULL, rip_thread, sums[i]),
+                         0);
+
+    for (i = 0; i < NTHREAD; i++) {
+        ck_assert_int_eq(pthread_join(tid[i], &status), 0);
+        ck_assert_ptr_eq(status, NULL);
+    }
+
+    for (i = 0; i < NTHREAD; i++)
+        for (j = 0; j < (int)NTRACK; j++)
+            ck_assert_msg(!strcmp(sums[i][j], checksums[j]),
+                          "track #%d: MD5 %s, expected %s", j + 1,
+                          sums[i][j], checksums[j]);
+}
+END_TEST
+
+START_TEST(known_checksums)
+{
+    char sums[NTRACK][33];
+    int  i;
+
+    ck_assert_int_eq(rip_device(sums), 0);
+
+    for (i = 0; i < (int)NTRACK; i++) {
+        ck_assert_msg(!strcmp(sums[i], checksums[i]),
+                      "track #%d: MD5 %s, expected %s", i + 1, sums[i],
+                      checksums[i]);
+    }
+}
+END_TEST
+
+START_TEST(reads_and_seeks)
+{
+    rnc_dev_t   *dev;
+    rnc_track_t  tracks[NTRACK], *t;
+    char        *ref, *buf;
+    size_t       offs;
+    int          blksize, sizes[] = { 1, 3, 75 }, i, s, first;
+
+    dev = rnc_device_open(&rnc, DEVICE);
+    ck_assert_ptr_ne(dev, NULL);
+    ck_assert_int_eq(rnc_device_get_tracks(dev, tracks, NTRACK), NTRACK);
+
+    blksize = rnc_device_get_blocksize(dev);
+
+    /* audio must not depend on read sizes or where we seek to */
+    for (i = 0; i < (int)NTRACK; i++) {
+        t   = tracks + i;
+        ref = read_track(dev, t, 0, READ_BLOCKS);
+        ck_assert_ptr_ne(ref, NULL);
+
+        for (s = 0; s < (int)MRP_ARRAY_SIZE(sizes); s++) {
+            first = s * (int)t->nblk / 4;
+            buf   = read_track(dev, t, first, sizes[s]);
+            ck_assert_ptr_ne(buf, NULL);
+
+            offs = (size_t)first * blksize;
+            ck_assert_int_eq(memcmp(ref + offs, buf + offs,
+                                    (size_t)t->nblk * blksize - offs), 0);
+            mrp_free(buf);
+        }
+
+        mrp_free(ref);
+    }
+
+    rnc_device_close(dev);
+}
+END_TEST
+
+
+void synthetic_tests(Suite *s)
+{
+    TCase *c;
+
+    c = tcase_create("Synthetic Device Tests");
+
+    tcase_add_checked_fixture(c, setup, NULL);
+    tcase_add_test(c, parallel_rips);
+    tcase_add_test(c, known_checksums);
+    tcase_add_test(c, reads_and_seeks);
+
+    suite_add_tcase(s, c);
+}
+
+
+int main(int argc, char *argv[])
+{
+    Suite   *s;
+    SRunner *r;
+    int      f, i;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-d") && i < argc - 1) {
+            mrp_log_set_mask(MRP_LOG_UPTO(MRP_LOG_WARNING) | MRP_LOG_MASK_DEBUG);
+            mrp_debug_set(argv[i + 1]);
+            mrp_debug_enable(TRUE);
+        }
+    }
+
+    s = suite_create("Synthetic");
+    r = srunner_create(s);
+
+    synthetic_tests(s);
+
+    srunner_run_all(r, CK_NORMAL);
+    f = srunner_ntests_failed(r);
+    srunner_free(r);
+
+    exit(f == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}